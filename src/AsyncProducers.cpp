@@ -0,0 +1,408 @@
+#include "AsyncProducers.h"
+#include "Debug.h"
+#include "Function.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "Scope.h"
+
+#include <set>
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+Stmt make_semaphore(const string &name, Expr initial_count, Stmt body) {
+    Expr sema = Variable::make(type_of<halide_semaphore_t *>(), name);
+    Stmt init = Evaluate::make(Call::make(Int(32), "halide_semaphore_init",
+                                          {sema, initial_count}, Call::Extern));
+    // A halide_semaphore_t is two 64-bit words.
+    return Allocate::make(name, UInt(64), {2}, const_true(), Block::make(init, body));
+}
+
+Stmt acquire_semaphore(const string &name, Expr n) {
+    Expr sema = Variable::make(type_of<halide_semaphore_t *>(), name);
+    return Evaluate::make(Call::make(Int(32), "halide_semaphore_acquire", {sema, n}, Call::Extern));
+}
+
+Stmt release_semaphore(const string &name, Expr n) {
+    Expr sema = Variable::make(type_of<halide_semaphore_t *>(), name);
+    return Evaluate::make(Call::make(Int(32), "halide_semaphore_release", {sema, n}, Call::Extern));
+}
+
+namespace {
+
+// Close the semaphore with the given name when the task running body
+// exits, whether or not it succeeds, so that the other task can't
+// wait forever for a release that will never come.
+Stmt close_semaphore_on_exit(const string &name, Stmt body) {
+    Expr sema = Variable::make(type_of<halide_semaphore_t *>(), name);
+    return Allocate::make(name + ".closer", Int(32), {}, const_true(), body,
+                          sema, "halide_semaphore_close");
+}
+
+// If the statement acquires or releases one of the semaphores that
+// storage folding uses to guard the folded storage of func, return
+// the name of the runtime call. Otherwise return the empty string.
+string folding_semaphore_op(const Evaluate *op, const string &func) {
+    const Call *call = op->value.as<Call>();
+    if (!call || call->call_type != Call::Extern || call->args.empty() ||
+        (call->name != "halide_semaphore_acquire" &&
+         call->name != "halide_semaphore_release")) {
+        return "";
+    }
+    const Variable *sema = call->args[0].as<Variable>();
+    if (sema && starts_with(sema->name, func + ".folding_semaphore.")) {
+        return call->name;
+    }
+    return "";
+}
+
+// Find the Funcs read by the produce nodes of the given Funcs.
+class FindProducerInputs : public IRVisitor {
+    const set<string> &producers;
+    bool in_producer = false;
+
+    using IRVisitor::visit;
+
+    void visit(const ProducerConsumer *op) {
+        if (op->is_producer && producers.count(op->name)) {
+            bool old = in_producer;
+            in_producer = true;
+            IRVisitor::visit(op);
+            in_producer = old;
+        } else {
+            IRVisitor::visit(op);
+        }
+    }
+
+    void visit(const Call *op) {
+        IRVisitor::visit(op);
+        if (in_producer && op->call_type == Call::Halide) {
+            inputs.insert(op->name);
+        }
+    }
+
+    void visit(const Variable *op) {
+        // Extern stages refer to their inputs by buffer.
+        if (in_producer && ends_with(op->name, ".buffer")) {
+            inputs.insert(op->name.substr(0, op->name.size() - 7));
+        }
+    }
+
+public:
+    set<string> inputs;
+    FindProducerInputs(const set<string> &p) : producers(p) {}
+};
+
+// Find the semaphores guarding the folded storage of a Func.
+class FindFoldingSemaphores : public IRVisitor {
+    const string &func;
+
+    using IRVisitor::visit;
+
+    void visit(const Evaluate *op) {
+        if (!folding_semaphore_op(op, func).empty()) {
+            names.insert(op->value.as<Call>()->args[0].as<Variable>()->name);
+        }
+    }
+
+public:
+    set<string> names;
+    FindFoldingSemaphores(const string &f) : func(f) {}
+};
+
+// Find the Funcs realized somewhere in a statement.
+class FindRealizations : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Realize *op) {
+        realized.insert(op->name);
+        IRVisitor::visit(op);
+    }
+
+public:
+    set<string> realized;
+};
+
+// Find the Funcs produced somewhere in a statement.
+class FindProducers : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const ProducerConsumer *op) {
+        if (op->is_producer) {
+            produced.insert(op->name);
+        }
+        IRVisitor::visit(op);
+    }
+
+public:
+    set<string> produced;
+};
+
+// Find the Funcs called in a statement, ignoring the produce nodes of
+// the given Funcs.
+class FindCallsOutsideProducers : public IRVisitor {
+    const set<string> &ignored;
+
+    using IRVisitor::visit;
+
+    void visit(const ProducerConsumer *op) {
+        if (!(op->is_producer && ignored.count(op->name))) {
+            IRVisitor::visit(op);
+        }
+    }
+
+    void visit(const Call *op) {
+        IRVisitor::visit(op);
+        if (op->call_type == Call::Halide) {
+            called.insert(op->name);
+        }
+    }
+
+    void visit(const Variable *op) {
+        if (ends_with(op->name, ".buffer")) {
+            called.insert(op->name.substr(0, op->name.size() - 7));
+        }
+    }
+
+public:
+    set<string> called;
+    FindCallsOutsideProducers(const set<string> &i) : ignored(i) {}
+};
+
+// Strip a statement down to the production of func, and of the Funcs
+// in 'inputs' that it needs. Loops, lets, conditions and assertions
+// are kept, so that the producer steps through the same iterations as
+// the consumer and fails the same checks.
+class GenerateProducerBody : public IRMutator {
+    const string &func, &sema;
+    const set<string> &inputs;
+
+    using IRMutator::visit;
+
+    void visit(const ProducerConsumer *op) {
+        if (op->name == func) {
+            if (op->is_producer) {
+                stmt = Block::make(op, release_semaphore(sema, 1));
+            } else {
+                stmt = Evaluate::make(0);
+            }
+        } else if (op->is_producer && inputs.count(op->name)) {
+            stmt = op;
+        } else {
+            // The produce and consume markers of other Funcs belong
+            // to the consumer task. Keep whatever the producer needs
+            // from inside them.
+            stmt = mutate(op->body);
+        }
+    }
+
+    void visit(const Provide *op) {
+        stmt = Evaluate::make(0);
+    }
+
+    void visit(const Store *op) {
+        stmt = Evaluate::make(0);
+    }
+
+    void visit(const Evaluate *op) {
+        const Call *call = op->value.as<Call>();
+        if (folding_semaphore_op(op, func) == "halide_semaphore_acquire" ||
+            (call && call->name == "halide_semaphore_init")) {
+            // Keep the initialization of the semaphores of any
+            // async producers nested inside this one too.
+            stmt = op;
+        } else {
+            stmt = Evaluate::make(0);
+        }
+    }
+
+public:
+    GenerateProducerBody(const string &f, const string &s, const set<string> &i)
+        : func(f), sema(s), inputs(i) {}
+};
+
+// Replace the production of func with a wait for the producer task,
+// and drop the production of Funcs that only the producer needs.
+class GenerateConsumerBody : public IRMutator {
+    const string &func, &sema;
+    const set<string> &producer_only;
+
+    using IRMutator::visit;
+
+    void visit(const ProducerConsumer *op) {
+        if (op->is_producer && op->name == func) {
+            stmt = acquire_semaphore(sema, 1);
+        } else if (op->is_producer && producer_only.count(op->name)) {
+            stmt = Evaluate::make(0);
+        } else {
+            IRMutator::visit(op);
+        }
+    }
+
+    void visit(const Evaluate *op) {
+        if (folding_semaphore_op(op, func) == "halide_semaphore_acquire") {
+            stmt = Evaluate::make(0);
+        } else {
+            stmt = op;
+        }
+    }
+
+public:
+    GenerateConsumerBody(const string &f, const string &s, const set<string> &p)
+        : func(f), sema(s), producer_only(p) {}
+};
+
+// Make every semaphore acquire check its result, so that a task
+// whose counterpart failed fails too instead of carrying on.
+class CheckSemaphoreAcquires : public IRMutator {
+    using IRMutator::visit;
+
+    void visit(const Evaluate *op) {
+        const Call *call = op->value.as<Call>();
+        if (call && call->call_type == Call::Extern &&
+            call->name == "halide_semaphore_acquire") {
+            string result_name = unique_name("halide_semaphore_acquire_result");
+            Expr result = Variable::make(Int(32), result_name);
+            stmt = LetStmt::make(result_name, op->value,
+                                 AssertStmt::make(result == 0, result));
+        } else {
+            stmt = op;
+        }
+    }
+};
+
+class ForkAsyncProducers : public IRMutator {
+    const map<string, Function> &env;
+
+    // The kinds of loop we're inside, innermost last.
+    vector<ForType> loops;
+
+    using IRMutator::visit;
+
+    void visit(const For *op) {
+        loops.push_back(op->for_type);
+        IRMutator::visit(op);
+        loops.pop_back();
+    }
+
+    void visit(const Realize *op) {
+        Stmt body = mutate(op->body);
+
+        auto it = env.find(op->name);
+        if (it == env.end() || !it->second.schedule().async()) {
+            if (body.same_as(op->body)) {
+                stmt = op;
+            } else {
+                stmt = Realize::make(op->name, op->types, op->bounds, op->condition, body);
+            }
+            return;
+        }
+
+        const Function &f = it->second;
+        user_assert(!f.schedule().memoized())
+            << "Func " << f.name() << " cannot be both memoized and computed asynchronously.\n";
+        for (ForType t : loops) {
+            user_assert(t == ForType::Serial || t == ForType::Parallel || t == ForType::Unrolled)
+                << "Func " << f.name() << " cannot be computed asynchronously, "
+                << "because it is stored inside a vectorized or GPU loop.\n";
+        }
+
+        // Find the Funcs computed alongside this one that its
+        // producer reads from, directly or indirectly. The producer
+        // task has to compute them too.
+        FindProducers find_producers;
+        body.accept(&find_producers);
+        set<string> inputs;
+        set<string> frontier = {f.name()};
+        while (!frontier.empty()) {
+            FindProducerInputs finder(frontier);
+            body.accept(&finder);
+            frontier.clear();
+            for (const string &input : finder.inputs) {
+                if (input != f.name() &&
+                    find_producers.produced.count(input) &&
+                    inputs.insert(input).second) {
+                    frontier.insert(input);
+                }
+            }
+        }
+
+        // Of those, find the ones the consumer doesn't need, so
+        // that the consumer task can skip computing them.
+        set<string> producer_only = inputs;
+        producer_only.insert(f.name());
+        bool changed = true;
+        while (changed) {
+            FindCallsOutsideProducers finder(producer_only);
+            body.accept(&finder);
+            changed = false;
+            for (auto p = producer_only.begin(); p != producer_only.end(); ) {
+                if (*p != f.name() && finder.called.count(*p)) {
+                    p = producer_only.erase(p);
+                    changed = true;
+                } else {
+                    ++p;
+                }
+            }
+        }
+        producer_only.erase(f.name());
+
+        // The rest are computed by both tasks, so they had better not
+        // share storage.
+        FindRealizations find_realizations;
+        body.accept(&find_realizations);
+        for (const string &input : inputs) {
+            user_assert(producer_only.count(input) || find_realizations.realized.count(input))
+                << "Func " << input << " is computed by both the producer and the consumer "
+                << "of the asynchronous Func " << f.name() << ", so it must be stored "
+                << "inside the storage of " << f.name() << ".\n";
+        }
+
+        debug(3) << "Forking async producer of " << f.name() << "\n";
+
+        // The producer releases this once per produce node, and the
+        // consumer acquires it once in place of each produce node.
+        string sema = f.name() + ".produced_semaphore";
+        Stmt producer = GenerateProducerBody(f.name(), sema, inputs).mutate(body);
+        Stmt consumer = GenerateConsumerBody(f.name(), sema, producer_only).mutate(body);
+
+        // Each task closes the semaphores it releases when it exits,
+        // so that if one task fails, the other fails too rather than
+        // waiting on it forever. A task that succeeds has already
+        // released everything the other one will acquire.
+        producer = close_semaphore_on_exit(sema, producer);
+        FindFoldingSemaphores find_folding_semaphores(f.name());
+        body.accept(&find_folding_semaphores);
+        for (const string &name : find_folding_semaphores.names) {
+            consumer = close_semaphore_on_exit(name, consumer);
+        }
+
+        // Later passes expect every loop to be named like a loop of
+        // some stage of a Func.
+        string fork_name = f.name() + ".s0.__async_fork";
+        Expr fork_var = Variable::make(Int(32), fork_name);
+        Stmt fork = IfThenElse::make(fork_var == 0, producer, consumer);
+        fork = For::make(fork_name, 0, 2, ForType::Parallel, DeviceAPI::None, fork);
+        fork = make_semaphore(sema, 0, fork);
+
+        stmt = Realize::make(op->name, op->types, op->bounds, op->condition, fork);
+    }
+
+public:
+    ForkAsyncProducers(const map<string, Function> &e) : env(e) {}
+};
+
+}  // namespace
+
+Stmt fork_async_producers(Stmt s, const map<string, Function> &env) {
+    s = ForkAsyncProducers(env).mutate(s);
+    return CheckSemaphoreAcquires().mutate(s);
+}
+
+}
+}
@@ -0,0 +1,43 @@
+#ifndef HALIDE_ASYNC_PRODUCERS_H
+#define HALIDE_ASYNC_PRODUCERS_H
+
+/** \file
+ * Defines the lowering pass that runs the producers of Funcs
+ * scheduled with Func::async concurrently with their consumers.
+ */
+
+#include <map>
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Split the realization of each async Func into two tasks run by a
+ * parallel loop of extent two: one containing only the production of
+ * the Func (and of anything it needs that is computed alongside it),
+ * and one containing everything else. The consumer task waits on a
+ * semaphore before each step that used to be a produce node, and the
+ * producer task releases it after each produce node. Acquires and
+ * releases of semaphores guarding folded storage (injected by
+ * storage folding) are kept on the producer and consumer sides
+ * respectively. Each task closes the semaphores it releases when it
+ * exits, and every acquire is checked, so that if either task fails
+ * the other fails too instead of waiting forever. */
+Stmt fork_async_producers(Stmt s, const std::map<std::string, Function> &env);
+
+/** Wrap a statement in the allocation and initialization of a
+ * halide_semaphore_t with the given name and initial count. */
+Stmt make_semaphore(const std::string &name, Expr initial_count, Stmt body);
+
+/** Make statements that acquire or release n counts of the
+ * semaphore with the given name. */
+// @{
+Stmt acquire_semaphore(const std::string &name, Expr n);
+Stmt release_semaphore(const std::string &name, Expr n);
+// @}
+
+}
+}
+
+#endif
@@ -1570,6 +1570,19 @@ void CodeGen_C::compile(const LoweredFunc &f) {
         stream << "const struct halide_filter_metadata_t *" << simple_name << "_metadata() HALIDE_FUNCTION_ATTRS;\n";
     }
 
+    if (f.linkage == LoweredFunc::ExternalPlusMetadata &&
+        target.has_feature(Target::ScratchMemory)) {
+        // The amount of scratch memory the caller must pass in.
+        stream << "int64_t " << simple_name << "_scratch_bytes() HALIDE_FUNCTION_ATTRS";
+        if (is_header()) {
+            stream << ";\n";
+        } else {
+            stream << " {\n"
+                   << "    return " << f.scratch_bytes << ";\n"
+                   << "}\n";
+        }
+    }
+
     if (!namespaces.empty()) {
         stream << "\n";
         for (size_t i = namespaces.size(); i > 0; i--) {
@@ -2437,7 +2450,7 @@ void CodeGen_C::visit(const Allocate *op) {
         alloc.type = op->type;
         allocations.push(op->name, alloc);
         heap_allocations.push(op->name);
-        stream << op_type << "*" << op_name << " = (" << print_expr(op->new_expr) << ");\n";
+        stream << op_type << "*" << op_name << " = (" << op_type << "*)(" << print_expr(op->new_expr) << ");\n";
     } else {
         constant_size = op->constant_allocation_size();
         if (constant_size > 0) {
@@ -157,8 +157,13 @@ bool function_takes_user_context(const std::string &name) {
         "halide_free",
         "halide_malloc",
         "halide_print",
+        "halide_semaphore_init",
         "halide_profiler_memory_allocate",
         "halide_profiler_memory_free",
+        "halide_profiler_memory_traffic",
+        "halide_profiler_memoization_lookup",
+        "halide_profiler_acquire_thread_slot",
+        "halide_profiler_timeline_acquire_thread_slot",
         "halide_profiler_pipeline_start",
         "halide_profiler_pipeline_end",
         "halide_profiler_stack_peak_update",
@@ -168,8 +173,12 @@ bool function_takes_user_context(const std::string &name) {
         "halide_trace",
         "halide_trace_helper",
         "halide_memoization_cache_lookup",
+        "halide_memoization_cache_lookup_crop",
+        "halide_memoization_cache_lookup_in_partition",
         "halide_memoization_cache_store",
         "halide_memoization_cache_release",
+        "halide_worker_buffers_create",
+        "halide_worker_buffers_acquire",
         "halide_cuda_run",
         "halide_opencl_run",
         "halide_opengl_run",
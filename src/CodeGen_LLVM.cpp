@@ -437,6 +437,7 @@ struct MangledNames {
     string extern_name;
     string argv_name;
     string metadata_name;
+    string scratch_bytes_name;
 };
 
 MangledNames get_mangled_names(const std::string &name,
@@ -450,6 +451,7 @@ MangledNames get_mangled_names(const std::string &name,
     names.extern_name = names.simple_name;
     names.argv_name = names.simple_name + "_argv";
     names.metadata_name = names.simple_name + "_metadata";
+    names.scratch_bytes_name = names.simple_name + "_scratch_bytes";
 
     if (linkage != LoweredFunc::Internal &&
         ((mangling == NameMangling::Default &&
@@ -470,6 +472,7 @@ MangledNames get_mangled_names(const std::string &name,
         Type void_star_star(Handle(1, &inner_type));
         names.argv_name = cplusplus_function_mangled_name(names.argv_name, namespaces, type_of<int>(), { ExternFuncArgument(make_zero(void_star_star)) }, target);
         names.metadata_name = cplusplus_function_mangled_name(names.metadata_name, namespaces, type_of<const struct halide_filter_metadata_t *>(), {}, target);
+        names.scratch_bytes_name = cplusplus_function_mangled_name(names.scratch_bytes_name, namespaces, type_of<int64_t>(), {}, target);
     }
     return names;
 }
@@ -541,6 +544,10 @@ std::unique_ptr<llvm::Module> CodeGen_LLVM::compile(const Module &input) {
             if (target.has_feature(Target::Matlab)) {
                 define_matlab_wrapper(module.get(), wrapper, metadata_getter);
             }
+
+            if (target.has_feature(Target::ScratchMemory)) {
+                add_scratch_bytes_getter(names.scratch_bytes_name, f.scratch_bytes);
+            }
         }
     }
 
@@ -907,6 +914,18 @@ llvm::Function *CodeGen_LLVM::add_argv_wrapper(const std::string &name) {
     return wrapper;
 }
 
+// Make a function that returns the number of bytes of scratch memory
+// the pipeline must be passed.
+llvm::Function *CodeGen_LLVM::add_scratch_bytes_getter(const std::string &name, int64_t scratch_bytes) {
+    llvm::FunctionType *func_t = llvm::FunctionType::get(i64_t, false);
+    llvm::Function *getter = llvm::Function::Create(func_t, llvm::GlobalValue::ExternalLinkage, name, module.get());
+    llvm::BasicBlock *block = llvm::BasicBlock::Create(module->getContext(), "entry", getter);
+    builder->SetInsertPoint(block);
+    builder->CreateRet(ConstantInt::get(i64_t, scratch_bytes));
+    internal_assert(!verifyFunction(*getter, &llvm::errs()));
+    return getter;
+}
+
 llvm::Function *CodeGen_LLVM::embed_metadata_getter(const std::string &metadata_name,
         const std::string &function_name, const std::vector<LoweredArgument> &args,
         const std::map<std::string, std::string> &metadata_name_map) {
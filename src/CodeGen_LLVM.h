@@ -471,6 +471,11 @@ private:
 
     llvm::Function *add_argv_wrapper(const std::string &name);
 
+    /** Add a function with the given name that returns the number of
+     * bytes of scratch memory a pipeline compiled with
+     * Target::ScratchMemory must be passed. */
+    llvm::Function *add_scratch_bytes_getter(const std::string &name, int64_t scratch_bytes);
+
     llvm::Value *codegen_dense_vector_load(const Load *load, llvm::Value *vpred = nullptr);
 
     virtual void codegen_predicated_vector_load(const Load *op);
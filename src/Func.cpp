@@ -1946,6 +1946,26 @@ Func &Func::memoize() {
     return *this;
 }
 
+Func &Func::memoize(const std::string &partition) {
+    invalidate_cache();
+    func.schedule().memoized() = true;
+    func.schedule().memoize_partition() = partition;
+    return *this;
+}
+
+Func &Func::memoize_reuse_crops() {
+    invalidate_cache();
+    func.schedule().memoized() = true;
+    func.schedule().memoize_reuse_crops() = true;
+    return *this;
+}
+
+Func &Func::async() {
+    invalidate_cache();
+    func.schedule().async() = true;
+    return *this;
+}
+
 Stage Func::specialize(Expr c) {
     invalidate_cache();
     return Stage(func.definition(), name(), args(), func.schedule()).specialize(c);
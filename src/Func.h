@@ -1874,6 +1874,58 @@ public:
      */
     EXPORT Func &memoize();
 
+    /** Memoize this function in the named partition of the
+     * memoization cache. Each partition has its own size limit (see
+     * halide_memoization_cache_set_partition_size), so results in one
+     * partition are never evicted to make room for results in
+     * another. This overrides any partition selected for the whole
+     * pipeline with \ref Pipeline::set_memoization_partition. */
+    EXPORT Func &memoize(const std::string &partition);
+
+    /** Memoize this function, and let a lookup that finds no result
+     * for exactly the region required use a cached result computed
+     * over a larger region that contains it, instead of recomputing
+     * it. The region required is copied out of the larger
+     * result. This suits uses where the region required moves around
+     * within regions computed before, such as a viewer panning and
+     * zooming within cached tiles. The function's value at a point
+     * must not depend on the region it is computed over, which only
+     * an extern stage could violate. Combine with memoize(partition)
+     * to choose the partition. */
+    EXPORT Func &memoize_reuse_crops();
+
+    /** Produce this Func asynchronously, as a separate task that runs
+     * concurrently with its consumers. The producer and consumer are
+     * connected by semaphores: each time the producer finishes a
+     * produce step, the consumer may run the corresponding consume
+     * step. If the storage of this Func is folded (see \ref
+     * Func::fold_storage), the producer is never more than the fold
+     * factor ahead of the consumer, so the folded storage acts as a
+     * bounded buffer between them. For example:
+     *
+     \code
+     Func f, g;
+     f(x, y) = expensive(x, y);
+     g(x, y) = f(x, y - 1) + f(x, y + 1);
+     f.store_root().compute_at(g, y).fold_storage(y, 4).async();
+     \endcode
+     *
+     * computes rows of f on one thread while another thread computes
+     * rows of g from them, with at most four rows of f in flight.
+     *
+     * An async Func must not be computed inline, and must not be an
+     * output of the pipeline. Other Funcs computed at the same loop
+     * level that the producer reads from are recomputed by the
+     * producer task. If the consumer reads them too, they must be
+     * stored inside the storage of this Func, so that each task has
+     * its own copy. If either task fails, the other fails too. The
+     * runtime brings in extra worker threads while a task is blocked
+     * waiting on the other, so async producers work with any number
+     * of threads, but a custom halide_do_par_for must run the two
+     * tasks concurrently.
+     */
+    EXPORT Func &async();
+
 
     /** Allocate storage for this function within f's loop over
      * var. Scheduling storage is optional, and can be used to
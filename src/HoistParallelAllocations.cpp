@@ -0,0 +1,129 @@
+#include "HoistParallelAllocations.h"
+#include "CodeGen_Internal.h"
+#include "ExprUsesVar.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "Scope.h"
+#include "Simplify.h"
+#include "Util.h"
+
+namespace Halide {
+namespace Internal {
+
+using std::string;
+using std::vector;
+
+namespace {
+
+class HoistParallelAllocations : public IRMutator2 {
+    using IRMutator2::visit;
+
+    struct WorkerBuffers {
+        string name;
+        Expr size;
+    };
+
+    // The names defined inside the innermost enclosing parallel loop.
+    Scope<> loop_vars;
+    bool in_parallel_loop = false;
+
+    // The buffer sets to create before the innermost enclosing
+    // parallel loop.
+    vector<WorkerBuffers> worker_buffers;
+
+    Stmt visit(const For *op) override {
+        if (op->for_type == ForType::GPUBlock ||
+            op->for_type == ForType::GPUThread ||
+            (op->device_api != DeviceAPI::None &&
+             op->device_api != DeviceAPI::Host)) {
+            // Device code doesn't allocate from the heap.
+            return op;
+        }
+
+        if (op->for_type != ForType::Parallel) {
+            if (!in_parallel_loop) {
+                return IRMutator2::visit(op);
+            }
+            ScopedBinding<> bind(loop_vars, op->name);
+            return IRMutator2::visit(op);
+        }
+
+        Scope<> old_loop_vars;
+        loop_vars.swap(old_loop_vars);
+        vector<WorkerBuffers> old_worker_buffers;
+        worker_buffers.swap(old_worker_buffers);
+        bool old_in_parallel_loop = in_parallel_loop;
+        in_parallel_loop = true;
+
+        Stmt body;
+        {
+            ScopedBinding<> bind(loop_vars, op->name);
+            body = mutate(op->body);
+        }
+        Stmt result = For::make(op->name, op->min, op->extent, op->for_type, op->device_api, body);
+        for (const WorkerBuffers &b : worker_buffers) {
+            Expr create = Call::make(Handle(), "halide_worker_buffers_create", {b.size}, Call::Extern);
+            result = Allocate::make(b.name, UInt(8), {}, const_true(), result,
+                                    create, "halide_worker_buffers_destroy");
+        }
+
+        loop_vars.swap(old_loop_vars);
+        worker_buffers.swap(old_worker_buffers);
+        in_parallel_loop = old_in_parallel_loop;
+        return result;
+    }
+
+    Stmt visit(const LetStmt *op) override {
+        if (!in_parallel_loop) {
+            return IRMutator2::visit(op);
+        }
+        ScopedBinding<> bind(loop_vars, op->name);
+        return IRMutator2::visit(op);
+    }
+
+    Stmt visit(const Allocate *op) override {
+        if (!in_parallel_loop ||
+            op->new_expr.defined() ||
+            !op->free_function.empty() ||
+            op->extents.empty() ||
+            !is_one(op->condition)) {
+            return IRMutator2::visit(op);
+        }
+
+        // Small constant-sized allocations go on the stack anyway.
+        int32_t constant_size = op->constant_allocation_size();
+        if (constant_size > 0 &&
+            can_allocation_fit_on_stack((int64_t)constant_size * op->type.bytes())) {
+            return IRMutator2::visit(op);
+        }
+
+        // Codegen pads heap allocations by one element.
+        Expr size = make_const(UInt(64), op->type.bytes());
+        for (const Expr &e : op->extents) {
+            size *= cast<uint64_t>(e);
+        }
+        size = simplify(size + make_const(UInt(64), op->type.bytes()));
+        if (expr_uses_vars(size, loop_vars)) {
+            // The size changes from one task to the next.
+            return IRMutator2::visit(op);
+        }
+
+        debug(3) << "Using per-worker buffers of " << size << " bytes for " << op->name << "\n";
+        string buffers_name = unique_name(op->name + ".worker_buffers");
+        worker_buffers.push_back({buffers_name, size});
+
+        Expr acquire = Call::make(Handle(), "halide_worker_buffers_acquire",
+                                  {Variable::make(Handle(), buffers_name)}, Call::Extern);
+        return Allocate::make(op->name, op->type, op->extents, op->condition,
+                              mutate(op->body), acquire, "halide_worker_buffers_release");
+    }
+};
+
+}  // namespace
+
+Stmt hoist_parallel_allocations(const Stmt &s) {
+    return HoistParallelAllocations().mutate(s);
+}
+
+}
+}
@@ -0,0 +1,24 @@
+#ifndef HALIDE_HOIST_PARALLEL_ALLOCATIONS_H
+#define HALIDE_HOIST_PARALLEL_ALLOCATIONS_H
+
+/** \file
+ * Defines the lowering pass that gives allocations inside parallel
+ * loops per-worker buffers that persist across tasks.
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Find the heap allocations inside parallel loops whose size doesn't
+ * depend on anything defined inside the loop. Create a set of
+ * per-worker buffers of that size before the loop, and make each task
+ * borrow one of them instead of calling halide_malloc. See
+ * halide_worker_buffers_create in HalideRuntime.h. */
+Stmt hoist_parallel_allocations(const Stmt &s);
+
+}
+}
+
+#endif
@@ -453,6 +453,14 @@ void JITModule::memoization_cache_set_size(int64_t size) const {
     }
 }
 
+void JITModule::memoization_cache_set_partition_size(const std::string &partition, int64_t size) const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_memoization_cache_set_partition_size");
+    if (f != exports().end()) {
+        (reinterpret_bits<int (*)(const char *, int64_t)>(f->second.address))(partition.c_str(), size);
+    }
+}
+
 bool JITModule::compiled() const {
   return jit_module->execution_engine != nullptr;
 }
@@ -463,6 +471,7 @@ JITHandlers runtime_internal_handlers;
 JITHandlers default_handlers;
 JITHandlers active_handlers;
 int64_t default_cache_size;
+std::map<std::string, int64_t> partition_cache_sizes;
 
 void merge_handlers(JITHandlers &base, const JITHandlers &addins) {
     if (addins.custom_print) {
@@ -740,6 +749,9 @@ JITModule &make_module(llvm::Module *for_module, Target target,
             if (default_cache_size != 0) {
                 runtime.memoization_cache_set_size(default_cache_size);
             }
+            for (const auto &p : partition_cache_sizes) {
+                runtime.memoization_cache_set_partition_size(p.first, p.second);
+            }
 
             runtime.jit_module->name = "MainShared";
         } else {
@@ -858,5 +870,16 @@ void JITSharedRuntime::memoization_cache_set_size(int64_t size) {
     }
 }
 
+void JITSharedRuntime::memoization_cache_set_partition_size(const std::string &partition, int64_t size) {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+
+    if (size == 0) {
+        partition_cache_sizes.erase(partition);
+    } else {
+        partition_cache_sizes[partition] = size;
+    }
+    shared_runtimes(MainShared).memoization_cache_set_partition_size(partition, size);
+}
+
 }
 }
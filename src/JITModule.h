@@ -115,6 +115,7 @@ struct JITModule {
 
     /** Encapsulate device (GPU) and buffer interactions. */
     EXPORT void memoization_cache_set_size(int64_t size) const;
+    EXPORT void memoization_cache_set_partition_size(const std::string &partition, int64_t size) const;
 
     /** Return true if compile_module has been called on this module. */
     EXPORT bool compiled() const;
@@ -153,6 +154,12 @@ public:
      */
     EXPORT static void memoization_cache_set_size(int64_t size);
 
+    /** Set the maximum number of bytes used by the named partition of
+     * the memoization cache. See Func::memoize. If you are compiling
+     * statically, call halide_memoization_cache_set_partition_size()
+     * instead. */
+    EXPORT static void memoization_cache_set_partition_size(const std::string &partition, int64_t size);
+
     EXPORT static void release_all();
 };
 
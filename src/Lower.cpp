@@ -8,6 +8,7 @@
 #include "AddImageChecks.h"
 #include "AddParameterChecks.h"
 #include "AllocationBoundsInference.h"
+#include "AsyncProducers.h"
 #include "Bounds.h"
 #include "BoundsInference.h"
 #include "BoundSmallAllocations.h"
@@ -24,6 +25,7 @@
 #include "FuseGPUThreadLoops.h"
 #include "FuzzFloatStores.h"
 #include "HexagonOffload.h"
+#include "HoistParallelAllocations.h"
 #include "InferArguments.h"
 #include "InjectHostDevBufferCopies.h"
 #include "InjectOpenGLIntrinsics.h"
@@ -34,6 +36,7 @@
 #include "LICM.h"
 #include "LoopCarry.h"
 #include "Memoization.h"
+#include "MemoryPlanning.h"
 #include "PartitionLoops.h"
 #include "Prefetch.h"
 #include "Profiling.h"
@@ -74,7 +77,8 @@ using std::map;
 
 Module lower(const vector<Function> &output_funcs, const string &pipeline_name, const Target &t,
              const vector<Argument> &args, const Internal::LoweredFunc::LinkageType linkage_type,
-             const vector<IRMutator2 *> &custom_passes) {
+             const vector<IRMutator2 *> &custom_passes,
+             const string &memoization_partition) {
     std::vector<std::string> namespaces;
     std::string simple_pipeline_name = extract_namespaces(pipeline_name, namespaces);
 
@@ -100,6 +104,15 @@ Module lower(const vector<Function> &output_funcs, const string &pipeline_name,
         iter.second.lock_loop_levels();
     }
 
+    // Apply the pipeline's memoization partition to the memoized
+    // Funcs that don't select their own.
+    for (auto &iter : env) {
+        FuncSchedule &schedule = iter.second.schedule();
+        if (schedule.memoized() && schedule.memoize_partition().empty()) {
+            schedule.memoize_partition() = memoization_partition;
+        }
+    }
+
     // Substitute in wrapper Funcs
     env = wrap_func_calls(env);
 
@@ -121,7 +134,7 @@ Module lower(const vector<Function> &output_funcs, const string &pipeline_name,
 
     if (any_memoized) {
         debug(1) << "Injecting memoization...\n";
-        s = inject_memoization(s, env, pipeline_name, outputs);
+        s = inject_memoization(s, env, pipeline_name, outputs, t);
         debug(2) << "Lowering after injecting memoization:\n" << s << '\n';
     } else {
         debug(1) << "Skipping injecting memoization...\n";
@@ -176,6 +189,10 @@ Module lower(const vector<Function> &output_funcs, const string &pipeline_name,
     s = storage_folding(s, env);
     debug(2) << "Lowering after storage folding:\n" << s << '\n';
 
+    debug(1) << "Forking asynchronous producers...\n";
+    s = fork_async_producers(s, env);
+    debug(2) << "Lowering after forking asynchronous producers:\n" << s << '\n';
+
     debug(1) << "Injecting debug_to_file calls...\n";
     s = debug_to_file(s, outputs, env);
     debug(2) << "Lowering after injecting debug_to_file calls:\n" << s << '\n';
@@ -280,9 +297,11 @@ Module lower(const vector<Function> &output_funcs, const string &pipeline_name,
     s = inject_early_frees(s);
     debug(2) << "Lowering after injecting early frees:\n" << s << "\n\n";
 
-    if (t.has_feature(Target::Profile)) {
+    if (t.has_feature(Target::Profile) ||
+        t.has_feature(Target::ProfileTimeline) ||
+        t.has_feature(Target::ProfileMemoryTraffic)) {
         debug(1) << "Injecting profiling...\n";
-        s = inject_profiling(s, pipeline_name);
+        s = inject_profiling(s, pipeline_name, t);
         debug(2) << "Lowering after injecting profiling:\n" << s << "\n\n";
     }
 
@@ -296,6 +315,15 @@ Module lower(const vector<Function> &output_funcs, const string &pipeline_name,
     s = bound_small_allocations(s);
     debug(2) << "Lowering after bounding small allocations:\n" << s << "\n\n";
 
+    debug(1) << "Planning memory...\n";
+    int64_t scratch_bytes = 0;
+    s = plan_memory(s, t, scratch_bytes);
+    debug(2) << "Lowering after planning memory:\n" << s << "\n\n";
+
+    debug(1) << "Hoisting allocations out of parallel loops...\n";
+    s = hoist_parallel_allocations(s);
+    debug(2) << "Lowering after hoisting allocations out of parallel loops:\n" << s << "\n\n";
+
     debug(1) << "Simplifying...\n";
     s = common_subexpression_elimination(s);
 
@@ -402,6 +430,7 @@ Module lower(const vector<Function> &output_funcs, const string &pipeline_name,
     s = StrengthenRefs().mutate(s);
 
     LoweredFunc main_func(pipeline_name, public_args, s, linkage_type);
+    main_func.scratch_bytes = scratch_bytes;
 
     // If we're in debug mode, add code that prints the args.
     if (t.has_feature(Target::Debug)) {
@@ -1,13 +1,17 @@
 #include "Memoization.h"
 #include "Error.h"
+#include "FindCalls.h"
 #include "IRMutator.h"
 #include "IROperator.h"
+#include "IRPrinter.h"
+#include "IRVisitor.h"
 #include "Param.h"
 #include "Scope.h"
 #include "Util.h"
 #include "Var.h"
 
 #include <map>
+#include <sstream>
 
 namespace Halide {
 namespace Internal {
@@ -143,11 +147,152 @@ public:
 
 typedef std::pair<FindParameterDependencies::DependencyKey, FindParameterDependencies::DependencyInfo> DependencyKeyInfoPair;
 
+void print_definition(std::ostream &stream, const Definition &def) {
+    stream << "(";
+    for (const Expr &arg : def.args()) {
+        stream << arg << ",";
+    }
+    stream << ") = (";
+    for (const Expr &value : def.values()) {
+        stream << value << ",";
+    }
+    stream << ") if " << def.predicate() << "\n";
+    for (const Specialization &s : def.specializations()) {
+        stream << "specialize " << s.condition << " " << s.failure_message << "\n";
+        print_definition(stream, s.definition);
+    }
+}
+
+void fnv1a(uint64_t &h, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+}
+
+void hash_buffer_contents(uint64_t &h, const halide_buffer_t *buf, int d, const uint8_t *ptr) {
+    const int elem_size = buf->type.bytes();
+    if (d < 0) {
+        fnv1a(h, ptr, elem_size);
+        return;
+    }
+    if (d == 0 && buf->dim[0].stride == 1) {
+        // Hash a contiguous row in one go. This gives the same hash
+        // as hashing its elements one at a time.
+        fnv1a(h, ptr, (size_t)buf->dim[0].extent * elem_size);
+        return;
+    }
+    for (int i = 0; i < buf->dim[d].extent; i++) {
+        hash_buffer_contents(h, buf, d - 1, ptr + (int64_t)i * buf->dim[d].stride * elem_size);
+    }
+}
+
+// The versions of the buffers compiled into a pipeline, by buffer, so
+// that each is only hashed once per lowering.
+typedef std::map<const halide_buffer_t *, std::string> BufferVersions;
+
+// Concrete buffers compiled into a pipeline (e.g. lookup tables) are
+// printed by name only, so hash their shape and contents separately.
+std::string buffer_version(const Buffer<> &buffer, BufferVersions &versions) {
+    const halide_buffer_t *buf = buffer.raw_buffer();
+    auto cached = versions.find(buf);
+    if (cached != versions.end()) {
+        return cached->second;
+    }
+    std::ostringstream stream;
+    stream << buffer.name() << ":" << buffer.type();
+    for (int i = 0; i < buf->dimensions; i++) {
+        stream << "," << buf->dim[i].min << "+" << buf->dim[i].extent;
+    }
+    uint64_t h = 0xcbf29ce484222325ULL;
+    if (buf->host) {
+        hash_buffer_contents(h, buf, buf->dimensions - 1, buf->host);
+    }
+    stream << "=" << std::hex << h;
+    return versions[buf] = stream.str();
+}
+
+class FindEmbeddedBuffers : public IRGraphVisitor {
+    using IRGraphVisitor::visit;
+
+    void visit(const Call *op) {
+        IRGraphVisitor::visit(op);
+        if (op->image.defined()) {
+            buffers[op->image.name()] = op->image;
+        }
+    }
+
+public:
+    std::map<std::string, Buffer<>> buffers;
+};
+
+// Hash the definitions of a function and of everything it depends on,
+// including the contents of any buffers compiled into them, so that
+// the cache key changes when the algorithm does. Keys only
+// live as long as the process in the in-memory cache, but the on-disk
+// tier of the runtime cache relies on this to avoid reusing results
+// computed by a different version of a pipeline. Only needed for
+// targets with Target::MemoizeDisk.
+std::string definition_version(const Function &function, BufferVersions &buffer_versions) {
+    std::map<std::string, Function> env;
+    populate_environment(function, env);
+
+    std::ostringstream stream;
+    for (const auto &iter : env) {
+        const Function &f = iter.second;
+        stream << f.name() << "(";
+        for (const std::string &arg : f.args()) {
+            stream << arg << ",";
+        }
+        stream << ") -> (";
+        for (const Type &t : f.output_types()) {
+            stream << t << ",";
+        }
+        stream << ")\n";
+        if (f.has_extern_definition()) {
+            stream << "extern " << f.extern_function_name() << "(";
+            for (const ExternFuncArgument &arg : f.extern_arguments()) {
+                if (arg.is_func()) {
+                    stream << Function(arg.func).name();
+                } else if (arg.is_expr()) {
+                    stream << arg.expr;
+                } else if (arg.is_buffer()) {
+                    stream << buffer_version(arg.buffer, buffer_versions);
+                } else if (arg.is_image_param()) {
+                    stream << arg.image_param.name();
+                }
+                stream << ",";
+            }
+            stream << ")\n";
+        } else {
+            print_definition(stream, f.definition());
+            for (const Definition &update : f.updates()) {
+                print_definition(stream, update);
+            }
+        }
+        FindEmbeddedBuffers find_buffers;
+        f.accept(&find_buffers);
+        for (const auto &b : find_buffers.buffers) {
+            stream << "buffer " << buffer_version(b.second, buffer_versions) << "\n";
+        }
+    }
+
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const std::string str = stream.str();
+    fnv1a(h, (const uint8_t *)str.data(), str.size());
+    std::ostringstream hex;
+    hex << std::hex << h;
+    return hex.str();
+}
+
 class KeyInfo {
     FindParameterDependencies dependencies;
     Expr key_size_expr;
     const std::string &top_level_name;
     const std::string &function_name;
+    const std::string &partition;
+    bool reuse_crops;
+    std::string version;
 
     size_t parameters_alignment() {
         int32_t max_alignment = 0;
@@ -181,8 +326,13 @@ class KeyInfo {
 // It was deleted as part of the address_of intrinsic cleanup).
 
 public:
-  KeyInfo(const Function &function, const std::string &name)
-        : top_level_name(name), function_name(function.name())
+  // The version is the hash from definition_version, or empty if the
+  // key doesn't need one.
+  KeyInfo(const Function &function, const std::string &name, const std::string &version)
+        : top_level_name(name), function_name(function.name()),
+          partition(function.schedule().memoize_partition()),
+          reuse_crops(function.schedule().memoize_reuse_crops()),
+          version(version)
     {
         dependencies.visit_function(function);
         size_t size_so_far = 0;
@@ -216,10 +366,16 @@ public:
         // mechanism can also break in those conditions. For JIT, a
         // counter is needed as the address may be reused. This isn't
         // a problem when using full names as the function names
-        // already are uniquefied by a counter.
+        // already are uniquefied by a counter. If there is a
+        // version, the string ends with a colon and the version. The
+        // on-disk tier of the runtime cache only keeps keys with a
+        // version, and replaces the pointer and the counter with the
+        // string itself, so they must stay the first things in the
+        // key.
         writes.push_back(Store::make(key_name,
                                      StringImm::make(std::to_string(top_level_name.size()) + ":" + top_level_name +
-                                                     std::to_string(function_name.size()) + ":" + function_name),
+                                                     std::to_string(function_name.size()) + ":" + function_name +
+                                                     (version.empty() ? "" : ":" + version)),
                                      (index / Handle().bytes()), Parameter(), const_true()));
         size_t alignment = Handle().bytes();
         index += Handle().bytes();
@@ -262,6 +418,9 @@ public:
     Expr generate_lookup(std::string key_allocation_name, std::string computed_bounds_name,
                          int32_t tuple_count, std::string storage_base_name) {
         std::vector<Expr> args;
+        if (!partition.empty() || reuse_crops) {
+            args.push_back(StringImm::make(partition));
+        }
         args.push_back(Variable::make(type_of<uint8_t *>(), key_allocation_name));
         args.push_back(key_size());
         args.push_back(Variable::make(type_of<halide_buffer_t *>(), computed_bounds_name));
@@ -276,7 +435,16 @@ public:
         }
         args.push_back(Call::make(type_of<halide_buffer_t **>(), Call::make_struct, buffers, Call::Intrinsic));
 
-        return Call::make(Int(32), "halide_memoization_cache_lookup", args, Call::Extern);
+        if (reuse_crops) {
+            // The runtime checks whether a cached result contains the
+            // computed bounds, and copies them out into the buffers,
+            // which are laid out as usual for the allocation bounds.
+            return Call::make(Int(32), "halide_memoization_cache_lookup_crop", args, Call::Extern);
+        } else if (partition.empty()) {
+            return Call::make(Int(32), "halide_memoization_cache_lookup", args, Call::Extern);
+        } else {
+            return Call::make(Int(32), "halide_memoization_cache_lookup_in_partition", args, Call::Extern);
+        }
     }
 
     // Returns a statement which will store the result of a computation under this key
@@ -310,14 +478,29 @@ public:
     const std::map<std::string, Function> &env;
     const std::string &top_level_name;
     const std::vector<Function> &outputs;
+    const bool versioned_keys;
 
   InjectMemoization(const std::map<std::string, Function> &e, const std::string &name,
-                    const std::vector<Function> &outputs) :
-    env(e), top_level_name(name), outputs(outputs) {}
+                    const std::vector<Function> &outputs, const Target &t) :
+    env(e), top_level_name(name), outputs(outputs),
+    versioned_keys(t.has_feature(Target::MemoizeDisk)) {}
 private:
 
     using IRMutator2::visit;
 
+    BufferVersions buffer_versions;
+    std::map<std::string, std::string> versions;
+
+    // Only keys that can go in the on-disk tier need a version, and
+    // computing it hashes every buffer compiled into the pipeline.
+    const std::string &version(const Function &f) {
+        auto iter = versions.find(f.name());
+        if (iter == versions.end()) {
+            iter = versions.emplace(f.name(), versioned_keys ? definition_version(f, buffer_versions) : "").first;
+        }
+        return iter->second;
+    }
+
     Stmt visit(const Realize *op) override {
         std::map<std::string, Function>::const_iterator iter = env.find(op->name);
         if (iter != env.end() &&
@@ -345,7 +528,7 @@ private:
 
             Stmt mutated_body = mutate(op->body);
 
-            KeyInfo key_info(f, top_level_name);
+            KeyInfo key_info(f, top_level_name, version(f));
 
             std::string cache_key_name = op->name + ".cache_key";
             std::string cache_result_name = op->name + ".cache_result";
@@ -407,7 +590,7 @@ private:
                 return ProducerConsumer::make(op->name, op->is_producer, mutated_body);
             } else {
                 const Function f(iter->second);
-                KeyInfo key_info(f, top_level_name);
+                KeyInfo key_info(f, top_level_name, version(f));
 
                 std::string cache_key_name = op->name + ".cache_key";
                 std::string computed_bounds_name = op->name + ".computed_bounds.buffer";
@@ -426,8 +609,8 @@ private:
 
 Stmt inject_memoization(Stmt s, const std::map<std::string, Function> &env,
                         const std::string &name,
-                        const std::vector<Function> &outputs) {
-    InjectMemoization injector(env, name, outputs);
+                        const std::vector<Function> &outputs, const Target &t) {
+    InjectMemoization injector(env, name, outputs, t);
 
     return injector.mutate(s);
 }
@@ -10,6 +10,7 @@
 #include <map>
 
 #include "IR.h"
+#include "Target.h"
 
 namespace Halide {
 namespace Internal {
@@ -17,12 +18,15 @@ namespace Internal {
 /** Transform pipeline calls for Funcs scheduled with memoize to do a
  *  lookup call to the runtime cache implementation, and if there is a
  *  miss, compute the results and call the runtime to store it back to
- *  the cache.
+ *  the cache. If the target has Target::MemoizeDisk, the cache keys
+ *  include a hash of the algorithm, so that the runtime can keep the
+ *  results on disk.
  *  Should leave non-memoized Funcs unchanged.
  */
 Stmt inject_memoization(Stmt s, const std::map<std::string, Function> &env,
                         const std::string &name,
-                        const std::vector<Function> &outputs);
+                        const std::vector<Function> &outputs,
+                        const Target &t);
 
 /** This should be called after Storage Flattening has added Allocation
  *  IR nodes. It connects the memoization cache lookups to the Allocations
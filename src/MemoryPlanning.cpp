@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include "MemoryPlanning.h"
+#include "Bounds.h"
+#include "CodeGen_Internal.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "IRVisitor.h"
+#include "Scope.h"
+#include "Simplify.h"
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::pair;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace {
+
+const char *const arena_name = "memory_arena";
+
+// Offsets into the arena are multiples of this, which is at least the
+// native vector width of every target.
+const int64_t arena_alignment = 128;
+
+// The arena's size must fit in the 32-bit extent of an Allocate node.
+const int64_t max_arena_size = 0x7fffffff;
+
+struct ArenaAllocation {
+    const Allocate *op;
+    // The reserved size in bytes, including padding.
+    int64_t size;
+    // The lifetime, from the first use to the free, as positions in
+    // the order the statement is traversed.
+    int first_use, last_use;
+    int64_t offset;
+    // The path of statements from the root to the Allocate node.
+    vector<const IRNode *> path;
+};
+
+// Find the allocations that can live in the arena, and their
+// lifetimes.
+class FindArenaAllocations : public IRVisitor {
+    using IRVisitor::visit;
+
+    Scope<Interval> scope;
+    vector<const IRNode *> path;
+    map<string, size_t> live;
+    set<const Allocate *> seen, shared;
+    int loop_depth = 0;
+    int device_loop_depth = 0;
+    int position = 0;
+    // Whether to reserve the constant upper bound of allocations
+    // whose sizes vary.
+    bool bound_sizes;
+
+    int64_t reserved_size(const Allocate *op) {
+        if (op->new_expr.defined() ||
+            !op->free_function.empty() ||
+            op->extents.empty()) {
+            return 0;
+        }
+
+        // Small constant-sized allocations go on the stack anyway.
+        int32_t constant_size = op->constant_allocation_size();
+        if (constant_size > 0 &&
+            can_allocation_fit_on_stack((int64_t)constant_size * op->type.bytes())) {
+            return 0;
+        }
+
+        if (loop_depth > 0) {
+            // Allocations in device code don't come from the heap.
+            if (device_loop_depth == 0) {
+                unplanned.insert(op->name);
+            }
+            return 0;
+        }
+
+        // Outside of scratch memory, reserving the upper bound of an
+        // allocation whose size varies would allocate its worst case
+        // on every call, even when it's usually much smaller.
+        if (constant_size == 0 && !bound_sizes) {
+            return 0;
+        }
+
+        Expr total_bytes = make_const(Int(64), op->type.bytes());
+        for (const Expr &e : op->extents) {
+            total_bytes *= cast<int64_t>(e);
+        }
+        Expr bound = find_constant_bound(simplify(total_bytes), Direction::Upper, scope);
+        const int64_t *bytes = bound.defined() ? as_const_int(bound) : nullptr;
+        if (!bytes || *bytes <= 0 || *bytes > max_arena_size) {
+            unplanned.insert(op->name);
+            return 0;
+        }
+
+        // Codegen pads heap allocations by one element, so that
+        // vector loads can read slightly past the end.
+        int64_t size = *bytes + op->type.bytes();
+        return ((size + arena_alignment - 1) / arena_alignment) * arena_alignment;
+    }
+
+    void use(const string &name) {
+        auto it = live.find(name);
+        if (it != live.end() && result[it->second].first_use < 0) {
+            result[it->second].first_use = position++;
+        }
+    }
+
+    void end_lifetime(const string &name) {
+        auto it = live.find(name);
+        if (it != live.end()) {
+            ArenaAllocation &a = result[it->second];
+            if (a.first_use < 0) {
+                a.first_use = position;
+            }
+            a.last_use = position++;
+            live.erase(it);
+        }
+    }
+
+    void visit(const LetStmt *op) override {
+        op->value.accept(this);
+        Interval b = find_constant_bounds(op->value, scope);
+        ScopedBinding<Interval> bind(scope, op->name, b);
+        path.push_back(op);
+        op->body.accept(this);
+        path.pop_back();
+    }
+
+    void visit(const ProducerConsumer *op) override {
+        path.push_back(op);
+        IRVisitor::visit(op);
+        path.pop_back();
+    }
+
+    void visit(const Block *op) override {
+        path.push_back(op);
+        IRVisitor::visit(op);
+        path.pop_back();
+    }
+
+    void visit(const IfThenElse *op) override {
+        path.push_back(op);
+        IRVisitor::visit(op);
+        path.pop_back();
+    }
+
+    void visit(const For *op) override {
+        op->min.accept(this);
+        op->extent.accept(this);
+        bool device_loop = (op->for_type == ForType::GPUBlock ||
+                            op->for_type == ForType::GPUThread ||
+                            (op->device_api != DeviceAPI::None &&
+                             op->device_api != DeviceAPI::Host));
+        loop_depth++;
+        device_loop_depth += device_loop;
+        op->body.accept(this);
+        device_loop_depth -= device_loop;
+        loop_depth--;
+    }
+
+    void visit(const Allocate *op) override {
+        for (const Expr &e : op->extents) {
+            e.accept(this);
+        }
+        op->condition.accept(this);
+
+        path.push_back(op);
+        int64_t size = reserved_size(op);
+        if (size > 0) {
+            if (seen.count(op)) {
+                // The same node appears more than once in the
+                // statement, so one offset may not suit every
+                // instance.
+                shared.insert(op);
+            } else {
+                seen.insert(op);
+                ArenaAllocation a;
+                a.op = op;
+                a.size = size;
+                a.first_use = -1;
+                a.last_use = -1;
+                a.offset = 0;
+                a.path = path;
+                live[op->name] = result.size();
+                result.push_back(a);
+            }
+        }
+        op->body.accept(this);
+        // There should have been a Free node, but be safe.
+        end_lifetime(op->name);
+        path.pop_back();
+    }
+
+    void visit(const Free *op) override {
+        end_lifetime(op->name);
+    }
+
+    void visit(const Variable *op) override {
+        use(op->name);
+        if (ends_with(op->name, ".buffer")) {
+            use(op->name.substr(0, op->name.size() - 7));
+        }
+    }
+
+    void visit(const Load *op) override {
+        use(op->name);
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Store *op) override {
+        use(op->name);
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Call *op) override {
+        use(op->name);
+        IRVisitor::visit(op);
+    }
+
+public:
+    vector<ArenaAllocation> result;
+
+    // The heap allocations that can't live in the arena.
+    set<string> unplanned;
+
+    FindArenaAllocations(bool bound_sizes) : bound_sizes(bound_sizes) {}
+
+    void remove_shared() {
+        vector<ArenaAllocation> unshared;
+        for (const ArenaAllocation &a : result) {
+            if (!shared.count(a.op)) {
+                unshared.push_back(a);
+            } else {
+                unplanned.insert(a.op->name);
+            }
+        }
+        result.swap(unshared);
+    }
+};
+
+bool lifetimes_overlap(const ArenaAllocation &a, const ArenaAllocation &b) {
+    return a.first_use <= b.last_use && b.first_use <= a.last_use;
+}
+
+// Assign offsets so that allocations with overlapping lifetimes don't
+// overlap in the arena. Place the largest allocations first, each at
+// the lowest offset that doesn't collide with an allocation already
+// placed. Returns the size of the arena.
+int64_t assign_offsets(vector<ArenaAllocation> &allocations) {
+    vector<size_t> order(allocations.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return allocations[a].size > allocations[b].size;
+    });
+
+    int64_t arena_size = 0;
+    vector<size_t> placed;
+    for (size_t i : order) {
+        ArenaAllocation &a = allocations[i];
+        vector<pair<int64_t, int64_t>> taken;
+        for (size_t j : placed) {
+            const ArenaAllocation &b = allocations[j];
+            if (lifetimes_overlap(a, b)) {
+                taken.push_back({b.offset, b.offset + b.size});
+            }
+        }
+        std::sort(taken.begin(), taken.end());
+
+        int64_t offset = 0;
+        for (const auto &t : taken) {
+            if (offset + a.size <= t.first) {
+                break;
+            }
+            offset = std::max(offset, t.second);
+        }
+        a.offset = offset;
+        arena_size = std::max(arena_size, offset + a.size);
+        placed.push_back(i);
+    }
+    return arena_size;
+}
+
+// Point each allocation into the arena, and wrap the smallest
+// statement that contains all of them in the arena's allocation.
+class UseArena : public IRMutator2 {
+    using IRMutator2::visit;
+
+    map<const Allocate *, int64_t> offsets;
+    const IRNode *outermost;
+    int64_t arena_size;
+    bool use_scratch;
+
+    Stmt visit(const Allocate *op) override {
+        auto it = offsets.find(op);
+        if (it == offsets.end()) {
+            return IRMutator2::visit(op);
+        }
+        Expr arena = Variable::make(Handle(), arena_name);
+        Expr ptr = reinterpret(Handle(), reinterpret<uint64_t>(arena) + make_const(UInt(64), it->second));
+        // The arena is freed as a whole, so freeing this part of it
+        // does nothing.
+        return Allocate::make(op->name, op->type, op->extents, op->condition,
+                              mutate(op->body), ptr, "halide_device_host_nop_free");
+    }
+
+public:
+    using IRMutator2::mutate;
+
+    Stmt mutate(const Stmt &s) override {
+        Stmt result = IRMutator2::mutate(s);
+        if (s.get() != outermost) {
+            return result;
+        }
+
+        Expr size = make_const(Int(32), arena_size);
+        result = Block::make(result, Free::make(arena_name));
+        if (!use_scratch) {
+            return Allocate::make(arena_name, UInt(8), {size}, const_true(), result);
+        }
+
+        // Carve the arena out of the caller's scratch memory, which
+        // may not be aligned.
+        Expr scratch = Variable::make(Handle(), "__scratch");
+        Expr scratch_size = Variable::make(UInt(64), "__scratch_size");
+        Expr scratch_addr = reinterpret<uint64_t>(scratch);
+        Expr required = make_const(UInt(64), arena_size + arena_alignment - 1);
+        Expr aligned = (scratch_addr + make_const(UInt(64), arena_alignment - 1)) & make_const(UInt(64), ~(arena_alignment - 1));
+        result = Allocate::make(arena_name, UInt(8), {size}, const_true(), result,
+                                reinterpret(Handle(), aligned), "halide_device_host_nop_free");
+
+        // This check is not an assertion, because codegen drops those
+        // under no_asserts, and then a null or short buffer would be
+        // written out of bounds. If the memory is too small, the
+        // pipeline reports the error and skips everything that uses
+        // the arena instead. Without no_asserts, it also returns the
+        // error code.
+        Expr has_scratch = scratch_addr != make_zero(UInt(64));
+        Expr error = Call::make(Int(32), "halide_error_scratch_too_small",
+                                {select(has_scratch, scratch_size, make_zero(UInt(64))), required},
+                                Call::Extern);
+        Expr error_var = Variable::make(Int(32), "scratch_error");
+        Stmt fail = LetStmt::make("scratch_error", error,
+                                  AssertStmt::make(error_var == 0, error_var));
+        return IfThenElse::make(has_scratch && scratch_size >= required, result, fail);
+    }
+
+    UseArena(const vector<ArenaAllocation> &allocations, int64_t arena_size, bool use_scratch)
+        : arena_size(arena_size), use_scratch(use_scratch) {
+        vector<const IRNode *> common = allocations[0].path;
+        for (const ArenaAllocation &a : allocations) {
+            offsets[a.op] = a.offset;
+            size_t i = 0;
+            while (i < common.size() && i < a.path.size() && common[i] == a.path[i]) {
+                i++;
+            }
+            common.resize(i);
+        }
+        internal_assert(!common.empty());
+        outermost = common.back();
+    }
+};
+
+}  // namespace
+
+Stmt plan_memory(const Stmt &s, const Target &t, int64_t &scratch_bytes) {
+    const bool use_scratch = t.has_feature(Target::ScratchMemory);
+    scratch_bytes = 0;
+
+    FindArenaAllocations finder(use_scratch);
+    s.accept(&finder);
+    finder.remove_shared();
+    vector<ArenaAllocation> &allocations = finder.result;
+
+    int64_t arena_size = allocations.empty() ? 0 : assign_offsets(allocations);
+    if (arena_size > max_arena_size) {
+        for (const ArenaAllocation &a : allocations) {
+            finder.unplanned.insert(a.op->name);
+        }
+        allocations.clear();
+    }
+
+    if (use_scratch && !finder.unplanned.empty()) {
+        std::ostringstream names;
+        for (const string &name : finder.unplanned) {
+            names << " " << name;
+        }
+        user_error << "Target has feature scratch_memory, but these allocations "
+                   << "have no constant upper bound on their size, are inside a "
+                   << "loop, or don't fit in the scratch memory, so they would "
+                   << "still use halide_malloc:"
+                   << names.str() << "\n"
+                   << "Bound their sizes, or compute them at an outer loop level.\n";
+    }
+
+    if (allocations.empty()) {
+        return s;
+    }
+
+    for (const ArenaAllocation &a : allocations) {
+        debug(3) << "Placing " << a.op->name << " at offset " << a.offset
+                 << " of the memory arena (" << a.size << " bytes, live from "
+                 << a.first_use << " to " << a.last_use << ")\n";
+    }
+    debug(2) << "Memory arena holds " << allocations.size()
+             << " allocations in " << arena_size << " bytes\n";
+
+    if (use_scratch) {
+        // Leave room to align the start of the caller's memory.
+        scratch_bytes = arena_size + arena_alignment - 1;
+    }
+
+    return UseArena(allocations, arena_size, use_scratch).mutate(s);
+}
+
+}
+}
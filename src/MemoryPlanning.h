@@ -0,0 +1,35 @@
+#ifndef HALIDE_MEMORY_PLANNING_H
+#define HALIDE_MEMORY_PLANNING_H
+
+/** \file
+ * Defines the lowering pass that packs heap allocations into a single
+ * arena allocated once per pipeline invocation.
+ */
+
+#include "IR.h"
+#include "Target.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Find the heap allocations outside of any loop whose sizes are
+ * constant, and carve them out of a single arena instead of
+ * allocating each one separately. Allocations whose lifetimes don't
+ * overlap share space in the arena. Lifetimes end at the Free nodes,
+ * so this must be called after inject_early_frees. Allocations small
+ * enough for the stack are left alone, so it should also be called
+ * after bound_small_allocations.
+ *
+ * If the target has Target::ScratchMemory, the arena is the memory
+ * the caller passes in the __scratch and __scratch_size arguments
+ * instead, and scratch_bytes is set to the size it must be. Then
+ * allocations whose sizes vary but have a constant upper bound are
+ * placed in it too, and any heap allocation that can't be is an
+ * error. The pipeline fails with halide_error_code_scratch_too_small
+ * if it is given less. */
+Stmt plan_memory(const Stmt &s, const Target &t, int64_t &scratch_bytes);
+
+}
+}
+
+#endif
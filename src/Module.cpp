@@ -1,5 +1,6 @@
 #include "Module.h"
 
+#include <algorithm>
 #include <array>
 #include <fstream>
 #include <future>
@@ -489,6 +490,9 @@ void compile_multitarget(const std::string &fn_name,
     TemporaryObjectFileDir temp_dir;
     std::vector<Expr> wrapper_args;
     std::vector<LoweredArgument> base_target_args;
+    // The wrapper passes its scratch memory to whichever sub-target it
+    // calls, so it needs as much as the hungriest of them.
+    int64_t scratch_bytes = 0;
     for (const Target &target : targets) {
         // arch-bits-os must be identical across all targets.
         if (target.os != base_target.os ||
@@ -497,12 +501,13 @@ void compile_multitarget(const std::string &fn_name,
             user_error << "All Targets must have matching arch-bits-os for compile_multitarget.\n";
         }
         // Some features must match across all targets.
-        static const std::array<Target::Feature, 6> must_match_features = {{
+        static const std::array<Target::Feature, 7> must_match_features = {{
             Target::CPlusPlusMangling,
             Target::JIT,
             Target::Matlab,
             Target::MSAN,
             Target::NoRuntime,
+            Target::ScratchMemory,
             Target::UserContext,
         }};
         for (auto f : must_match_features) {
@@ -533,6 +538,7 @@ void compile_multitarget(const std::string &fn_name,
         // Re-assign every time -- should be the same across all targets anyway,
         // but base_target is always the last one we encounter.
         base_target_args = sub_module.get_function_by_name(sub_fn_name).args;
+        scratch_bytes = std::max(scratch_bytes, sub_module.get_function_by_name(sub_fn_name).scratch_bytes);
 
         Outputs sub_out = add_suffixes(output_files, suffix);
         internal_assert(sub_out.object_name.empty());
@@ -605,7 +611,9 @@ void compile_multitarget(const std::string &fn_name,
         }
 
         Module wrapper_module(fn_name, wrapper_target);
-        wrapper_module.append(LoweredFunc(fn_name, base_target_args, wrapper_body, LoweredFunc::ExternalPlusMetadata));
+        LoweredFunc wrapper_func(fn_name, base_target_args, wrapper_body, LoweredFunc::ExternalPlusMetadata);
+        wrapper_func.scratch_bytes = scratch_bytes;
+        wrapper_module.append(wrapper_func);
 
         // Add a wrapper to accept old buffer_ts
         add_legacy_wrapper(wrapper_module, wrapper_module.functions().back());
@@ -620,7 +628,9 @@ void compile_multitarget(const std::string &fn_name,
 
     if (!output_files.c_header_name.empty()) {
         Module header_module(fn_name, base_target);
-        header_module.append(LoweredFunc(fn_name, base_target_args, {}, LoweredFunc::ExternalPlusMetadata));
+        LoweredFunc header_func(fn_name, base_target_args, {}, LoweredFunc::ExternalPlusMetadata);
+        header_func.scratch_bytes = scratch_bytes;
+        header_module.append(header_func);
         // Add a wrapper to accept old buffer_ts
         add_legacy_wrapper(header_module, header_module.functions().back());
         Outputs header_out = Outputs().c_header(output_files.c_header_name);
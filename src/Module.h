@@ -60,6 +60,11 @@ struct LoweredFunc {
      * the Target. */
     NameMangling name_mangling;
 
+    /** The number of bytes of scratch memory the caller must pass to
+     * this function when it is compiled with
+     * Target::ScratchMemory. Zero otherwise. */
+    int64_t scratch_bytes = 0;
+
     LoweredFunc(const std::string &name,
                 const std::vector<LoweredArgument> &args,
                 Stmt body,
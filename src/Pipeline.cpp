@@ -80,6 +80,10 @@ struct PipelineContents {
     /** A set of custom passes to use when lowering this Func. */
     vector<CustomLoweringPass> custom_lowering_passes;
 
+    /** The partition of the memoization cache used by memoized Funcs
+     * that don't select one themselves. */
+    string memoization_partition;
+
     /** The inferred arguments. Also the arguments to the main
      * function in the jit_module above. The two must be updated
      * together. */
@@ -353,6 +357,19 @@ Module Pipeline::compile_to_module(const vector<Argument> &args,
         lowering_args.insert(lowering_args.begin(), contents->user_context_arg.arg);
     }
 
+    // Pipelines that take their scratch memory from the caller get
+    // two more arguments, right after the user context.
+    if (target.has_feature(Target::ScratchMemory)) {
+        auto pos = lowering_args.begin();
+        if (pos != lowering_args.end() && pos->name == contents->user_context_arg.arg.name) {
+            pos++;
+        }
+        lowering_args.insert(pos, {
+            Argument("__scratch", Argument::InputScalar, type_of<void *>(), 0),
+            Argument("__scratch_size", Argument::InputScalar, UInt(64), 0)
+        });
+    }
+
     const Module &old_module = contents->module;
 
     bool same_compile = !old_module.functions().empty() && old_module.target() == target;
@@ -383,7 +400,8 @@ Module Pipeline::compile_to_module(const vector<Argument> &args,
             custom_passes.push_back(p.pass);
         }
 
-        contents->module = lower(contents->outputs, new_fn_name, target, lowering_args, linkage_type, custom_passes);
+        contents->module = lower(contents->outputs, new_fn_name, target, lowering_args, linkage_type, custom_passes,
+                                 contents->memoization_partition);
     }
 
     return contents->module;
@@ -407,6 +425,9 @@ void *Pipeline::compile_jit(const Target &target_arg) {
     Target target(target_arg);
     target.set_feature(Target::JIT);
     target.set_feature(Target::UserContext);
+    // The JIT calls the pipeline with the arguments the user gave it,
+    // so there's no way to pass scratch memory.
+    target.set_feature(Target::ScratchMemory, false);
 
     debug(2) << "jit-compiling for: " << target_arg.to_string() << "\n";
 
@@ -522,6 +543,17 @@ const vector<CustomLoweringPass> &Pipeline::custom_lowering_passes() {
     return contents->custom_lowering_passes;
 }
 
+void Pipeline::set_memoization_partition(const std::string &partition) {
+    user_assert(defined()) << "Pipeline is undefined\n";
+    contents->invalidate_cache();
+    contents->memoization_partition = partition;
+}
+
+const std::string &Pipeline::memoization_partition() {
+    user_assert(defined()) << "Pipeline is undefined\n";
+    return contents->memoization_partition;
+}
+
 const JITHandlers &Pipeline::jit_handlers() {
     user_assert(defined()) << "Pipeline is undefined\n";
     return contents->jit_handlers;
@@ -907,7 +939,9 @@ void Pipeline::realize(Realization dst, const Target &t) {
     debug(2) << "Back from jitted function. Exit status was " << exit_status << "\n";
 
     // If we're profiling, report runtimes and reset profiler stats.
-    if (target.has_feature(Target::Profile)) {
+    if (target.has_feature(Target::Profile) ||
+        target.has_feature(Target::ProfileTimeline) ||
+        target.has_feature(Target::ProfileMemoryTraffic)) {
         JITModule::Symbol report_sym =
             contents->jit_module.find_symbol_by_name("halide_profiler_report");
         JITModule::Symbol reset_sym =
@@ -917,6 +951,19 @@ void Pipeline::realize(Realization dst, const Target &t) {
             void (*report_fn_ptr)(void *) = (void (*)(void *))(report_sym.address);
             report_fn_ptr(uc);
 
+            // The stats and timeline are about to be reset, so write
+            // them out now rather than at exit, if asked to.
+            const char *writers[][2] = {{"HL_PROFILER_JSON", "halide_profiler_write_json"},
+                                        {"HL_PROFILER_TRACE", "halide_profiler_write_trace"}};
+            for (const auto &w : writers) {
+                string filename = get_env_variable(w[0]);
+                JITModule::Symbol write_sym = contents->jit_module.find_symbol_by_name(w[1]);
+                if (!filename.empty() && write_sym.address) {
+                    int (*write_fn_ptr)(void *, const char *) = (int (*)(void *, const char *))(write_sym.address);
+                    write_fn_ptr(uc, filename.c_str());
+                }
+            }
+
             void (*reset_fn_ptr)() = (void (*)())(reset_sym.address);
             reset_fn_ptr();
         }
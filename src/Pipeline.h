@@ -351,6 +351,16 @@ public:
     /** Get the custom lowering passes. */
     EXPORT const std::vector<CustomLoweringPass> &custom_lowering_passes();
 
+    /** Store the results of the memoized Funcs in this pipeline in the
+     * named partition of the memoization cache, unless they select a
+     * partition of their own with Func::memoize(partition). An empty
+     * name means the default partition. */
+    EXPORT void set_memoization_partition(const std::string &partition);
+
+    /** Get the partition of the memoization cache set with
+     * set_memoization_partition. */
+    EXPORT const std::string &memoization_partition();
+
     /** See Func::realize */
     // @{
     EXPORT Realization realize(std::vector<int32_t> sizes, const Target &target = Target());
@@ -5,8 +5,10 @@
 
 #include "Profiling.h"
 #include "CodeGen_Internal.h"
+#include "ExprUsesVar.h"
 #include "IRMutator.h"
 #include "IROperator.h"
+#include "IRVisitor.h"
 #include "Scope.h"
 #include "Simplify.h"
 #include "Substitute.h"
@@ -27,25 +29,57 @@ public:
 
     string pipeline_name;
 
-    InjectProfiling(const string &pipeline_name) : pipeline_name(pipeline_name) {
+    // The slot the current thread publishes the running Func in. Empty
+    // inside offloaded code, which sets the single current_func of its
+    // profiler state instead.
+    string thread_slot;
+
+    // Whether threads also log when they start running each Func and
+    // each task to a timeline.
+    bool timeline;
+
+    InjectProfiling(const string &pipeline_name, const string &thread_slot, bool timeline)
+        : pipeline_name(pipeline_name), thread_slot(thread_slot), timeline(timeline) {
         indices["overhead"] = 0;
         stack.push_back(0);
     }
 
-    map<int, uint64_t> func_stack_current; // map from func id -> current stack allocation
-    map<int, uint64_t> func_stack_peak; // map from func id -> peak stack allocation
-
-private:
-    using IRMutator2::visit;
-
-    struct AllocSize {
-        bool on_stack;
-        Expr size;
-    };
-
-    Scope<AllocSize> func_alloc_sizes;
+    // Claim a slot for the current thread for the duration of
+    // body. The slot is released even if the body fails.
+    Stmt with_thread_slot(const string &name, bool is_task, Stmt body) {
+        Expr acquire;
+        string release;
+        if (timeline) {
+            Expr profiler_token = Variable::make(Int(32), "profiler_token");
+            acquire = Call::make(Handle(), "halide_profiler_timeline_acquire_thread_slot",
+                                 {profiler_token, is_task ? 1 : 0}, Call::Extern);
+            release = "halide_profiler_timeline_release_thread_slot";
+        } else {
+            acquire = Call::make(Handle(), "halide_profiler_acquire_thread_slot", {}, Call::Extern);
+            release = "halide_profiler_release_thread_slot";
+        }
+        return Allocate::make(name, Int(32), {}, const_true(), body, acquire, release);
+    }
 
-    bool profiling_memory = true;
+    Stmt set_current_func(int idx) {
+        Expr profiler_token = Variable::make(Int(32), "profiler_token");
+        if (thread_slot.empty()) {
+            Expr profiler_state = Variable::make(Handle(), "profiler_state");
+            // This call gets inlined and becomes a single store instruction.
+            return Evaluate::make(Call::make(Int(32), "halide_profiler_set_current_func",
+                                             {profiler_state, profiler_token, idx}, Call::Extern));
+        }
+        Expr slot = Variable::make(Handle(), thread_slot);
+        Expr func = idx < 0 ? Expr(idx) : profiler_token + idx;
+        if (timeline) {
+            // Stores to the slot and logs the time.
+            return Evaluate::make(Call::make(Int(32), "halide_profiler_timeline_set_thread_func",
+                                             {slot, func}, Call::Extern));
+        }
+        // Also inlined into a single store.
+        return Evaluate::make(Call::make(Int(32), "halide_profiler_set_thread_func",
+                                         {slot, func}, Call::Extern));
+    }
 
     // Strip down the tuple name, e.g. f.0 into f
     string normalize_name(const string &name) {
@@ -67,6 +101,21 @@ private:
         return idx;
     }
 
+    map<int, uint64_t> func_stack_current; // map from func id -> current stack allocation
+    map<int, uint64_t> func_stack_peak; // map from func id -> peak stack allocation
+
+private:
+    using IRMutator2::visit;
+
+    struct AllocSize {
+        bool on_stack;
+        Expr size;
+    };
+
+    Scope<AllocSize> func_alloc_sizes;
+
+    bool profiling_memory = true;
+
     Expr compute_allocation_size(const vector<Expr> &extents,
                                  const Expr &condition,
                                  const Type &type,
@@ -184,6 +233,25 @@ private:
         return stmt;
     }
 
+    Stmt visit(const LetStmt *op) override {
+        Stmt stmt = IRMutator2::visit(op);
+
+        // Memoization defines a .cache_miss variable right after each
+        // cache lookup. Count the hits and misses of each Func there.
+        const string suffix = ".cache_miss";
+        if (profiling_memory && ends_with(op->name, suffix)) {
+            const LetStmt *let = stmt.as<LetStmt>();
+            internal_assert(let);
+            int idx = get_func_id(op->name.substr(0, op->name.size() - suffix.size()));
+            Expr profiler_pipeline_state = Variable::make(Handle(), "profiler_pipeline_state");
+            Expr hit = cast<int>(!Variable::make(Bool(), op->name));
+            Stmt count = Evaluate::make(Call::make(Int(32), "halide_profiler_memoization_lookup",
+                                                   {profiler_pipeline_state, idx, hit}, Call::Extern));
+            stmt = LetStmt::make(let->name, let->value, Block::make(count, let->body));
+        }
+        return stmt;
+    }
+
     Stmt visit(const ProducerConsumer *op) override {
         int idx;
         Stmt body;
@@ -199,14 +267,7 @@ private:
             idx = stack.back();
         }
 
-        Expr profiler_token = Variable::make(Int(32), "profiler_token");
-        Expr profiler_state = Variable::make(Handle(), "profiler_state");
-
-        // This call gets inlined and becomes a single store instruction.
-        Expr set_task = Call::make(Int(32), "halide_profiler_set_current_func",
-                                   {profiler_state, profiler_token, idx}, Call::Extern);
-
-        body = Block::make(Evaluate::make(set_task), body);
+        body = Block::make(set_current_func(idx), body);
 
         return ProducerConsumer::make(op->name, op->is_producer, body);
     }
@@ -214,10 +275,31 @@ private:
     Stmt visit(const For *op) override {
         Stmt body = op->body;
 
-        // The for loop indicates a device transition or a
-        // parallel job launch. Decrement the number of active
-        // threads outside the loop, and increment it inside the
-        // body.
+        bool on_host = (op->device_api == DeviceAPI::None ||
+                        op->device_api == DeviceAPI::Host);
+        if (op->is_parallel() && on_host && !thread_slot.empty()) {
+            // Each task publishes the Func it is running in a slot of
+            // its own. The slot starts out with the Func whose
+            // production contains the loop, and is released even if
+            // the task fails.
+            string old_thread_slot = thread_slot;
+            thread_slot = unique_name("profiler_thread_slot");
+            body = Block::make(set_current_func(stack.back()), mutate(body));
+            body = with_thread_slot(thread_slot, true, body);
+            thread_slot = old_thread_slot;
+
+            // This thread only waits, or runs tasks in slots of their
+            // own, until the loop is done.
+            Stmt stmt = For::make(op->name, op->min, op->extent, op->for_type, op->device_api, body);
+            return Block::make({set_current_func(halide_profiler_outside_of_halide),
+                                stmt,
+                                set_current_func(stack.back())});
+        }
+
+        // The for loop indicates a device transition or a parallel
+        // job launch in offloaded code. Decrement the number of
+        // active threads outside the loop, and increment it inside
+        // the body.
         bool update_active_threads = (op->device_api == DeviceAPI::Hexagon ||
                                       op->is_parallel());
 
@@ -240,9 +322,12 @@ private:
             // hexagon. We don't support per-func stats remotely,
             // which means we can't do memory accounting.
             bool old_profiling_memory = profiling_memory;
+            string old_thread_slot = thread_slot;
             profiling_memory = false;
+            thread_slot.clear();
             body = mutate(body);
             profiling_memory = old_profiling_memory;
+            thread_slot = old_thread_slot;
 
             // Get the profiler state pointer from scratch inside the
             // kernel. There will be a separate copy of the state on
@@ -250,8 +335,7 @@ private:
             Expr get_state = Call::make(Handle(), "halide_profiler_get_state", {}, Call::Extern);
             body = substitute("profiler_state", Variable::make(Handle(), "hvx_profiler_state"), body);
             body = LetStmt::make("hvx_profiler_state", get_state, body);
-        } else if (op->device_api == DeviceAPI::None ||
-                   op->device_api == DeviceAPI::Host) {
+        } else if (on_host) {
             body = mutate(body);
         } else {
             body = op->body;
@@ -266,8 +350,185 @@ private:
     }
 };
 
-Stmt inject_profiling(Stmt s, string pipeline_name) {
-    InjectProfiling profiling(pipeline_name);
+// Counts the arithmetic operations in an expression, not including
+// the address arithmetic of loads.
+class CountOps : public IRVisitor {
+    using IRVisitor::visit;
+
+    template<typename T>
+    void count(const T *op) {
+        ops += op->type.lanes();
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Add *op) override { count(op); }
+    void visit(const Sub *op) override { count(op); }
+    void visit(const Mul *op) override { count(op); }
+    void visit(const Div *op) override { count(op); }
+    void visit(const Mod *op) override { count(op); }
+    void visit(const Min *op) override { count(op); }
+    void visit(const Max *op) override { count(op); }
+    void visit(const EQ *op) override { count(op); }
+    void visit(const NE *op) override { count(op); }
+    void visit(const LT *op) override { count(op); }
+    void visit(const LE *op) override { count(op); }
+    void visit(const GT *op) override { count(op); }
+    void visit(const GE *op) override { count(op); }
+    void visit(const And *op) override { count(op); }
+    void visit(const Or *op) override { count(op); }
+    void visit(const Not *op) override { count(op); }
+    void visit(const Select *op) override { count(op); }
+
+    void visit(const Call *op) override {
+        // Math library functions.
+        if (op->call_type == Call::PureExtern) {
+            ops += op->type.lanes();
+        }
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Load *op) override {}
+
+public:
+    int64_t ops = 0;
+};
+
+// Counts the bytes each Func's host loops load and store, and the
+// arithmetic in the values they store, and adds them to the Func's
+// stats at runtime. The counts of a loop are those of its body times
+// its extent, as if every condition inside were true. They are added
+// to the counts of the enclosing loop where possible, so that most
+// loop nests only report once, before they start. They are reported
+// before the loop itself when they depend on variables defined inside
+// the enclosing loop.
+class InjectMemoryTrafficCounts : public IRMutator2 {
+public:
+    InjectMemoryTrafficCounts(InjectProfiling &profiling) : profiling(profiling) {
+        stack.push_back(0);
+    }
+
+private:
+    using IRMutator2::visit;
+
+    struct Traffic {
+        Expr bytes_read, bytes_written, ops;
+    };
+
+    InjectProfiling &profiling;
+
+    // The Funcs whose produce nodes we are inside of.
+    vector<int> stack;
+
+    // The counts of the loop being visited by Func id, and the
+    // variables defined inside it. Null outside of any host loop.
+    map<int, Traffic> *counts = nullptr;
+    Scope<> *defined = nullptr;
+
+    void add(int idx, Expr bytes_read, Expr bytes_written, Expr ops) {
+        auto it = counts->find(idx);
+        if (it == counts->end()) {
+            (*counts)[idx] = {bytes_read, bytes_written, ops};
+        } else {
+            it->second.bytes_read += bytes_read;
+            it->second.bytes_written += bytes_written;
+            it->second.ops += ops;
+        }
+    }
+
+    Expr visit(const Load *op) override {
+        if (counts) {
+            add(stack.back(), make_const(UInt(64), op->type.bytes() * op->type.lanes()),
+                make_zero(UInt(64)), make_zero(UInt(64)));
+        }
+        return IRMutator2::visit(op);
+    }
+
+    Stmt visit(const Store *op) override {
+        if (counts) {
+            CountOps c;
+            op->value.accept(&c);
+            add(stack.back(), make_zero(UInt(64)),
+                make_const(UInt(64), op->value.type().bytes() * op->value.type().lanes()),
+                make_const(UInt(64), c.ops));
+        }
+        return IRMutator2::visit(op);
+    }
+
+    Stmt visit(const ProducerConsumer *op) override {
+        if (op->is_producer) {
+            stack.push_back(profiling.get_func_id(op->name));
+            Stmt stmt = IRMutator2::visit(op);
+            stack.pop_back();
+            return stmt;
+        }
+        return IRMutator2::visit(op);
+    }
+
+    Stmt visit(const LetStmt *op) override {
+        if (defined) {
+            defined->push(op->name);
+            Stmt stmt = IRMutator2::visit(op);
+            defined->pop(op->name);
+            return stmt;
+        }
+        return IRMutator2::visit(op);
+    }
+
+    Stmt visit(const For *op) override {
+        if (op->device_api != DeviceAPI::None &&
+            op->device_api != DeviceAPI::Host) {
+            // Loads and stores on a device aren't counted.
+            return op;
+        }
+
+        map<int, Traffic> *old_counts = counts;
+        Scope<> *old_defined = defined;
+        map<int, Traffic> body_counts;
+        Scope<> body_defined;
+        body_defined.push(op->name);
+        counts = &body_counts;
+        defined = &body_defined;
+        Stmt body = mutate(op->body);
+        counts = old_counts;
+        defined = old_defined;
+
+        Stmt stmt = op;
+        if (!body.same_as(op->body)) {
+            stmt = For::make(op->name, op->min, op->extent, op->for_type, op->device_api, body);
+        }
+
+        Expr extent = cast<uint64_t>(op->extent);
+        vector<Stmt> reports;
+        for (const auto &c : body_counts) {
+            Traffic t = {simplify(c.second.bytes_read * extent),
+                         simplify(c.second.bytes_written * extent),
+                         simplify(c.second.ops * extent)};
+            if (counts &&
+                !expr_uses_vars(t.bytes_read, *defined) &&
+                !expr_uses_vars(t.bytes_written, *defined) &&
+                !expr_uses_vars(t.ops, *defined)) {
+                add(c.first, t.bytes_read, t.bytes_written, t.ops);
+            } else {
+                Expr state = Variable::make(Handle(), "profiler_pipeline_state");
+                reports.push_back(Evaluate::make(Call::make(Int(32), "halide_profiler_memory_traffic",
+                                                            {state, c.first, t.bytes_read, t.bytes_written, t.ops},
+                                                            Call::Extern)));
+            }
+        }
+        if (!reports.empty()) {
+            reports.push_back(stmt);
+            stmt = Block::make(reports);
+        }
+        return stmt;
+    }
+};
+
+Stmt inject_profiling(Stmt s, string pipeline_name, const Target &t) {
+    const string thread_slot = "profiler_thread_slot";
+    InjectProfiling profiling(pipeline_name, thread_slot, t.has_feature(Target::ProfileTimeline));
+    if (t.has_feature(Target::ProfileMemoryTraffic)) {
+        s = InjectMemoryTrafficCounts(profiling).mutate(s);
+    }
     s = profiling.mutate(s);
 
     int num_funcs = (int)(profiling.indices.size());
@@ -296,14 +557,9 @@ Stmt inject_profiling(Stmt s, string pipeline_name) {
         s = Block::make(update_stack, s);
     }
 
-    Expr profiler_state = Variable::make(Handle(), "profiler_state");
-    Stmt incr_active_threads =
-        Evaluate::make(Call::make(Int(32), "halide_profiler_incr_active_threads",
-                                  {profiler_state}, Call::Extern));
-    Stmt decr_active_threads =
-        Evaluate::make(Call::make(Int(32), "halide_profiler_decr_active_threads",
-                                  {profiler_state}, Call::Extern));
-    s = Block::make({incr_active_threads, s, decr_active_threads});
+    // The calling thread publishes the Func it is running in a slot
+    // of its own.
+    s = profiling.with_thread_slot(thread_slot, false, s);
 
     s = LetStmt::make("profiler_pipeline_state", get_pipeline_state, s);
     s = LetStmt::make("profiler_state", get_state, s);
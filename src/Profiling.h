@@ -25,6 +25,7 @@
  */
 
 #include "IR.h"
+#include "Target.h"
 
 namespace Halide {
 namespace Internal {
@@ -32,11 +33,14 @@ namespace Internal {
 /** Take a statement representing a halide pipeline insert
  * high-resolution timing into the generated code (via spawning a
  * thread that acts as a sampling profiler); summaries of execution
- * times and counts will be logged at the end. Should be done before
- * storage flattening, but after all bounds inference.
+ * times and counts will be logged at the end. If the target has the
+ * profile_timeline feature, the threads running the pipeline also log
+ * exactly when they start running each Func and each parallel task.
+ * Should be done before storage flattening, but after all bounds
+ * inference.
  *
  */
-Stmt inject_profiling(Stmt, std::string);
+Stmt inject_profiling(Stmt, std::string, const Target &);
 
 }
 }
@@ -35,6 +35,15 @@ class RemoveDeadAllocations : public IRMutator2 {
         return IRMutator2::visit(op);
     }
 
+    Expr visit(const Variable *op) override {
+        // Other allocations may be carved out of this one by pointer.
+        if (op->type.is_handle() && allocs.contains(op->name)) {
+            allocs.pop(op->name);
+        }
+
+        return op;
+    }
+
     Stmt visit(const Store *op) override {
         if (allocs.contains(op->name)) {
             allocs.pop(op->name);
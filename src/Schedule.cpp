@@ -186,10 +186,13 @@ struct FuncScheduleContents {
     std::vector<Bound> estimates;
     std::map<std::string, Internal::FunctionPtr> wrappers;
     bool memoized;
+    std::string memoize_partition;
+    bool memoize_reuse_crops;
+    bool async;
 
     FuncScheduleContents() :
         store_level(LoopLevel::inlined()), compute_level(LoopLevel::inlined()),
-        memoized(false) {};
+        memoized(false), memoize_reuse_crops(false), async(false) {};
 
     // Pass an IRMutator2 through to all Exprs referenced in the FuncScheduleContents
     void mutate(IRMutator2 *mutator) {
@@ -296,6 +299,9 @@ FuncSchedule FuncSchedule::deep_copy(
     copy.contents->bounds = contents->bounds;
     copy.contents->estimates = contents->estimates;
     copy.contents->memoized = contents->memoized;
+    copy.contents->memoize_partition = contents->memoize_partition;
+    copy.contents->memoize_reuse_crops = contents->memoize_reuse_crops;
+    copy.contents->async = contents->async;
 
     // Deep-copy wrapper functions.
     for (const auto &iter : contents->wrappers) {
@@ -315,6 +321,30 @@ bool FuncSchedule::memoized() const {
     return contents->memoized;
 }
 
+std::string &FuncSchedule::memoize_partition() {
+    return contents->memoize_partition;
+}
+
+const std::string &FuncSchedule::memoize_partition() const {
+    return contents->memoize_partition;
+}
+
+bool &FuncSchedule::memoize_reuse_crops() {
+    return contents->memoize_reuse_crops;
+}
+
+bool FuncSchedule::memoize_reuse_crops() const {
+    return contents->memoize_reuse_crops;
+}
+
+bool &FuncSchedule::async() {
+    return contents->async;
+}
+
+bool FuncSchedule::async() const {
+    return contents->async;
+}
+
 std::vector<StorageDim> &FuncSchedule::storage_dims() {
     return contents->storage_dims;
 }
@@ -316,6 +316,30 @@ public:
     bool memoized() const;
     // @}
 
+    /** The partition of the memoization cache that the results of a
+     * memoized function are stored in. Empty means the partition
+     * selected for the whole pipeline, if any, or else the default
+     * partition. See \ref Func::memoize */
+    // @{
+    std::string &memoize_partition();
+    const std::string &memoize_partition() const;
+    // @}
+
+    /** This flag is set to true if lookups of a memoized function may
+     * be satisfied by a crop of a result cached over a larger
+     * region. See \ref Func::memoize_reuse_crops */
+    // @{
+    bool &memoize_reuse_crops();
+    bool memoize_reuse_crops() const;
+    // @}
+
+    /** This flag is set to true if the producer of this function
+     * should run concurrently with its consumers. See \ref Func::async */
+    // @{
+    bool &async();
+    bool async() const;
+    // @}
+
     /** The list and order of dimensions used to store this
      * function. The first dimension in the vector corresponds to the
      * innermost dimension for storage (i.e. which dimension is
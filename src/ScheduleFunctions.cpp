@@ -1149,6 +1149,10 @@ bool validate_schedule(Function f, Stmt s, const Target &target, bool is_output,
     // Outputs must be compute_root and store_root. They're really
     // store_in_user_code, but store_root is close enough.
     if (is_output) {
+        if (f.schedule().async()) {
+            user_error << "Func " << f.name() << " is an output, so it"
+                       << " cannot be computed asynchronously.\n";
+        }
         if (store_at.is_root() && compute_at.is_root()) {
             return true;
         } else {
@@ -1,4 +1,5 @@
 #include "StorageFolding.h"
+#include "AsyncProducers.h"
 #include "IROperator.h"
 #include "IRMutator.h"
 #include "Simplify.h"
@@ -422,10 +423,44 @@ class AttemptStorageFoldingOfFunction : public IRMutator {
                 if (factor.defined()) {
                     debug(3) << "Proceeding with factor " << factor << "\n";
 
-                    Fold fold = {(int)i - 1, factor};
-                    dims_folded.push_back(fold);
+                    Fold fold = {(int)i - 1, factor, ""};
                     body = FoldStorageOfFunction(func.name(), (int)i - 1, factor, dynamic_footprint).mutate(body);
 
+                    if (func.schedule().async()) {
+                        user_assert(dynamic_footprint.empty())
+                            << "Func " << func.name() << " is computed asynchronously, so its storage "
+                            << "can only be folded over a loop along which its footprint provably "
+                            << "moves monotonically, which is not the case for the loop over "
+                            << op->name << ".\n";
+
+                        // The producer runs ahead of the consumer in
+                        // a separate task (see AsyncProducers.cpp). A
+                        // semaphore counts the free slots in the
+                        // folded dimension, so that the producer
+                        // can't overwrite values the consumer has yet
+                        // to read. Each iteration, the producer
+                        // acquires the slots it is about to use for
+                        // the first time, and the consumer releases
+                        // the ones the next iteration won't touch.
+                        Expr loop_var = Variable::make(Int(32), op->name);
+                        Expr to_acquire, to_release;
+                        if (min_monotonic_increasing) {
+                            to_acquire = max - substitute(op->name, loop_var - 1, max);
+                            to_release = substitute(op->name, loop_var + 1, min) - min;
+                        } else {
+                            to_acquire = substitute(op->name, loop_var - 1, min) - min;
+                            to_release = max - substitute(op->name, loop_var + 1, max);
+                        }
+                        // On the first iteration, the whole footprint is new.
+                        to_acquire = select(loop_var > op->min, to_acquire, extent);
+
+                        fold.semaphore = func.name() + ".folding_semaphore." + unique_name('s');
+                        body = Block::make({acquire_semaphore(fold.semaphore, simplify(to_acquire)),
+                                            body,
+                                            release_semaphore(fold.semaphore, simplify(to_release))});
+                    }
+                    dims_folded.push_back(fold);
+
                     Expr next_var = Variable::make(Int(32), op->name) + 1;
                     Expr next_min = substitute(op->name, next_var, min);
                     if (can_prove(max < next_min)) {
@@ -477,6 +512,9 @@ public:
     struct Fold {
         int dim;
         Expr factor;
+        // The semaphore guarding the folded storage of an async
+        // Func, if any.
+        string semaphore;
     };
     vector<Fold> dims_folded;
 
@@ -522,6 +560,13 @@ class StorageFolding : public IRMutator {
             }
 
             stmt = Realize::make(op->name, op->types, bounds, op->condition, body);
+
+            for (const auto &fold : folder.dims_folded) {
+                if (!fold.semaphore.empty()) {
+                    // Initially all of the folded storage is free.
+                    stmt = make_semaphore(fold.semaphore, fold.factor, stmt);
+                }
+            }
         }
     }
 
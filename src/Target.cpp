@@ -263,6 +263,11 @@ const std::map<std::string, Target::Feature> feature_name_map = {
     {"trace_loads", Target::TraceLoads},
     {"trace_stores", Target::TraceStores},
     {"trace_realizations", Target::TraceRealizations},
+    {"malloc_pool", Target::MallocPool},
+    {"scratch_memory", Target::ScratchMemory},
+    {"profile_timeline", Target::ProfileTimeline},
+    {"profile_memory_traffic", Target::ProfileMemoryTraffic},
+    {"memoize_disk", Target::MemoizeDisk},
 };
 
 bool lookup_feature(const std::string &tok, Target::Feature &result) {
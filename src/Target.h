@@ -85,6 +85,11 @@ struct Target {
         TraceLoads = halide_target_feature_trace_loads,
         TraceStores = halide_target_feature_trace_stores,
         TraceRealizations = halide_target_feature_trace_realizations,
+        MallocPool = halide_target_feature_malloc_pool,
+        ScratchMemory = halide_target_feature_scratch_memory,
+        ProfileTimeline = halide_target_feature_profile_timeline,
+        ProfileMemoryTraffic = halide_target_feature_profile_memory_traffic,
+        MemoizeDisk = halide_target_feature_memoize_disk,
         FeatureEnd = halide_target_feature_end
     };
     Target() : os(OSUnknown), arch(ArchUnknown), bits(0) {}
@@ -180,6 +180,157 @@ extern void halide_join_thread(struct halide_thread *);
  */
 extern int halide_set_num_threads(int n);
 
+/** Control whether the worker threads of Halide's thread pool are
+ * pinned to cores. Returns the old setting.
+ *
+ * enabled == 0 : threads are not pinned (the default).
+ * enabled != 0 : each worker thread is pinned to its own core, with
+ *                consecutive workers on the same NUMA node where the
+ *                topology is known. Consecutive calls to
+ *                halide_do_par_for also hand each worker the same
+ *                slice of the task indices, so that memory first
+ *                touched by a parallel loop tends to be consumed on
+ *                the same node by the next one.
+ *
+ * Pinning can also be enabled by setting the environment variable
+ * HL_THREAD_AFFINITY=1. Only the default thread pool on Linux, Android
+ * and Windows respects this setting.
+ */
+extern int halide_set_thread_affinity(int enabled);
+
+/** Set how many times an idle thread in Halide's thread pool polls
+ * for new work before going to sleep. Spinning briefly lets
+ * back-to-back parallel loops start without waiting for threads to
+ * wake up, at the cost of some CPU time while the pool is idle. Zero
+ * disables spinning. Returns the old value. Can also be set with the
+ * environment variable HL_THREAD_POOL_SPIN_COUNT. Only the default
+ * thread pool on Linux, Android, Windows and Hexagon respects this
+ * setting.
+ */
+extern int halide_set_thread_pool_spin_count(int spin_count);
+
+/** An opaque handle to a thread pool separate from the default one,
+ * for isolating the parallel work of one client of Halide from
+ * another. */
+struct halide_thread_pool;
+
+/** Create a thread pool with its own worker threads. num_threads
+ * works as for halide_set_num_threads, with zero meaning the default
+ * size. priority is relative to the default scheduling priority of
+ * the platform: positive values raise the priority of the pool's
+ * worker threads (which may require privileges), negative values
+ * lower it, and zero leaves it alone. Threads are created lazily on
+ * first use. On platforms where Halide does not manage its own
+ * threads (OS X, iOS, and targets without threads) all pools share
+ * the platform's threads. Returns NULL on failure.
+ */
+extern struct halide_thread_pool *halide_thread_pool_create(int num_threads, int priority);
+
+/** Destroy a thread pool created with halide_thread_pool_create,
+ * after removing any bindings to it. Any pipelines using the pool
+ * must have finished. */
+extern void halide_thread_pool_destroy(struct halide_thread_pool *pool);
+
+/** Run all parallel work for calls made with the given user_context
+ * on the given thread pool instead of the default one. Pass a NULL
+ * pool to go back to the default thread pool. Calls with other
+ * user_contexts are unaffected. Has no effect if halide_do_par_for
+ * has been replaced with a custom implementation. Returns zero on
+ * success.
+ */
+extern int halide_thread_pool_bind(void *user_context, struct halide_thread_pool *pool);
+
+/** Statistics gathered by Halide's thread pool, for telling whether a
+ * pipeline is bound by compute or by waiting in the thread pool. All
+ * times are in nanoseconds. */
+typedef struct halide_thread_pool_stats_t {
+    /** The number of calls to halide_do_par_for. */
+    uint64_t jobs;
+
+    /** The number of tasks run, the number of chunks they were
+     * claimed in, and the largest chunk. */
+    uint64_t tasks, chunks, max_chunk_size;
+
+    /** The number of jobs that some thread other than the caller of
+     * halide_do_par_for helped with, and the total and maximum time
+     * from those jobs being enqueued to the first helper joining
+     * them. */
+    uint64_t jobs_helped, total_join_latency, max_join_latency;
+
+    /** The time worker threads spent with no job to work on, and how
+     * much of that they spent asleep rather than spinning. */
+    uint64_t idle_time, sleep_time;
+
+    /** The time callers of halide_do_par_for spent waiting for other
+     * threads to finish the last tasks of their jobs. */
+    uint64_t owner_wait_time;
+
+    /** The number of times a worker thread left the active team and
+     * went to sleep because there were more workers than work. */
+    uint64_t b_team_transitions;
+
+    /** The number of worker threads created. */
+    uint64_t workers;
+} halide_thread_pool_stats_t;
+
+/** Turn on or off the timing statistics of Halide's thread pools
+ * (the latency, idle, sleep and wait times above), which cost a
+ * clock read each time a thread starts or stops waiting. The counts
+ * are always gathered. Can also be turned on by setting the
+ * environment variable HL_THREAD_POOL_STATS=1, and is turned on
+ * while pipelines compiled with the profile feature are running.
+ * Returns the old value. */
+extern int halide_set_thread_pool_stats(int enabled);
+
+/** Get the statistics gathered by a thread pool since it was created
+ * or last reset. A NULL pool means the totals over the default thread
+ * pool and all pools created with halide_thread_pool_create (the
+ * maximums are maximums over all of them). All zero on platforms
+ * where Halide does not manage its own threads. */
+extern void halide_thread_pool_get_stats(struct halide_thread_pool *pool,
+                                         halide_thread_pool_stats_t *stats);
+
+/** Get the number of tasks run by each thread of a thread pool, for
+ * spotting load imbalance. Entry zero counts the tasks run by the
+ * callers of halide_do_par_for, and entry i by the i'th worker
+ * thread. Fills in at most max_threads entries and returns the number
+ * available. A NULL pool means the totals over all pools, by
+ * index. */
+extern int halide_thread_pool_get_thread_tasks(struct halide_thread_pool *pool,
+                                               uint64_t *tasks, int max_threads);
+
+/** Zero the statistics of a thread pool, or of all of them if pool
+ * is NULL. */
+extern void halide_thread_pool_reset_stats(struct halide_thread_pool *pool);
+
+/** A counting semaphore, used to connect the producer and consumer
+ * of a Func scheduled with Func::async, which run as concurrent
+ * tasks on the thread pool. The contents are private to the
+ * runtime. */
+typedef struct halide_semaphore_t {
+    uint64_t _private[2];
+} halide_semaphore_t;
+
+/** Initialize a semaphore to the given count. The semaphore belongs
+ * to the thread pool used by calls with the given user_context. */
+extern int halide_semaphore_init(void *user_context, struct halide_semaphore_t *sem, int count);
+
+/** Add n to the count of a semaphore, waking any threads blocked
+ * acquiring it. */
+extern int halide_semaphore_release(struct halide_semaphore_t *sem, int n);
+
+/** Subtract n from the count of a semaphore if the count is at least
+ * n, and return whether it was. Never blocks. */
+extern bool halide_semaphore_try_acquire(struct halide_semaphore_t *sem, int n);
+
+/** Subtract n from the count of a semaphore, blocking until the
+ * count is at least n. While a thread is blocked here, the thread
+ * pool runs an extra worker thread in its place, so that the task
+ * that will release the semaphore is guaranteed to make
+ * progress. Returns zero on success, or an error code if the task
+ * that releases the semaphore exits without releasing enough. */
+extern int halide_semaphore_acquire(struct halide_semaphore_t *sem, int n);
+
 /** Halide calls these functions to allocate and free memory. To
  * replace in AOT code, use the halide_set_custom_malloc and
  * halide_set_custom_free, or (on platforms that support weak
@@ -208,6 +359,110 @@ extern halide_malloc_t halide_set_custom_malloc(halide_malloc_t user_malloc);
 extern halide_free_t halide_set_custom_free(halide_free_t user_free);
 //@}
 
+/** An implementation of halide_malloc and halide_free that keeps
+ * freed blocks in a pool and hands them out again, instead of calling
+ * the system allocator for every allocation. Blocks are rounded up to
+ * one of a set of size classes, and the free lists are split across
+ * several caches so that threads rarely contend for them. Blocks
+ * larger than 1MB are not pooled.
+ *
+ * Install them with halide_set_custom_malloc and
+ * halide_set_custom_free, or make halide_default_malloc use the pool
+ * by compiling with the malloc_pool target feature or by setting the
+ * environment variable HL_MALLOC_POOL=1. halide_set_custom_malloc
+ * still overrides the pool in the latter cases. Either free function
+ * can free blocks from either malloc function.
+ *
+ * halide_malloc_pool_trim returns the free blocks in the pool to the
+ * system, and returns the number of bytes released. Blocks that are
+ * still in use are unaffected. Not available on Hexagon or on
+ * targets with no OS.
+ */
+//@{
+extern void *halide_pooled_malloc(void *user_context, size_t x);
+extern void halide_pooled_free(void *user_context, void *ptr);
+extern int64_t halide_malloc_pool_trim(void *user_context);
+//@}
+
+/** How halide_default_malloc allocates blocks at least as large as
+ * the huge page threshold. Large intermediate buffers allocated with
+ * malloc are backed by small pages, which cost a TLB miss on almost
+ * every access and a page fault on the first touch of every 4KB. */
+typedef enum halide_huge_page_mode_t {
+    /** Use malloc, as for smaller blocks. */
+    halide_huge_pages_off = 0,
+    /** Map memory aligned to the kernel's transparent huge page size
+     * (2MB on x86) with mmap, and ask the kernel to back it with
+     * transparent huge pages. */
+    halide_huge_pages_transparent = 1,
+    /** Map memory with MAP_HUGETLB, from the huge pages of that same
+     * size reserved by the system. Falls back to transparent huge
+     * pages if there aren't enough. */
+    halide_huge_pages_hugetlb = 2,
+} halide_huge_page_mode_t;
+
+/** Statistics about the blocks halide_default_malloc has allocated
+ * in huge page mode. All sizes are in bytes. */
+typedef struct halide_huge_page_stats_t {
+    /** The number of regions mapped from the OS, and the number of
+     * allocations that reused a freed region instead. */
+    uint64_t mapped, reused;
+
+    /** The total size of the regions ever mapped, and of the regions
+     * unmapped again. */
+    uint64_t mapped_bytes, unmapped_bytes;
+
+    /** The current and peak size of the regions in use. */
+    uint64_t in_use_bytes, peak_in_use_bytes;
+
+    /** The size of the freed regions kept for reuse. */
+    uint64_t cached_bytes;
+} halide_huge_page_stats_t;
+
+/** Set the huge page mode, and the smallest size of block it applies
+ * to. Defaults to the environment variables HL_HUGE_PAGES (one of
+ * "transparent" or "1", or "hugetlb") and HL_HUGE_PAGE_THRESHOLD (in
+ * bytes, 32MB if unset). Freed blocks are kept and reused by later
+ * allocations of a similar size, up to 1GB of them, instead of being
+ * unmapped. halide_set_custom_malloc overrides this, as it does for
+ * all other blocks. Only supported on Linux and Android, other than
+ * on MIPS. Elsewhere these functions do nothing.
+ *
+ * halide_huge_page_trim unmaps the freed regions kept for reuse, and
+ * returns the number of bytes released. The sampling profiler reports
+ * the statistics returned by halide_huge_page_get_stats.
+ */
+//@{
+extern void halide_set_huge_page_mode(halide_huge_page_mode_t mode, uint64_t threshold);
+extern int64_t halide_huge_page_trim(void *user_context);
+extern void halide_huge_page_get_stats(halide_huge_page_stats_t *stats);
+//@}
+
+/** Allocations inside a parallel loop whose size is the same for
+ * every task come from a set of per-worker buffers instead of
+ * halide_malloc. The pipeline creates the set before the loop with
+ * halide_worker_buffers_create, each task takes a buffer from it with
+ * halide_worker_buffers_acquire and gives it back with
+ * halide_worker_buffers_release, and the set is destroyed after the
+ * loop. A worker running several tasks in a row usually gets the same
+ * buffer each time. The buffers themselves come from halide_malloc.
+ *
+ * By default the set and its buffers are freed when the loop is
+ * done. Calling halide_worker_buffers_set_caching(true) keeps them
+ * for later calls of the pipeline instead. Only do this if
+ * halide_malloc and halide_free don't depend on the user context,
+ * because the buffers may be reused and freed from calls with a
+ * different one. halide_worker_buffers_trim frees the cached buffers.
+ */
+//@{
+extern void *halide_worker_buffers_create(void *user_context, uint64_t size);
+extern void *halide_worker_buffers_acquire(void *user_context, void *buffers);
+extern void halide_worker_buffers_release(void *user_context, void *ptr);
+extern void halide_worker_buffers_destroy(void *user_context, void *buffers);
+extern void halide_worker_buffers_set_caching(bool enabled);
+extern void halide_worker_buffers_trim(void *user_context);
+//@}
+
 /** Halide calls these functions to interact with the underlying
  * system runtime functions. To replace in AOT code on platforms that
  * support weak linking, define these functions yourself, or use
@@ -476,7 +731,9 @@ struct halide_trace_packet_t {
  * Halide checks the for existence of an environment variable called
  * HL_TRACE_FILE and opens that file. If HL_TRACE_FILE is not defined,
  * it outputs trace information to stdout in a human-readable
- * format. */
+ * format. Binary trace events are buffered, and written to the file
+ * by a background thread. Everything traced by a pipeline has been
+ * written by the time it returns. */
 extern void halide_set_trace_file(int fd);
 
 /** Halide calls this to retrieve the file descriptor to write binary
@@ -643,14 +900,98 @@ extern void halide_set_gpu_device(int n);
  * HL_GPU_DEVICE. */
 extern int halide_get_gpu_device(void *user_context);
 
-/** Set the soft maximum amount of memory, in bytes, that the LRU
- *  cache will use to memoize Func results.  This is not a strict
+/** Set the soft maximum amount of memory, in bytes, that the default
+ *  partition of the cache will use to memoize Func results.  This is not a strict
  *  maximum in that concurrency and simultaneous use of memoized
  *  reults larger than the cache size can both cause it to
  *  temporariliy be larger than the size specified here.
  */
 extern void halide_memoization_cache_set_size(int64_t size);
 
+/** The memoization cache can be split into named partitions, each
+ * with its own size limit, so that the results of one pipeline can't
+ * push those of another out of the cache. Funcs memoized with a
+ * partition name store their results in that partition, and the
+ * rest in the default partition, whose size is set by
+ * halide_memoization_cache_set_size. Partitions are created on first
+ * use, with the default size of the default partition. At most eight
+ * named partitions can exist at a time; lookups in partitions beyond
+ * that always miss, and their results are not cached. */
+// @{
+
+/** Set the soft maximum amount of memory, in bytes, that a named
+ * partition of the memoization cache will use, creating the
+ * partition if it doesn't exist. Returns zero on success, or -1 if
+ * the partition couldn't be created. A size of zero restores the
+ * default. */
+extern int halide_memoization_cache_set_partition_size(const char *partition, int64_t size);
+
+/** Like halide_memoization_cache_lookup, but looking up and storing
+ * the result in the named partition of the cache. A NULL or empty
+ * name means the default partition. halide_memoization_cache_store
+ * and halide_memoization_cache_release work out the partition from
+ * the buffers, so a custom cache implementation that replaces those
+ * must replace this too. */
+extern int halide_memoization_cache_lookup_in_partition(void *user_context, const char *partition,
+                                                        const uint8_t *cache_key, int32_t size,
+                                                        struct halide_buffer_t *realized_bounds,
+                                                        int32_t tuple_count,
+                                                        struct halide_buffer_t **tuple_buffers);
+// @}
+
+/** Like halide_memoization_cache_lookup_in_partition, but if there is
+ * no result for exactly the bounds requested, a result for the same
+ * key whose computed bounds contain them is used instead. The part of
+ * it within the bounds requested is copied into newly allocated
+ * buffers laid out as described by tuple_buffers, which
+ * halide_memoization_cache_release frees. Used by Funcs scheduled
+ * with Func::memoize_reuse_crops. */
+extern int halide_memoization_cache_lookup_crop(void *user_context, const char *partition,
+                                                const uint8_t *cache_key, int32_t size,
+                                                struct halide_buffer_t *realized_bounds,
+                                                int32_t tuple_count,
+                                                struct halide_buffer_t **tuple_buffers);
+
+/** The ways the memoization cache can choose what to evict. See
+ * halide_memoization_cache_set_eviction_policy. */
+typedef enum halide_memoization_eviction_policy_t {
+    /** Evict the result with the least compute time saved per byte,
+     * aged by how long it has been since it was last used
+     * (GreedyDual-Size). The default. */
+    halide_memoization_evict_by_cost = 0,
+    /** Evict the least recently used result. */
+    halide_memoization_evict_lru = 1
+} halide_memoization_eviction_policy_t;
+
+/** Set how the memoization cache chooses which results to evict,
+ * and return the previous policy. If never called, the policy is
+ * taken from the environment variable HL_MEMOIZATION_CACHE_POLICY,
+ * which may be "cost" or "lru". The cost of a result is the time
+ * between the lookup that missed and the store of the result. */
+extern int halide_memoization_cache_set_eviction_policy(int policy);
+
+/** Keep memoized results in files in a directory as well as in
+ * memory, so that they survive eviction and can be reused by later
+ * runs of the same pipeline, in this process or another. Results are
+ * written to the directory when they are stored in the cache, and
+ * lookups that miss in memory map matching files back in without
+ * copying them. Results are identified by the cache key and a hash of
+ * the algorithm that computed them, so a pipeline that has been
+ * changed and recompiled won't find the results of the old version.
+ * The least recently used files are deleted to keep the total size of
+ * the directory under max_bytes, or 1GB if max_bytes is zero. The
+ * directory must already exist. A NULL directory turns the disk tier
+ * off. The disk tier relies on the layout of the cache keys Halide
+ * generates, so it can't be used with keys made some other way. Only
+ * the results of pipelines compiled with the memoize_disk target
+ * feature are kept on disk. If never called, the
+ * directory and size in megabytes are taken from the environment
+ * variables HL_MEMOIZATION_CACHE_DIR and HL_MEMOIZATION_CACHE_DISK_MB.
+ * Must be called at a time when no other threads are accessing the
+ * cache. Returns zero on success, or -1 if the directory can't be
+ * used. Not supported on Windows. */
+extern int halide_memoization_cache_set_disk_tier(const char *dir, int64_t max_bytes);
+
 /** Given a cache key for a memoized result, currently constructed
  *  from the Func name and top-level Func name plus the arguments of
  *  the computation, determine if the result is in the cache and
@@ -708,6 +1049,61 @@ extern int halide_memoization_cache_store(void *user_context, const uint8_t *cac
   */
 extern void halide_memoization_cache_release(void *user_context, void *host);
 
+/** Statistics of the memoization cache. See
+ * halide_memoization_cache_get_stats. */
+typedef struct halide_memoization_cache_stats_t {
+    /** The number of lookups that found a cached result, and the
+     * number that didn't. */
+    uint64_t hits, misses;
+
+    /** The number of results stored in the cache, and the number
+     * evicted to keep it within its size limit. */
+    uint64_t stores, evictions;
+
+    /** The number of results in the cache, and how many of them are
+     * currently in use by a pipeline (and so can't be evicted). */
+    uint64_t entries, pinned_entries;
+
+    /** The total size of the cached results in bytes, and the size
+     * limit, summed over the partitions covered. */
+    int64_t bytes_resident, max_bytes;
+
+    /** Hits and misses broken down by the size of the cache key:
+     * entry i counts lookups with keys of 2^i to 2^(i+1)-1 bytes, with
+     * all longer keys in the last entry. */
+    uint64_t hits_by_key_size[16], misses_by_key_size[16];
+
+    /** The total compute time in nanoseconds that hits saved, as
+     * measured when the results they found were computed. */
+    uint64_t compute_time_saved;
+
+    /** The number of hits that were found on disk rather than in
+     * memory, and the number of results written to disk. See
+     * halide_memoization_cache_set_disk_tier. */
+    uint64_t disk_hits, disk_stores;
+
+    /** The number of hits that were satisfied by copying part of a
+     * result cached over a larger region. See
+     * halide_memoization_cache_lookup_crop. */
+    uint64_t crop_hits;
+} halide_memoization_cache_stats_t;
+
+/** Get the statistics of the memoization cache, summed over all its
+ * partitions. The counts cover everything since the cache was created
+ * or the counts were last reset with
+ * halide_memoization_cache_reset_stats. */
+extern void halide_memoization_cache_get_stats(halide_memoization_cache_stats_t *stats);
+
+/** Get the statistics of one partition of the memoization cache. A
+ * NULL or empty name means the default partition. Returns zero on
+ * success, or -1 if there is no partition with that name. */
+extern int halide_memoization_cache_get_partition_stats(const char *partition,
+                                                        halide_memoization_cache_stats_t *stats);
+
+/** Zero the hit, miss, store and eviction counts of all the
+ * partitions of the memoization cache. */
+extern void halide_memoization_cache_reset_stats();
+
 /** Free all memory and resources associated with the memoization cache.
  * Must be called at a time when no other threads are accessing the cache.
  */
@@ -926,6 +1322,11 @@ enum halide_error_code_t {
      * existed on a different device interface. Free the old one
      * first. */
     halide_error_code_incompatible_device_interface = -42,
+
+    /** A pipeline compiled with the scratch_memory target feature was
+     * passed scratch memory that was null or smaller than the size
+     * returned by its _scratch_bytes() entry point. */
+    halide_error_code_scratch_too_small = -43,
 };
 
 /** Halide calls the functions below on various error conditions. The
@@ -1002,6 +1403,7 @@ extern int halide_error_no_device_interface(void *user_context);
 extern int halide_error_device_interface_no_device(void *user_context);
 extern int halide_error_host_and_device_dirty(void *user_context);
 extern int halide_error_buffer_is_null(void *user_context, const char *routine);
+extern int halide_error_scratch_too_small(void *user_context, uint64_t scratch_size, uint64_t required_size);
 
 // @}
 
@@ -1071,7 +1473,12 @@ typedef enum halide_target_feature_t {
     halide_target_feature_cuda_capability61 = 46,  ///< Enable CUDA compute capability 6.1 (Pascal)
     halide_target_feature_hvx_v65 = 47, ///< Enable Hexagon v65 architecture.
     halide_target_feature_hvx_v66 = 48, ///< Enable Hexagon v66 architecture.
-    halide_target_feature_end = 49, ///< A sentinel. Every target is considered to have this feature, and setting this feature does nothing.
+    halide_target_feature_malloc_pool = 49, ///< Make halide_default_malloc allocate from a pool of reused blocks. See halide_pooled_malloc.
+    halide_target_feature_scratch_memory = 50, ///< Generated pipelines take __scratch and __scratch_size arguments, and carve their heap allocations out of that memory. The required size is returned by an additional _scratch_bytes() entry point.
+    halide_target_feature_profile_timeline = 51, ///< Like profile, but also record exactly when each thread runs each Func and each parallel task, for halide_profiler_write_trace.
+    halide_target_feature_profile_memory_traffic = 52, ///< Like profile, but also count the bytes loaded and stored and the arithmetic done by each Func.
+    halide_target_feature_memoize_disk = 53, ///< Give the cache keys of memoized Funcs a hash of their algorithm, including the contents of buffers compiled into it, so that their results can be kept in the on-disk tier of the memoization cache. See halide_memoization_cache_set_disk_tier.
+    halide_target_feature_end = 54, ///< A sentinel. Every target is considered to have this feature, and setting this feature does nothing.
 } halide_target_feature_t;
 
 /** This function is called internally by Halide in some situations to determine
@@ -1414,9 +1821,15 @@ struct halide_filter_metadata_t {
 
 /** Per-Func state tracked by the sampling profiler. */
 struct halide_profiler_func_stats {
-    /** Total time taken evaluating this Func (in nanoseconds). */
+    /** Total time taken evaluating this Func (in nanoseconds). When
+     * several Funcs of a pipeline run at once, each sample is split
+     * between them in proportion to the threads running each. */
     uint64_t time;
 
+    /** The sum over threads of the time spent evaluating this Func
+     * (in nanoseconds). */
+    uint64_t cpu_time;
+
     /** The current memory allocation of this Func. */
     uint64_t memory_current;
 
@@ -1429,9 +1842,27 @@ struct halide_profiler_func_stats {
     /** The peak stack allocation of this Func's threads. */
     uint64_t stack_peak;
 
-    /** The average number of thread pool worker threads active while computing this Func. */
+    /** The average number of threads computing this Func, over the
+     * samples in which at least one thread was. */
     uint64_t active_threads_numerator, active_threads_denominator;
 
+    /** The hardware events counted while threads were computing
+     * this Func: cycles, instructions, last level cache misses and
+     * branch misses. Zero unless counters are turned on with
+     * halide_profiler_set_counters. */
+    uint64_t cycles, instructions, cache_misses, branch_misses;
+
+    /** The number of memoization cache lookups for this Func that
+     * hit, and the number that missed. Zero unless the Func is
+     * memoized. */
+    uint64_t memoize_hits, memoize_misses;
+
+    /** The bytes loaded and stored by this Func's loops, and the
+     * arithmetic operations in the values it stores, as counted from
+     * the loop bodies and their trip counts. Zero unless the pipeline
+     * was compiled with the profile_memory_traffic target feature. */
+    uint64_t bytes_read, bytes_written, ops;
+
     /** The name of this Func. A global constant string. */
     const char *name;
 
@@ -1445,6 +1876,10 @@ struct halide_profiler_pipeline_stats {
     /** Total time spent inside this pipeline (in nanoseconds) */
     uint64_t time;
 
+    /** The sum over threads of the time spent inside this pipeline
+     * (in nanoseconds). */
+    uint64_t cpu_time;
+
     /** The current memory allocation of funcs in this pipeline. */
     uint64_t memory_current;
 
@@ -1482,6 +1917,9 @@ struct halide_profiler_pipeline_stats {
 
     /** The total number of memory allocation of funcs in this pipeline. */
     int num_allocs;
+
+    /** The most threads seen running this pipeline at once. */
+    int max_threads;
 };
 
 /** The global state of the profiler. */
@@ -1498,11 +1936,16 @@ struct halide_profiler_state {
     /** An internal id used for bookkeeping. */
     int first_free_id;
 
-    /** The id of the current running Func. Set by the pipeline, read
-     * periodically by the profiler thread. */
+    /** The id of the current running Func. Set by pipelines running
+     * on devices with remote profiling (e.g. Hexagon DSP), read by
+     * get_remote_profiler_state. Code running on the host publishes
+     * the Func each of its threads is running separately, so that the
+     * profiler thread can bill concurrently running Funcs
+     * correctly. Also used to tell the profiler thread to stop. */
     int current_func;
 
-    /** The number of threads currently doing work. */
+    /** The number of threads currently doing work, in pipelines that
+     * set current_func. */
     int active_threads;
 
     /** A linked list of stats gathered for each pipeline. */
@@ -1546,6 +1989,44 @@ extern void halide_profiler_reset();
  * reset. Also happens at process exit. */
 extern void halide_profiler_report(void *user_context);
 
+/** Turn on or off reading hardware performance counters (cycles,
+ * instructions, last level cache misses and branch misses) in the
+ * threads running pipelines compiled with the -profile target flag.
+ * The counters are billed to Funcs along with the time at each sample,
+ * and the report shows instructions per cycle and misses per thousand
+ * instructions for each Func. Takes effect for threads that start
+ * running a pipeline afterwards. Can also be turned on by setting the
+ * environment variable HL_PROFILER_COUNTERS=1. Only supported on x86
+ * Linux and Android, where the kernel must allow perf_event_open for
+ * the process. Returns the old value. */
+extern int halide_profiler_set_counters(int enabled);
+
+/** Write the stats of everything run since the last reset to a file
+ * as JSON: an object with a list of pipelines, each with its list of
+ * Funcs, and the stats of the thread pool and huge page mode. Times
+ * are totals over all runs in nanoseconds. Also happens at process
+ * exit if the environment variable HL_PROFILER_JSON names a file.
+ * Returns zero on success, or an error code on failure. */
+extern int halide_profiler_write_json(void *user_context, const char *filename);
+
+/** Write the timeline recorded while halide_profiler_record_timeline
+ * was on to a file in the Chrome trace event format, which
+ * chrome://tracing and Perfetto can show. Each event is a run of
+ * samples in which a thread ran the same Func. Pipelines compiled with
+ * the profile_timeline target feature instead record exactly when
+ * each thread ran each Func, each task of a parallel loop, and the
+ * time spent waiting for parallel loops to finish, whether or not
+ * halide_profiler_record_timeline is on. Also happens at process exit
+ * if the environment variable HL_PROFILER_TRACE names a file. Returns
+ * zero on success, or an error code on failure. */
+extern int halide_profiler_write_trace(void *user_context, const char *filename);
+
+/** Turn on or off recording which Func each thread ran at every
+ * sample, for halide_profiler_write_trace. Off by default, unless
+ * HL_PROFILER_TRACE is set. The timeline is cleared by
+ * halide_profiler_reset. Returns the old value. */
+extern int halide_profiler_record_timeline(int enabled);
+
 /// \name "Float16" functions
 /// These functions operate of bits (``uint16_t``) representing a half
 /// precision floating point number (IEEE-754 2008 binary16).
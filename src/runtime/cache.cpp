@@ -65,7 +65,14 @@ WEAK bool buffer_has_shape(const halide_buffer_t *buf, const halide_dimension_t
     return true;
 }
 
+// An entry's in_use_count is set to this once it has been chosen for
+// eviction, so that lookups racing with the eviction can no longer
+// pin it.
+const uint32_t kEntryEvicted = 0x80000000;
+
 struct CacheEntry {
+    // The next entry in the same hash bucket. Lookups follow these
+    // without holding any lock.
     CacheEntry *next;
     CacheEntry *more_recent;
     CacheEntry *less_recent;
@@ -73,13 +80,38 @@ struct CacheEntry {
     size_t key_size;
     uint8_t *key;
     uint32_t hash;
-    uint32_t in_use_count; // 0 if none returned from halide_cache_lookup
+    // The number of buffers returned by halide_cache_lookup that are
+    // still in use, or kEntryEvicted. Updated atomically, as lookups
+    // pin entries without holding the shard lock.
+    uint32_t in_use_count;
     uint32_t tuple_count;
+    // Set by lookups that hit this entry, and cleared when eviction
+    // passes over it. Entries that have been used since eviction last
+    // looked at them get a second chance instead of being evicted.
+    uint8_t referenced;
+    // How long the data took to compute, in nanoseconds, measured
+    // from the lookup that missed to the store.
+    uint64_t cost;
+    // The GreedyDual-Size priority of the entry, and its position in
+    // its shard's priority heap. Entries with the lowest priority are
+    // evicted first when evicting by cost.
+    uint64_t priority;
+    uint32_t heap_index;
+    // Links the entries set aside while evicting by cost.
+    CacheEntry *next_in_use;
     // The shape of the computed data. There may be more data allocated than this.
     int32_t dimensions;
     halide_dimension_t *computed_bounds;
     // The actual stored data.
     halide_buffer_t *buf;
+    // If the data was loaded from the on-disk tier, the mapping of
+    // the file that holds it. The buffers point into the mapping
+    // rather than into their own allocations.
+    void *mapping;
+    size_t mapping_size;
+    // The reader epoch the entry was removed from its shard in. See
+    // retire_epoch.
+    uint64_t retired_epoch;
 
     bool init(const uint8_t *cache_key, size_t cache_key_size,
               uint32_t key_hash,
@@ -87,19 +119,28 @@ struct CacheEntry {
               int32_t tuples, halide_buffer_t **tuple_buffers);
     void destroy();
     halide_buffer_t &buffer(int32_t i);
+    size_t size_in_bytes() const;
 
+    // Add n to the in-use count, unless the entry is being
+    // evicted. Returns whether it did.
+    bool pin(uint32_t n);
 };
 
+struct CachePartition;
+
 struct CacheBlockHeader {
     CacheEntry *entry;
+    CachePartition *partition;
     uint32_t hash;
+    // When the lookup that allocated this block missed.
+    int64_t miss_time;
 };
 
 // Each host block has extra space to store a header just before the
 // contents. This block must respect the same alignment as
 // halide_malloc, because it offsets the return value from
-// halide_malloc. The header holds the cache key hash and pointer to
-// the hash entry.
+// halide_malloc. The header holds the cache key hash and pointers to
+// the hash entry and the partition it belongs in.
 WEAK __attribute((always_inline)) size_t header_bytes() {
     size_t s = sizeof(CacheBlockHeader);
     size_t mask = halide_malloc_alignment() - 1;
@@ -120,6 +161,12 @@ WEAK bool CacheEntry::init(const uint8_t *cache_key, size_t cache_key_size,
     hash = key_hash;
     in_use_count = 0;
     tuple_count = tuples;
+    referenced = 0;
+    cost = 0;
+    priority = 0;
+    heap_index = 0;
+    mapping = NULL;
+    mapping_size = 0;
     dimensions = computed_bounds_buf->dimensions;
 
     // Allocate all the necessary space (or die)
@@ -172,177 +219,826 @@ WEAK bool CacheEntry::init(const uint8_t *cache_key, size_t cache_key_size,
 WEAK void CacheEntry::destroy() {
     for (uint32_t i = 0; i < tuple_count; i++) {
         halide_device_free(NULL, &buf[i]);
-        halide_free(NULL, get_pointer_to_header(buf[i].host));
+        if (!mapping) {
+            halide_free(NULL, get_pointer_to_header(buf[i].host));
+        }
+    }
+    if (mapping) {
+        halide_unmap_file(NULL, mapping, mapping_size);
     }
     halide_free(NULL, metadata_storage);
 }
 
-WEAK uint32_t djb_hash(const uint8_t *key, size_t key_size)  {
-    uint32_t h = 5381;
-    for (size_t i = 0; i < key_size; i++) {
-      h = (h << 5) + h + key[i];
+WEAK size_t CacheEntry::size_in_bytes() const {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < tuple_count; i++) {
+        bytes += buf[i].size_in_bytes();
     }
-    return h;
+    return bytes;
+}
+
+WEAK bool CacheEntry::pin(uint32_t n) {
+    uint32_t count = __atomic_load_n(&in_use_count, __ATOMIC_RELAXED);
+    while (count != kEntryEvicted) {
+        if (__atomic_compare_exchange_n(&in_use_count, &count, count + n,
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hash the key a word at a time. Keys are typically a few dozen
+// bytes, made of pointers and 32-bit scalars.
+WEAK uint32_t hash_key(const uint8_t *key, size_t key_size)  {
+    const uint64_t m = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = key_size * m;
+    size_t i = 0;
+    for (; i + 8 <= key_size; i += 8) {
+        uint64_t w;
+        memcpy(&w, key + i, 8);
+        w *= m;
+        w ^= w >> 32;
+        h = (h ^ w) * m;
+    }
+    if (i < key_size) {
+        uint64_t w = 0;
+        memcpy(&w, key + i, key_size - i);
+        w *= m;
+        w ^= w >> 32;
+        h = (h ^ w) * m;
+    }
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return (uint32_t)h;
 }
 
-WEAK halide_mutex memoization_lock;
+// A hash table of entries. Lookups read it without holding any
+// lock, so it is replaced rather than resized in place.
+struct CacheTable {
+    // Always a power of two.
+    uint32_t num_buckets;
+    CacheTable *next_retired;
+    uint64_t retired_epoch;
+    CacheEntry *buckets[1];
+};
+
+// Each partition of the cache is split into shards by hash, each with
+// its own lock, hash table and LRU list, so that threads working on
+// different keys don't contend. The size limit applies to the
+// partition as a whole.
+const size_t kNumShards = 16;
 
-const size_t kHashTableSize = 256;
+// The number of buckets in a new shard. The table doubles whenever
+// the number of entries exceeds the number of buckets.
+const uint32_t kInitialBuckets = 16;
 
-WEAK CacheEntry *cache_entries[kHashTableSize];
+// Lookups are counted by key size class: class i holds keys of
+// between 2^i and 2^(i+1)-1 bytes, with everything larger in the last
+// class.
+const int kKeySizeClasses = 16;
+
+WEAK int key_size_class(int32_t key_size) {
+    if (key_size <= 1) {
+        return 0;
+    }
+    int c = 31 - __builtin_clz((uint32_t)key_size);
+    return c < kKeySizeClasses ? c : kKeySizeClasses - 1;
+}
 
-WEAK CacheEntry *most_recently_used = NULL;
-WEAK CacheEntry *least_recently_used = NULL;
+struct CacheShard {
+    // Protects everything below, except that lookups read the hash
+    // table and pin entries without it.
+    halide_mutex lock;
+
+    CacheTable *table;
+    uint32_t num_entries;
+
+    CacheEntry *most_recently_used;
+    CacheEntry *least_recently_used;
+
+    // The total size of the buffers of the entries in this shard.
+    int64_t size;
+
+    // Entries and tables removed from the shard, which lookups that
+    // started before they were removed may still be reading. Newest
+    // first.
+    CacheEntry *retired_entries;
+    CacheTable *retired_tables;
+
+    // A binary min-heap of the entries by priority, for evicting by
+    // cost. It holds num_entries entries.
+    CacheEntry **heap;
+    uint32_t heap_capacity;
+
+    // The priority at the top of the heap, or kNoPriority if it's
+    // empty, for choosing which shard to evict from without taking
+    // every lock.
+    uint64_t min_priority;
+
+    // Statistics for halide_memoization_cache_get_stats. The ones
+    // lookups update are in the partition's CacheLookupStats.
+    uint64_t stores, evictions, disk_hits, disk_stores;
+} __attribute__((aligned(64)));
+
+// The statistics updated by lookups. Each partition has several
+// copies, and a lookup updates the one picked by its thread, so that
+// threads hitting the same entry don't all write one cache line. They
+// are still updated atomically, because threads share a copy when
+// there are more threads than copies.
+struct CacheLookupStats {
+    uint64_t hits, misses, time_saved, crop_hits;
+    uint64_t hits_by_key_size[kKeySizeClasses];
+    uint64_t misses_by_key_size[kKeySizeClasses];
+} __attribute__((aligned(64)));
+
+const int kNumLookupStatsLog2 = 4;
+const int kNumLookupStats = 1 << kNumLookupStatsLog2;
+
+// A part of the cache with its own size limit. Each partition prunes
+// independently: entries are never evicted to make room in another
+// partition. The default partition holds the results of Funcs
+// memoized without a partition name.
+struct CachePartition {
+    CacheShard shards[kNumShards];
+
+    CacheLookupStats lookup_stats[kNumLookupStats];
+
+    // NULL for the default partition.
+    char *name;
+
+    // The allocation this partition was carved out of, aligned for
+    // the shards. NULL for the default partition.
+    void *allocation;
+
+    // The size limit in bytes, or zero for kDefaultCacheSize.
+    int64_t max_size;
+
+    // The shard to evict from first next time the partition is over
+    // its size limit, when evicting by recency. Eviction visits the
+    // shards in turn, to approximate evicting in LRU order over the
+    // whole partition.
+    uint32_t next_shard_to_prune;
+
+    // The priority of the last entry evicted by cost. New and
+    // recently used entries get their value added to this, so that
+    // entries that aren't used age relative to those that are.
+    uint64_t cost_inflation;
+};
 
 const uint64_t kDefaultCacheSize = 1 << 20;
-WEAK int64_t max_cache_size = kDefaultCacheSize;
-WEAK int64_t current_cache_size = 0;
 
-#if CACHE_DEBUGGING
-WEAK void validate_cache() {
-    print(NULL) << "validating cache, "
-                << "current size " << current_cache_size
-                << " of maximum " << max_cache_size << "\n";
-    int entries_in_hash_table = 0;
-    for (size_t i = 0; i < kHashTableSize; i++) {
-        CacheEntry *entry = cache_entries[i];
-        while (entry != NULL) {
-            entries_in_hash_table++;
-            if (entry->more_recent == NULL && entry != most_recently_used) {
-                halide_print(NULL, "cache invalid case 1\n");
-                __builtin_trap();
-            }
-            if (entry->less_recent == NULL && entry != least_recently_used) {
-                halide_print(NULL, "cache invalid case 2\n");
-                __builtin_trap();
-            }
-            entry = entry->next;
+const uint64_t kNoPriority = ~(uint64_t)0;
+
+WEAK CachePartition default_partition;
+
+// The named partitions, created on first use. Slots are filled in
+// order under partitions_lock, and never emptied except by
+// halide_memoization_cache_cleanup, so lookups can search them
+// without the lock.
+const int kMaxNamedPartitions = 8;
+WEAK CachePartition *named_partitions[kMaxNamedPartitions];
+WEAK halide_mutex partitions_lock;
+
+WEAK int64_t partition_max_size(const CachePartition *partition) {
+    int64_t size = __atomic_load_n(&partition->max_size, __ATOMIC_RELAXED);
+    return size ? size : kDefaultCacheSize;
+}
+
+// Get partition i, where partition 0 is the default one and the rest
+// are the named ones. Returns NULL for named partitions that don't
+// exist yet.
+WEAK CachePartition *partition_at(int i) {
+    if (i == 0) {
+        return &default_partition;
+    }
+    return __atomic_load_n(&named_partitions[i - 1], __ATOMIC_ACQUIRE);
+}
+
+// Find the partition with the given name, creating it if it doesn't
+// exist. A NULL or empty name means the default partition. Returns
+// NULL if the partition doesn't exist and couldn't be created,
+// because there are already kMaxNamedPartitions of them or memory
+// ran out.
+WEAK CachePartition *find_partition(const char *name, bool create) {
+    if (name == NULL || *name == 0) {
+        return &default_partition;
+    }
+    for (int i = 0; i < kMaxNamedPartitions; i++) {
+        CachePartition *partition = __atomic_load_n(&named_partitions[i], __ATOMIC_ACQUIRE);
+        if (partition == NULL) {
+            break;
+        }
+        if (strcmp(partition->name, name) == 0) {
+            return partition;
         }
     }
-    int entries_from_mru = 0;
-    CacheEntry *mru_chain = most_recently_used;
-    while (mru_chain != NULL) {
-        entries_from_mru++;
-        mru_chain = mru_chain->less_recent;
+    if (!create) {
+        return NULL;
     }
-    int entries_from_lru = 0;
-    CacheEntry *lru_chain = least_recently_used;
-    while (lru_chain != NULL) {
-        entries_from_lru++;
-        lru_chain = lru_chain->more_recent;
+
+    ScopedMutexLock lock(&partitions_lock);
+    // Check again, in case another thread created it.
+    int i = 0;
+    for (; i < kMaxNamedPartitions && named_partitions[i] != NULL; i++) {
+        if (strcmp(named_partitions[i]->name, name) == 0) {
+            return named_partitions[i];
+        }
     }
-    print(NULL) << "hash entries " << entries_in_hash_table
-                << ", mru entries " << entries_from_mru
-                << ", lru entries " << entries_from_lru << "\n";
-    if (entries_in_hash_table != entries_from_mru) {
-        halide_print(NULL, "cache invalid case 3\n");
-        __builtin_trap();
+    if (i == kMaxNamedPartitions) {
+        return NULL;
     }
-    if (entries_in_hash_table != entries_from_lru) {
-        halide_print(NULL, "cache invalid case 4\n");
-        __builtin_trap();
+    size_t name_size = strlen(name) + 1;
+    // halide_malloc doesn't promise the alignment of the shards.
+    const size_t alignment = __alignof__(CachePartition);
+    void *allocation = halide_malloc(NULL, sizeof(CachePartition) + alignment - 1);
+    char *partition_name = (char *)halide_malloc(NULL, name_size);
+    if (allocation == NULL || partition_name == NULL) {
+        halide_free(NULL, allocation);
+        halide_free(NULL, partition_name);
+        return NULL;
     }
-    if (current_cache_size < 0) {
-        halide_print(NULL, "cache size is negative\n");
-        __builtin_trap();
+    CachePartition *partition =
+        (CachePartition *)(((uintptr_t)allocation + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    memset(partition, 0, sizeof(CachePartition));
+    memcpy(partition_name, name, name_size);
+    partition->name = partition_name;
+    partition->allocation = allocation;
+    __atomic_store_n(&named_partitions[i], partition, __ATOMIC_RELEASE);
+    return partition;
+}
+
+// One of halide_memoization_eviction_policy_t, or -1 if it hasn't
+// been set yet.
+WEAK int eviction_policy = -1;
+
+WEAK int default_eviction_policy() {
+    const char *policy = getenv("HL_MEMOIZATION_CACHE_POLICY");
+    if (policy && strcmp(policy, "lru") == 0) {
+        return halide_memoization_evict_lru;
     }
+    return halide_memoization_evict_by_cost;
 }
-#endif
 
-WEAK void prune_cache() {
-#if CACHE_DEBUGGING
-    validate_cache();
-#endif
-    CacheEntry *prune_candidate = least_recently_used;
-    while (current_cache_size > max_cache_size &&
-           prune_candidate != NULL) {
-        CacheEntry *more_recent = prune_candidate->more_recent;
-
-        if (prune_candidate->in_use_count == 0) {
-            uint32_t h = prune_candidate->hash;
-            uint32_t index = h % kHashTableSize;
-
-            // Remove from hash table
-            CacheEntry *prev_hash_entry = cache_entries[index];
-            if (prev_hash_entry == prune_candidate) {
-                cache_entries[index] = prune_candidate->next;
-            } else {
-                while (prev_hash_entry != NULL && prev_hash_entry->next != prune_candidate) {
-                    prev_hash_entry = prev_hash_entry->next;
-                }
-                halide_assert(NULL, prev_hash_entry != NULL);
-                prev_hash_entry->next = prune_candidate->next;
-            }
+WEAK int get_eviction_policy() {
+    int policy = __atomic_load_n(&eviction_policy, __ATOMIC_RELAXED);
+    if (policy < 0) {
+        policy = default_eviction_policy();
+        __atomic_store_n(&eviction_policy, policy, __ATOMIC_RELAXED);
+    }
+    return policy;
+}
 
-            // Remove from less recent chain.
-            if (least_recently_used == prune_candidate) {
-                least_recently_used = more_recent;
-            }
-            if (more_recent != NULL) {
-                more_recent->less_recent = prune_candidate->less_recent;
-            }
+WEAK __attribute((always_inline)) CacheShard *shard_for_hash(CachePartition *partition, uint32_t h) {
+    // The bucket index uses the low bits, so pick the shard with the
+    // high bits.
+    return &partition->shards[h >> 28];
+}
 
-            // Remove from more recent chain.
-            if (most_recently_used == prune_candidate) {
-                most_recently_used = prune_candidate->less_recent;
-            }
-            if (prune_candidate->less_recent != NULL) {
-                prune_candidate->less_recent = more_recent;
-            }
+// The total size of a partition. The shard sizes are read without
+// their locks, so this can be slightly stale. It's only used to
+// decide whether to evict something.
+WEAK int64_t current_cache_size(const CachePartition *partition) {
+    int64_t total = 0;
+    for (size_t i = 0; i < kNumShards; i++) {
+        total += partition->shards[i].size;
+    }
+    return total;
+}
 
-            // Decrease cache used amount.
-            for (uint32_t i = 0; i < prune_candidate->tuple_count; i++) {
-                current_cache_size -= prune_candidate->buf[i].size_in_bytes();
+WEAK CacheTable *new_cache_table(uint32_t num_buckets) {
+    size_t bytes = sizeof(CacheTable) + (num_buckets - 1) * sizeof(CacheEntry *);
+    CacheTable *table = (CacheTable *)halide_malloc(NULL, bytes);
+    if (table) {
+        memset(table, 0, bytes);
+        table->num_buckets = num_buckets;
+    }
+    return table;
+}
+
+// Lookups read the hash tables and entries of a shard without its
+// lock, so anything removed from a shard is only freed once no lookup
+// that could have found it is still running. While a lookup runs, it
+// publishes the reader epoch it started in, in a slot of its own.
+// Removing something from a shard advances the epoch, and tags what
+// was removed with the epoch before. It can be freed once every
+// running lookup started in a later epoch. Lookups only write their
+// own slot, and only read the epoch, so they don't contend with each
+// other.
+const int kNumCacheReaderSlotsLog2 = 8;
+const int kNumCacheReaderSlots = 1 << kNumCacheReaderSlotsLog2;
+
+struct CacheReaderSlot {
+    // The epoch the lookup using this slot started in, or zero if the
+    // slot is free.
+    uint64_t epoch;
+} __attribute__((aligned(64)));
+
+WEAK CacheReaderSlot cache_reader_slots[kNumCacheReaderSlots];
+
+// One more than the highest slot ever used, so that reclaiming only
+// looks at the slots that have been.
+WEAK int num_cache_reader_slots = 0;
+
+// Starts at one, so that an epoch is never zero.
+WEAK uint64_t cache_reader_epoch = 1;
+
+// Publish the epoch of a lookup about to read a shard without its
+// lock. Returns NULL if every slot is in use, in which case the
+// lookup must hold the shard lock instead.
+WEAK CacheReaderSlot *begin_unlocked_read() {
+    uint64_t epoch = __atomic_load_n(&cache_reader_epoch, __ATOMIC_SEQ_CST);
+    int start = current_thread_slot(kNumCacheReaderSlotsLog2);
+    for (int j = 0; j < kNumCacheReaderSlots; j++) {
+        int i = (start + j) % kNumCacheReaderSlots;
+        uint64_t expected = 0;
+        if (__atomic_load_n(&cache_reader_slots[i].epoch, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&cache_reader_slots[i].epoch, &expected, epoch,
+                                        false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            int used = __atomic_load_n(&num_cache_reader_slots, __ATOMIC_RELAXED);
+            while (used <= i &&
+                   !__atomic_compare_exchange_n(&num_cache_reader_slots, &used, i + 1,
+                                                false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
             }
+            return &cache_reader_slots[i];
+        }
+    }
+    return NULL;
+}
+
+WEAK void end_unlocked_read(CacheReaderSlot *slot) {
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// The epoch to tag something just removed from a shard with. Lookups
+// that start from now on can't find it.
+WEAK uint64_t retire_epoch() {
+    return __atomic_fetch_add(&cache_reader_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+// Free the entries and tables removed from a shard that no running
+// lookup could have found. Must be called with the shard lock held.
+WEAK void reclaim_retired_already_locked(CacheShard *shard) {
+    if (!shard->retired_entries && !shard->retired_tables) {
+        return;
+    }
+    // Everything on the retired lists was unlinked before this
+    // point. The fence keeps the unlinking from being reordered after
+    // reading the slots.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t oldest = ~(uint64_t)0;
+    int used = __atomic_load_n(&num_cache_reader_slots, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < used; i++) {
+        uint64_t epoch = __atomic_load_n(&cache_reader_slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    CacheEntry **entry = &shard->retired_entries;
+    while (*entry) {
+        CacheEntry *e = *entry;
+        if (e->retired_epoch < oldest) {
+            *entry = e->less_recent;
+            e->destroy();
+            halide_free(NULL, e);
+        } else {
+            entry = &e->less_recent;
+        }
+    }
+    CacheTable **table = &shard->retired_tables;
+    while (*table) {
+        CacheTable *t = *table;
+        if (t->retired_epoch < oldest) {
+            *table = t->next_retired;
+            halide_free(NULL, t);
+        } else {
+            table = &t->next_retired;
+        }
+    }
+}
 
-            // Deallocate the entry.
-            prune_candidate->destroy();
-            halide_free(NULL, prune_candidate);
+// Double the number of buckets in a shard's hash table. Must be called
+// with the shard lock held. Lookups racing with this may miss entries
+// that are being moved, which just costs them a recomputation.
+WEAK void grow_table_already_locked(CacheShard *shard) {
+    CacheTable *old_table = shard->table;
+    CacheTable *new_table = new_cache_table(old_table->num_buckets * 2);
+    if (!new_table) {
+        // Keep using the old table, with longer chains.
+        return;
+    }
+    uint32_t mask = new_table->num_buckets - 1;
+    for (uint32_t i = 0; i < old_table->num_buckets; i++) {
+        CacheEntry *entry = old_table->buckets[i];
+        while (entry) {
+            CacheEntry *next = entry->next;
+            CacheEntry **bucket = &new_table->buckets[entry->hash & mask];
+            __atomic_store_n(&entry->next, *bucket, __ATOMIC_RELEASE);
+            *bucket = entry;
+            entry = next;
         }
+    }
+    __atomic_store_n(&shard->table, new_table, __ATOMIC_RELEASE);
+    old_table->retired_epoch = retire_epoch();
+    old_table->next_retired = shard->retired_tables;
+    shard->retired_tables = old_table;
+}
 
-        prune_candidate = more_recent;
+// Give a shard a hash table if it doesn't have one yet. Must be called
+// with the shard lock held. Returns whether it has one.
+WEAK bool ensure_table_already_locked(CacheShard *shard) {
+    if (shard->table == NULL) {
+        __atomic_store_n(&shard->table, new_cache_table(kInitialBuckets), __ATOMIC_RELEASE);
     }
+    return shard->table != NULL;
+}
+
 #if CACHE_DEBUGGING
-    validate_cache();
+WEAK void validate_cache(CachePartition *partition) {
+    print(NULL) << "validating cache partition " << (partition->name ? partition->name : "(default)")
+                << ", current size " << current_cache_size(partition)
+                << " of maximum " << partition_max_size(partition) << "\n";
+    for (size_t s = 0; s < kNumShards; s++) {
+        CacheShard *shard = &partition->shards[s];
+        ScopedMutexLock lock(&shard->lock);
+        uint32_t entries_in_hash_table = 0;
+        int64_t size_in_hash_table = 0;
+        for (uint32_t i = 0; shard->table && i < shard->table->num_buckets; i++) {
+            CacheEntry *entry = shard->table->buckets[i];
+            while (entry != NULL) {
+                entries_in_hash_table++;
+                size_in_hash_table += entry->size_in_bytes();
+                if (shard_for_hash(partition, entry->hash) != shard ||
+                    (entry->hash & (shard->table->num_buckets - 1)) != i) {
+                    halide_print(NULL, "cache invalid case 0\n");
+                    __builtin_trap();
+                }
+                if (entry->more_recent == NULL && entry != shard->most_recently_used) {
+                    halide_print(NULL, "cache invalid case 1\n");
+                    __builtin_trap();
+                }
+                if (entry->less_recent == NULL && entry != shard->least_recently_used) {
+                    halide_print(NULL, "cache invalid case 2\n");
+                    __builtin_trap();
+                }
+                entry = entry->next;
+            }
+        }
+        uint32_t entries_from_mru = 0;
+        CacheEntry *mru_chain = shard->most_recently_used;
+        while (mru_chain != NULL) {
+            entries_from_mru++;
+            mru_chain = mru_chain->less_recent;
+        }
+        uint32_t entries_from_lru = 0;
+        CacheEntry *lru_chain = shard->least_recently_used;
+        while (lru_chain != NULL) {
+            entries_from_lru++;
+            lru_chain = lru_chain->more_recent;
+        }
+        if (entries_in_hash_table != shard->num_entries) {
+            halide_print(NULL, "cache invalid case 3\n");
+            __builtin_trap();
+        }
+        if (entries_in_hash_table != entries_from_mru) {
+            halide_print(NULL, "cache invalid case 4\n");
+            __builtin_trap();
+        }
+        if (entries_in_hash_table != entries_from_lru) {
+            halide_print(NULL, "cache invalid case 5\n");
+            __builtin_trap();
+        }
+        if (size_in_hash_table != shard->size) {
+            halide_print(NULL, "cache size is wrong\n");
+            __builtin_trap();
+        }
+        for (uint32_t i = 0; i < shard->num_entries; i++) {
+            if (shard->heap[i]->heap_index != i ||
+                (i > 0 && shard->heap[i]->priority < shard->heap[(i - 1) / 2]->priority)) {
+                halide_print(NULL, "cache invalid case 6\n");
+                __builtin_trap();
+            }
+        }
+    }
+}
 #endif
+
+// Unlink an entry from its shard's LRU list. Must be called with the
+// shard lock held.
+WEAK void unlink_from_lru_already_locked(CacheShard *shard, CacheEntry *entry) {
+    if (entry->less_recent != NULL) {
+        entry->less_recent->more_recent = entry->more_recent;
+    } else {
+        shard->least_recently_used = entry->more_recent;
+    }
+    if (entry->more_recent != NULL) {
+        entry->more_recent->less_recent = entry->less_recent;
+    } else {
+        shard->most_recently_used = entry->less_recent;
+    }
+    entry->more_recent = NULL;
+    entry->less_recent = NULL;
 }
 
-}}} // namespace Halide::Runtime::Internal
+// Make an entry the most recently used one in its shard. Must be
+// called with the shard lock held.
+WEAK void push_to_mru_already_locked(CacheShard *shard, CacheEntry *entry) {
+    entry->more_recent = NULL;
+    entry->less_recent = shard->most_recently_used;
+    if (shard->most_recently_used != NULL) {
+        shard->most_recently_used->more_recent = entry;
+    }
+    shard->most_recently_used = entry;
+    if (shard->least_recently_used == NULL) {
+        shard->least_recently_used = entry;
+    }
+}
 
-extern "C" {
+// The GreedyDual-Size value of an entry: what it cost to compute
+// per byte of cache it takes up, in 1/65536ths of a nanosecond.
+WEAK uint64_t entry_value(const CacheEntry *entry) {
+    uint64_t bytes = entry->size_in_bytes();
+    return (entry->cost << 16) / (bytes ? bytes : 1);
+}
 
-WEAK void halide_memoization_cache_set_size(int64_t size) {
-    if (size == 0) {
-        size = kDefaultCacheSize;
+WEAK uint64_t entry_priority(const CachePartition *partition, const CacheEntry *entry) {
+    return __atomic_load_n(&partition->cost_inflation, __ATOMIC_RELAXED) + entry_value(entry);
+}
+
+// Publish the lowest priority in a shard's heap. Must be called with
+// the shard lock held, whenever the heap changes.
+WEAK void publish_min_priority_already_locked(CacheShard *shard) {
+    uint64_t p = shard->num_entries ? shard->heap[0]->priority : kNoPriority;
+    __atomic_store_n(&shard->min_priority, p, __ATOMIC_RELAXED);
+}
+
+WEAK void heap_swap(CacheEntry **heap, uint32_t a, uint32_t b) {
+    CacheEntry *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_index = a;
+    heap[b]->heap_index = b;
+}
+
+// Restore the heap property around position i of a shard's priority
+// heap after the priority of the entry there changed. Must be called
+// with the shard lock held.
+WEAK void heap_fix_already_locked(CacheShard *shard, uint32_t i) {
+    CacheEntry **heap = shard->heap;
+    while (i > 0 && heap[i]->priority < heap[(i - 1) / 2]->priority) {
+        heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    uint32_t n = shard->num_entries;
+    while (true) {
+        uint32_t smallest = i;
+        uint32_t l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && heap[l]->priority < heap[smallest]->priority) {
+            smallest = l;
+        }
+        if (r < n && heap[r]->priority < heap[smallest]->priority) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(heap, i, smallest);
+        i = smallest;
     }
+}
 
-    ScopedMutexLock lock(&memoization_lock);
+// Make sure the priority heap of a shard has room for one more
+// entry. Must be called with the shard lock held. Returns false if
+// out of memory.
+WEAK bool reserve_heap_already_locked(CacheShard *shard) {
+    if (shard->num_entries < shard->heap_capacity) {
+        return true;
+    }
+    uint32_t capacity = shard->heap_capacity ? shard->heap_capacity * 2 : kInitialBuckets;
+    CacheEntry **heap = (CacheEntry **)halide_malloc(NULL, capacity * sizeof(CacheEntry *));
+    if (!heap) {
+        return false;
+    }
+    if (shard->num_entries) {
+        memcpy(heap, shard->heap, shard->num_entries * sizeof(CacheEntry *));
+    }
+    halide_free(NULL, shard->heap);
+    shard->heap = heap;
+    shard->heap_capacity = capacity;
+    return true;
+}
 
-    max_cache_size = size;
-    prune_cache();
+// Add a new entry to a shard's hash table, LRU list and priority
+// heap. The heap must have room for it. Must be called with the shard
+// lock held.
+WEAK void insert_entry_already_locked(CachePartition *partition, CacheShard *shard, CacheEntry *entry) {
+    // Publish the entry to lookups only once it's fully set up.
+    CacheTable *table = shard->table;
+    CacheEntry **bucket = &table->buckets[entry->hash & (table->num_buckets - 1)];
+    entry->next = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+
+    push_to_mru_already_locked(shard, entry);
+
+    entry->priority = entry_priority(partition, entry);
+    entry->heap_index = shard->num_entries;
+    shard->heap[shard->num_entries] = entry;
+    shard->num_entries++;
+    heap_fix_already_locked(shard, entry->heap_index);
+    publish_min_priority_already_locked(shard);
+
+    shard->size += entry->size_in_bytes();
 }
 
-WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
-                                         halide_buffer_t *computed_bounds, int32_t tuple_count, halide_buffer_t **tuple_buffers) {
-    uint32_t h = djb_hash(cache_key, size);
-    uint32_t index = h % kHashTableSize;
+// Remove an entry that has been claimed for eviction from its
+// shard. Must be called with the shard lock held.
+WEAK void remove_entry_already_locked(CacheShard *shard, CacheEntry *entry) {
+    // Remove from hash table
+    CacheTable *table = shard->table;
+    CacheEntry **prev = &table->buckets[entry->hash & (table->num_buckets - 1)];
+    while (*prev != entry) {
+        halide_assert(NULL, *prev != NULL);
+        prev = &((*prev)->next);
+    }
+    __atomic_store_n(prev, entry->next, __ATOMIC_RELEASE);
+
+    // Remove from the priority heap, by moving the last entry into
+    // its place.
+    uint32_t i = entry->heap_index;
+    shard->num_entries--;
+    if (i != shard->num_entries) {
+        shard->heap[i] = shard->heap[shard->num_entries];
+        shard->heap[i]->heap_index = i;
+        heap_fix_already_locked(shard, i);
+    }
+    publish_min_priority_already_locked(shard);
 
-    ScopedMutexLock lock(&memoization_lock);
+    unlink_from_lru_already_locked(shard, entry);
 
-#if CACHE_DEBUGGING
-    debug_print_key(user_context, "halide_memoization_cache_lookup", cache_key, size);
+    // Decrease cache used amount.
+    shard->size -= entry->size_in_bytes();
 
-    debug_print_buffer(user_context, "computed_bounds", *computed_bounds);
+    // Lookups may still be looking at the entry, or following its
+    // next pointer, so defer deallocating it. It's no longer in the
+    // LRU list, so chain the retired entries through that instead.
+    entry->retired_epoch = retire_epoch();
+    entry->less_recent = shard->retired_entries;
+    shard->retired_entries = entry;
+    shard->evictions++;
+}
 
-    {
-        for (int32_t i = 0; i < tuple_count; i++) {
-            halide_buffer_t *buf = tuple_buffers[i];
-            debug_print_buffer(user_context, "Allocation bounds", *buf);
+// Try to claim an entry for eviction. Fails if it's in use.
+WEAK bool claim_for_eviction(CacheEntry *entry) {
+    uint32_t unused = 0;
+    return __atomic_compare_exchange_n(&entry->in_use_count, &unused, kEntryEvicted,
+                                       false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// Evict the least recently used entry of a shard that isn't in use,
+// giving entries that have been hit since eviction last considered
+// them a second chance. Must be called with the shard lock
+// held. Returns whether anything was evicted.
+WEAK bool evict_lru_already_locked(CacheShard *shard) {
+    CacheEntry *candidate = shard->least_recently_used;
+    // Each entry is looked at most twice: once to clear its
+    // referenced bit, and once more after it has come back around.
+    uint32_t budget = shard->num_entries * 2;
+    while (candidate != NULL && budget-- > 0) {
+        CacheEntry *more_recent = candidate->more_recent;
+        if (__atomic_load_n(&candidate->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&candidate->referenced, 0, __ATOMIC_RELAXED);
+            unlink_from_lru_already_locked(shard, candidate);
+            push_to_mru_already_locked(shard, candidate);
+        } else if (claim_for_eviction(candidate)) {
+            remove_entry_already_locked(shard, candidate);
+            return true;
         }
+        candidate = more_recent;
     }
+    return false;
+}
+
+// Evict the entry of a shard with the lowest GreedyDual-Size
+// priority that isn't in use. Hits don't take the lock, so instead of
+// raising the priority of an entry when it's hit, this raises it
+// when eviction finds it has been hit since it was last
+// considered. Must be called with the shard lock held. Returns
+// whether anything was evicted.
+WEAK bool evict_by_cost_already_locked(CachePartition *partition, CacheShard *shard) {
+    // Entries that are in use are set aside, and put back once a
+    // victim has been found.
+    CacheEntry *in_use = NULL;
+    bool evicted = false;
+    uint32_t budget = shard->num_entries * 2;
+    while (shard->num_entries > 0 && budget-- > 0) {
+        CacheEntry *candidate = shard->heap[0];
+        if (__atomic_load_n(&candidate->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&candidate->referenced, 0, __ATOMIC_RELAXED);
+            candidate->priority = entry_priority(partition, candidate);
+            heap_fix_already_locked(shard, 0);
+        } else if (claim_for_eviction(candidate)) {
+            if (candidate->priority > __atomic_load_n(&partition->cost_inflation, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&partition->cost_inflation, candidate->priority, __ATOMIC_RELAXED);
+            }
+            remove_entry_already_locked(shard, candidate);
+            evicted = true;
+            break;
+        } else {
+            // Take it out of the heap, keeping its place in the hash
+            // table and LRU list.
+            shard->num_entries--;
+            if (shard->num_entries) {
+                shard->heap[0] = shard->heap[shard->num_entries];
+                shard->heap[0]->heap_index = 0;
+                heap_fix_already_locked(shard, 0);
+            }
+            candidate->next_in_use = in_use;
+            in_use = candidate;
+        }
+    }
+    while (in_use) {
+        CacheEntry *entry = in_use;
+        in_use = entry->next_in_use;
+        entry->heap_index = shard->num_entries;
+        shard->heap[shard->num_entries] = entry;
+        shard->num_entries++;
+        heap_fix_already_locked(shard, entry->heap_index);
+    }
+    publish_min_priority_already_locked(shard);
+    return evicted;
+}
+
+// Choose the next shard to evict from, or return NULL if every
+// shard has been tried. When evicting by recency, this visits the
+// shards in turn. When evicting by cost, it picks the shard with the
+// lowest priority entry, so that entries are compared across the
+// whole partition.
+WEAK CacheShard *next_shard_to_evict_from(CachePartition *partition, int policy, uint32_t tried) {
+    if (policy == halide_memoization_evict_lru) {
+        for (size_t i = 0; i < kNumShards; i++) {
+            uint32_t s = __sync_fetch_and_add(&partition->next_shard_to_prune, 1) % kNumShards;
+            if (!(tried & (1 << s))) {
+                return &partition->shards[s];
+            }
+        }
+        return NULL;
+    }
+    CacheShard *best = NULL;
+    uint64_t best_priority = kNoPriority;
+    for (size_t s = 0; s < kNumShards; s++) {
+        uint64_t p = __atomic_load_n(&partition->shards[s].min_priority, __ATOMIC_RELAXED);
+        if (!(tried & (1 << s)) && (best == NULL || p < best_priority)) {
+            best = &partition->shards[s];
+            best_priority = p;
+        }
+    }
+    return best;
+}
+
+// Evict entries until a partition is within its size limit. Must be
+// called without any shard lock held.
+WEAK void prune_cache(CachePartition *partition) {
+#if CACHE_DEBUGGING
+    validate_cache(partition);
 #endif
+    int policy = get_eviction_policy();
+    // The shards that had nothing to evict since the last eviction.
+    uint32_t tried = 0;
+    while (current_cache_size(partition) > partition_max_size(partition)) {
+        CacheShard *shard = next_shard_to_evict_from(partition, policy, tried);
+        if (shard == NULL) {
+            break;
+        }
+        ScopedMutexLock lock(&shard->lock);
+        bool evicted = policy == halide_memoization_evict_lru ?
+            evict_lru_already_locked(shard) :
+            evict_by_cost_already_locked(partition, shard);
+        if (evicted) {
+            tried = 0;
+        } else {
+            tried |= 1 << (shard - partition->shards);
+        }
+        reclaim_retired_already_locked(shard);
+    }
+#if CACHE_DEBUGGING
+    validate_cache(partition);
+#endif
+}
 
-    CacheEntry *entry = cache_entries[index];
+// Find the entry matching a key and shape in a shard. Safe to call
+// without the shard lock, between begin_unlocked_read and
+// end_unlocked_read.
+WEAK CacheEntry *find_entry(CacheShard *shard, uint32_t h,
+                            const uint8_t *cache_key, int32_t size,
+                            const halide_buffer_t *computed_bounds,
+                            int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    CacheTable *table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return NULL;
+    }
+    CacheEntry *entry = __atomic_load_n(&table->buckets[h & (table->num_buckets - 1)],
+                                        __ATOMIC_ACQUIRE);
     while (entry != NULL) {
         if (entry->hash == h && entry->key_size == (size_t)size &&
             keys_equal(entry->key, cache_key, size) &&
@@ -356,37 +1052,765 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
             }
 
             if (all_bounds_equal) {
-                if (entry != most_recently_used) {
-                    halide_assert(user_context, entry->more_recent != NULL);
-                    if (entry->less_recent != NULL) {
-                        entry->less_recent->more_recent = entry->more_recent;
-                    } else {
-                        halide_assert(user_context, least_recently_used == entry);
-                        least_recently_used = entry->more_recent;
-                    }
-                    halide_assert(user_context, entry->more_recent != NULL);
-                    entry->more_recent->less_recent = entry->less_recent;
-
-                    entry->more_recent = NULL;
-                    entry->less_recent = most_recently_used;
-                    if (most_recently_used != NULL) {
-                        most_recently_used->more_recent = entry;
-                    }
-                    most_recently_used = entry;
+                return entry;
+            }
+        }
+        entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+// Add the statistics of a partition to stats.
+WEAK void accumulate_partition_stats(CachePartition *partition, halide_memoization_cache_stats_t *stats) {
+    for (size_t s = 0; s < kNumShards; s++) {
+        CacheShard *shard = &partition->shards[s];
+        ScopedMutexLock lock(&shard->lock);
+        stats->stores += shard->stores;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->num_entries;
+        stats->bytes_resident += shard->size;
+        stats->disk_hits += shard->disk_hits;
+        stats->disk_stores += __atomic_load_n(&shard->disk_stores, __ATOMIC_RELAXED);
+        for (CacheEntry *entry = shard->most_recently_used; entry; entry = entry->less_recent) {
+            if (__atomic_load_n(&entry->in_use_count, __ATOMIC_RELAXED) != 0) {
+                stats->pinned_entries++;
+            }
+        }
+    }
+    for (int s = 0; s < kNumLookupStats; s++) {
+        CacheLookupStats *l = &partition->lookup_stats[s];
+        stats->hits += __atomic_load_n(&l->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&l->misses, __ATOMIC_RELAXED);
+        stats->compute_time_saved += __atomic_load_n(&l->time_saved, __ATOMIC_RELAXED);
+        stats->crop_hits += __atomic_load_n(&l->crop_hits, __ATOMIC_RELAXED);
+        for (int i = 0; i < kKeySizeClasses; i++) {
+            stats->hits_by_key_size[i] += __atomic_load_n(&l->hits_by_key_size[i], __ATOMIC_RELAXED);
+            stats->misses_by_key_size[i] += __atomic_load_n(&l->misses_by_key_size[i], __ATOMIC_RELAXED);
+        }
+    }
+    stats->max_bytes += partition_max_size(partition);
+}
+
+WEAK void reset_partition_stats(CachePartition *partition) {
+    for (size_t s = 0; s < kNumShards; s++) {
+        CacheShard *shard = &partition->shards[s];
+        ScopedMutexLock lock(&shard->lock);
+        shard->stores = 0;
+        shard->evictions = 0;
+        shard->disk_hits = 0;
+        __atomic_store_n(&shard->disk_stores, 0, __ATOMIC_RELAXED);
+    }
+    for (int s = 0; s < kNumLookupStats; s++) {
+        CacheLookupStats *l = &partition->lookup_stats[s];
+        __atomic_store_n(&l->hits, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->misses, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->time_saved, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->crop_hits, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < kKeySizeClasses; i++) {
+            __atomic_store_n(&l->hits_by_key_size[i], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&l->misses_by_key_size[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Free all the entries of a partition. Must be called at a time when
+// no other threads are accessing the cache.
+WEAK void cleanup_partition(CachePartition *partition) {
+    for (size_t s = 0; s < kNumShards; s++) {
+        CacheShard *shard = &partition->shards[s];
+        if (shard->table) {
+            for (uint32_t i = 0; i < shard->table->num_buckets; i++) {
+                CacheEntry *entry = shard->table->buckets[i];
+                while (entry != NULL) {
+                    CacheEntry *next = entry->next;
+                    entry->destroy();
+                    halide_free(NULL, entry);
+                    entry = next;
                 }
+            }
+            halide_free(NULL, shard->table);
+            shard->table = NULL;
+        }
+        // No lookups can be running, so everything retired can go too.
+        reclaim_retired_already_locked(shard);
+        halide_free(NULL, shard->heap);
+        shard->heap = NULL;
+        shard->heap_capacity = 0;
+        shard->min_priority = kNoPriority;
+        shard->num_entries = 0;
+        shard->size = 0;
+        shard->most_recently_used = NULL;
+        shard->least_recently_used = NULL;
+        halide_mutex_destroy(&shard->lock);
+    }
+    partition->cost_inflation = 0;
+}
+
+// The on-disk tier. Each result is stored in its own file in the
+// directory, named after a hash of its key. The key on disk is the
+// string identifying the Func, which the key generated by the
+// compiler points to in its first bytes, followed by the rest of the
+// key after the instance counter. The string includes a hash of the
+// algorithm, so results computed by a different version of a
+// pipeline have different keys. The compiler only adds the hash for
+// targets with the memoize_disk feature, and keys without one are
+// never kept on disk.
+//
+// A file holds a DiskHeader, the key, the computed bounds, and a
+// DiskTuple and the allocated bounds for each buffer, followed by the
+// data of each buffer. Each buffer's data is aligned to
+// kDiskAlignment, with room before it for a CacheBlockHeader, so that
+// lookups can map the file copy-on-write and use the data in place.
+//
+// The index file in the directory records the size of each file and
+// when it was last used, so that the least recently used can be
+// deleted to keep the directory under its size limit. It is mapped
+// by every process using the directory, and only accessed while
+// holding a lock on it.
+
+const uint32_t kDiskMagic = 0x434d4c48;  // "HLMC"
+const uint32_t kDiskFormatVersion = 1;
+const size_t kDiskAlignment = 128;
+const uint32_t kDiskIndexSlots = 4096;
+const size_t kMaxDiskDirLength = 512;
+const size_t kDiskPathLength = kMaxDiskDirLength + 64;
+const int64_t kDefaultDiskTierSize = (int64_t)1 << 30;
+
+// The bytes at the start of a generated key replaced by the Func's
+// identifying string on disk: a pointer to it and a counter.
+const size_t kDiskKeyPrefixBytes = sizeof(void *) + 4;
+
+struct DiskHeader {
+    uint32_t magic;
+    // The format version and the size of a pointer, as the file
+    // contains halide_dimension_t's.
+    uint32_t version;
+    uint64_t file_size;
+    uint32_t key_size;
+    uint32_t tuple_count;
+    int32_t dimensions;
+    uint32_t padding;
+    uint64_t cost;
+};
+
+struct DiskTuple {
+    halide_type_t type;
+    uint32_t padding;
+    uint64_t data_offset;
+    uint64_t data_size;
+};
+
+struct DiskIndexSlot {
+    // The hash naming the file, or zero for an empty slot.
+    uint64_t hash;
+    uint64_t bytes;
+    uint64_t last_used;
+};
 
+struct DiskIndex {
+    uint32_t magic;
+    uint32_t version;
+    // Incremented on every use of a file.
+    uint64_t clock;
+    DiskIndexSlot slots[kDiskIndexSlots];
+};
+
+struct DiskTier {
+    // Serializes access to the index by threads of this process. The
+    // lock on the index file only excludes other processes.
+    halide_mutex lock;
+    // Whether the disk tier has been configured, either by
+    // halide_memoization_cache_set_disk_tier or from the environment.
+    int initialized;
+    // NULL if the disk tier is off.
+    char *dir;
+    int64_t max_bytes;
+    void *index_file;
+    DiskIndex *index;
+};
+
+WEAK DiskTier disk_tier;
+
+WEAK uint32_t disk_version() {
+    return (kDiskFormatVersion << 8) | sizeof(void *);
+}
+
+WEAK size_t align_up(size_t x, size_t alignment) {
+    return (x + alignment - 1) & ~(alignment - 1);
+}
+
+WEAK const char *disk_key_name(const uint8_t *cache_key) {
+    const char *name;
+    memcpy(&name, cache_key, sizeof(name));
+    return name;
+}
+
+WEAK uint64_t fnv1a(uint64_t h, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Hash the key as stored on disk. Never zero, which marks empty index
+// slots.
+WEAK uint64_t disk_key_hash(const uint8_t *cache_key, int32_t size) {
+    const char *name = disk_key_name(cache_key);
+    uint64_t h = fnv1a(0xcbf29ce484222325ULL, (const uint8_t *)name, strlen(name));
+    h = fnv1a(h, cache_key + kDiskKeyPrefixBytes, size - kDiskKeyPrefixBytes);
+    return h ? h : 1;
+}
+
+// Whether a generated key can be kept on disk. Its string is the
+// pipeline and Func names, each preceded by its length and a colon,
+// and then, if it has a hash of the algorithm, a colon and the hash.
+WEAK bool disk_key_has_version(const uint8_t *cache_key, int32_t size) {
+    if (size < (int32_t)kDiskKeyPrefixBytes) {
+        return false;
+    }
+    const char *name = disk_key_name(cache_key);
+    for (int field = 0; field < 2; field++) {
+        size_t length = 0;
+        while (*name >= '0' && *name <= '9') {
+            length = length * 10 + (*name++ - '0');
+        }
+        if (*name++ != ':') {
+            return false;
+        }
+        for (size_t i = 0; i < length; i++) {
+            if (*name++ == 0) {
+                return false;
+            }
+        }
+    }
+    return *name == ':';
+}
+
+WEAK void disk_path(char *path, uint64_t hash, const char *suffix) {
+    char *end = path + kDiskPathLength - 1;
+    char *dst = halide_string_to_string(path, end, disk_tier.dir);
+    dst = halide_string_to_string(dst, end, "/");
+    dst = halide_uint64_to_string(dst, end, hash, 1);
+    dst = halide_string_to_string(dst, end, suffix);
+    *dst = 0;
+}
+
+WEAK void lock_disk_index() {
+    halide_mutex_lock(&disk_tier.lock);
+    halide_lock_file(NULL, disk_tier.index_file, true);
+}
+
+WEAK void unlock_disk_index() {
+    halide_lock_file(NULL, disk_tier.index_file, false);
+    halide_mutex_unlock(&disk_tier.lock);
+}
+
+WEAK DiskIndexSlot *find_disk_slot_already_locked(uint64_t hash) {
+    for (uint32_t i = 0; i < kDiskIndexSlots; i++) {
+        if (disk_tier.index->slots[i].hash == hash) {
+            return &disk_tier.index->slots[i];
+        }
+    }
+    return NULL;
+}
+
+WEAK DiskIndexSlot *least_recently_used_disk_slot_already_locked(const DiskIndexSlot *except) {
+    DiskIndexSlot *result = NULL;
+    for (uint32_t i = 0; i < kDiskIndexSlots; i++) {
+        DiskIndexSlot *slot = &disk_tier.index->slots[i];
+        if (slot->hash != 0 && slot != except &&
+            (result == NULL || slot->last_used < result->last_used)) {
+            result = slot;
+        }
+    }
+    return result;
+}
+
+WEAK void remove_disk_file_already_locked(DiskIndexSlot *slot) {
+    char path[kDiskPathLength];
+    disk_path(path, slot->hash, ".hlmc");
+    remove(path);
+    slot->hash = 0;
+    slot->bytes = 0;
+    slot->last_used = 0;
+}
+
+WEAK void close_disk_tier() {
+    if (disk_tier.index) {
+        halide_unmap_file(NULL, disk_tier.index, sizeof(DiskIndex));
+        disk_tier.index = NULL;
+    }
+    if (disk_tier.index_file) {
+        fclose(disk_tier.index_file);
+        disk_tier.index_file = NULL;
+    }
+    halide_free(NULL, disk_tier.dir);
+    disk_tier.dir = NULL;
+}
+
+// Open the index in a directory, creating it if need be. Returns
+// whether the disk tier can be used.
+WEAK bool open_disk_tier(const char *dir, int64_t max_bytes) {
+    // Buffers on disk are laid out for the largest alignment
+    // halide_malloc can have.
+    size_t dir_length = strlen(dir);
+    if (header_bytes() > kDiskAlignment || halide_malloc_alignment() > (int)kDiskAlignment ||
+        dir_length > kMaxDiskDirLength) {
+        return false;
+    }
+    disk_tier.dir = (char *)halide_malloc(NULL, dir_length + 1);
+    if (!disk_tier.dir) {
+        return false;
+    }
+    memcpy(disk_tier.dir, dir, dir_length + 1);
+    disk_tier.max_bytes = max_bytes > 0 ? max_bytes : kDefaultDiskTierSize;
+
+    char path[kDiskPathLength];
+    disk_path(path, 0, "");
+    char *end = path + kDiskPathLength - 1;
+    // Replace the "0" with the index file name.
+    char *dst = halide_string_to_string(path + dir_length + 1, end, "index.hlmc");
+    *dst = 0;
+
+    // Create the index if it doesn't exist, without truncating it if
+    // it does.
+    void *f = fopen(path, "ab");
+    if (!f) {
+        close_disk_tier();
+        return false;
+    }
+    fclose(f);
+    f = fopen(path, "r+b");
+    if (!f) {
+        close_disk_tier();
+        return false;
+    }
+    disk_tier.index_file = f;
+    if (halide_lock_file(NULL, f, true) != 0) {
+        close_disk_tier();
+        return false;
+    }
+
+    bool ok = true;
+    uint32_t magic_and_version[2];
+    if (fread(magic_and_version, sizeof(magic_and_version), 1, f) != 1 ||
+        magic_and_version[0] != kDiskMagic || magic_and_version[1] != kDiskFormatVersion) {
+        // A new index, or one written by an incompatible version of
+        // the runtime. Start again from empty. Files it listed are
+        // left behind.
+        DiskIndex *empty = (DiskIndex *)halide_malloc(NULL, sizeof(DiskIndex));
+        if (empty) {
+            memset(empty, 0, sizeof(DiskIndex));
+            empty->magic = kDiskMagic;
+            empty->version = kDiskFormatVersion;
+            ok = (fseek(f, 0, 0) == 0 &&
+                  fwrite(empty, sizeof(DiskIndex), 1, f) == 1 &&
+                  fflush(f) == 0);
+            halide_free(NULL, empty);
+        } else {
+            ok = false;
+        }
+    }
+    if (ok) {
+        disk_tier.index = (DiskIndex *)halide_map_file(NULL, f, sizeof(DiskIndex), true);
+    }
+    halide_lock_file(NULL, f, false);
+
+    if (!disk_tier.index) {
+        close_disk_tier();
+        return false;
+    }
+    return true;
+}
+
+// Whether results should be looked up and stored on disk. Configures
+// the disk tier from the environment on first use.
+WEAK bool disk_tier_enabled() {
+    if (!__atomic_load_n(&disk_tier.initialized, __ATOMIC_ACQUIRE)) {
+        ScopedMutexLock lock(&disk_tier.lock);
+        if (!disk_tier.initialized) {
+            const char *dir = getenv("HL_MEMOIZATION_CACHE_DIR");
+            if (dir && *dir) {
+                const char *megabytes = getenv("HL_MEMOIZATION_CACHE_DISK_MB");
+                open_disk_tier(dir, megabytes ? (int64_t)atoi(megabytes) << 20 : 0);
+            }
+            __atomic_store_n(&disk_tier.initialized, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return disk_tier.index != NULL;
+}
+
+// Write a result to disk, and delete the least recently used files
+// if that takes the directory over its size limit.
+WEAK bool write_to_disk(void *user_context, const uint8_t *cache_key, int32_t size,
+                        const halide_buffer_t *computed_bounds, int32_t tuple_count,
+                        halide_buffer_t **tuple_buffers, uint64_t cost) {
+    const char *name = disk_key_name(cache_key);
+    size_t name_size = strlen(name);
+    int32_t dimensions = computed_bounds->dimensions;
+
+    DiskHeader header;
+    header.magic = kDiskMagic;
+    header.version = disk_version();
+    header.key_size = name_size + size - kDiskKeyPrefixBytes;
+    header.tuple_count = tuple_count;
+    header.dimensions = dimensions;
+    header.padding = 0;
+    header.cost = cost;
+
+    size_t key_offset = sizeof(DiskHeader);
+    size_t bounds_offset = align_up(key_offset + header.key_size, 8);
+    size_t tuples_offset = bounds_offset + sizeof(halide_dimension_t) * dimensions;
+    size_t shapes_offset = tuples_offset + sizeof(DiskTuple) * tuple_count;
+    size_t metadata_size = shapes_offset + sizeof(halide_dimension_t) * dimensions * tuple_count;
+
+    uint8_t *metadata = (uint8_t *)halide_malloc(user_context, metadata_size);
+    if (!metadata) {
+        return false;
+    }
+    memset(metadata, 0, metadata_size);
+    memcpy(metadata + key_offset, name, name_size);
+    memcpy(metadata + key_offset + name_size, cache_key + kDiskKeyPrefixBytes, size - kDiskKeyPrefixBytes);
+    memcpy(metadata + bounds_offset, computed_bounds->dim, sizeof(halide_dimension_t) * dimensions);
+    size_t data_end = metadata_size;
+    for (int32_t i = 0; i < tuple_count; i++) {
+        DiskTuple tuple;
+        tuple.type = tuple_buffers[i]->type;
+        tuple.padding = 0;
+        tuple.data_offset = align_up(data_end, kDiskAlignment) + kDiskAlignment;
+        tuple.data_size = tuple_buffers[i]->size_in_bytes();
+        data_end = tuple.data_offset + tuple.data_size;
+        memcpy(metadata + tuples_offset + sizeof(DiskTuple) * i, &tuple, sizeof(tuple));
+        memcpy(metadata + shapes_offset + sizeof(halide_dimension_t) * dimensions * i,
+               tuple_buffers[i]->dim, sizeof(halide_dimension_t) * dimensions);
+    }
+    header.file_size = data_end;
+    memcpy(metadata, &header, sizeof(header));
+
+    // Write to a temporary file and rename it, so that other
+    // processes never see a partially written file.
+    uint64_t hash = disk_key_hash(cache_key, size);
+    char temp_path[kDiskPathLength], path[kDiskPathLength];
+    disk_path(path, hash, ".hlmc");
+    uint64_t unique = (uint64_t)halide_current_time_ns(user_context) ^ (uint64_t)(uintptr_t)tuple_buffers[0]->host;
+    {
+        char *end = temp_path + kDiskPathLength - 1;
+        char *dst = halide_string_to_string(temp_path, end, path);
+        dst = halide_string_to_string(dst, end, ".");
+        dst = halide_uint64_to_string(dst, end, unique, 1);
+        *dst = 0;
+    }
+
+    bool ok = false;
+    void *f = fopen(temp_path, "wb");
+    if (f) {
+        static const uint8_t zeros[kDiskAlignment * 2] = {0};
+        ok = fwrite(metadata, metadata_size, 1, f) == 1;
+        size_t written = metadata_size;
+        for (int32_t i = 0; ok && i < tuple_count; i++) {
+            DiskTuple tuple;
+            memcpy(&tuple, metadata + tuples_offset + sizeof(DiskTuple) * i, sizeof(tuple));
+            size_t padding = tuple.data_offset - written;
+            ok = (fwrite(zeros, padding, 1, f) == 1 &&
+                  (tuple.data_size == 0 || fwrite(tuple_buffers[i]->host, tuple.data_size, 1, f) == 1));
+            written = tuple.data_offset + tuple.data_size;
+        }
+        // Make sure the contents reach the disk before the rename
+        // does, or a crash could leave a short file under the final
+        // name.
+        ok = ok && halide_sync_file(user_context, f) == 0;
+        ok = (fclose(f) == 0) && ok;
+    }
+    halide_free(user_context, metadata);
+    if (!ok) {
+        remove(temp_path);
+        return false;
+    }
+
+    lock_disk_index();
+    ok = rename(temp_path, path) == 0;
+    if (ok) {
+        DiskIndex *index = disk_tier.index;
+        DiskIndexSlot *slot = find_disk_slot_already_locked(hash);
+        if (slot == NULL) {
+            slot = find_disk_slot_already_locked(0);
+        }
+        if (slot == NULL) {
+            slot = least_recently_used_disk_slot_already_locked(NULL);
+            remove_disk_file_already_locked(slot);
+        }
+        slot->hash = hash;
+        slot->bytes = header.file_size;
+        slot->last_used = ++index->clock;
+
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < kDiskIndexSlots; i++) {
+            total += index->slots[i].bytes;
+        }
+        while (total > (uint64_t)disk_tier.max_bytes) {
+            DiskIndexSlot *victim = least_recently_used_disk_slot_already_locked(slot);
+            if (victim == NULL) {
+                break;
+            }
+            total -= victim->bytes;
+            remove_disk_file_already_locked(victim);
+        }
+    } else {
+        remove(temp_path);
+    }
+    unlock_disk_index();
+    return ok;
+}
+
+WEAK bool types_equal(const halide_type_t &a, const halide_type_t &b) {
+    return a.code == b.code && a.bits == b.bits && a.lanes == b.lanes;
+}
+
+// Look for a result on disk, and if there is one, map it and add it
+// to the in-memory cache. Returns the entry, pinned once for each
+// buffer, or NULL.
+WEAK CacheEntry *load_from_disk(void *user_context, CachePartition *partition, CacheShard *shard,
+                                uint32_t h, const uint8_t *cache_key, int32_t size,
+                                const halide_buffer_t *computed_bounds,
+                                int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    uint64_t hash = disk_key_hash(cache_key, size);
+    char path[kDiskPathLength];
+    disk_path(path, hash, ".hlmc");
+    void *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+
+    const char *name = disk_key_name(cache_key);
+    size_t name_size = strlen(name);
+    int32_t dimensions = computed_bounds->dimensions;
+    size_t key_offset = sizeof(DiskHeader);
+    size_t bounds_offset = align_up(key_offset + name_size + size - kDiskKeyPrefixBytes, 8);
+    size_t tuples_offset = bounds_offset + sizeof(halide_dimension_t) * dimensions;
+    size_t shapes_offset = tuples_offset + sizeof(DiskTuple) * tuple_count;
+    size_t metadata_size = shapes_offset + sizeof(halide_dimension_t) * dimensions * tuple_count;
+
+    DiskHeader header;
+    uint8_t *mapping = NULL;
+    if (fread(&header, sizeof(header), 1, f) == 1 &&
+        header.magic == kDiskMagic &&
+        header.version == disk_version() &&
+        header.key_size == name_size + size - kDiskKeyPrefixBytes &&
+        header.tuple_count == (uint32_t)tuple_count &&
+        header.dimensions == dimensions &&
+        header.file_size >= metadata_size &&
+        header.file_size == (size_t)header.file_size &&
+        // Reading past the end of a mapped file faults, so check that
+        // the file wasn't cut short, e.g. by a crash or a full disk.
+        fseek(f, 0, 2 /* SEEK_END */) == 0 &&
+        (uint64_t)ftell(f) == header.file_size) {
+        mapping = (uint8_t *)halide_map_file(user_context, f, header.file_size, false);
+    }
+    // The mapping stays valid after the file is closed, and after it
+    // is deleted.
+    fclose(f);
+    if (!mapping) {
+        return NULL;
+    }
+
+    // Check the file holds this key, with the same shapes and types,
+    // as the hash may have collided.
+    bool matches = (memcmp(mapping + key_offset, name, name_size) == 0 &&
+                    memcmp(mapping + key_offset + name_size, cache_key + kDiskKeyPrefixBytes,
+                           size - kDiskKeyPrefixBytes) == 0 &&
+                    buffer_has_shape(computed_bounds, (halide_dimension_t *)(mapping + bounds_offset)));
+    for (int32_t i = 0; matches && i < tuple_count; i++) {
+        DiskTuple tuple;
+        memcpy(&tuple, mapping + tuples_offset + sizeof(DiskTuple) * i, sizeof(tuple));
+        matches = (types_equal(tuple.type, tuple_buffers[i]->type) &&
+                   buffer_has_shape(tuple_buffers[i],
+                                    (halide_dimension_t *)(mapping + shapes_offset +
+                                                           sizeof(halide_dimension_t) * dimensions * i)) &&
+                   tuple.data_size == tuple_buffers[i]->size_in_bytes() &&
+                   tuple.data_offset >= metadata_size + kDiskAlignment &&
+                   tuple.data_offset % kDiskAlignment == 0 &&
+                   tuple.data_offset + tuple.data_size <= header.file_size);
+        if (matches) {
+            tuple_buffers[i]->host = mapping + tuple.data_offset;
+        }
+    }
+    if (!matches) {
+        for (int32_t i = 0; i < tuple_count; i++) {
+            tuple_buffers[i]->host = NULL;
+        }
+        halide_unmap_file(user_context, mapping, header.file_size);
+        return NULL;
+    }
+
+    CacheEntry *entry = NULL;
+    {
+        ScopedMutexLock lock(&shard->lock);
+
+        // Another thread may have loaded or computed it in the meantime.
+        CacheEntry *existing = find_entry(shard, h, cache_key, size, computed_bounds, tuple_count, tuple_buffers);
+        if (existing != NULL && existing->pin(tuple_count)) {
+            entry = existing;
+        } else {
+            if (ensure_table_already_locked(shard) && reserve_heap_already_locked(shard)) {
+                entry = (CacheEntry *)halide_malloc(NULL, sizeof(CacheEntry));
+                if (entry && !entry->init(cache_key, size, h, computed_bounds, tuple_count, tuple_buffers)) {
+                    halide_free(NULL, entry);
+                    entry = NULL;
+                }
+            }
+            if (entry) {
+                entry->mapping = mapping;
+                entry->mapping_size = header.file_size;
+                entry->in_use_count = tuple_count;
+                entry->cost = header.cost;
                 for (int32_t i = 0; i < tuple_count; i++) {
-                    halide_buffer_t *buf = tuple_buffers[i];
-                    *buf = entry->buf[i];
+                    // The mapping is private, so this doesn't modify the file.
+                    CacheBlockHeader *block_header = get_pointer_to_header(entry->buf[i].host);
+                    block_header->entry = entry;
+                    block_header->partition = partition;
+                    block_header->hash = h;
+                    block_header->miss_time = 0;
+                }
+                insert_entry_already_locked(partition, shard, entry);
+                if (shard->num_entries > shard->table->num_buckets) {
+                    grow_table_already_locked(shard);
                 }
+                reclaim_retired_already_locked(shard);
+            }
+        }
+        if (entry) {
+            shard->disk_hits++;
+        }
+    }
+    if (entry == NULL || entry->mapping != mapping) {
+        halide_unmap_file(user_context, mapping, header.file_size);
+    }
+    if (entry == NULL) {
+        for (int32_t i = 0; i < tuple_count; i++) {
+            tuple_buffers[i]->host = NULL;
+        }
+        return NULL;
+    }
 
-                entry->in_use_count += tuple_count;
+    lock_disk_index();
+    DiskIndexSlot *slot = find_disk_slot_already_locked(hash);
+    if (slot) {
+        slot->last_used = ++disk_tier.index->clock;
+    }
+    unlock_disk_index();
 
-                return 0;
+    // The new entry is pinned, so this won't evict it.
+    prune_cache(partition);
+    return entry;
+}
+
+// Whether the region of each dimension of a buffer lies within the
+// corresponding one of a shape.
+WEAK bool shape_contains(const halide_dimension_t *shape, const halide_buffer_t *buf) {
+    for (int i = 0; i < buf->dimensions; i++) {
+        if (buf->dim[i].min < shape[i].min ||
+            buf->dim[i].min + buf->dim[i].extent > shape[i].min + shape[i].extent) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Find an entry for a key whose computed bounds contain the ones
+// requested, and pin it once. Entries with data that is only up to
+// date on a device are skipped. Safe to call without the shard lock,
+// between begin_unlocked_read and end_unlocked_read.
+WEAK CacheEntry *find_containing_entry(CacheShard *shard, uint32_t h,
+                                       const uint8_t *cache_key, int32_t size,
+                                       const halide_buffer_t *computed_bounds,
+                                       int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    if (computed_bounds->dimensions > MAX_COPY_DIMS) {
+        return NULL;
+    }
+    CacheTable *table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return NULL;
+    }
+    CacheEntry *entry = __atomic_load_n(&table->buckets[h & (table->num_buckets - 1)],
+                                        __ATOMIC_ACQUIRE);
+    while (entry != NULL) {
+        if (entry->hash == h && entry->key_size == (size_t)size &&
+            keys_equal(entry->key, cache_key, size) &&
+            entry->tuple_count == (uint32_t)tuple_count &&
+            entry->dimensions == computed_bounds->dimensions &&
+            shape_contains(entry->computed_bounds, computed_bounds)) {
+
+            bool usable = true;
+            for (int32_t i = 0; usable && i < tuple_count; i++) {
+                usable = (entry->buf[i].type == tuple_buffers[i]->type &&
+                          !entry->buf[i].device_dirty() &&
+                          shape_contains(tuple_buffers[i]->dim, computed_bounds));
+            }
+
+            if (usable && entry->pin(1)) {
+                if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+                    __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+                }
+                return entry;
             }
         }
-        entry = entry->next;
+        entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
     }
+    return NULL;
+}
+
+// Allocate buffers with the allocation bounds requested, and copy the
+// computed bounds requested into them from an entry that contains
+// them. The buffers aren't part of any entry, so releasing them frees
+// them.
+WEAK bool copy_crop(void *user_context, CachePartition *partition, uint32_t h, CacheEntry *entry,
+                    const halide_buffer_t *computed_bounds,
+                    int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    int32_t dimensions = computed_bounds->dimensions;
+    for (int32_t i = 0; i < tuple_count; i++) {
+        halide_buffer_t *buf = tuple_buffers[i];
+        uint8_t *block = (uint8_t *)halide_malloc(user_context, buf->size_in_bytes() + header_bytes());
+        if (block == NULL) {
+            for (int32_t j = i; j > 0; j--) {
+                halide_free(user_context, get_pointer_to_header(tuple_buffers[j - 1]->host));
+                tuple_buffers[j - 1]->host = NULL;
+            }
+            return false;
+        }
+        buf->host = block + header_bytes();
+        CacheBlockHeader *header = get_pointer_to_header(buf->host);
+        header->hash = h;
+        header->entry = NULL;
+        header->partition = partition;
+        header->miss_time = 0;
+
+        // Only the computed bounds need to be filled in. Describe
+        // them as a buffer within the allocation.
+        halide_dimension_t crop_dims[MAX_COPY_DIMS];
+        halide_buffer_t crop = *buf;
+        crop.dim = crop_dims;
+        int64_t offset = 0;
+        for (int32_t d = 0; d < dimensions; d++) {
+            crop_dims[d] = buf->dim[d];
+            crop_dims[d].min = computed_bounds->dim[d].min;
+            crop_dims[d].extent = computed_bounds->dim[d].extent;
+            offset += (int64_t)(crop_dims[d].min - buf->dim[d].min) * buf->dim[d].stride;
+        }
+        crop.host = buf->host + offset * buf->type.bytes();
+        copy_memory(make_buffer_copy(&entry->buf[i], true, &crop, true), user_context);
+    }
+    return true;
+}
+
+// Allocate buffers for the caller to compute a result in after a
+// miss, and return 1. The store goes to the given partition, or
+// nowhere if it's NULL. Returns -1 if out of memory.
+WEAK int allocate_result_buffers(void *user_context, CachePartition *partition, uint32_t h,
+                                 int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    // The cost of the result is how long it takes from here to the
+    // store.
+    halide_start_clock(user_context);
+    int64_t miss_time = halide_current_time_ns(user_context);
 
     for (int32_t i = 0; i < tuple_count; i++) {
         halide_buffer_t *buf = tuple_buffers[i];
@@ -403,13 +1827,180 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
         CacheBlockHeader *header = get_pointer_to_header(buf->host);
         header->hash = h;
         header->entry = NULL;
+        header->partition = partition;
+        header->miss_time = miss_time;
+    }
+
+    return 1;
+}
+
+// Look up a result in the cache, and if there is none, allocate
+// buffers for the caller to compute it in. If reuse_crops is set, a
+// result whose computed bounds contain those requested can be used
+// too. See halide_memoization_cache_lookup.
+WEAK int lookup(void *user_context, const char *partition_name,
+                const uint8_t *cache_key, int32_t size,
+                const halide_buffer_t *computed_bounds,
+                int32_t tuple_count, halide_buffer_t **tuple_buffers, bool reuse_crops) {
+    CachePartition *partition = find_partition(partition_name, true);
+    if (partition == NULL) {
+        // Rather than share the size limit of another partition,
+        // don't cache the result at all.
+        return allocate_result_buffers(user_context, NULL, 0, tuple_count, tuple_buffers);
     }
+    uint32_t h = hash_key(cache_key, size);
+    CacheShard *shard = shard_for_hash(partition, h);
 
 #if CACHE_DEBUGGING
-    validate_cache();
+    debug_print_key(user_context, "halide_memoization_cache_lookup", cache_key, size);
+
+    debug_print_buffer(user_context, "computed_bounds", *computed_bounds);
+
+    {
+        for (int32_t i = 0; i < tuple_count; i++) {
+            halide_buffer_t *buf = tuple_buffers[i];
+            debug_print_buffer(user_context, "Allocation bounds", *buf);
+        }
+    }
 #endif
 
-    return 1;
+    // Hits don't take the shard lock. Publishing a reader epoch keeps
+    // any entry found from being freed until we're done with it, and
+    // pinning it keeps it from being evicted after that.
+    CacheReaderSlot *reader = begin_unlocked_read();
+    if (reader == NULL) {
+        halide_mutex_lock(&shard->lock);
+    }
+    CacheEntry *entry = find_entry(shard, h, cache_key, size, computed_bounds, tuple_count, tuple_buffers);
+    bool hit = entry != NULL && entry->pin(tuple_count);
+    uint64_t cost = hit ? entry->cost : 0;
+    if (hit) {
+        for (int32_t i = 0; i < tuple_count; i++) {
+            halide_buffer_t *buf = tuple_buffers[i];
+            *buf = entry->buf[i];
+        }
+        // Only write to the entry if it's not already marked, so
+        // that frequently hit entries aren't bounced between cores.
+        if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        }
+    }
+    CacheEntry *containing = NULL;
+    if (!hit && reuse_crops) {
+        containing = find_containing_entry(shard, h, cache_key, size, computed_bounds, tuple_count, tuple_buffers);
+    }
+    if (reader) {
+        end_unlocked_read(reader);
+    } else {
+        halide_mutex_unlock(&shard->lock);
+    }
+
+    int size_class = key_size_class(size);
+    CacheLookupStats *stats = &partition->lookup_stats[current_thread_slot(kNumLookupStatsLog2)];
+    if (hit) {
+        __atomic_fetch_add(&stats->hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->time_saved, cost, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->hits_by_key_size[size_class], 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (containing) {
+        bool copied = copy_crop(user_context, partition, h, containing, computed_bounds,
+                                tuple_count, tuple_buffers);
+        // Credit the hit with the share of the entry's cost that the
+        // crop represents.
+        double fraction = (double)tuple_buffers[0]->size_in_bytes() / (double)containing->buf[0].size_in_bytes();
+        uint64_t saved = (uint64_t)(containing->cost * (fraction < 1 ? fraction : 1));
+        __atomic_fetch_sub(&containing->in_use_count, 1, __ATOMIC_RELEASE);
+        if (copied) {
+            __atomic_fetch_add(&stats->hits, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats->crop_hits, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats->time_saved, saved, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats->hits_by_key_size[size_class], 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    if (disk_tier_enabled() && disk_key_has_version(cache_key, size)) {
+        entry = load_from_disk(user_context, partition, shard, h, cache_key, size,
+                               computed_bounds, tuple_count, tuple_buffers);
+        if (entry) {
+            for (int32_t i = 0; i < tuple_count; i++) {
+                halide_buffer_t *buf = tuple_buffers[i];
+                *buf = entry->buf[i];
+            }
+            __atomic_fetch_add(&stats->hits, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats->time_saved, entry->cost, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats->hits_by_key_size[size_class], 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    __atomic_fetch_add(&stats->misses, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->misses_by_key_size[size_class], 1, __ATOMIC_RELAXED);
+
+    return allocate_result_buffers(user_context, partition, h, tuple_count, tuple_buffers);
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK void halide_memoization_cache_set_size(int64_t size) {
+    if (size == 0) {
+        size = kDefaultCacheSize;
+    }
+
+    __atomic_store_n(&default_partition.max_size, size, __ATOMIC_RELAXED);
+    prune_cache(&default_partition);
+}
+
+WEAK int halide_memoization_cache_set_partition_size(const char *partition_name, int64_t size) {
+    CachePartition *partition = find_partition(partition_name, true);
+    if (partition == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&partition->max_size, size, __ATOMIC_RELAXED);
+    prune_cache(partition);
+    return 0;
+}
+
+WEAK int halide_memoization_cache_set_eviction_policy(int policy) {
+    int old_policy = get_eviction_policy();
+    __atomic_store_n(&eviction_policy, policy, __ATOMIC_RELAXED);
+    return old_policy;
+}
+
+WEAK int halide_memoization_cache_set_disk_tier(const char *dir, int64_t max_bytes) {
+    ScopedMutexLock lock(&disk_tier.lock);
+    close_disk_tier();
+    __atomic_store_n(&disk_tier.initialized, 1, __ATOMIC_RELEASE);
+    if (dir == NULL) {
+        return 0;
+    }
+    return open_disk_tier(dir, max_bytes) ? 0 : -1;
+}
+
+WEAK int halide_memoization_cache_lookup_in_partition(void *user_context, const char *partition_name,
+                                                      const uint8_t *cache_key, int32_t size,
+                                                      halide_buffer_t *computed_bounds,
+                                                      int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    return lookup(user_context, partition_name, cache_key, size, computed_bounds,
+                  tuple_count, tuple_buffers, false);
+}
+
+WEAK int halide_memoization_cache_lookup_crop(void *user_context, const char *partition_name,
+                                              const uint8_t *cache_key, int32_t size,
+                                              halide_buffer_t *computed_bounds,
+                                              int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    return lookup(user_context, partition_name, cache_key, size, computed_bounds,
+                  tuple_count, tuple_buffers, true);
+}
+
+WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
+                                         halide_buffer_t *computed_bounds, int32_t tuple_count, halide_buffer_t **tuple_buffers) {
+    return halide_memoization_cache_lookup_in_partition(user_context, NULL, cache_key, size, computed_bounds,
+                                                        tuple_count, tuple_buffers);
 }
 
 WEAK int halide_memoization_cache_store(void *user_context, const uint8_t *cache_key, int32_t size,
@@ -417,11 +2008,18 @@ WEAK int halide_memoization_cache_store(void *user_context, const uint8_t *cache
                                         int32_t tuple_count, halide_buffer_t **tuple_buffers) {
     debug(user_context) << "halide_memoization_cache_store\n";
 
-    uint32_t h = get_pointer_to_header(tuple_buffers[0]->host)->hash;
-
-    uint32_t index = h % kHashTableSize;
-
-    ScopedMutexLock lock(&memoization_lock);
+    CacheBlockHeader *first_header = get_pointer_to_header(tuple_buffers[0]->host);
+    CachePartition *partition = first_header->partition;
+    if (partition == NULL) {
+        // The lookup had nowhere to cache the result. The entry of
+        // each buffer is already NULL, so halide_memoization_cache_release
+        // frees them.
+        return 0;
+    }
+    uint32_t h = first_header->hash;
+    int64_t cost = halide_current_time_ns(user_context) - first_header->miss_time;
+    CacheShard *shard = shard_for_hash(partition, h);
+    uint64_t stored_cost = 0;
 
 #if CACHE_DEBUGGING
     debug_print_key(user_context, "halide_memoization_cache_store", cache_key, size);
@@ -436,88 +2034,73 @@ WEAK int halide_memoization_cache_store(void *user_context, const uint8_t *cache
     }
 #endif
 
-    CacheEntry *entry = cache_entries[index];
-    while (entry != NULL) {
-        if (entry->hash == h && entry->key_size == (size_t)size &&
-            keys_equal(entry->key, cache_key, size) &&
-            buffer_has_shape(computed_bounds, entry->computed_bounds) &&
-            entry->tuple_count == (uint32_t)tuple_count) {
+    {
+        ScopedMutexLock lock(&shard->lock);
 
-            bool all_bounds_equal = true;
-            bool no_host_pointers_equal = true;
-            {
-                for (int32_t i = 0; all_bounds_equal && i < tuple_count; i++) {
-                    halide_buffer_t *buf = tuple_buffers[i];
-                    all_bounds_equal = buffer_has_shape(tuple_buffers[i], entry->buf[i].dim);
-                    if (entry->buf[i].host == buf->host) {
-                        no_host_pointers_equal = false;
-                    }
-                }
+        CacheEntry *entry = find_entry(shard, h, cache_key, size, computed_bounds, tuple_count, tuple_buffers);
+        if (entry != NULL) {
+            for (int32_t i = 0; i < tuple_count; i++) {
+                halide_assert(user_context, entry->buf[i].host != tuple_buffers[i]->host);
             }
-            if (all_bounds_equal) {
-                halide_assert(user_context, no_host_pointers_equal);
-                // This entry is still in use by the caller. Mark it as having no cache entry
-                // so halide_memoization_cache_release can free the buffer.
-                for (int32_t i = 0; i < tuple_count; i++) {
-                    get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
-
-                }
-                return 0;
+            // This entry is still in use by the caller. Mark it as having no cache entry
+            // so halide_memoization_cache_release can free the buffer.
+            for (int32_t i = 0; i < tuple_count; i++) {
+                get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
             }
+            return 0;
         }
-        entry = entry->next;
-    }
 
-    uint64_t added_size = 0;
-    {
-        for (int32_t i = 0; i < tuple_count; i++) {
-            halide_buffer_t *buf = tuple_buffers[i];
-            added_size += buf->size_in_bytes();
+        CacheEntry *new_entry = NULL;
+        bool inited = false;
+        if (ensure_table_already_locked(shard) && reserve_heap_already_locked(shard)) {
+            new_entry = (CacheEntry *)halide_malloc(NULL, sizeof(CacheEntry));
+            if (new_entry) {
+                inited = new_entry->init(cache_key, size, h, computed_bounds, tuple_count, tuple_buffers);
+            }
         }
-    }
-    current_cache_size += added_size;
-    prune_cache();
+        if (!inited) {
+            // This entry is still in use by the caller. Mark it as having no cache entry
+            // so halide_memoization_cache_release can free the buffer.
+            for (int32_t i = 0; i < tuple_count; i++) {
+                get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
+            }
 
-    CacheEntry *new_entry = (CacheEntry *)halide_malloc(NULL, sizeof(CacheEntry));
-    bool inited = false;
-    if (new_entry) {
-        inited = new_entry->init(cache_key, size, h, computed_bounds, tuple_count, tuple_buffers);
-    }
-    if (!inited) {
-        current_cache_size -= added_size;
+            if (new_entry) {
+                halide_free(user_context, new_entry);
+            }
+            return 0;
+        }
 
-        // This entry is still in use by the caller. Mark it as having no cache entry
-        // so halide_memoization_cache_release can free the buffer.
+        new_entry->in_use_count = tuple_count;
+        // Clamp the cost so that entry_value can't overflow.
+        const int64_t max_cost = (int64_t)1 << 47;
+        new_entry->cost = cost < 0 ? 0 : (cost > max_cost ? max_cost : cost);
+        stored_cost = new_entry->cost;
         for (int32_t i = 0; i < tuple_count; i++) {
-            get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
+            get_pointer_to_header(tuple_buffers[i]->host)->entry = new_entry;
         }
 
-        if (new_entry) {
-            halide_free(user_context, new_entry);
-        }
-        return 0;
-    }
+        insert_entry_already_locked(partition, shard, new_entry);
+        shard->stores++;
 
-    new_entry->next = cache_entries[index];
-    new_entry->less_recent = most_recently_used;
-    if (most_recently_used != NULL) {
-        most_recently_used->more_recent = new_entry;
-    }
-    most_recently_used = new_entry;
-    if (least_recently_used == NULL) {
-        least_recently_used = new_entry;
+        if (shard->num_entries > shard->table->num_buckets) {
+            grow_table_already_locked(shard);
+        }
+        reclaim_retired_already_locked(shard);
     }
-    cache_entries[index] = new_entry;
 
-    new_entry->in_use_count = tuple_count;
+    // The new entry is pinned, so this won't evict it, even if it's
+    // larger than the whole cache.
+    prune_cache(partition);
 
-    for (int32_t i = 0; i < tuple_count; i++) {
-        get_pointer_to_header(tuple_buffers[i]->host)->entry = new_entry;
+    // Results are written through to disk as they are stored, while
+    // the caller still holds the data, rather than when they're
+    // evicted. The store has already missed on disk.
+    if (disk_tier_enabled() && disk_key_has_version(cache_key, size) &&
+        write_to_disk(user_context, cache_key, size, computed_bounds, tuple_count, tuple_buffers, stored_cost)) {
+        __atomic_fetch_add(&shard->disk_stores, 1, __ATOMIC_RELAXED);
     }
 
-#if CACHE_DEBUGGING
-    validate_cache();
-#endif
     debug(user_context) << "Exiting halide_memoization_cache_store\n";
 
     return 0;
@@ -531,34 +2114,61 @@ WEAK void halide_memoization_cache_release(void *user_context, void *host) {
     if (entry == NULL) {
         halide_free(user_context, header);
     } else {
-        ScopedMutexLock lock(&memoization_lock);
-
-        halide_assert(user_context, entry->in_use_count > 0);
-        entry->in_use_count--;
-#if CACHE_DEBUGGING
-        validate_cache();
-#endif
+        // The entry can't be evicted until this reaches zero, so
+        // there's no need to lock its shard.
+        uint32_t old_count = __atomic_fetch_sub(&entry->in_use_count, 1, __ATOMIC_RELEASE);
+        halide_assert(user_context, old_count > 0 && old_count != kEntryEvicted);
     }
 
     debug(user_context) << "Exited halide_memoization_cache_release.\n";
 }
 
+WEAK void halide_memoization_cache_get_stats(halide_memoization_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(halide_memoization_cache_stats_t));
+    for (int i = 0; i <= kMaxNamedPartitions; i++) {
+        CachePartition *partition = partition_at(i);
+        if (partition) {
+            accumulate_partition_stats(partition, stats);
+        }
+    }
+}
+
+WEAK int halide_memoization_cache_get_partition_stats(const char *partition_name,
+                                                      halide_memoization_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(halide_memoization_cache_stats_t));
+    CachePartition *partition = find_partition(partition_name, false);
+    if (partition == NULL) {
+        return -1;
+    }
+    accumulate_partition_stats(partition, stats);
+    return 0;
+}
+
+WEAK void halide_memoization_cache_reset_stats() {
+    for (int i = 0; i <= kMaxNamedPartitions; i++) {
+        CachePartition *partition = partition_at(i);
+        if (partition) {
+            reset_partition_stats(partition);
+        }
+    }
+}
+
 WEAK void halide_memoization_cache_cleanup() {
     debug(NULL) << "halide_memoization_cache_cleanup\n";
-    for (size_t i = 0; i < kHashTableSize; i++) {
-        CacheEntry *entry = cache_entries[i];
-        cache_entries[i] = NULL;
-        while (entry != NULL) {
-            CacheEntry *next = entry->next;
-            entry->destroy();
-            halide_free(NULL, entry);
-            entry = next;
+    cleanup_partition(&default_partition);
+    for (int i = 0; i < kMaxNamedPartitions; i++) {
+        CachePartition *partition = named_partitions[i];
+        if (partition) {
+            cleanup_partition(partition);
+            halide_free(NULL, partition->name);
+            halide_free(NULL, partition->allocation);
+            named_partitions[i] = NULL;
         }
     }
-    current_cache_size = 0;
-    most_recently_used = NULL;
-    least_recently_used = NULL;
-    halide_mutex_destroy(&memoization_lock);
+    halide_mutex_destroy(&partitions_lock);
+    close_disk_tier();
+    disk_tier.initialized = 0;
+    halide_mutex_destroy(&disk_tier.lock);
 }
 
 namespace {
@@ -277,4 +277,10 @@ WEAK int halide_error_buffer_is_null(void *user_context, const char *routine) {
     return halide_error_code_buffer_is_null;
 }
 
+WEAK int halide_error_scratch_too_small(void *user_context, uint64_t scratch_size, uint64_t required_size) {
+    error(user_context) << "Scratch memory of " << scratch_size
+                        << " bytes was passed to a pipeline that requires " << required_size << " bytes.\n";
+    return halide_error_code_scratch_too_small;
+}
+
 }  // extern "C"
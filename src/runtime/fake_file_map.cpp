@@ -0,0 +1,24 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+
+extern "C" {
+
+// Files can't be mapped on this platform, so the on-disk tier of the
+// memoization cache is unavailable.
+
+WEAK void *halide_map_file(void *user_context, void *file, size_t size, bool shared) {
+    return NULL;
+}
+
+WEAK void halide_unmap_file(void *user_context, void *addr, size_t size) {
+}
+
+WEAK int halide_lock_file(void *user_context, void *file, bool lock) {
+    return -1;
+}
+
+WEAK int halide_sync_file(void *user_context, void *file) {
+    return -1;
+}
+
+}  // extern "C"
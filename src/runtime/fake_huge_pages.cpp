@@ -0,0 +1,32 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+
+// Huge page allocation isn't supported on this platform, so
+// halide_default_malloc always uses malloc.
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK void *huge_page_malloc(void *user_context, size_t x) {
+    return NULL;
+}
+
+WEAK bool huge_page_free(void *user_context, void *ptr) {
+    return false;
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK void halide_set_huge_page_mode(halide_huge_page_mode_t mode, uint64_t threshold) {
+}
+
+WEAK int64_t halide_huge_page_trim(void *user_context) {
+    return 0;
+}
+
+WEAK void halide_huge_page_get_stats(halide_huge_page_stats_t *stats) {
+    memset(stats, 0, sizeof(halide_huge_page_stats_t));
+}
+
+}  // extern "C"
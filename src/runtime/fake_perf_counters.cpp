@@ -0,0 +1,25 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+
+// Hardware performance counters aren't supported on this platform, so
+// the profiler only reports times.
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK int profiler_counters_open_thread() {
+    return -1;
+}
+
+WEAK int profiler_counters_read_all(uint64_t (*deltas)[kNumProfilerCounters], int max_threads) {
+    return 0;
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK int halide_profiler_set_counters(int enabled) {
+    return 0;
+}
+
+}  // extern "C"
@@ -54,6 +54,119 @@ WEAK int halide_set_num_threads(int n) {
     return 1;
 }
 
+WEAK int halide_set_thread_pool_stats(int enabled) {
+    return 0;
+}
+
+WEAK void halide_thread_pool_get_stats(halide_thread_pool *pool, halide_thread_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(halide_thread_pool_stats_t));
+}
+
+WEAK int halide_thread_pool_get_thread_tasks(halide_thread_pool *pool, uint64_t *tasks, int max_threads) {
+    return 0;
+}
+
+WEAK void halide_thread_pool_reset_stats(halide_thread_pool *pool) {
+}
+
+WEAK int halide_set_thread_pool_spin_count(int spin_count) {
+    return 0;
+}
+
+WEAK halide_thread_pool *halide_thread_pool_create(int num_threads, int priority) {
+    // There's only ever one thread, so all pools are the same pool.
+    if (num_threads < 0) {
+        halide_error(NULL, "halide_thread_pool_create: num_threads must be >= 0.");
+        return NULL;
+    }
+    static char the_pool;
+    return (halide_thread_pool *)&the_pool;
+}
+
+WEAK void halide_thread_pool_destroy(halide_thread_pool *pool) {
+}
+
+WEAK int halide_thread_pool_bind(void *user_context, halide_thread_pool *pool) {
+    return 0;
+}
+
+WEAK int halide_semaphore_init(void *user_context, halide_semaphore_t *sem, int count) {
+    int *value = (int *)sem;
+    *value = count;
+    return 0;
+}
+
+WEAK int halide_semaphore_release(halide_semaphore_t *sem, int n) {
+    if (n > 0) {
+        __sync_fetch_and_add((int *)sem, n);
+    }
+    return 0;
+}
+
+WEAK bool halide_semaphore_try_acquire(halide_semaphore_t *sem, int n) {
+    if (n <= 0) {
+        return true;
+    }
+    int *value = (int *)sem;
+    int old_value = __atomic_load_n(value, __ATOMIC_ACQUIRE);
+    while ((old_value & ~HALIDE_SEMAPHORE_CLOSED) >= n) {
+        if (__atomic_compare_exchange_n(value, &old_value, old_value - n,
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+WEAK void halide_semaphore_close(void *user_context, void *sem) {
+    __sync_fetch_and_or((int *)sem, HALIDE_SEMAPHORE_CLOSED);
+}
+
+WEAK bool halide_can_spawn_threads() {
+    return false;
+}
+
+WEAK int halide_current_thread_id() {
+    return -1;
+}
+
+WEAK void halide_wakeup_init(halide_wakeup *w) {
+    *(int *)w = 0;
+}
+
+WEAK void halide_wakeup_destroy(halide_wakeup *w) {
+}
+
+WEAK void halide_wakeup_wait(halide_wakeup *w) {
+    // There are no condition variables here, so poll.
+    while (!__sync_bool_compare_and_swap((int *)w, 1, 0)) {
+        halide_sleep_ms(NULL, 1);
+    }
+}
+
+WEAK void halide_wakeup_signal(halide_wakeup *w) {
+    __atomic_store_n((int *)w, 1, __ATOMIC_RELEASE);
+}
+
+WEAK int halide_semaphore_acquire(halide_semaphore_t *sem, int n) {
+    // Tasks run one after the other, so if the semaphore isn't
+    // available now, nothing will ever release it.
+    if (!halide_semaphore_try_acquire(sem, n)) {
+        if (*(int *)sem & HALIDE_SEMAPHORE_CLOSED) {
+            // The releasing task failed, and has already reported why.
+            return halide_error_code_generic_error;
+        }
+        halide_error(NULL, "halide_semaphore_acquire would block forever: async "
+                     "producers need a thread pool that can run tasks concurrently.\n");
+        return halide_error_code_generic_error;
+    }
+    return 0;
+}
+
+WEAK int halide_set_thread_affinity(int enabled) {
+    return 0;
+}
+
 WEAK halide_do_task_t halide_set_custom_do_task(halide_do_task_t f) {
     halide_do_task_t result = custom_do_task;
     custom_do_task = f;
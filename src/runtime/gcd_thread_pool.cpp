@@ -24,6 +24,19 @@ extern long dispatch_semaphore_wait(dispatch_semaphore_t dsema, dispatch_time_t
 extern long dispatch_semaphore_signal(dispatch_semaphore_t dsema);
 extern void dispatch_release(void *object);
 
+typedef struct dispatch_group_s *dispatch_group_t;
+
+extern dispatch_group_t dispatch_group_create();
+extern void dispatch_group_async_f(dispatch_group_t group, dispatch_queue_t queue,
+                                   void *context, void (*work)(void *));
+extern long dispatch_group_wait(dispatch_group_t group, dispatch_time_t timeout);
+
+typedef unsigned long pthread_key_t;
+extern int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+extern int pthread_key_delete(pthread_key_t key);
+extern void *pthread_getspecific(pthread_key_t key);
+extern int pthread_setspecific(pthread_key_t key, const void *value);
+
 }
 
 namespace Halide { namespace Runtime { namespace Internal {
@@ -73,6 +86,12 @@ WEAK void init_mutex(void *mutex_arg) {
     mutex->semaphore = dispatch_semaphore_create(1);
 }
 
+// The private contents of a halide_wakeup.
+struct gcd_wakeup {
+    dispatch_semaphore_t semaphore;
+    int pending;
+};
+
 struct halide_gcd_job {
     int (*f)(void *, int, uint8_t *);
     void *user_context;
@@ -85,8 +104,46 @@ struct halide_gcd_job {
 // make a call to Halide's do task
 WEAK void halide_do_gcd_task(void *job, size_t idx) {
     halide_gcd_job *j = (halide_gcd_job *)job;
-    j->exit_status = halide_do_task(j->user_context, j->f, j->min + (int)idx,
-                                    j->closure);
+    int result = halide_do_task(j->user_context, j->f, j->min + (int)idx,
+                                j->closure);
+    if (result) {
+        j->exit_status = result;
+    }
+}
+
+WEAK void halide_do_gcd_first_task(void *job) {
+    halide_do_gcd_task(job, 0);
+}
+
+WEAK void halide_do_gcd_later_task(void *job, size_t idx) {
+    halide_do_gcd_task(job, idx + 1);
+}
+
+// A thread blocked in halide_semaphore_acquire. Each one sleeps on
+// its own dispatch semaphore, so that a wakeup meant for one waiter
+// can't be taken by another.
+struct semaphore_waiter {
+    halide_semaphore_t *sem;
+    dispatch_semaphore_t wakeup;
+    semaphore_waiter *next;
+};
+
+WEAK halide_mutex semaphore_waiters_lock = { { 0 } };
+WEAK semaphore_waiter *semaphore_waiters = NULL;
+WEAK int semaphore_num_waiters = 0;
+
+// Wake the threads blocked acquiring sem, so that they check it again.
+WEAK void wake_semaphore_waiters(halide_semaphore_t *sem) {
+    if (__atomic_load_n(&semaphore_num_waiters, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    halide_mutex_lock(&semaphore_waiters_lock);
+    for (semaphore_waiter *w = semaphore_waiters; w; w = w->next) {
+        if (w->sem == sem) {
+            dispatch_semaphore_signal(w->wakeup);
+        }
+    }
+    halide_mutex_unlock(&semaphore_waiters_lock);
 }
 
 }}}  // namespace Halide::Runtime::Internal
@@ -100,16 +157,8 @@ WEAK int halide_default_do_task(void *user_context, int (*f)(void *, int, uint8_
 
 WEAK int halide_default_do_par_for(void *user_context, halide_task_t f,
                                    int min, int size, uint8_t *closure) {
-    if (custom_num_threads == 1 || size == 1) {
-        // GCD doesn't really allow us to limit the threads,
-        // so ensure that there's no parallelism by executing serially.
-        for (int x = min; x < min + size; x++) {
-            int result = halide_do_task(user_context, f, x, closure);
-            if (result) {
-                return result;
-            }
-        }
-        return 0;
+    if (size == 1) {
+        return halide_do_task(user_context, f, min, closure);
     }
 
     halide_gcd_job job;
@@ -119,7 +168,27 @@ WEAK int halide_default_do_par_for(void *user_context, halide_task_t f,
     job.min = min;
     job.exit_status = 0;
 
-    dispatch_apply_f(size, dispatch_get_global_queue(0, 0), &job, &halide_do_gcd_task);
+    // The first task runs asynchronously and the rest run under
+    // dispatch_apply. A nested dispatch_apply may run all of its
+    // iterations one after the other on the calling thread, and then a
+    // task blocked on a semaphore (such as the producer task of an
+    // async Func, which is task zero of its fork) would wait forever
+    // for a task that never starts.
+    dispatch_queue_t queue = dispatch_get_global_queue(0, 0);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_group_async_f(group, queue, &job, &halide_do_gcd_first_task);
+    if (custom_num_threads == 1) {
+        // GCD doesn't really allow us to limit the threads, so run
+        // the rest of the tasks serially on this thread. The first
+        // task still runs alongside them, in case it waits on one.
+        for (int x = 1; x < size && job.exit_status == 0; x++) {
+            halide_do_gcd_task(&job, x);
+        }
+    } else {
+        dispatch_apply_f(size - 1, queue, &job, &halide_do_gcd_later_task);
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    dispatch_release(group);
     return job.exit_status;
 }
 
@@ -165,6 +234,156 @@ WEAK int halide_set_num_threads(int n) {
     return old_custom_num_threads;
 }
 
+WEAK int halide_set_thread_pool_stats(int enabled) {
+    return 0;
+}
+
+WEAK void halide_thread_pool_get_stats(halide_thread_pool *pool, halide_thread_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(halide_thread_pool_stats_t));
+}
+
+WEAK int halide_thread_pool_get_thread_tasks(halide_thread_pool *pool, uint64_t *tasks, int max_threads) {
+    return 0;
+}
+
+WEAK void halide_thread_pool_reset_stats(halide_thread_pool *pool) {
+}
+
+WEAK int halide_set_thread_pool_spin_count(int spin_count) {
+    return 0;
+}
+
+WEAK halide_thread_pool *halide_thread_pool_create(int num_threads, int priority) {
+    // Grand Central Dispatch owns the threads, so all pools are the
+    // same pool.
+    if (num_threads < 0) {
+        halide_error(NULL, "halide_thread_pool_create: num_threads must be >= 0.");
+        return NULL;
+    }
+    static char the_pool;
+    return (halide_thread_pool *)&the_pool;
+}
+
+WEAK void halide_thread_pool_destroy(halide_thread_pool *pool) {
+}
+
+WEAK int halide_thread_pool_bind(void *user_context, halide_thread_pool *pool) {
+    return 0;
+}
+
+WEAK int halide_semaphore_init(void *user_context, halide_semaphore_t *sem, int count) {
+    int *value = (int *)sem;
+    *value = count;
+    return 0;
+}
+
+WEAK int halide_semaphore_release(halide_semaphore_t *sem, int n) {
+    if (n > 0) {
+        __atomic_fetch_add((int *)sem, n, __ATOMIC_SEQ_CST);
+        wake_semaphore_waiters(sem);
+    }
+    return 0;
+}
+
+WEAK bool halide_semaphore_try_acquire(halide_semaphore_t *sem, int n) {
+    if (n <= 0) {
+        return true;
+    }
+    int *value = (int *)sem;
+    int old_value = __atomic_load_n(value, __ATOMIC_ACQUIRE);
+    while ((old_value & ~HALIDE_SEMAPHORE_CLOSED) >= n) {
+        if (__atomic_compare_exchange_n(value, &old_value, old_value - n,
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+WEAK void halide_semaphore_close(void *user_context, void *sem) {
+    __atomic_fetch_or((int *)sem, HALIDE_SEMAPHORE_CLOSED, __ATOMIC_SEQ_CST);
+    wake_semaphore_waiters((halide_semaphore_t *)sem);
+}
+
+WEAK bool halide_can_spawn_threads() {
+    return true;
+}
+
+WEAK void halide_wakeup_init(halide_wakeup *w) {
+    gcd_wakeup *wakeup = (gcd_wakeup *)w;
+    wakeup->semaphore = dispatch_semaphore_create(0);
+    wakeup->pending = 0;
+}
+
+WEAK void halide_wakeup_destroy(halide_wakeup *w) {
+    gcd_wakeup *wakeup = (gcd_wakeup *)w;
+    dispatch_release(wakeup->semaphore);
+}
+
+WEAK void halide_wakeup_wait(halide_wakeup *w) {
+    gcd_wakeup *wakeup = (gcd_wakeup *)w;
+    dispatch_semaphore_wait(wakeup->semaphore, DISPATCH_TIME_FOREVER);
+    __atomic_store_n(&wakeup->pending, 0, __ATOMIC_SEQ_CST);
+}
+
+WEAK void halide_wakeup_signal(halide_wakeup *w) {
+    gcd_wakeup *wakeup = (gcd_wakeup *)w;
+    // Only the first signal since the last wakeup posts the dispatch
+    // semaphore, so that a burst of signals wakes the waiter once.
+    if (__sync_bool_compare_and_swap(&wakeup->pending, 0, 1)) {
+        dispatch_semaphore_signal(wakeup->semaphore);
+    }
+}
+
+WEAK int halide_semaphore_acquire(halide_semaphore_t *sem, int n) {
+    if (halide_semaphore_try_acquire(sem, n)) {
+        return 0;
+    }
+    // Grand Central Dispatch brings in another thread when one blocks
+    // on a dispatch semaphore, so the task that will release this one
+    // still gets to run. The waiter is counted before it is listed,
+    // and listed before it checks again, so a release either sees it
+    // or happened before the check.
+    semaphore_waiter waiter;
+    waiter.sem = sem;
+    waiter.wakeup = dispatch_semaphore_create(0);
+    __atomic_fetch_add(&semaphore_num_waiters, 1, __ATOMIC_SEQ_CST);
+    halide_mutex_lock(&semaphore_waiters_lock);
+    waiter.next = semaphore_waiters;
+    semaphore_waiters = &waiter;
+    halide_mutex_unlock(&semaphore_waiters_lock);
+
+    int result = 0;
+    while (!halide_semaphore_try_acquire(sem, n)) {
+        int value = __atomic_load_n((int *)sem, __ATOMIC_SEQ_CST);
+        if (value & HALIDE_SEMAPHORE_CLOSED) {
+            // The releasing task has exited. Check once more in
+            // case its last release came in after our attempt.
+            if (!halide_semaphore_try_acquire(sem, n)) {
+                result = halide_error_code_generic_error;
+            }
+            break;
+        }
+        dispatch_semaphore_wait(waiter.wakeup, DISPATCH_TIME_FOREVER);
+    }
+
+    halide_mutex_lock(&semaphore_waiters_lock);
+    semaphore_waiter **w = &semaphore_waiters;
+    while (*w != &waiter) {
+        w = &(*w)->next;
+    }
+    *w = waiter.next;
+    halide_mutex_unlock(&semaphore_waiters_lock);
+    __atomic_fetch_sub(&semaphore_num_waiters, 1, __ATOMIC_SEQ_CST);
+    dispatch_release(waiter.wakeup);
+    return result;
+}
+
+WEAK int halide_set_thread_affinity(int enabled) {
+    // Grand Central Dispatch owns the threads, so we can't pin them.
+    return 0;
+}
+
 WEAK halide_do_task_t halide_set_custom_do_task(halide_do_task_t f) {
     halide_do_task_t result = custom_do_task;
     custom_do_task = f;
@@ -188,3 +407,27 @@ WEAK int halide_do_par_for(void *user_context, halide_task_t f,
 }
 
 }
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK pthread_key_t thread_id_key;
+
+WEAK bool thread_id_key_create(void (*destructor)(void *)) {
+    return pthread_key_create(&thread_id_key, destructor) == 0;
+}
+
+WEAK void thread_id_key_delete() {
+    pthread_key_delete(thread_id_key);
+}
+
+WEAK void *thread_id_key_get() {
+    return pthread_getspecific(thread_id_key);
+}
+
+WEAK bool thread_id_key_set(void *value) {
+    return pthread_setspecific(thread_id_key, value) == 0;
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+#include "thread_ids.h"
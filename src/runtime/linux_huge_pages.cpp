@@ -0,0 +1,270 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+#include "scoped_mutex_lock.h"
+
+extern "C" {
+
+extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, ssize_t offset);
+extern int munmap(void *addr, size_t length);
+extern int madvise(void *addr, size_t length, int advice);
+
+// These are the same on all Linux architectures we support except
+// MIPS, which uses fake_huge_pages.cpp instead.
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_PRIVATE 2
+#define MAP_ANONYMOUS 0x20
+#define MAP_HUGETLB 0x40000
+#define MAP_HUGE_SHIFT 26
+#define MAP_FAILED ((void *)-1)
+#define MADV_HUGEPAGE 14
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// Large blocks for halide_default_malloc, mapped directly from the
+// OS. Regions are multiples of the huge page size, and aligned to it,
+// so that the kernel can back them with huge pages. Freed regions
+// go on a free list and are handed out again to later requests of a
+// similar size, which saves both the mmap and the page faults on first
+// touch.
+//
+// The block header sits at the start of the region, and the block
+// starts one alignment unit later. The word before the block holds
+// kHugePageBlockTag, which can't be confused with the pointer stored
+// there by halide_default_malloc (which is even) or the size class tag
+// stored by the malloc pool (which is small).
+
+// The huge page size on x86, used if the kernel doesn't say.
+const size_t kDefaultHugePageSize = 2 * 1024 * 1024;
+const size_t kHugePageBlockTag = ~(size_t)0;
+const uint64_t kDefaultHugePageThreshold = 32 * 1024 * 1024;
+
+// The most bytes of freed regions kept for reuse.
+const uint64_t kMaxCachedHugePageBytes = (uint64_t)1024 * 1024 * 1024;
+
+struct HugePageRegion {
+    size_t size;
+    HugePageRegion *next;
+};
+
+WEAK halide_mutex huge_page_lock;
+WEAK HugePageRegion *free_huge_page_regions = NULL;
+WEAK halide_huge_page_stats_t huge_page_stats;
+
+// One of -1 (not yet decided), or a halide_huge_page_mode_t.
+WEAK int huge_page_mode = -1;
+WEAK uint64_t huge_page_threshold = kDefaultHugePageThreshold;
+// Set before huge_page_mode is.
+WEAK size_t huge_page_size = 0;
+
+// Ask the kernel what size of huge page it backs anonymous memory
+// with. It depends on the base page size: 2MB with 4K pages, but e.g.
+// 512MB with the 64K pages some ARM systems use.
+WEAK size_t read_huge_page_size() {
+    size_t size = 0;
+    void *f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+    if (f) {
+        char buf[32];
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        for (size_t i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++) {
+            size = size * 10 + (buf[i] - '0');
+        }
+    }
+    if (size == 0 || (size & (size - 1)) != 0) {
+        size = kDefaultHugePageSize;
+    }
+    return size;
+}
+
+WEAK int get_huge_page_mode() {
+    int mode = __atomic_load_n(&huge_page_mode, __ATOMIC_ACQUIRE);
+    if (mode < 0) {
+        ScopedMutexLock lock(&huge_page_lock);
+        if (huge_page_mode < 0) {
+            const char *var = getenv("HL_HUGE_PAGES");
+            if (var && (strcmp(var, "1") == 0 || strcmp(var, "transparent") == 0)) {
+                mode = halide_huge_pages_transparent;
+            } else if (var && strcmp(var, "hugetlb") == 0) {
+                mode = halide_huge_pages_hugetlb;
+            } else {
+                mode = halide_huge_pages_off;
+            }
+            var = getenv("HL_HUGE_PAGE_THRESHOLD");
+            if (var && *var) {
+                uint64_t threshold = 0;
+                for (; *var >= '0' && *var <= '9'; var++) {
+                    threshold = threshold * 10 + (*var - '0');
+                }
+                huge_page_threshold = threshold;
+            }
+            if (huge_page_size == 0) {
+                huge_page_size = read_huge_page_size();
+            }
+            __atomic_store_n(&huge_page_mode, mode, __ATOMIC_RELEASE);
+        }
+        mode = huge_page_mode;
+    }
+    return mode;
+}
+
+// Map a region of the given size, which is a multiple of the huge
+// page size, aligned to the huge page size.
+WEAK void *map_huge_page_region(size_t size, int mode) {
+    if (mode == halide_huge_pages_hugetlb) {
+        // Explicit huge pages are always aligned, but fail if the
+        // system doesn't have enough of them reserved. Ask for ones of
+        // the size the region is a multiple of, rather than the
+        // system's default size, which may be larger.
+        const int log2_size = __builtin_ctzll(huge_page_size);
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2_size << MAP_HUGE_SHIFT), -1, 0);
+        if (addr != MAP_FAILED) {
+            return addr;
+        }
+    }
+
+    // Over-allocate, then trim the ends so that the region is
+    // aligned.
+    void *addr = mmap(NULL, size + huge_page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    size_t start = (size_t)addr;
+    size_t aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+    if (aligned > start) {
+        munmap(addr, aligned - start);
+    }
+    size_t end = start + size + huge_page_size;
+    if (end > aligned + size) {
+        munmap((void *)(aligned + size), end - (aligned + size));
+    }
+    madvise((void *)aligned, size, MADV_HUGEPAGE);
+    return (void *)aligned;
+}
+
+// Must be called with huge_page_lock held.
+WEAK void note_huge_page_region_in_use(size_t size) {
+    huge_page_stats.in_use_bytes += size;
+    if (huge_page_stats.in_use_bytes > huge_page_stats.peak_in_use_bytes) {
+        huge_page_stats.peak_in_use_bytes = huge_page_stats.in_use_bytes;
+    }
+}
+
+WEAK void *huge_page_malloc(void *user_context, size_t x) {
+    int mode = get_huge_page_mode();
+    if (mode == halide_huge_pages_off || x < huge_page_threshold) {
+        return NULL;
+    }
+
+    const size_t offset = halide_malloc_alignment() < 64 ? 64 : (size_t)halide_malloc_alignment();
+    size_t size = (x + offset + huge_page_size - 1) & ~(huge_page_size - 1);
+
+    HugePageRegion *region = NULL;
+    {
+        ScopedMutexLock lock(&huge_page_lock);
+        // Take the smallest free region that fits, unless it's much
+        // too big.
+        HugePageRegion **best = NULL;
+        for (HugePageRegion **r = &free_huge_page_regions; *r; r = &(*r)->next) {
+            if ((*r)->size >= size && (*r)->size <= size + size / 4 &&
+                (best == NULL || (*r)->size < (*best)->size)) {
+                best = r;
+            }
+        }
+        if (best) {
+            region = *best;
+            *best = region->next;
+            huge_page_stats.cached_bytes -= region->size;
+            huge_page_stats.reused++;
+            note_huge_page_region_in_use(region->size);
+        }
+    }
+
+    if (region == NULL) {
+        region = (HugePageRegion *)map_huge_page_region(size, mode);
+        if (region == NULL) {
+            // Let halide_default_malloc try malloc instead.
+            return NULL;
+        }
+        region->size = size;
+        ScopedMutexLock lock(&huge_page_lock);
+        huge_page_stats.mapped++;
+        huge_page_stats.mapped_bytes += size;
+        note_huge_page_region_in_use(size);
+    }
+
+    void *ptr = (char *)region + offset;
+    ((void **)ptr)[-1] = (void *)kHugePageBlockTag;
+    ((void **)ptr)[-2] = region;
+    return ptr;
+}
+
+WEAK bool huge_page_free(void *user_context, void *ptr) {
+    if ((size_t)((void **)ptr)[-1] != kHugePageBlockTag) {
+        return false;
+    }
+    HugePageRegion *region = (HugePageRegion *)((void **)ptr)[-2];
+    ScopedMutexLock lock(&huge_page_lock);
+    huge_page_stats.in_use_bytes -= region->size;
+    if (huge_page_stats.cached_bytes + region->size <= kMaxCachedHugePageBytes) {
+        region->next = free_huge_page_regions;
+        free_huge_page_regions = region;
+        huge_page_stats.cached_bytes += region->size;
+    } else {
+        huge_page_stats.unmapped_bytes += region->size;
+        munmap(region, region->size);
+    }
+    return true;
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK void halide_set_huge_page_mode(halide_huge_page_mode_t mode, uint64_t threshold) {
+    ScopedMutexLock lock(&huge_page_lock);
+    huge_page_threshold = threshold;
+    if (huge_page_size == 0) {
+        huge_page_size = read_huge_page_size();
+    }
+    __atomic_store_n(&huge_page_mode, (int)mode, __ATOMIC_RELEASE);
+}
+
+WEAK int64_t halide_huge_page_trim(void *user_context) {
+    HugePageRegion *regions;
+    int64_t released = 0;
+    {
+        ScopedMutexLock lock(&huge_page_lock);
+        regions = free_huge_page_regions;
+        free_huge_page_regions = NULL;
+        released = huge_page_stats.cached_bytes;
+        huge_page_stats.unmapped_bytes += huge_page_stats.cached_bytes;
+        huge_page_stats.cached_bytes = 0;
+    }
+    while (regions) {
+        HugePageRegion *next = regions->next;
+        munmap(regions, regions->size);
+        regions = next;
+    }
+    return released;
+}
+
+WEAK void halide_huge_page_get_stats(halide_huge_page_stats_t *stats) {
+    ScopedMutexLock lock(&huge_page_lock);
+    *stats = huge_page_stats;
+}
+
+namespace {
+
+__attribute__((destructor))
+WEAK void halide_huge_page_cleanup() {
+    halide_huge_page_trim(NULL);
+}
+
+}
+
+}
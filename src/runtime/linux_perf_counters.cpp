@@ -0,0 +1,285 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+#include "scoped_mutex_lock.h"
+
+extern "C" {
+
+// The syscall numbers vary across platforms. This module is only used
+// on x86:
+// -- x64 is 298 for perf_event_open
+// -- i386 is 336
+
+#ifndef SYS_PERF_EVENT_OPEN
+
+#ifdef BITS_64
+#define SYS_PERF_EVENT_OPEN 298
+#endif
+
+#ifdef BITS_32
+#define SYS_PERF_EVENT_OPEN 336
+#endif
+
+#endif
+
+extern int syscall(int num, ...);
+extern ssize_t read(int fd, void *buf, size_t count);
+
+typedef unsigned int pthread_key_t;
+extern int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+extern int pthread_key_delete(pthread_key_t key);
+extern void *pthread_getspecific(pthread_key_t key);
+extern int pthread_setspecific(pthread_key_t key, const void *value);
+
+// The parts of linux/perf_event.h used here. The struct is version 5
+// of perf_event_attr, which every kernel since 4.1 accepts.
+struct perf_event_attr {
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+    uint64_t config2;
+    uint64_t branch_sample_type;
+    uint64_t sample_regs_user;
+    uint32_t sample_stack_user;
+    int32_t clockid;
+    uint64_t sample_regs_intr;
+    uint32_t aux_watermark;
+    uint16_t sample_max_stack;
+    uint16_t reserved;
+};
+
+#define PERF_TYPE_HARDWARE 0
+#define PERF_COUNT_HW_CPU_CYCLES 0
+#define PERF_COUNT_HW_INSTRUCTIONS 1
+#define PERF_COUNT_HW_CACHE_MISSES 3
+#define PERF_COUNT_HW_BRANCH_MISSES 5
+#define PERF_FORMAT_GROUP 8
+#define PERF_ATTR_FLAG_EXCLUDE_KERNEL (1 << 5)
+#define PERF_ATTR_FLAG_EXCLUDE_HV (1 << 6)
+#define PERF_FLAG_FD_CLOEXEC 8
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// Each thread that runs a pipeline opens a group of counters the
+// first time it claims a profiler slot. The group counts the thread's
+// user-space events from then on, wherever it is scheduled, and the
+// profiler thread reads the groups of all threads at each sample.
+//
+// A thread keeps the handle of its group in thread-specific data, so
+// later claims are cheap. The group is closed when the thread exits,
+// and its entry handed to the next thread that needs one, so that a
+// new thread never inherits the counters of a dead one.
+
+const int kMaxCounterThreads = 256;
+
+// The events counted, in the order given in runtime_internal.h.
+const uint64_t kCounterEvents[kNumProfilerCounters] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+struct ThreadCounters {
+    // Whether a live thread owns this entry.
+    bool open;
+    // The fd of each event, or -1 if the CPU can't count it. The
+    // first is the group leader, which counts cycles.
+    int fd[kNumProfilerCounters];
+    // The position of each event in the values read from the group,
+    // or -1 if the CPU can't count it.
+    int position[kNumProfilerCounters];
+    uint64_t last[kNumProfilerCounters];
+};
+
+WEAK halide_mutex thread_counters_lock;
+WEAK ThreadCounters thread_counters[kMaxCounterThreads];
+// One more than the highest entry ever used.
+WEAK int num_thread_counters = 0;
+
+// Holds one more than the handle of the calling thread's group, or
+// zero if it hasn't opened one.
+WEAK pthread_key_t thread_counters_key;
+WEAK bool thread_counters_key_created = false;
+
+// One of -1 (not yet decided from HL_PROFILER_COUNTERS), 0 or 1.
+WEAK int profiler_counters_mode = -1;
+
+// Set when the kernel refuses to open counters (e.g. because of
+// perf_event_paranoid, or inside a VM without a PMU), so that threads
+// don't each try again.
+WEAK bool profiler_counters_unavailable = false;
+
+WEAK int open_counter(uint64_t config, int group_fd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.flags = PERF_ATTR_FLAG_EXCLUDE_KERNEL | PERF_ATTR_FLAG_EXCLUDE_HV;
+    // pid zero and cpu -1 count the calling thread on any cpu.
+    return syscall(SYS_PERF_EVENT_OPEN, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Read the current totals of a group. Events the CPU can't count
+// read as zero.
+WEAK bool read_thread_counters(const ThreadCounters *c, uint64_t *values) {
+    uint64_t buf[1 + kNumProfilerCounters];
+    ssize_t bytes = read(c->fd[0], buf, sizeof(buf));
+    if (bytes < (ssize_t)sizeof(uint64_t)) {
+        return false;
+    }
+    for (int i = 0; i < kNumProfilerCounters; i++) {
+        int p = c->position[i];
+        values[i] = (p >= 0 && (uint64_t)p < buf[0]) ? buf[1 + p] : 0;
+    }
+    return true;
+}
+
+WEAK bool profiler_counters_enabled() {
+    int mode = __atomic_load_n(&profiler_counters_mode, __ATOMIC_RELAXED);
+    if (mode < 0) {
+        const char *var = getenv("HL_PROFILER_COUNTERS");
+        mode = (var && atoi(var)) ? 1 : 0;
+        __atomic_store_n(&profiler_counters_mode, mode, __ATOMIC_RELAXED);
+    }
+    return mode && !profiler_counters_unavailable;
+}
+
+// Must be called with thread_counters_lock held.
+WEAK void close_counter_group(ThreadCounters *c) {
+    // Close the members before the leader.
+    for (int i = kNumProfilerCounters - 1; i >= 0; i--) {
+        if (c->fd[i] >= 0) {
+            close(c->fd[i]);
+        }
+    }
+    c->open = false;
+}
+
+// The destructor of thread_counters_key, called when a thread that
+// opened a group exits.
+WEAK void close_thread_counters(void *value) {
+    ScopedMutexLock lock(&thread_counters_lock);
+    close_counter_group(&thread_counters[(uintptr_t)value - 1]);
+}
+
+WEAK int profiler_counters_open_thread() {
+    if (!profiler_counters_enabled()) {
+        return -1;
+    }
+
+    if (__atomic_load_n(&thread_counters_key_created, __ATOMIC_ACQUIRE)) {
+        void *value = pthread_getspecific(thread_counters_key);
+        if (value) {
+            return (int)((uintptr_t)value - 1);
+        }
+    }
+
+    ScopedMutexLock lock(&thread_counters_lock);
+    if (!thread_counters_key_created) {
+        if (pthread_key_create(&thread_counters_key, close_thread_counters) != 0) {
+            profiler_counters_unavailable = true;
+            return -1;
+        }
+        __atomic_store_n(&thread_counters_key_created, true, __ATOMIC_RELEASE);
+    }
+
+    // Reuse the entry of a thread that has exited if there is one.
+    int n = 0;
+    while (n < num_thread_counters && thread_counters[n].open) {
+        n++;
+    }
+    if (n == kMaxCounterThreads) {
+        return -1;
+    }
+
+    ThreadCounters *c = &thread_counters[n];
+    c->fd[0] = open_counter(kCounterEvents[0], -1);
+    if (c->fd[0] < 0) {
+        profiler_counters_unavailable = true;
+        return -1;
+    }
+    c->position[0] = 0;
+    int members = 1;
+    for (int i = 1; i < kNumProfilerCounters; i++) {
+        c->fd[i] = open_counter(kCounterEvents[i], c->fd[0]);
+        c->position[i] = c->fd[i] < 0 ? -1 : members++;
+    }
+    c->open = true;
+    if (!read_thread_counters(c, c->last) ||
+        pthread_setspecific(thread_counters_key, (void *)(uintptr_t)(n + 1)) != 0) {
+        close_counter_group(c);
+        profiler_counters_unavailable = true;
+        return -1;
+    }
+    if (n == num_thread_counters) {
+        num_thread_counters = n + 1;
+    }
+    return n;
+}
+
+WEAK int profiler_counters_read_all(uint64_t (*deltas)[kNumProfilerCounters], int max_threads) {
+    // Hold the lock so that no group is closed, and its fds reused,
+    // while it is being read.
+    ScopedMutexLock lock(&thread_counters_lock);
+    int n = num_thread_counters;
+    if (n > max_threads) {
+        n = max_threads;
+    }
+    for (int i = 0; i < n; i++) {
+        ThreadCounters *c = &thread_counters[i];
+        uint64_t values[kNumProfilerCounters];
+        if (c->open && read_thread_counters(c, values)) {
+            for (int j = 0; j < kNumProfilerCounters; j++) {
+                deltas[i][j] = values[j] - c->last[j];
+                c->last[j] = values[j];
+            }
+        } else {
+            memset(deltas[i], 0, sizeof(deltas[i]));
+        }
+    }
+    return n;
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK int halide_profiler_set_counters(int enabled) {
+    bool old = profiler_counters_enabled();
+    __atomic_store_n(&profiler_counters_mode, enabled ? 1 : 0, __ATOMIC_RELAXED);
+    return old;
+}
+
+namespace {
+
+__attribute__((destructor))
+WEAK void halide_profiler_counters_cleanup() {
+    ScopedMutexLock lock(&thread_counters_lock);
+    // Threads that exit after the runtime is unloaded (e.g. when JIT
+    // compiled code is released) must not call back into it.
+    if (thread_counters_key_created) {
+        pthread_key_delete(thread_counters_key);
+        thread_counters_key_created = false;
+    }
+    for (int i = 0; i < num_thread_counters; i++) {
+        if (thread_counters[i].open) {
+            close_counter_group(&thread_counters[i]);
+        }
+    }
+    num_thread_counters = 0;
+}
+
+}
+
+}
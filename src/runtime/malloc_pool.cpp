@@ -0,0 +1,212 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+
+extern "C" {
+
+extern void *malloc(size_t);
+extern void free(void *);
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// A pool of blocks for halide_malloc. Pipelines that allocate inside
+// loops ask for the same few sizes over and over, so freed blocks are
+// kept on free lists and handed out again instead of going back to
+// the system allocator.
+//
+// Requests are rounded up to one of a set of size classes, four per
+// power of two from 64 bytes to 1MB. Larger requests bypass the pool.
+// The free lists live in a number of caches, each with its own
+// spinlock. A thread uses the cache picked by its thread id, so
+// threads only share a cache when more of them are alive than there
+// are caches. A thread that finds its cache locked falls back to the
+// system allocator rather than waiting.
+//
+// Every block from the pool records its size class in the word before
+// it, with the low bit set. halide_default_malloc stores the pointer
+// returned by malloc there instead, which always has the low bit
+// clear, so the two kinds of block can be freed by either free
+// function.
+
+const int kMinSizeClassLog2 = 6;
+const int kMaxSizeClassLog2 = 20;
+const int kSizeClassesPerPowerOfTwo = 4;
+const int kNumSizeClasses = (kMaxSizeClassLog2 - kMinSizeClassLog2) * kSizeClassesPerPowerOfTwo + 1;
+
+const int kNumPoolCachesLog2 = 6;
+const int kNumPoolCaches = 1 << kNumPoolCachesLog2;
+
+// The most bytes of free blocks one cache holds on to. Blocks freed
+// into a full cache go back to the system allocator.
+const size_t kMaxCachedBytesPerCache = 8 * 1024 * 1024;
+
+struct PoolCache {
+    int lock;
+    size_t cached_bytes;
+    void *free_lists[kNumSizeClasses];
+} __attribute__((aligned(64)));
+
+WEAK PoolCache pool_caches[kNumPoolCaches];
+
+WEAK size_t size_class_bytes(int size_class) {
+    size_t base = (size_t)1 << (kMinSizeClassLog2 + size_class / kSizeClassesPerPowerOfTwo);
+    return base + (base / kSizeClassesPerPowerOfTwo) * (size_class % kSizeClassesPerPowerOfTwo);
+}
+
+// The smallest size class that holds x bytes, or -1 if x is too large
+// for the pool.
+WEAK int size_class_for(size_t x) {
+    if (x <= ((size_t)1 << kMinSizeClassLog2)) {
+        return 0;
+    } else if (x > ((size_t)1 << kMaxSizeClassLog2)) {
+        return -1;
+    }
+    int log2 = 63 - __builtin_clzll((uint64_t)(x - 1));
+    size_t base = (size_t)1 << log2;
+    size_t step = base / kSizeClassesPerPowerOfTwo;
+    int sub = (int)((x - base + step - 1) / step);
+    return (log2 - kMinSizeClassLog2) * kSizeClassesPerPowerOfTwo + sub;
+}
+
+WEAK PoolCache *pool_cache_for_current_thread() {
+    return &pool_caches[current_thread_slot(kNumPoolCachesLog2)];
+}
+
+WEAK __attribute__((always_inline)) bool try_lock_pool_cache(PoolCache *cache) {
+    return __sync_lock_test_and_set(&cache->lock, 1) == 0;
+}
+
+WEAK __attribute__((always_inline)) void unlock_pool_cache(PoolCache *cache) {
+    __sync_lock_release(&cache->lock);
+}
+
+WEAK void *new_pool_block(int size_class) {
+    const size_t alignment = halide_malloc_alignment();
+    const size_t header = 2 * sizeof(void *);
+    void *orig = malloc(size_class_bytes(size_class) + alignment + header - 1);
+    if (orig == NULL) {
+        return NULL;
+    }
+    void *ptr = (void *)(((size_t)orig + alignment + header - 1) & ~(alignment - 1));
+    ((void **)ptr)[-1] = (void *)(((size_t)size_class << 1) | 1);
+    ((void **)ptr)[-2] = orig;
+    return ptr;
+}
+
+// One of -1 (not yet decided), 0, or 1.
+WEAK int malloc_pool_is_default = -1;
+
+WEAK bool use_malloc_pool() {
+    int enabled = __atomic_load_n(&malloc_pool_is_default, __ATOMIC_RELAXED);
+    if (enabled < 0) {
+        const char *var = getenv("HL_MALLOC_POOL");
+        enabled = (var && var[0] == '1') ? 1 : 0;
+        __atomic_store_n(&malloc_pool_is_default, enabled, __ATOMIC_RELAXED);
+    }
+    return enabled != 0;
+}
+
+WEAK void set_malloc_pool_default(bool enabled) {
+    __atomic_store_n(&malloc_pool_is_default, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK void *halide_pooled_malloc(void *user_context, size_t x) {
+    int size_class = size_class_for(x);
+    if (size_class < 0) {
+        // Too large to be worth keeping around.
+        const size_t alignment = halide_malloc_alignment();
+        void *orig = malloc(x + alignment);
+        if (orig == NULL) {
+            return NULL;
+        }
+        void *ptr = (void *)(((size_t)orig + alignment + sizeof(void*) - 1) & ~(alignment - 1));
+        ((void **)ptr)[-1] = orig;
+        return ptr;
+    }
+
+    PoolCache *cache = pool_cache_for_current_thread();
+    if (try_lock_pool_cache(cache)) {
+        void *ptr = cache->free_lists[size_class];
+        if (ptr) {
+            cache->free_lists[size_class] = *(void **)ptr;
+            cache->cached_bytes -= size_class_bytes(size_class);
+        }
+        unlock_pool_cache(cache);
+        if (ptr) {
+            return ptr;
+        }
+    }
+    return new_pool_block(size_class);
+}
+
+WEAK void halide_pooled_free(void *user_context, void *ptr) {
+    if (huge_page_free(user_context, ptr)) {
+        return;
+    }
+
+    size_t tag = (size_t)((void **)ptr)[-1];
+    if (!(tag & 1)) {
+        // Not from the pool.
+        free((void *)tag);
+        return;
+    }
+
+    int size_class = (int)(tag >> 1);
+    size_t bytes = size_class_bytes(size_class);
+    PoolCache *cache = pool_cache_for_current_thread();
+    if (try_lock_pool_cache(cache)) {
+        bool keep = cache->cached_bytes + bytes <= kMaxCachedBytesPerCache;
+        if (keep) {
+            *(void **)ptr = cache->free_lists[size_class];
+            cache->free_lists[size_class] = ptr;
+            cache->cached_bytes += bytes;
+        }
+        unlock_pool_cache(cache);
+        if (keep) {
+            return;
+        }
+    }
+    free(((void **)ptr)[-2]);
+}
+
+WEAK int64_t halide_malloc_pool_trim(void *user_context) {
+    int64_t released = 0;
+    for (int i = 0; i < kNumPoolCaches; i++) {
+        PoolCache *cache = &pool_caches[i];
+        void *free_lists[kNumSizeClasses];
+        while (!try_lock_pool_cache(cache)) {
+            // Caches are only held for a few instructions at a time.
+        }
+        memcpy(free_lists, cache->free_lists, sizeof(free_lists));
+        memset(cache->free_lists, 0, sizeof(cache->free_lists));
+        released += cache->cached_bytes;
+        cache->cached_bytes = 0;
+        unlock_pool_cache(cache);
+
+        for (int c = 0; c < kNumSizeClasses; c++) {
+            void *ptr = free_lists[c];
+            while (ptr) {
+                void *next = *(void **)ptr;
+                free(((void **)ptr)[-2]);
+                ptr = next;
+            }
+        }
+    }
+    return released;
+}
+
+namespace {
+
+__attribute__((destructor))
+WEAK void halide_malloc_pool_cleanup() {
+    halide_malloc_pool_trim(NULL);
+}
+
+}
+
+}
@@ -0,0 +1,19 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+
+// Linked in when the target has the malloc_pool feature, to make
+// halide_default_malloc allocate from the pool without needing
+// HL_MALLOC_POOL to be set.
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+namespace {
+
+__attribute__((constructor))
+WEAK void halide_malloc_pool_make_default() {
+    set_malloc_pool_default(true);
+}
+
+}
+
+}}} // namespace Halide::Runtime::Internal
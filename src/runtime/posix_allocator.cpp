@@ -7,6 +7,15 @@ extern void *malloc(size_t);
 extern void free(void *);
 
 WEAK void *halide_default_malloc(void *user_context, size_t x) {
+    void *huge = huge_page_malloc(user_context, x);
+    if (huge) {
+        return huge;
+    }
+
+    if (use_malloc_pool()) {
+        return halide_pooled_malloc(user_context, x);
+    }
+
     // Allocate enough space for aligning the pointer we return.
     const size_t alignment = halide_malloc_alignment();
     void *orig = malloc(x + alignment);
@@ -21,6 +30,17 @@ WEAK void *halide_default_malloc(void *user_context, size_t x) {
 }
 
 WEAK void halide_default_free(void *user_context, void *ptr) {
+    if (huge_page_free(user_context, ptr)) {
+        return;
+    }
+
+    // Blocks from the pool are tagged with a set low bit where we
+    // store the original pointer. The pool may have been turned on or
+    // off since this block was allocated, so check every block.
+    if ((size_t)((void**)ptr)[-1] & 1) {
+        halide_pooled_free(user_context, ptr);
+        return;
+    }
     free(((void**)ptr)[-1]);
 }
 
@@ -0,0 +1,44 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+
+extern "C" {
+
+extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, ssize_t offset);
+extern int munmap(void *addr, size_t length);
+extern int flock(int fd, int operation);
+extern int fsync(int fd);
+
+// These are the same on Linux, Android, OS X and iOS.
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_SHARED 1
+#define MAP_PRIVATE 2
+#define MAP_FAILED ((void *)-1)
+#define LOCK_EX 2
+#define LOCK_UN 8
+
+WEAK void *halide_map_file(void *user_context, void *file, size_t size, bool shared) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE,
+                      fileno(file), 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    return addr;
+}
+
+WEAK void halide_unmap_file(void *user_context, void *addr, size_t size) {
+    munmap(addr, size);
+}
+
+WEAK int halide_lock_file(void *user_context, void *file, bool lock) {
+    return flock(fileno(file), lock ? LOCK_EX : LOCK_UN);
+}
+
+WEAK int halide_sync_file(void *user_context, void *file) {
+    if (fflush(file) != 0) {
+        return -1;
+    }
+    return fsync(fileno(file));
+}
+
+}  // extern "C"
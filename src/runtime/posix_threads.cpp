@@ -23,11 +23,25 @@ extern int pthread_join(pthread_t thread, void **retval);
 extern int pthread_cond_init(halide_cond *cond, const void *attr);
 extern int pthread_cond_wait(halide_cond *cond, halide_mutex *mutex);
 extern int pthread_cond_broadcast(halide_cond *cond);
+extern int pthread_cond_signal(halide_cond *cond);
 extern int pthread_cond_destroy(halide_cond *cond);
 extern int pthread_mutex_init(halide_mutex *mutex, const void *attr);
 extern int pthread_mutex_lock(halide_mutex *mutex);
 extern int pthread_mutex_unlock(halide_mutex *mutex);
 extern int pthread_mutex_destroy(halide_mutex *mutex);
+typedef unsigned int pthread_key_t;
+extern int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+extern int pthread_key_delete(pthread_key_t key);
+extern void *pthread_getspecific(pthread_key_t key);
+extern int pthread_setspecific(pthread_key_t key, const void *value);
+
+// Linux-specific. Called with pid zero, these apply to the calling
+// thread only.
+extern int sched_setaffinity(int pid, size_t cpusetsize, const void *mask);
+extern int sched_getaffinity(int pid, size_t cpusetsize, void *mask);
+extern ssize_t read(int fd, void *buf, size_t count);
+extern int sched_yield();
+extern int setpriority(int which, int who, int prio);
 
 } // extern "C"
 
@@ -42,10 +56,147 @@ WEAK void *spawn_thread_helper(void *arg) {
     t->f(t->closure);
     return NULL;
 }
+
+// A cpu_set_t big enough for 1024 cores.
+#define CPU_SET_WORDS 16
+struct cpu_set {
+    uint64_t bits[CPU_SET_WORDS];
+
+    bool has(int cpu) const {
+        return cpu >= 0 && cpu < CPU_SET_WORDS * 64 && ((bits[cpu / 64] >> (cpu % 64)) & 1);
+    }
+    void add(int cpu) {
+        if (cpu >= 0 && cpu < CPU_SET_WORDS * 64) {
+            bits[cpu / 64] |= ((uint64_t)1) << (cpu % 64);
+        }
+    }
+};
+
+// The cores the process was allowed to run on before we pinned
+// anything. Unpinning a thread restores this set.
+WEAK cpu_set process_cpus;
+WEAK bool process_cpus_initialized = false;
+
+WEAK void init_process_cpus() {
+    if (!process_cpus_initialized) {
+        memset(&process_cpus, 0, sizeof(process_cpus));
+        if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0) {
+            memset(&process_cpus, 0xff, sizeof(process_cpus));
+        }
+        process_cpus_initialized = true;
+    }
+}
+
+// Parse a sysfs cpu list like "0-11,24-35" into a cpu_set. Returns
+// false if the file can't be read.
+WEAK bool read_cpu_list(const char *path, cpu_set *cpus) {
+    void *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char buf[1024];
+    ssize_t len = read(fileno(f), buf, sizeof(buf) - 1);
+    fclose(f);
+    if (len <= 0) {
+        return false;
+    }
+    buf[len] = 0;
+
+    memset(cpus, 0, sizeof(cpu_set));
+    const char *c = buf;
+    while (*c >= '0' && *c <= '9') {
+        int first = 0;
+        while (*c >= '0' && *c <= '9') {
+            first = first * 10 + (*c++ - '0');
+        }
+        int last = first;
+        if (*c == '-') {
+            c++;
+            last = 0;
+            while (*c >= '0' && *c <= '9') {
+                last = last * 10 + (*c++ - '0');
+            }
+        }
+        for (int i = first; i <= last; i++) {
+            cpus->add(i);
+        }
+        if (*c == ',') {
+            c++;
+        }
+    }
+    return true;
+}
+
 }}} // namespace Halide::Runtime::Internal
 
 extern "C" {
 
+WEAK int halide_get_cpu_order(int *cpus, int max_cpus) {
+    init_process_cpus();
+
+    // Walk the NUMA nodes in order, listing the cores of each one
+    // that this process is allowed to use. Node numbers can have
+    // gaps, so give up only after a run of missing nodes.
+    int count = 0;
+    int missing = 0;
+    cpu_set seen;
+    memset(&seen, 0, sizeof(seen));
+    for (int node = 0; missing < 8 && count < max_cpus; node++) {
+        char path[64];
+        char *end = path + sizeof(path);
+        char *dst = halide_string_to_string(path, end, "/sys/devices/system/node/node");
+        dst = halide_int64_to_string(dst, end, node, 1);
+        halide_string_to_string(dst, end, "/cpulist");
+        cpu_set node_cpus;
+        if (!read_cpu_list(path, &node_cpus)) {
+            missing++;
+            continue;
+        }
+        missing = 0;
+        for (int i = 0; i < CPU_SET_WORDS * 64 && count < max_cpus; i++) {
+            if (node_cpus.has(i) && process_cpus.has(i) && !seen.has(i)) {
+                cpus[count++] = i;
+                seen.add(i);
+            }
+        }
+    }
+
+    // Without NUMA information in sysfs, just use the allowed cores
+    // in order.
+    for (int i = 0; i < CPU_SET_WORDS * 64 && count < max_cpus; i++) {
+        if (process_cpus.has(i) && !seen.has(i)) {
+            cpus[count++] = i;
+        }
+    }
+    return count;
+}
+
+WEAK int halide_set_current_thread_cpu(int cpu) {
+    init_process_cpus();
+    if (cpu < 0) {
+        return sched_setaffinity(0, sizeof(process_cpus), &process_cpus);
+    }
+    cpu_set mask;
+    memset(&mask, 0, sizeof(mask));
+    mask.add(cpu);
+    return sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+WEAK void halide_thread_yield() {
+    sched_yield();
+}
+
+WEAK int halide_set_current_thread_priority(int priority) {
+    // On Linux nice values apply to the calling thread rather than
+    // the whole process. Raising priority requires privileges, so
+    // this may fail.
+    int nice_value = -priority;
+    if (nice_value < -20) nice_value = -20;
+    if (nice_value > 19) nice_value = 19;
+    const int PRIO_PROCESS = 0;
+    return setpriority(PRIO_PROCESS, 0, nice_value);
+}
+
 WEAK struct halide_thread *halide_spawn_thread(void (*f)(void *), void *closure) {
     spawned_thread *t = (spawned_thread *)malloc(sizeof(spawned_thread));
     t->f = f;
@@ -87,8 +238,36 @@ WEAK void halide_cond_broadcast(struct halide_cond *cond) {
     pthread_cond_broadcast(cond);
 }
 
+WEAK void halide_cond_signal(struct halide_cond *cond) {
+    pthread_cond_signal(cond);
+}
+
 WEAK void halide_cond_wait(struct halide_cond *cond, struct halide_mutex *mutex) {
     pthread_cond_wait(cond, mutex);
 }
 
 } // extern "C"
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK pthread_key_t thread_id_key;
+
+WEAK bool thread_id_key_create(void (*destructor)(void *)) {
+    return pthread_key_create(&thread_id_key, destructor) == 0;
+}
+
+WEAK void thread_id_key_delete() {
+    pthread_key_delete(thread_id_key);
+}
+
+WEAK void *thread_id_key_get() {
+    return pthread_getspecific(thread_id_key);
+}
+
+WEAK bool thread_id_key_set(void *value) {
+    return pthread_setspecific(thread_id_key, value) == 0;
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+#include "thread_ids.h"
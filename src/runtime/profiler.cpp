@@ -16,6 +16,252 @@ WEAK halide_profiler_state *halide_profiler_get_state() {
 
 namespace Halide { namespace Runtime { namespace Internal {
 
+// Each thread running host code of a pipeline publishes the id of the
+// Func it is running in a slot of its own, which the profiler thread
+// reads when it takes a sample. The pipeline claims a slot for the
+// thread that called it, and each task of a parallel loop claims
+// another, since a thread waiting for a parallel loop can run tasks
+// of it. As in worker_buffers.cpp, a task starts looking for a free
+// slot at the one picked by its thread id.
+const int kMaxProfilerThreadSlotsLog2 = 8;
+const int kMaxProfilerThreadSlots = 1 << kMaxProfilerThreadSlotsLog2;
+
+// The value of a slot no thread has claimed. A claimed slot holds
+// halide_profiler_outside_of_halide while its thread isn't running a
+// Func, e.g. because it is waiting for a parallel loop to finish.
+const int kProfilerThreadSlotFree = -3;
+
+WEAK int profiler_thread_slots[kMaxProfilerThreadSlots];
+WEAK bool profiler_thread_slots_initialized = false;
+
+// One more than the highest slot ever claimed, so that the profiler
+// thread only reads the slots that have been used.
+WEAK int num_profiler_thread_slots = 0;
+
+// Handed out when every slot is claimed. Never sampled.
+WEAK int overflow_profiler_thread_slot;
+
+// The handle of the hardware counters of the thread that claimed each
+// slot, or -1 if counters are off.
+WEAK int profiler_thread_slot_counters[kMaxProfilerThreadSlots];
+
+// The change in each thread's counters since the last sample. Only
+// used by the profiler thread.
+WEAK uint64_t profiler_counter_deltas[kMaxProfilerThreadSlots][kNumProfilerCounters];
+
+// The timeline of the Funcs each slot ran, for
+// halide_profiler_write_trace. Only touched with the profiler state's
+// lock held.
+enum ProfilerTimelineKind {
+    // Running the Func with id func.
+    kTimelineFunc = 0,
+    // Waiting for a parallel loop to finish. func is the token of the
+    // pipeline, i.e. the id of its first Func.
+    kTimelineWait = 1,
+    // A task of a parallel loop of the pipeline with token func.
+    kTimelineTask = 2,
+    // A call to the pipeline with token func.
+    kTimelinePipeline = 3
+};
+
+// Events sampled by the profiler thread cover a run of samples in
+// which a slot was running the same Func. Events logged by pipelines
+// compiled with the profile_timeline target feature are exact.
+struct ProfilerTimelineEvent {
+    uint64_t start, end;
+    int func, slot, kind;
+};
+
+const int kMaxProfilerTimelineEvents = 1 << 20;
+
+// One of -1 (not yet decided from HL_PROFILER_TRACE), 0 or 1.
+WEAK int profiler_timeline_mode = -1;
+WEAK ProfilerTimelineEvent *profiler_timeline = NULL;
+WEAK int profiler_timeline_size = 0;
+WEAK int profiler_timeline_capacity = 0;
+WEAK uint64_t profiler_timeline_dropped = 0;
+
+// The index of the event each slot is in the middle of, or -1.
+WEAK int profiler_timeline_open[kMaxProfilerThreadSlots];
+
+// Pipelines compiled with the profile_timeline target feature log when
+// each thread claims and releases its slot, and the time it starts
+// running each Func, to a ring buffer that belongs to the slot. Only
+// the thread that claimed the slot writes to its ring, so logging needs
+// no locks or atomic read-modify-writes. The profiler thread turns the
+// logs into timeline events at every sample, as does each pipeline
+// when it finishes. Events a slot logs faster than that are dropped.
+const int kTimelineRingSizeLog2 = 13;
+const int kTimelineRingSize = 1 << kTimelineRingSizeLog2;
+
+enum TimelineRingEventType {
+    kRingClaimPipeline = 0,
+    kRingClaimTask = 1,
+    kRingSetFunc = 2,
+    kRingRelease = 3
+};
+
+struct TimelineRingEvent {
+    uint64_t time;
+    int type, func;
+};
+
+// The value of TimelineRing::func when the slot isn't running a Func
+// or waiting.
+const int kTimelineNoFunc = -100;
+
+struct TimelineRing {
+    // The number of events ever logged. Only written by the thread
+    // that claimed the slot.
+    uint64_t head;
+    // The number of events turned into timeline events. The rest of
+    // the fields describe the slot as of the last of those, and are
+    // only touched with the profiler state's lock held.
+    uint64_t tail;
+    int claim_type, token, func;
+    uint64_t claim_start, func_start;
+    TimelineRingEvent events[kTimelineRingSize];
+};
+
+WEAK TimelineRing *profiler_timeline_rings[kMaxProfilerThreadSlots];
+WEAK bool profiler_timeline_rings_used = false;
+
+// The number of profiled pipelines running, and the thread pool
+// statistics setting to put back when the last of them ends. The
+// thread pool only times how long it spends waiting while a profiled
+// pipeline is running. Both are protected by the profiler state lock.
+WEAK int profiler_pipelines_running = 0;
+WEAK int profiler_old_thread_pool_stats = 0;
+
+WEAK void reset_timeline() {
+    profiler_timeline_size = 0;
+    profiler_timeline_dropped = 0;
+    for (int i = 0; i < kMaxProfilerThreadSlots; i++) {
+        profiler_timeline_open[i] = -1;
+        TimelineRing *r = profiler_timeline_rings[i];
+        if (r) {
+            r->tail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            r->claim_type = -1;
+            r->func = kTimelineNoFunc;
+        }
+    }
+}
+
+// Add an event to the timeline, growing it if need be.
+WEAK void append_timeline_event(uint64_t start, uint64_t end, int func, int slot, int kind) {
+    if (profiler_timeline_size == profiler_timeline_capacity) {
+        int capacity = profiler_timeline_capacity ? profiler_timeline_capacity * 2 : 1024;
+        ProfilerTimelineEvent *events = NULL;
+        if (capacity <= kMaxProfilerTimelineEvents) {
+            events = (ProfilerTimelineEvent *)malloc(capacity * sizeof(ProfilerTimelineEvent));
+        }
+        if (!events) {
+            profiler_timeline_dropped++;
+            return;
+        }
+        if (profiler_timeline) {
+            memcpy(events, profiler_timeline, profiler_timeline_size * sizeof(ProfilerTimelineEvent));
+            free(profiler_timeline);
+        }
+        profiler_timeline = events;
+        profiler_timeline_capacity = capacity;
+    }
+    ProfilerTimelineEvent *e = profiler_timeline + profiler_timeline_size++;
+    e->start = start;
+    e->end = end;
+    e->func = func;
+    e->slot = slot;
+    e->kind = kind;
+}
+
+WEAK void log_timeline_ring_event(TimelineRing *r, int type, int func) {
+    uint64_t head = r->head;
+    TimelineRingEvent *e = r->events + (head & (kTimelineRingSize - 1));
+    e->time = halide_current_time_ns(NULL);
+    e->type = type;
+    e->func = func;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+WEAK void process_timeline_ring_event(int slot, TimelineRing *r, const TimelineRingEvent &e) {
+    // Every event ends whatever the slot was running.
+    if (r->func >= 0) {
+        append_timeline_event(r->func_start, e.time, r->func, slot, kTimelineFunc);
+    } else if (r->func == halide_profiler_outside_of_halide) {
+        append_timeline_event(r->func_start, e.time, r->token, slot, kTimelineWait);
+    }
+    r->func = kTimelineNoFunc;
+
+    if (e.type == kRingClaimPipeline || e.type == kRingClaimTask) {
+        r->claim_type = e.type;
+        r->token = e.func;
+        r->claim_start = e.time;
+    } else if (e.type == kRingSetFunc) {
+        if (r->claim_type >= 0) {
+            r->func = e.func;
+            r->func_start = e.time;
+        }
+    } else if (r->claim_type >= 0) {
+        append_timeline_event(r->claim_start, e.time, r->token, slot,
+                              r->claim_type == kRingClaimTask ? kTimelineTask : kTimelinePipeline);
+        r->claim_type = -1;
+    }
+}
+
+WEAK void drain_timeline_ring(int slot, TimelineRing *r) {
+    const int chunk = 256;
+    TimelineRingEvent events[chunk];
+    while (1) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head - r->tail > (uint64_t)kTimelineRingSize) {
+            // The slot has overwritten events that weren't drained
+            // yet, so what it was running is unknown.
+            profiler_timeline_dropped += head - kTimelineRingSize - r->tail;
+            r->tail = head - kTimelineRingSize;
+            r->claim_type = -1;
+            r->func = kTimelineNoFunc;
+        }
+        uint64_t n = head - r->tail;
+        if (n == 0) {
+            break;
+        } else if (n > (uint64_t)chunk) {
+            n = chunk;
+        }
+        for (uint64_t k = 0; k < n; k++) {
+            events[k] = r->events[(r->tail + k) & (kTimelineRingSize - 1)];
+        }
+        // The slot may have overwritten some of those while they were
+        // being copied, including the entry it is writing right now.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t skip = 0;
+        if (head + 1 > r->tail + kTimelineRingSize) {
+            skip = min(n, head + 1 - kTimelineRingSize - r->tail);
+            profiler_timeline_dropped += skip;
+            r->claim_type = -1;
+            r->func = kTimelineNoFunc;
+        }
+        for (uint64_t k = skip; k < n; k++) {
+            process_timeline_ring_event(slot, r, events[k]);
+        }
+        r->tail += n;
+    }
+}
+
+// Must be called with the profiler state's lock held.
+WEAK void drain_timeline_rings() {
+    if (!__atomic_load_n(&profiler_timeline_rings_used, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    int num_slots = __atomic_load_n(&num_profiler_thread_slots, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_slots; i++) {
+        TimelineRing *r = __atomic_load_n(&profiler_timeline_rings[i], __ATOMIC_ACQUIRE);
+        if (r) {
+            drain_timeline_ring(i, r);
+        }
+    }
+}
+
 WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipeline_name, int num_funcs, const uint64_t *func_names) {
     halide_profiler_state *s = halide_profiler_get_state();
 
@@ -38,7 +284,9 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
     p->num_funcs = num_funcs;
     p->runs = 0;
     p->time = 0;
+    p->cpu_time = 0;
     p->samples = 0;
+    p->max_threads = 0;
     p->memory_current = 0;
     p->memory_peak = 0;
     p->memory_total = 0;
@@ -52,6 +300,11 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
     }
     for (int i = 0; i < num_funcs; i++) {
         p->funcs[i].time = 0;
+        p->funcs[i].cpu_time = 0;
+        p->funcs[i].cycles = 0;
+        p->funcs[i].instructions = 0;
+        p->funcs[i].cache_misses = 0;
+        p->funcs[i].branch_misses = 0;
         p->funcs[i].name = (const char *)(func_names[i]);
         p->funcs[i].memory_current = 0;
         p->funcs[i].memory_peak = 0;
@@ -60,13 +313,18 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
         p->funcs[i].stack_peak = 0;
         p->funcs[i].active_threads_numerator = 0;
         p->funcs[i].active_threads_denominator = 0;
+        p->funcs[i].memoize_hits = 0;
+        p->funcs[i].memoize_misses = 0;
+        p->funcs[i].bytes_read = 0;
+        p->funcs[i].bytes_written = 0;
+        p->funcs[i].ops = 0;
     }
     s->first_free_id += num_funcs;
     s->pipelines = p;
     return p;
 }
 
-WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time, int active_threads) {
+WEAK halide_profiler_pipeline_stats *find_pipeline(halide_profiler_state *s, int func_id) {
     halide_profiler_pipeline_stats *p_prev = NULL;
     for (halide_profiler_pipeline_stats *p = s->pipelines; p;
          p = (halide_profiler_pipeline_stats *)(p->next)) {
@@ -77,19 +335,349 @@ WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time, int ac
                 p->next = s->pipelines;
                 s->pipelines = p;
             }
-            halide_profiler_func_stats *f = p->funcs + func_id - p->first_func_id;
-            f->time += time;
-            f->active_threads_numerator += active_threads;
-            f->active_threads_denominator += 1;
-            p->time += time;
-            p->samples++;
-            p->active_threads_numerator += active_threads;
-            p->active_threads_denominator += 1;
-            return;
+            return p;
         }
         p_prev = p;
     }
-    // Someone must have called reset_state while a kernel was running. Do nothing.
+    // Someone must have called reset_state while a kernel was running.
+    return NULL;
+}
+
+WEAK void bill_pipeline(halide_profiler_pipeline_stats *p, uint64_t time, int threads) {
+    p->time += time;
+    p->cpu_time += time * threads;
+    p->samples++;
+    p->active_threads_numerator += threads;
+    p->active_threads_denominator += 1;
+    if (threads > p->max_threads) {
+        p->max_threads = threads;
+    }
+}
+
+// Bill a sample of remote execution, which only reports one Func.
+WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time, int active_threads) {
+    halide_profiler_pipeline_stats *p = find_pipeline(s, func_id);
+    if (p) {
+        halide_profiler_func_stats *f = p->funcs + func_id - p->first_func_id;
+        f->time += time;
+        f->cpu_time += time * active_threads;
+        f->active_threads_numerator += active_threads;
+        f->active_threads_denominator += 1;
+        bill_pipeline(p, time, active_threads);
+    }
+}
+
+// Bill a sample of the host threads to the Funcs they are running.
+WEAK void bill_threads(halide_profiler_state *s, uint64_t time) {
+    // Count the threads running each Func, and remember which Func
+    // each thread's counters should be billed to.
+    int funcs[kMaxProfilerThreadSlots];
+    int threads[kMaxProfilerThreadSlots];
+    halide_profiler_pipeline_stats *pipelines[kMaxProfilerThreadSlots];
+    int counters[kMaxProfilerThreadSlots];
+    int counted_funcs[kMaxProfilerThreadSlots];
+    int num_funcs = 0, num_counted = 0;
+    int num_slots = __atomic_load_n(&num_profiler_thread_slots, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_slots; i++) {
+        int func = __atomic_load_n(&profiler_thread_slots[i], __ATOMIC_ACQUIRE);
+        if (func < 0) {
+            continue;
+        }
+        int j = 0;
+        while (j < num_funcs && funcs[j] != func) {
+            j++;
+        }
+        if (j == num_funcs) {
+            funcs[j] = func;
+            threads[j] = 0;
+            num_funcs++;
+        }
+        threads[j]++;
+        int c = __atomic_load_n(&profiler_thread_slot_counters[i], __ATOMIC_RELAXED);
+        if (c >= 0) {
+            counters[num_counted] = c;
+            counted_funcs[num_counted] = j;
+            num_counted++;
+        }
+    }
+
+    for (int j = 0; j < num_funcs; j++) {
+        pipelines[j] = find_pipeline(s, funcs[j]);
+    }
+
+    for (int j = 0; j < num_funcs; j++) {
+        halide_profiler_pipeline_stats *p = pipelines[j];
+        if (!p) {
+            continue;
+        }
+        int pipeline_threads = 0;
+        bool first = true;
+        for (int k = 0; k < num_funcs; k++) {
+            if (pipelines[k] == p) {
+                pipeline_threads += threads[k];
+                first = first && k >= j;
+            }
+        }
+
+        // Split the pipeline's time between the Funcs it is running
+        // in proportion to their threads, so that the times of its
+        // Funcs add up to the time of the pipeline.
+        halide_profiler_func_stats *f = p->funcs + funcs[j] - p->first_func_id;
+        f->time += time * threads[j] / pipeline_threads;
+        f->cpu_time += time * threads[j];
+        f->active_threads_numerator += threads[j];
+        f->active_threads_denominator += 1;
+
+        if (first) {
+            bill_pipeline(p, time, pipeline_threads);
+        }
+    }
+
+    // Read the counters of every thread, including idle ones, so that
+    // events while idle aren't billed to the next Func a thread runs.
+    int num_counters = profiler_counters_read_all(profiler_counter_deltas, kMaxProfilerThreadSlots);
+    for (int k = 0; k < num_counted; k++) {
+        int j = counted_funcs[k];
+        int c = counters[k];
+        if (!pipelines[j] || c >= num_counters) {
+            continue;
+        }
+        halide_profiler_func_stats *f = pipelines[j]->funcs + funcs[j] - pipelines[j]->first_func_id;
+        uint64_t *delta = profiler_counter_deltas[c];
+        f->cycles += delta[0];
+        f->instructions += delta[1];
+        f->cache_misses += delta[2];
+        f->branch_misses += delta[3];
+        // Don't bill a thread twice if it shows up in two slots.
+        memset(delta, 0, sizeof(profiler_counter_deltas[c]));
+    }
+}
+
+// Extend the timeline with a sample of the host threads taken at
+// t_now, the last one having been taken at t. Slots with a ring log
+// their own events instead.
+WEAK void record_timeline(uint64_t t, uint64_t t_now) {
+    int num_slots = __atomic_load_n(&num_profiler_thread_slots, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_slots; i++) {
+        int func = __atomic_load_n(&profiler_thread_slots[i], __ATOMIC_ACQUIRE);
+        int open = profiler_timeline_open[i];
+        if (open >= 0 &&
+            profiler_timeline[open].func == func &&
+            profiler_timeline[open].end == t) {
+            profiler_timeline[open].end = t_now;
+            continue;
+        }
+        profiler_timeline_open[i] = -1;
+        if (func < 0 || __atomic_load_n(&profiler_timeline_rings[i], __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        int size = profiler_timeline_size;
+        append_timeline_event(t, t_now, func, i, kTimelineFunc);
+        if (profiler_timeline_size > size) {
+            profiler_timeline_open[i] = size;
+        }
+    }
+}
+
+// Like find_pipeline, but leaves the list of pipelines alone.
+WEAK halide_profiler_func_stats *find_func(halide_profiler_state *s, int func_id,
+                                           halide_profiler_pipeline_stats **pipeline) {
+    for (halide_profiler_pipeline_stats *p = s->pipelines; p;
+         p = (halide_profiler_pipeline_stats *)(p->next)) {
+        if (func_id >= p->first_func_id && func_id < p->first_func_id + p->num_funcs) {
+            *pipeline = p;
+            return p->funcs + func_id - p->first_func_id;
+        }
+    }
+    return NULL;
+}
+
+// Append a string to a printer as a quoted JSON string.
+template<typename T>
+void print_json_string(T &sstr, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    char c[7] = {0};
+    sstr << "\"";
+    for (; *str; str++) {
+        unsigned char ch = (unsigned char)*str;
+        if (ch == '"' || ch == '\\') {
+            c[0] = '\\';
+            c[1] = ch;
+            c[2] = 0;
+        } else if (ch < 0x20) {
+            c[0] = '\\';
+            c[1] = 'u';
+            c[2] = '0';
+            c[3] = '0';
+            c[4] = hex[ch >> 4];
+            c[5] = hex[ch & 15];
+            c[6] = 0;
+        } else {
+            c[0] = ch;
+            c[1] = 0;
+        }
+        sstr << c;
+    }
+    sstr << "\"";
+}
+
+// Write the contents of a printer to a file and clear it. Returns
+// false if the write failed.
+template<typename T>
+bool flush_to_file(T &sstr, void *f) {
+    uint64_t size = sstr.size();
+    bool ok = size == 0 || fwrite(sstr.str(), size, 1, f) == 1;
+    sstr.clear();
+    return ok;
+}
+
+WEAK int write_json_unlocked(void *user_context, halide_profiler_state *s, const char *filename) {
+    void *f = fopen(filename, "wb");
+    if (!f) {
+        error(user_context) << "Failed to open profiler json file " << filename << "\n";
+        return halide_error_code_generic_error;
+    }
+
+    char line_buf[4096];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
+    bool ok = true;
+
+    // All times are in nanoseconds, and are totals over all runs.
+    sstr << "{\n  \"pipelines\": [";
+    bool first_pipeline = true;
+    for (halide_profiler_pipeline_stats *p = s->pipelines; p;
+         p = (halide_profiler_pipeline_stats *)(p->next)) {
+        if (!p->runs) continue;
+        sstr << (first_pipeline ? "\n" : ",\n") << "    {\"name\": ";
+        print_json_string(sstr, p->name);
+        sstr << ", \"runs\": " << p->runs
+             << ", \"time_ns\": " << p->time
+             << ", \"cpu_time_ns\": " << p->cpu_time
+             << ", \"samples\": " << p->samples
+             << ", \"average_threads\": "
+             << (double)p->active_threads_numerator / (p->active_threads_denominator + 1e-10)
+             << ", \"max_threads\": " << p->max_threads
+             << ", \"num_allocs\": " << p->num_allocs
+             << ", \"memory_peak\": " << p->memory_peak
+             << ", \"memory_total\": " << p->memory_total
+             << ",\n     \"funcs\": [";
+        first_pipeline = false;
+        ok = ok && flush_to_file(sstr, f);
+        for (int i = 0; i < p->num_funcs; i++) {
+            halide_profiler_func_stats *fs = p->funcs + i;
+            sstr << (i == 0 ? "\n" : ",\n") << "      {\"name\": ";
+            print_json_string(sstr, fs->name);
+            sstr << ", \"time_ns\": " << fs->time
+                 << ", \"cpu_time_ns\": " << fs->cpu_time
+                 << ", \"average_threads\": "
+                 << (double)fs->active_threads_numerator / (fs->active_threads_denominator + 1e-10)
+                 << ", \"num_allocs\": " << fs->num_allocs
+                 << ", \"memory_peak\": " << fs->memory_peak
+                 << ", \"memory_total\": " << fs->memory_total
+                 << ", \"stack_peak\": " << fs->stack_peak
+                 << ", \"memoize_hits\": " << fs->memoize_hits
+                 << ", \"memoize_misses\": " << fs->memoize_misses
+                 << ", \"cycles\": " << fs->cycles
+                 << ", \"instructions\": " << fs->instructions
+                 << ", \"cache_misses\": " << fs->cache_misses
+                 << ", \"branch_misses\": " << fs->branch_misses
+                 << ", \"bytes_read\": " << fs->bytes_read
+                 << ", \"bytes_written\": " << fs->bytes_written
+                 << ", \"ops\": " << fs->ops
+                 << "}";
+            ok = ok && flush_to_file(sstr, f);
+        }
+        sstr << "]}";
+    }
+    sstr << "],\n";
+
+    halide_huge_page_stats_t huge_pages;
+    halide_huge_page_get_stats(&huge_pages);
+    sstr << "  \"huge_pages\": {\"mapped\": " << huge_pages.mapped
+         << ", \"reused\": " << huge_pages.reused
+         << ", \"mapped_bytes\": " << huge_pages.mapped_bytes
+         << ", \"unmapped_bytes\": " << huge_pages.unmapped_bytes
+         << ", \"in_use_bytes\": " << huge_pages.in_use_bytes
+         << ", \"peak_in_use_bytes\": " << huge_pages.peak_in_use_bytes
+         << ", \"cached_bytes\": " << huge_pages.cached_bytes << "},\n";
+
+    halide_thread_pool_stats_t pool;
+    halide_thread_pool_get_stats(NULL, &pool);
+    sstr << "  \"thread_pool\": {\"jobs\": " << pool.jobs
+         << ", \"tasks\": " << pool.tasks
+         << ", \"chunks\": " << pool.chunks
+         << ", \"max_chunk_size\": " << pool.max_chunk_size
+         << ", \"jobs_helped\": " << pool.jobs_helped
+         << ", \"total_join_latency_ns\": " << pool.total_join_latency
+         << ", \"max_join_latency_ns\": " << pool.max_join_latency
+         << ", \"workers\": " << pool.workers
+         << ", \"idle_time_ns\": " << pool.idle_time
+         << ", \"sleep_time_ns\": " << pool.sleep_time
+         << ", \"owner_wait_time_ns\": " << pool.owner_wait_time
+         << ", \"b_team_transitions\": " << pool.b_team_transitions << "}\n}\n";
+    ok = ok && flush_to_file(sstr, f);
+
+    fclose(f);
+    if (!ok) {
+        error(user_context) << "Failed to write profiler json file " << filename << "\n";
+        return halide_error_code_generic_error;
+    }
+    return 0;
+}
+
+WEAK int write_trace_unlocked(void *user_context, halide_profiler_state *s, const char *filename) {
+    void *f = fopen(filename, "wb");
+    if (!f) {
+        error(user_context) << "Failed to open profiler trace file " << filename << "\n";
+        return halide_error_code_generic_error;
+    }
+
+    char line_buf[1024];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
+    bool ok = true;
+
+    // The Chrome trace event format, with one complete event per
+    // timeline event, shown as a thread per slot. Times are in
+    // microseconds.
+    sstr << "{\"traceEvents\": [";
+    bool first_event = true;
+    for (int i = 0; i < profiler_timeline_size; i++) {
+        const ProfilerTimelineEvent *e = profiler_timeline + i;
+        halide_profiler_pipeline_stats *p;
+        halide_profiler_func_stats *fs = find_func(s, e->func, &p);
+        if (!fs) continue;
+        sstr << (first_event ? "\n" : ",\n") << "{\"name\": ";
+        if (e->kind == kTimelineFunc) {
+            print_json_string(sstr, fs->name);
+        } else if (e->kind == kTimelineWait) {
+            sstr << "\"wait\"";
+        } else if (e->kind == kTimelineTask) {
+            sstr << "\"task\"";
+        } else {
+            print_json_string(sstr, p->name);
+        }
+        sstr << ", \"cat\": ";
+        if (e->kind == kTimelinePipeline) {
+            sstr << "\"pipeline\"";
+        } else {
+            print_json_string(sstr, p->name);
+        }
+        sstr << ", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e->slot
+             << ", \"ts\": " << e->start / 1000.0
+             << ", \"dur\": " << (e->end - e->start) / 1000.0 << "}";
+        first_event = false;
+        ok = ok && flush_to_file(sstr, f);
+    }
+    sstr << "\n],\n\"displayTimeUnit\": \"ms\",\n"
+         << "\"otherData\": {\"dropped_events\": " << profiler_timeline_dropped << "}}\n";
+    ok = ok && flush_to_file(sstr, f);
+
+    fclose(f);
+    if (!ok) {
+        error(user_context) << "Failed to write profiler trace file " << filename << "\n";
+        return halide_error_code_generic_error;
+    }
+    return 0;
 }
 
 WEAK void sampling_profiler_thread(void *) {
@@ -104,23 +692,29 @@ WEAK void sampling_profiler_thread(void *) {
         uint64_t t = t1;
         while (1) {
             int func, active_threads;
-            if (s->get_remote_profiler_state) {
+            bool remote = s->get_remote_profiler_state != NULL;
+            if (remote) {
                 // Execution has disappeared into remote code running
                 // on an accelerator (e.g. Hexagon DSP)
                 s->get_remote_profiler_state(&func, &active_threads);
             } else {
                 func = s->current_func;
-                active_threads = s->active_threads;
             }
             uint64_t t_now = halide_current_time_ns(NULL);
             if (func == halide_profiler_please_stop) {
                 break;
-            } else if (func >= 0) {
+            } else if (!remote) {
                 // Assume all time since I was last awake is due to
-                // the currently running func.
+                // the Funcs the threads are running now.
+                bill_threads(s, t_now - t);
+                if (profiler_timeline_mode > 0) {
+                    record_timeline(t, t_now);
+                }
+            } else if (func >= 0) {
                 bill_func(s, func, t_now - t, active_threads);
             }
             t = t_now;
+            drain_timeline_rings();
 
             // Release the lock, sleep, reacquire.
             int sleep_ms = s->sleep_time;
@@ -180,12 +774,31 @@ WEAK int halide_profiler_pipeline_start(void *user_context,
 
     ScopedMutexLock lock(&s->lock);
 
+    if (!profiler_thread_slots_initialized) {
+        for (int i = 0; i < kMaxProfilerThreadSlots; i++) {
+            profiler_thread_slots[i] = kProfilerThreadSlotFree;
+        }
+        reset_timeline();
+        if (profiler_timeline_mode < 0) {
+            const char *var = getenv("HL_PROFILER_TRACE");
+            profiler_timeline_mode = (var && *var) ? 1 : 0;
+        }
+        profiler_thread_slots_initialized = true;
+    }
+
     if (!s->started) {
         halide_start_clock(user_context);
         halide_spawn_thread(sampling_profiler_thread, NULL);
         s->started = true;
     }
 
+    // Also time how long the thread pool spends waiting, for the
+    // report. halide_profiler_pipeline_end is called even if this
+    // call fails below.
+    if (profiler_pipelines_running++ == 0) {
+        profiler_old_thread_pool_stats = halide_set_thread_pool_stats(1);
+    }
+
     halide_profiler_pipeline_stats *p =
         find_or_create_pipeline(pipeline_name, num_funcs, func_names);
     if (!p) {
@@ -197,6 +810,74 @@ WEAK int halide_profiler_pipeline_start(void *user_context,
     return p->first_func_id;
 }
 
+WEAK int *halide_profiler_acquire_thread_slot(void *user_context) {
+    int start = current_thread_slot(kMaxProfilerThreadSlotsLog2);
+    for (int j = 0; j < kMaxProfilerThreadSlots; j++) {
+        int i = (start + j) % kMaxProfilerThreadSlots;
+        if (__sync_bool_compare_and_swap(&profiler_thread_slots[i], kProfilerThreadSlotFree,
+                                         halide_profiler_outside_of_halide)) {
+            __atomic_store_n(&profiler_thread_slot_counters[i], profiler_counters_open_thread(), __ATOMIC_RELAXED);
+            sync_compare_max_and_swap(&num_profiler_thread_slots, i + 1);
+            return &profiler_thread_slots[i];
+        }
+    }
+    // More threads are running pipelines than there are slots. Time
+    // spent on this one goes unbilled.
+    return &overflow_profiler_thread_slot;
+}
+
+WEAK void halide_profiler_release_thread_slot(void *user_context, void *slot) {
+    if (slot != &overflow_profiler_thread_slot) {
+        __atomic_store_n((int *)slot, kProfilerThreadSlotFree, __ATOMIC_RELEASE);
+    }
+}
+
+WEAK int *halide_profiler_timeline_acquire_thread_slot(void *user_context, int token, int is_task) {
+    int *slot = halide_profiler_acquire_thread_slot(user_context);
+    if (slot == &overflow_profiler_thread_slot) {
+        return slot;
+    }
+    int i = (int)(slot - profiler_thread_slots);
+    TimelineRing *r = profiler_timeline_rings[i];
+    if (!r) {
+        // Only the thread that claimed the slot creates its ring.
+        r = (TimelineRing *)malloc(sizeof(TimelineRing));
+        if (!r) {
+            return slot;
+        }
+        r->head = 0;
+        r->tail = 0;
+        r->claim_type = -1;
+        r->func = kTimelineNoFunc;
+        __atomic_store_n(&profiler_timeline_rings[i], r, __ATOMIC_RELEASE);
+        __atomic_store_n(&profiler_timeline_rings_used, true, __ATOMIC_RELEASE);
+    }
+    log_timeline_ring_event(r, is_task ? kRingClaimTask : kRingClaimPipeline, token);
+    return slot;
+}
+
+WEAK int halide_profiler_timeline_set_thread_func(int *slot, int func) {
+    *(volatile int *)slot = func;
+    if (slot != &overflow_profiler_thread_slot) {
+        TimelineRing *r = profiler_timeline_rings[slot - profiler_thread_slots];
+        if (r) {
+            log_timeline_ring_event(r, kRingSetFunc, func);
+        }
+    }
+    return 0;
+}
+
+WEAK void halide_profiler_timeline_release_thread_slot(void *user_context, void *slot) {
+    // Log the release while the slot is still ours.
+    if (slot != &overflow_profiler_thread_slot) {
+        TimelineRing *r = profiler_timeline_rings[(int *)slot - profiler_thread_slots];
+        if (r) {
+            log_timeline_ring_event(r, kRingRelease, 0);
+        }
+    }
+    halide_profiler_release_thread_slot(user_context, slot);
+}
+
 WEAK void halide_profiler_stack_peak_update(void *user_context,
                                             void *pipeline_state,
                                             uint64_t *f_values) {
@@ -217,6 +898,24 @@ WEAK void halide_profiler_stack_peak_update(void *user_context,
     }
 }
 
+WEAK void halide_profiler_memory_traffic(void *user_context,
+                                         void *pipeline_state,
+                                         int func_id,
+                                         uint64_t bytes_read,
+                                         uint64_t bytes_written,
+                                         uint64_t ops) {
+    halide_profiler_pipeline_stats *p_stats = (halide_profiler_pipeline_stats *) pipeline_state;
+    halide_assert(user_context, p_stats != NULL);
+    halide_assert(user_context, func_id >= 0);
+    halide_assert(user_context, func_id < p_stats->num_funcs);
+
+    // As in halide_profiler_memory_allocate, no lock is needed.
+    halide_profiler_func_stats *f_stats = &p_stats->funcs[func_id];
+    __sync_add_and_fetch(&f_stats->bytes_read, bytes_read);
+    __sync_add_and_fetch(&f_stats->bytes_written, bytes_written);
+    __sync_add_and_fetch(&f_stats->ops, ops);
+}
+
 WEAK void halide_profiler_memory_allocate(void *user_context,
                                           void *pipeline_state,
                                           int func_id,
@@ -283,6 +982,24 @@ WEAK void halide_profiler_memory_free(void *user_context,
     __sync_sub_and_fetch(&f_stats->memory_current, decr);
 }
 
+WEAK void halide_profiler_memoization_lookup(void *user_context,
+                                             void *pipeline_state,
+                                             int func_id,
+                                             int hit) {
+    halide_profiler_pipeline_stats *p_stats = (halide_profiler_pipeline_stats *) pipeline_state;
+    halide_assert(user_context, p_stats != NULL);
+    halide_assert(user_context, func_id >= 0);
+    halide_assert(user_context, func_id < p_stats->num_funcs);
+
+    // As above, this is done without grabbing the state's lock.
+    halide_profiler_func_stats *f_stats = &p_stats->funcs[func_id];
+    if (hit) {
+        __sync_add_and_fetch(&f_stats->memoize_hits, 1);
+    } else {
+        __sync_add_and_fetch(&f_stats->memoize_misses, 1);
+    }
+}
+
 WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_state *s) {
 
     char line_buf[1024];
@@ -305,7 +1022,9 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
              << "  runs: " << p->runs
              << "  time/run: " << t / p->runs << " ms\n";
         if (!serial) {
-            sstr << " average threads used: " << threads << "\n";
+            sstr << " average threads used: " << threads
+                 << "  cpu time: " << p->cpu_time / 1000000.0f << " ms"
+                 << "  peak threads: " << p->max_threads << "\n";
         }
         sstr << " heap allocations: " << p->num_allocs
              << "  peak heap usage: " << p->memory_peak << " bytes\n";
@@ -315,7 +1034,7 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
         if (!print_f_states) {
             for (int i = 0; i < p->num_funcs; i++) {
                 halide_profiler_func_stats *fs = p->funcs + i;
-                if (fs->stack_peak) {
+                if (fs->stack_peak || fs->bytes_read || fs->bytes_written) {
                     print_f_states = true;
                     break;
                 }
@@ -352,8 +1071,9 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
                 cursor += 8;
                 while (sstr.size() < cursor) sstr << " ";
 
+                float threads = 0;
                 if (!serial) {
-                    float threads = fs->active_threads_numerator / (fs->active_threads_denominator + 1e-10);
+                    threads = fs->active_threads_numerator / (fs->active_threads_denominator + 1e-10);
                     sstr << "threads: " << threads;
                     sstr.erase(3);
                     cursor += 15;
@@ -377,12 +1097,127 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
                 if (fs->stack_peak > 0) {
                     sstr << " stack: " << fs->stack_peak;
                 }
+                if (!serial) {
+                    // The CPU time spent in this Func across all
+                    // threads, and how close the threads running it
+                    // came to keeping every thread the pipeline used
+                    // busy. These go after the memory columns, which
+                    // tools parse by position.
+                    sstr << " cpu: " << fs->cpu_time / (p->runs * 1000000.0f);
+                    sstr.erase(3);
+                    sstr << "ms";
+                    int efficiency = 0;
+                    if (p->max_threads > 0) {
+                        efficiency = (int)(100 * threads / p->max_threads);
+                    }
+                    sstr << " eff: " << efficiency << "%";
+                }
+                if (fs->cycles > 0 && fs->instructions > 0) {
+                    // Instructions per cycle, and last level cache
+                    // and branch misses per thousand instructions.
+                    float kinstrs = fs->instructions / 1000.0f;
+                    sstr << " ipc: " << (float)fs->instructions / fs->cycles;
+                    sstr.erase(4);
+                    sstr << " llc mpki: " << fs->cache_misses / kinstrs;
+                    sstr.erase(4);
+                    sstr << " branch mpki: " << fs->branch_misses / kinstrs;
+                    sstr.erase(4);
+                }
+                uint64_t bytes = fs->bytes_read + fs->bytes_written;
+                if (bytes > 0) {
+                    // Megabytes per run, the bandwidth achieved while
+                    // running this Func, and its arithmetic intensity
+                    // in operations per byte.
+                    sstr << " read: " << fs->bytes_read / (p->runs * 1000000.0f);
+                    sstr.erase(3);
+                    sstr << "MB write: " << fs->bytes_written / (p->runs * 1000000.0f);
+                    sstr.erase(3);
+                    sstr << "MB";
+                    if (fs->time > 0) {
+                        sstr << " GB/s: " << (float)bytes / fs->time;
+                        sstr.erase(4);
+                    }
+                    sstr << " ops/byte: " << (float)fs->ops / bytes;
+                    sstr.erase(4);
+                }
+                uint64_t lookups = fs->memoize_hits + fs->memoize_misses;
+                if (lookups > 0) {
+                    sstr << " memoize hits: " << fs->memoize_hits << "/" << lookups;
+                }
                 sstr << "\n";
 
                 halide_print(user_context, sstr.str());
             }
         }
     }
+
+    // Report the large blocks mapped in huge page mode, and how often
+    // freed ones were reused instead of mapping and faulting in new
+    // memory.
+    halide_huge_page_stats_t huge_pages;
+    halide_huge_page_get_stats(&huge_pages);
+    if (huge_pages.mapped) {
+        sstr.clear();
+        sstr << "huge pages\n"
+             << " regions mapped: " << huge_pages.mapped
+             << "  reused: " << huge_pages.reused
+             << "  mapped: " << huge_pages.mapped_bytes << " bytes"
+             << "  unmapped: " << huge_pages.unmapped_bytes << " bytes\n"
+             << " in use: " << huge_pages.in_use_bytes << " bytes"
+             << "  peak in use: " << huge_pages.peak_in_use_bytes << " bytes"
+             << "  cached: " << huge_pages.cached_bytes << " bytes\n";
+        halide_print(user_context, sstr.str());
+    }
+
+    // Report how the thread pool split parallel loops up into chunks
+    // of tasks, and how much time its threads spent waiting rather
+    // than running tasks. The chunk sizes are chosen adaptively, so
+    // this shows whether tasks were cheap enough to be worth
+    // batching. Long join latencies or owner waits with lots of idle
+    // time mean parallel loops are too short or too unbalanced to
+    // keep the pool busy.
+    halide_thread_pool_stats_t pool;
+    halide_thread_pool_get_stats(NULL, &pool);
+    if (pool.chunks) {
+        sstr.clear();
+        sstr << "thread pool\n"
+             << " jobs: " << pool.jobs
+             << "  tasks: " << pool.tasks
+             << "  chunks: " << pool.chunks
+             << "  average chunk size: " << (float)((double)pool.tasks / pool.chunks)
+             << "  max chunk size: " << pool.max_chunk_size << "\n";
+        if (pool.jobs_helped) {
+            sstr << " jobs helped: " << pool.jobs_helped
+                 << "  average join latency: "
+                 << (float)(pool.total_join_latency / (pool.jobs_helped * 1000.0)) << "us"
+                 << "  max join latency: " << (float)(pool.max_join_latency / 1000.0) << "us\n";
+        }
+        sstr << " workers: " << pool.workers
+             << "  idle: " << (float)(pool.idle_time / 1000000.0) << "ms"
+             << "  asleep: " << (float)(pool.sleep_time / 1000000.0) << "ms"
+             << "  owner wait: " << (float)(pool.owner_wait_time / 1000000.0) << "ms"
+             << "  b team transitions: " << pool.b_team_transitions << "\n";
+        halide_print(user_context, sstr.str());
+
+        // Tasks run per thread, eight to a line. Thread zero is the
+        // callers of halide_do_par_for.
+        const int max_threads = 256;
+        uint64_t thread_tasks[max_threads];
+        int num_threads = halide_thread_pool_get_thread_tasks(NULL, thread_tasks, max_threads);
+        num_threads = min(num_threads, max_threads);
+        while (num_threads > 0 && thread_tasks[num_threads - 1] == 0) {
+            num_threads--;
+        }
+        for (int i = 0; i < num_threads; i += 8) {
+            sstr.clear();
+            sstr << (i == 0 ? " tasks per thread:" : "                  ");
+            for (int j = i; j < min(i + 8, num_threads); j++) {
+                sstr << " " << thread_tasks[j];
+            }
+            sstr << "\n";
+            halide_print(user_context, sstr.str());
+        }
+    }
 }
 
 WEAK void halide_profiler_report(void *user_context) {
@@ -391,6 +1226,29 @@ WEAK void halide_profiler_report(void *user_context) {
     halide_profiler_report_unlocked(user_context, s);
 }
 
+WEAK int halide_profiler_write_json(void *user_context, const char *filename) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    ScopedMutexLock lock(&s->lock);
+    return write_json_unlocked(user_context, s, filename);
+}
+
+WEAK int halide_profiler_write_trace(void *user_context, const char *filename) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    ScopedMutexLock lock(&s->lock);
+    return write_trace_unlocked(user_context, s, filename);
+}
+
+WEAK int halide_profiler_record_timeline(int enabled) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    ScopedMutexLock lock(&s->lock);
+    int old = profiler_timeline_mode;
+    if (old < 0) {
+        const char *var = getenv("HL_PROFILER_TRACE");
+        old = (var && *var) ? 1 : 0;
+    }
+    profiler_timeline_mode = enabled ? 1 : 0;
+    return old;
+}
 
 WEAK void halide_profiler_reset() {
     // WARNING: Do not call this method while any other halide
@@ -408,6 +1266,9 @@ WEAK void halide_profiler_reset() {
         free(p);
     }
     s->first_free_id = 0;
+    reset_timeline();
+
+    halide_thread_pool_reset_stats(NULL);
 }
 
 namespace {
@@ -426,6 +1287,19 @@ WEAK void halide_profiler_shutdown() {
     // down the thread.
     halide_profiler_report_unlocked(NULL, s);
 
+    // Also write the stats and the timeline to files, if asked to,
+    // unless everything has been reset since (e.g. by the JIT, which
+    // writes them after each run), so as not to clobber them.
+    drain_timeline_rings();
+    const char *json_file = getenv("HL_PROFILER_JSON");
+    if (json_file && *json_file && s->pipelines) {
+        write_json_unlocked(NULL, s, json_file);
+    }
+    const char *trace_file = getenv("HL_PROFILER_TRACE");
+    if (trace_file && *trace_file && s->pipelines) {
+        write_trace_unlocked(NULL, s, trace_file);
+    }
+
     // Leak the memory. Not all implementations of ScopedMutexLock may
     // be safe to use at static destruction time (windows).
     // halide_profiler_reset();
@@ -433,7 +1307,15 @@ WEAK void halide_profiler_shutdown() {
 }
 
 WEAK void halide_profiler_pipeline_end(void *user_context, void *state) {
-    ((halide_profiler_state *)state)->current_func = halide_profiler_outside_of_halide;
+    halide_profiler_state *s = (halide_profiler_state *)state;
+    s->current_func = halide_profiler_outside_of_halide;
+    ScopedMutexLock lock(&s->lock);
+    if (--profiler_pipelines_running == 0) {
+        halide_set_thread_pool_stats(profiler_old_thread_pool_stats);
+    }
+    if (__atomic_load_n(&profiler_timeline_rings_used, __ATOMIC_ACQUIRE)) {
+        drain_timeline_rings();
+    }
 }
 
 } // extern "C"
@@ -12,6 +12,15 @@ WEAK __attribute__((always_inline)) int halide_profiler_set_current_func(halide_
     return 0;
 }
 
+WEAK __attribute__((always_inline)) int halide_profiler_set_thread_func(int *slot, int func) {
+    // As above. Only this thread writes to its slot.
+    volatile int *ptr = slot;
+    asm volatile ("":::);
+    *ptr = func;
+    asm volatile ("":::);
+    return 0;
+}
+
 WEAK __attribute__((always_inline)) int halide_profiler_incr_active_threads(halide_profiler_state *state) {
     volatile int *ptr = &(state->active_threads);
     asm volatile ("":::);
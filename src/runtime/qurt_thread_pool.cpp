@@ -81,10 +81,42 @@ WEAK void halide_cond_broadcast(struct halide_cond *cond) {
     qurt_cond_broadcast((qurt_cond_t *)cond);
 }
 
+WEAK void halide_cond_signal(struct halide_cond *cond) {
+    qurt_cond_signal((qurt_cond_t *)cond);
+}
+
 WEAK void halide_cond_wait(struct halide_cond *cond, struct halide_mutex *mutex) {
     qurt_cond_wait((qurt_cond_t *)cond, (qurt_mutex_t *)mutex);
 }
 
+WEAK int halide_get_cpu_order(int *cpus, int max_cpus) {
+    int count = halide_host_cpu_count();
+    if (count > max_cpus) {
+        count = max_cpus;
+    }
+    for (int i = 0; i < count; i++) {
+        cpus[i] = i;
+    }
+    return count;
+}
+
+WEAK int halide_set_current_thread_cpu(int cpu) {
+    // Pinning threads to hardware threads is not supported on QuRT.
+    return -1;
+}
+
+WEAK void halide_thread_yield() {
+    // QuRT threads run until they block, so there's nothing useful
+    // to do here. Spinning is bounded anyway.
+}
+
+WEAK int halide_set_current_thread_priority(int priority) {
+    // Worker threads are spawned at a fixed priority on QuRT.
+    return -1;
+}
+
+// There's no clock in the QuRT runtime, so claim tasks one at a time.
+#define HALIDE_THREAD_POOL_HAS_CLOCK 0
 #include "thread_pool_common.h"
 
 namespace {
@@ -98,6 +130,10 @@ struct wrapped_closure {
 
 extern "C" {
 
+WEAK int halide_current_thread_id() {
+    // No thread-specific storage is used on Hexagon.
+    return -1;
+}
 
 // There are two locks at play: the thread pool lock and the hvx
 // context lock. To ensure there's no way anything could ever
@@ -107,8 +143,9 @@ WEAK int halide_do_par_for(void *user_context,
                            halide_task_t task,
                            int min, int size, uint8_t *closure) {
     // Get the work queue mutex. We need to do a handful of hexagon-specific things.
-    qurt_mutex_t *mutex = (qurt_mutex_t *)(&work_queue.mutex);
-    if (!work_queue.initialized) {
+    work_queue_t *queue = find_work_queue(user_context);
+    qurt_mutex_t *mutex = (qurt_mutex_t *)(&queue->mutex);
+    if (!queue->initialized) {
         // The thread pool asssumes that a zero-initialized mutex can
         // be locked. Not true on hexagon, and there doesn't seem to
         // be an init_once mechanism either. In this shim binary, it's
@@ -174,6 +211,7 @@ WEAK int halide_do_task(void *user_context, halide_task_t f,
 namespace {
 __attribute__((destructor))
 WEAK void halide_thread_pool_cleanup() {
+    work_queue_destroyed = true;
     halide_shutdown_thread_pool();
 }
 }
@@ -21,6 +21,7 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_cond_broadcast,
     (void *)&halide_cond_destroy,
     (void *)&halide_cond_init,
+    (void *)&halide_cond_signal,
     (void *)&halide_cond_wait,
     (void *)&halide_copy_to_device,
     (void *)&halide_copy_to_device_legacy,
@@ -78,6 +79,7 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_error_param_too_small_i64,
     (void *)&halide_error_param_too_small_u64,
     (void *)&halide_error_requirement_failed,
+    (void *)&halide_error_scratch_too_small,
     (void *)&halide_error_specialize_fail,
     (void *)&halide_error_unaligned_host_ptr,
     (void *)&halide_float16_bits_to_double,
@@ -101,14 +103,25 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_hexagon_set_performance,
     (void *)&halide_hexagon_set_performance_mode,
     (void *)&halide_hexagon_wrap_device_handle,
+    (void *)&halide_huge_page_get_stats,
+    (void *)&halide_huge_page_trim,
     (void *)&halide_int64_to_string,
     (void *)&halide_join_thread,
     (void *)&halide_load_library,
     (void *)&halide_malloc,
+    (void *)&halide_malloc_pool_trim,
     (void *)&halide_matlab_call_pipeline,
     (void *)&halide_memoization_cache_cleanup,
+    (void *)&halide_memoization_cache_get_partition_stats,
+    (void *)&halide_memoization_cache_get_stats,
     (void *)&halide_memoization_cache_lookup,
+    (void *)&halide_memoization_cache_lookup_crop,
+    (void *)&halide_memoization_cache_lookup_in_partition,
     (void *)&halide_memoization_cache_release,
+    (void *)&halide_memoization_cache_reset_stats,
+    (void *)&halide_memoization_cache_set_disk_tier,
+    (void *)&halide_memoization_cache_set_eviction_policy,
+    (void *)&halide_memoization_cache_set_partition_size,
     (void *)&halide_memoization_cache_set_size,
     (void *)&halide_memoization_cache_store,
     (void *)&halide_metal_acquire_context,
@@ -149,19 +162,37 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_openglcompute_initialize_kernels,
     (void *)&halide_openglcompute_run,
     (void *)&halide_pointer_to_string,
+    (void *)&halide_pooled_free,
+    (void *)&halide_pooled_malloc,
     (void *)&halide_print,
+    (void *)&halide_profiler_acquire_thread_slot,
     (void *)&halide_profiler_get_pipeline_state,
     (void *)&halide_profiler_get_state,
     (void *)&halide_profiler_memory_allocate,
     (void *)&halide_profiler_memory_free,
+    (void *)&halide_profiler_memory_traffic,
+    (void *)&halide_profiler_memoization_lookup,
     (void *)&halide_profiler_pipeline_start,
+    (void *)&halide_profiler_record_timeline,
+    (void *)&halide_profiler_release_thread_slot,
     (void *)&halide_profiler_report,
     (void *)&halide_profiler_reset,
+    (void *)&halide_profiler_set_counters,
     (void *)&halide_profiler_stack_peak_update,
+    (void *)&halide_profiler_timeline_acquire_thread_slot,
+    (void *)&halide_profiler_timeline_release_thread_slot,
+    (void *)&halide_profiler_timeline_set_thread_func,
+    (void *)&halide_profiler_write_json,
+    (void *)&halide_profiler_write_trace,
     (void *)&halide_qurt_hvx_lock,
     (void *)&halide_qurt_hvx_unlock,
     (void *)&halide_qurt_hvx_unlock_as_destructor,
     (void *)&halide_release_jit_module,
+    (void *)&halide_semaphore_acquire,
+    (void *)&halide_semaphore_close,
+    (void *)&halide_semaphore_init,
+    (void *)&halide_semaphore_release,
+    (void *)&halide_semaphore_try_acquire,
     (void *)&halide_set_custom_can_use_target_features,
     (void *)&halide_set_custom_do_par_for,
     (void *)&halide_set_custom_do_task,
@@ -174,7 +205,11 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_set_custom_trace,
     (void *)&halide_set_error_handler,
     (void *)&halide_set_gpu_device,
+    (void *)&halide_set_huge_page_mode,
     (void *)&halide_set_num_threads,
+    (void *)&halide_set_thread_affinity,
+    (void *)&halide_set_thread_pool_spin_count,
+    (void *)&halide_set_thread_pool_stats,
     (void *)&halide_set_trace_file,
     (void *)&halide_shutdown_thread_pool,
     (void *)&halide_shutdown_trace,
@@ -183,8 +218,21 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_start_clock,
     (void *)&halide_string_to_string,
     (void *)&halide_trace,
+    (void *)&halide_thread_pool_bind,
+    (void *)&halide_thread_pool_create,
+    (void *)&halide_thread_pool_destroy,
+    (void *)&halide_thread_pool_get_stats,
+    (void *)&halide_thread_pool_get_thread_tasks,
+    (void *)&halide_thread_pool_reset_stats,
+    (void *)&halide_trace,
     (void *)&halide_trace_helper,
     (void *)&halide_uint64_to_string,
     (void *)&halide_upgrade_buffer_t,
     (void *)&halide_use_jit_module,
+    (void *)&halide_worker_buffers_acquire,
+    (void *)&halide_worker_buffers_create,
+    (void *)&halide_worker_buffers_destroy,
+    (void *)&halide_worker_buffers_release,
+    (void *)&halide_worker_buffers_set_caching,
+    (void *)&halide_worker_buffers_trim,
 };
@@ -78,6 +78,11 @@ int fileno(void *);
 int fclose(void *);
 int close(int);
 size_t fwrite(const void *, size_t, size_t, void *);
+size_t fread(void *, size_t, size_t, void *);
+int fseek(void *, long, int);
+long ftell(void *);
+int fflush(void *);
+int rename(const char *, const char *);
 ssize_t write(int fd, const void *buf, size_t bytes);
 int remove(const char *pathname);
 int ioctl(int fd, unsigned long request, ...);
@@ -113,6 +118,17 @@ WEAK void *halide_get_library_symbol(void *lib, const char *name);
 WEAK int halide_start_clock(void *user_context);
 WEAK int64_t halide_current_time_ns(void *user_context);
 WEAK void halide_sleep_ms(void *user_context, int ms);
+// Map a whole file, opened with fopen, into memory for reading and
+// writing. Writes to a private mapping are not written back to the
+// file. Returns NULL on failure, or on platforms without mmap.
+WEAK void *halide_map_file(void *user_context, void *file, size_t size, bool shared);
+WEAK void halide_unmap_file(void *user_context, void *addr, size_t size);
+// Take or release an exclusive advisory lock on a file opened with
+// fopen, shared with other processes. Returns nonzero on failure.
+WEAK int halide_lock_file(void *user_context, void *file, bool lock);
+// Flush a file opened with fopen all the way to the disk. Returns
+// nonzero on failure.
+WEAK int halide_sync_file(void *user_context, void *file);
 WEAK void halide_device_free_as_destructor(void *user_context, void *obj);
 WEAK void halide_device_and_host_free_as_destructor(void *user_context, void *obj);
 WEAK void halide_device_host_nop_free(void *user_context, void *obj);
@@ -130,10 +146,25 @@ WEAK void halide_profiler_memory_free(void *user_context,
                                       void *pipeline_state,
                                       int func_id,
                                       uint64_t decr);
+WEAK void halide_profiler_memory_traffic(void *user_context,
+                                         void *pipeline_state,
+                                         int func_id,
+                                         uint64_t bytes_read,
+                                         uint64_t bytes_written,
+                                         uint64_t ops);
+WEAK void halide_profiler_memoization_lookup(void *user_context,
+                                             void *pipeline_state,
+                                             int func_id,
+                                             int hit);
 WEAK int halide_profiler_pipeline_start(void *user_context,
                                         const char *pipeline_name,
                                         int num_funcs,
                                         const uint64_t *func_names);
+WEAK int *halide_profiler_acquire_thread_slot(void *user_context);
+WEAK void halide_profiler_release_thread_slot(void *user_context, void *slot);
+WEAK int *halide_profiler_timeline_acquire_thread_slot(void *user_context, int token, int is_task);
+WEAK int halide_profiler_timeline_set_thread_func(int *slot, int func);
+WEAK void halide_profiler_timeline_release_thread_slot(void *user_context, void *slot);
 WEAK int halide_host_cpu_count();
 
 WEAK int halide_device_and_host_malloc(void *user_context, struct halide_buffer_t *buf,
@@ -148,6 +179,15 @@ WEAK int halide_matlab_call_pipeline(void *user_context,
                                      int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs);
 
 
+// Close a halide_semaphore_t passed as a void *, so that it can be
+// the free function of an Allocate. The task of an async producer or
+// consumer closes the semaphores it releases when it exits, whether
+// or not it succeeded. Acquiring more than is left of a closed
+// semaphore then fails instead of waiting forever. A semaphore keeps
+// its count in the low bits of an int, and this bit marks it closed.
+#define HALIDE_SEMAPHORE_CLOSED (1 << 30)
+WEAK void halide_semaphore_close(void *user_context, void *sem);
+
 // Condition variables. Only available on some platforms (those that use the common thread pool).
 struct halide_cond {
     uint64_t _private[8];
@@ -156,8 +196,49 @@ struct halide_cond {
 WEAK void halide_cond_init(struct halide_cond *cond);
 WEAK void halide_cond_destroy(struct halide_cond *cond);
 WEAK void halide_cond_broadcast(struct halide_cond *cond);
+WEAK void halide_cond_signal(struct halide_cond *cond);
 WEAK void halide_cond_wait(struct halide_cond *cond, struct halide_mutex *mutex);
 
+// Lets a background thread started with halide_spawn_thread sleep
+// until there is work for it. halide_wakeup_wait returns once
+// halide_wakeup_signal has been called since it last returned. It
+// blocks on halide_cond, or on a dispatch semaphore with Grand Central
+// Dispatch. The fake thread pool, which can't spawn threads, polls.
+struct halide_wakeup {
+    uint64_t _private[17];
+};
+
+WEAK void halide_wakeup_init(struct halide_wakeup *w);
+WEAK void halide_wakeup_destroy(struct halide_wakeup *w);
+WEAK void halide_wakeup_wait(struct halide_wakeup *w);
+WEAK void halide_wakeup_signal(struct halide_wakeup *w);
+
+// Whether halide_spawn_thread can start threads on this platform. If
+// not, calling it is an error.
+WEAK bool halide_can_spawn_threads();
+
+// A small number identifying the calling thread, for indexing
+// per-thread state. No two threads alive at the same time have the
+// same one, and the ids of threads that exit are handed out again.
+// Returns -1 where there is no thread-specific storage, or if
+// kMaxThreadIds threads already have an id.
+WEAK int halide_current_thread_id();
+
+// Thread placement. Only available on some platforms (those that use the common thread pool).
+
+// Fill cpus with the ids of up to max_cpus cores this process may run
+// on, ordered so that the cores of each NUMA node are adjacent.
+// Returns the number of ids written.
+WEAK int halide_get_cpu_order(int *cpus, int max_cpus);
+// Pin the calling thread to the given core, or undo any pinning if
+// cpu is negative. Returns zero on success.
+WEAK int halide_set_current_thread_cpu(int cpu);
+// Offer the rest of the calling thread's time slice to other threads.
+WEAK void halide_thread_yield();
+// Raise (positive) or lower (negative) the scheduling priority of the
+// calling thread relative to the default. Returns zero on success.
+WEAK int halide_set_current_thread_priority(int priority);
+
 WEAK int halide_trace_helper(void *user_context,
                              const char *func,
                              void *value, int *coords,
@@ -219,6 +300,50 @@ __attribute__((always_inline)) T reinterpret(const U &x) {
 
 extern WEAK __attribute__((always_inline)) int halide_malloc_alignment();
 
+const int kMaxThreadIds = 256;
+
+// Pick one of 2^log2_buckets pieces of per-thread state for the
+// calling thread. Threads alive at the same time get different ones
+// unless there are more of them than buckets. Without thread ids,
+// this hashes the address of the calling thread's stack instead,
+// which can put two threads in the same bucket. Thread stacks are at
+// least 64K apart, so the low bits of the address are dropped before
+// mixing the rest.
+__attribute__((always_inline)) inline int current_thread_slot(int log2_buckets) {
+    int id = halide_current_thread_id();
+    if (id >= 0) {
+        return id & ((1 << log2_buckets) - 1);
+    }
+    int on_stack;
+    uint64_t h = (uint64_t)((uintptr_t)&on_stack >> 16) * 0x9E3779B97F4A7C15ULL;
+    return (int)(h >> (64 - log2_buckets));
+}
+
+// Whether halide_default_malloc should allocate from the pool in
+// malloc_pool.cpp. Defaults to the HL_MALLOC_POOL environment
+// variable unless set_malloc_pool_default has been called.
+extern WEAK bool use_malloc_pool();
+extern WEAK void set_malloc_pool_default(bool enabled);
+
+// Allocate a block for halide_default_malloc from memory mapped
+// directly from the OS, if huge page allocation is turned on and x is
+// at least the threshold. Returns NULL otherwise, or if the mapping
+// fails. huge_page_free frees a block if it came from
+// huge_page_malloc, and returns false if it didn't.
+extern WEAK void *huge_page_malloc(void *user_context, size_t x);
+extern WEAK bool huge_page_free(void *user_context, void *ptr);
+
+// Hardware performance counters for the profiler, in the order cycles,
+// instructions, last level cache misses and branch misses.
+// profiler_counters_open_thread starts counting for the calling
+// thread if counters are turned on, and returns a handle for its
+// counters, or -1. profiler_counters_read_all fills in the change in
+// the counters of each handle since the last call, and returns the
+// number of handles.
+const int kNumProfilerCounters = 4;
+extern WEAK int profiler_counters_open_thread();
+extern WEAK int profiler_counters_read_all(uint64_t (*deltas)[kNumProfilerCounters], int max_threads);
+
 }}}
 
 using namespace Halide::Runtime::Internal;
@@ -0,0 +1,100 @@
+#ifndef HALIDE_RUNTIME_THREAD_IDS_H
+#define HALIDE_RUNTIME_THREAD_IDS_H
+
+#include "scoped_mutex_lock.h"
+
+// halide_current_thread_id, for platforms with thread-specific
+// storage. The file that includes this defines the four
+// thread_id_key_* functions over the platform's thread-specific
+// storage, with a destructor that runs when a thread exits.
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK bool thread_id_key_create(void (*destructor)(void *));
+WEAK void thread_id_key_delete();
+WEAK void *thread_id_key_get();
+WEAK bool thread_id_key_set(void *value);
+
+// Bit i of word i / 64 is set while a thread holds id i. Ids are
+// claimed lowest first, so they stay below the most threads that
+// have asked for one at the same time.
+WEAK uint64_t thread_ids_in_use[kMaxThreadIds / 64];
+
+// Held while creating or deleting the key.
+WEAK halide_mutex thread_id_key_lock;
+WEAK bool thread_id_key_created = false;
+
+// The value of the key of a thread that asked for an id when they
+// had all been taken, so that it doesn't keep asking. Other values
+// are one more than the thread's id, and zero means it hasn't asked.
+const uintptr_t kNoThreadId = kMaxThreadIds + 1;
+
+WEAK int claim_thread_id() {
+    for (int w = 0; w < kMaxThreadIds / 64; w++) {
+        uint64_t used = __atomic_load_n(&thread_ids_in_use[w], __ATOMIC_RELAXED);
+        while (~used) {
+            int bit = __builtin_ctzll(~used);
+            if (__atomic_compare_exchange_n(&thread_ids_in_use[w], &used, used | ((uint64_t)1 << bit),
+                                            false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return w * 64 + bit;
+            }
+        }
+    }
+    return -1;
+}
+
+// The destructor of the key. Frees the id of a thread that exits.
+WEAK void release_thread_id(void *value) {
+    uintptr_t v = (uintptr_t)value;
+    if (v != 0 && v != kNoThreadId) {
+        int id = (int)(v - 1);
+        __atomic_fetch_and(&thread_ids_in_use[id / 64], ~((uint64_t)1 << (id % 64)), __ATOMIC_RELEASE);
+    }
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK int halide_current_thread_id() {
+    using namespace Halide::Runtime::Internal;
+    if (!__atomic_load_n(&thread_id_key_created, __ATOMIC_ACQUIRE)) {
+        ScopedMutexLock lock(&thread_id_key_lock);
+        if (!thread_id_key_created) {
+            if (!thread_id_key_create(release_thread_id)) {
+                return -1;
+            }
+            __atomic_store_n(&thread_id_key_created, true, __ATOMIC_RELEASE);
+        }
+    }
+    uintptr_t value = (uintptr_t)thread_id_key_get();
+    if (value == 0) {
+        int id = claim_thread_id();
+        value = id < 0 ? kNoThreadId : (uintptr_t)id + 1;
+        if (!thread_id_key_set((void *)value)) {
+            release_thread_id((void *)value);
+            return -1;
+        }
+    }
+    return value == kNoThreadId ? -1 : (int)(value - 1);
+}
+
+}
+
+namespace {
+
+__attribute__((destructor))
+WEAK void halide_thread_ids_cleanup() {
+    using namespace Halide::Runtime::Internal;
+    // Threads that exit after the runtime is unloaded (e.g. when JIT
+    // compiled code is released) must not call back into it.
+    ScopedMutexLock lock(&thread_id_key_lock);
+    if (thread_id_key_created) {
+        thread_id_key_delete();
+        thread_id_key_created = false;
+    }
+}
+
+}
+
+#endif
@@ -6,6 +6,7 @@ extern "C" {
 namespace {
 __attribute__((destructor))
 WEAK void halide_thread_pool_cleanup() {
+    work_queue_destroyed = true;
     halide_shutdown_thread_pool();
 }
 }
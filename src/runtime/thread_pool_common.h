@@ -1,19 +1,85 @@
+#include "scoped_spin_lock.h"
+
+// Platforms with no clock available to the runtime define this to
+// zero before including this file. Workers then claim one task at a
+// time instead of adapting chunk sizes to measured task durations.
+#ifndef HALIDE_THREAD_POOL_HAS_CLOCK
+#define HALIDE_THREAD_POOL_HAS_CLOCK 1
+#endif
 
 namespace Halide { namespace Runtime { namespace Internal {
 
+// A contiguous range of task indices, stored as offsets from the
+// start of the job. Tasks are claimed from the front of a range with
+// an atomic increment, so claiming never needs the work queue
+// lock. Ranges are padded out to a cache line so that workers
+// claiming from different ranges don't contend with each other.
+struct work_range {
+    uint32_t next, end;
+    uint8_t padding[64 - 2 * sizeof(uint32_t)];
+} __attribute__((aligned(64)));
+
+// The maximum number of ranges a job is split into. If there are more
+// workers than ranges, several workers share a home range.
+#define MAX_RANGES 32
+
+// Workers claim chunks of consecutive tasks at once, sized so that a
+// chunk takes roughly this long to run. This amortizes the cost of
+// claiming (and of timing the chunk) over many tiny tasks, while
+// keeping the granularity fine enough to balance load.
+#define TARGET_CHUNK_NS 20000
+
+// The largest chunk a worker will claim. This also bounds how far
+// racing workers can push a range's counter past its end.
+#define MAX_CHUNK_SIZE 65536
+
 struct work {
     work *next_job;
     int (*f)(void *, int, uint8_t *);
     void *user_context;
-    int next, max;
+    int min;
     uint8_t *closure;
+
+    // The tasks of the job are partitioned into one range per
+    // worker. Each worker starts on a home range and steals from the
+    // others once its home range is exhausted.
+    work_range ranges[MAX_RANGES];
+    int num_ranges;
+
+    // The number of workers that have joined this job so far. Used to
+    // assign home ranges.
+    int workers_joined;
+
+    // The most recent chunk size chosen by any worker on this
+    // job. Workers that join late start from here instead of
+    // relearning it.
+    int chunk_size;
+
     int active_workers;
     int exit_status;
-    bool running() { return next < max || active_workers > 0; }
+
+    // Set (under the work queue lock) by the first worker to find
+    // that every range is empty. At that point the job is also
+    // removed from the job stack.
+    bool drained;
+
+    // When the job was pushed onto the stack, if the pool is
+    // recording timing statistics, and whether any thread other than
+    // the owner has joined it yet.
+    int64_t enqueue_time;
+    bool helped;
+
+    bool running() { return !drained || active_workers > 0; }
 };
 
-// The work queue and thread pool is weak, so one big work queue is shared by all halide functions
-#define MAX_THREADS 64
+// The work queue and thread pool is weak, so one big work queue is
+// shared by all halide functions, except for calls whose user_context
+// has been bound to a separately created thread pool (see
+// halide_thread_pool_create).
+
+// The thread array is sized dynamically, so this only exists to catch
+// absurd values of HL_NUM_THREADS.
+#define MAX_THREADS 4096
 struct work_queue_t {
     // all fields are protected by this mutex.
     halide_mutex mutex;
@@ -26,21 +92,52 @@ struct work_queue_t {
     // team does work. Threads transition to the B team if they wake
     // up and find that a_team_size > target_a_team_size.  Threads
     // move into the A team whenever they wake up and find that
-    // a_team_size < target_a_team_size.
+    // a_team_size < target_a_team_size. Both counts only include
+    // worker threads, not the threads that called do_par_for.
     int a_team_size, target_a_team_size;
 
+    // The number of A team and B team threads currently waiting on
+    // wakeup_a_team and wakeup_b_team respectively. Used to signal
+    // just as many threads as there is work for, instead of waking
+    // the whole pool every time a job is enqueued.
+    int a_team_sleepers, b_team_sleepers;
+
+    // The number of A team threads currently spinning in the hope
+    // that a job arrives before they go to sleep. They will pick up
+    // new jobs without being signalled.
+    int a_team_spinners;
+
+    // How many times an idle thread polls for work before blocking
+    // on a condition variable, and whether that was set explicitly
+    // via halide_set_thread_pool_spin_count (as opposed to from
+    // HL_THREAD_POOL_SPIN_COUNT).
+    int spin_count;
+    bool spin_count_overridden;
+
     // Broadcast when a job completes.
     halide_cond wakeup_owners;
 
-    // Broadcast whenever items are added to the work queue.
+    // Signalled whenever items are added to the work queue, once per
+    // sleeping A team thread that is needed.
     halide_cond wakeup_a_team;
 
-    // May also be broadcast when items are added to the work queue if
+    // May also be signalled when items are added to the work queue if
     // more threads are required than are currently in the A team.
     halide_cond wakeup_b_team;
 
-    // Keep track of threads so they can be joined at shutdown
-    halide_thread *threads[MAX_THREADS];
+    // Broadcast when a semaphore that threads are blocked on is
+    // released.
+    halide_cond wakeup_semaphore_waiters;
+
+    // The number of threads blocked acquiring a semaphore. The pool
+    // keeps one extra worker thread running for each of them, so
+    // that whatever they're waiting for can still get done.
+    int threads_blocked;
+
+    // Keep track of threads so they can be joined at shutdown. Grown
+    // as needed.
+    halide_thread **threads;
+    int threads_capacity;
 
     // The number threads created
     int threads_created;
@@ -48,6 +145,34 @@ struct work_queue_t {
     // The desired number threads doing work.
     int desired_num_threads;
 
+    // Whether worker threads should be pinned to cores, and whether
+    // that was set explicitly via halide_set_thread_affinity (as
+    // opposed to from HL_THREAD_AFFINITY). Workers notice changes
+    // the next time they pick up a job.
+    int affinity;
+    bool affinity_overridden;
+
+    // The cores to pin workers to, grouped by NUMA node. Worker i is
+    // pinned to cpu_order[i % num_cpus]. Computed the first time
+    // pinning is enabled.
+    int *cpu_order;
+    int num_cpus;
+
+    // Statistics for halide_thread_pool_get_stats and the profiler
+    // report. Threads add their share when they leave a job or stop
+    // waiting for one.
+    halide_thread_pool_stats_t stats;
+
+    // The number of tasks run by each thread, indexed by worker
+    // index. Unlike the thread array, this survives shutting down
+    // the pool, so that it can still be reported afterwards.
+    uint64_t *thread_tasks;
+    int thread_tasks_capacity;
+
+    // The scheduling priority of the worker threads. Zero means leave
+    // them at the platform default.
+    int priority;
+
     // Global flags indicating the threadpool should shut down, and
     // whether the thread pool has been initialized.
     bool shutdown, initialized;
@@ -59,6 +184,13 @@ struct work_queue_t {
 };
 WEAK work_queue_t work_queue;
 
+// The argument passed to each newly spawned worker thread. The worker
+// frees it.
+struct worker_arg {
+    work_queue_t *queue;
+    int worker_index;
+};
+
 WEAK int clamp_num_threads(int desired_num_threads) {
     if (desired_num_threads > MAX_THREADS) {
         desired_num_threads = MAX_THREADS;
@@ -68,6 +200,39 @@ WEAK int clamp_num_threads(int desired_num_threads) {
     return desired_num_threads;
 }
 
+// Make room in the thread array for at least min_capacity
+// threads. Must be called with the work queue lock held.
+WEAK void grow_thread_array(work_queue_t *queue, int min_capacity) {
+    // Start with enough room for one worker per core, and double from
+    // there, so that repeated calls to halide_set_num_threads don't
+    // reallocate every time.
+    int capacity = max(queue->threads_capacity * 2, halide_host_cpu_count());
+    capacity = max(capacity, min_capacity);
+    halide_thread **threads = (halide_thread **)malloc(capacity * sizeof(halide_thread *));
+    halide_assert(NULL, threads != NULL);
+    if (queue->threads_created) {
+        memcpy(threads, queue->threads, queue->threads_created * sizeof(halide_thread *));
+    }
+    free(queue->threads);
+    queue->threads = threads;
+    queue->threads_capacity = capacity;
+
+    // Worker indices go up to the number of threads created, and
+    // zero is the calling thread.
+    if (queue->thread_tasks_capacity < capacity + 1) {
+        uint64_t *thread_tasks = (uint64_t *)malloc((capacity + 1) * sizeof(uint64_t));
+        halide_assert(NULL, thread_tasks != NULL);
+        memset(thread_tasks, 0, (capacity + 1) * sizeof(uint64_t));
+        if (queue->thread_tasks_capacity) {
+            memcpy(thread_tasks, queue->thread_tasks,
+                   queue->thread_tasks_capacity * sizeof(uint64_t));
+        }
+        free(queue->thread_tasks);
+        queue->thread_tasks = thread_tasks;
+        queue->thread_tasks_capacity = capacity + 1;
+    }
+}
+
 WEAK int default_desired_num_threads() {
     int desired_num_threads = 0;
     char *threads_str = getenv("HL_NUM_THREADS");
@@ -83,58 +248,349 @@ WEAK int default_desired_num_threads() {
     return desired_num_threads;
 }
 
-WEAK void worker_thread_already_locked(work *owned_job) {
+// By default, spin for roughly tens of microseconds before
+// sleeping. That's long enough to bridge the gap between back-to-back
+// parallel loops in a pipeline, without burning much CPU time when
+// the pool is really idle.
+#define DEFAULT_SPIN_COUNT 1000
+
+WEAK int default_spin_count() {
+    char *spin_str = getenv("HL_THREAD_POOL_SPIN_COUNT");
+    return spin_str ? atoi(spin_str) : DEFAULT_SPIN_COUNT;
+}
+
+// Whether to record the timing statistics of all thread pools, and
+// whether that was set explicitly via halide_set_thread_pool_stats
+// (as opposed to from HL_THREAD_POOL_STATS).
+WEAK int thread_pool_stats_enabled = 0;
+WEAK bool thread_pool_stats_overridden = false;
+
+WEAK int default_stats_enabled() {
+    char *stats_str = getenv("HL_THREAD_POOL_STATS");
+    return stats_str ? atoi(stats_str) : 0;
+}
+
+// The current time if timing statistics are being recorded, and zero
+// otherwise.
+WEAK int64_t stats_clock() {
+#if HALIDE_THREAD_POOL_HAS_CLOCK
+    if (__atomic_load_n(&thread_pool_stats_enabled, __ATOMIC_RELAXED)) {
+        return halide_current_time_ns(NULL);
+    }
+#endif
+    return 0;
+}
+
+// The time elapsed since a call to stats_clock, or zero if timing
+// statistics were off at either end.
+WEAK uint64_t stats_elapsed(int64_t start) {
+    if (start == 0) {
+        return 0;
+    }
+    int64_t now = stats_clock();
+    return now > start ? (uint64_t)(now - start) : 0;
+}
+
+// Poll without holding the lock for a while, waiting for something
+// that would make the caller stop waiting: a job arriving on the
+// stack, the owned job (if any) finishing, or the pool shutting
+// down. Must be called with the work queue lock held, and returns
+// with it held, whether or not anything happened.
+WEAK void spin_already_locked(work_queue_t *queue, work *owned_job) {
+    int spin_count = queue->spin_count;
+    halide_mutex_unlock(&queue->mutex);
+    for (int i = 0; i < spin_count; i++) {
+        if (__atomic_load_n(&queue->jobs, __ATOMIC_ACQUIRE) != NULL ||
+            __atomic_load_n(&queue->shutdown, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (owned_job &&
+            __atomic_load_n(&owned_job->drained, __ATOMIC_RELAXED) &&
+            __atomic_load_n(&owned_job->active_workers, __ATOMIC_RELAXED) == 0) {
+            break;
+        }
+        // The runtime is compiled to architecture-neutral code, so
+        // there's no pause instruction to use here. Give up the core
+        // every so often instead, in case there are more threads
+        // than cores.
+        if ((i & 31) == 31) {
+            halide_thread_yield();
+        }
+    }
+    halide_mutex_lock(&queue->mutex);
+}
+
+WEAK int default_affinity() {
+    char *affinity_str = getenv("HL_THREAD_AFFINITY");
+    return affinity_str ? atoi(affinity_str) : 0;
+}
+
+// Pin (or unpin) a worker thread according to the current affinity
+// setting. Must be called with the work queue lock held, from the
+// worker thread itself.
+WEAK void pin_worker_already_locked(work_queue_t *queue, int worker_index) {
+    int cpu = -1;
+    if (queue->affinity) {
+        if (!queue->cpu_order) {
+            int max_cpus = max(halide_host_cpu_count(), 1);
+            queue->cpu_order = (int *)malloc(max_cpus * sizeof(int));
+            halide_assert(NULL, queue->cpu_order != NULL);
+            queue->num_cpus = halide_get_cpu_order(queue->cpu_order, max_cpus);
+        }
+        if (queue->num_cpus > 0) {
+            cpu = queue->cpu_order[worker_index % queue->num_cpus];
+        }
+    }
+    // Failing to pin only costs us locality, so ignore errors.
+    halide_set_current_thread_cpu(cpu);
+}
+
+// Try to claim a chunk of up to chunk_size tasks from the given
+// range. Does not need the work queue lock. Returns the number of
+// tasks claimed.
+WEAK int claim_from_range(work_range *r, int chunk_size, uint32_t *offset) {
+    // Check before incrementing, so that the counter only overshoots
+    // the end of the range by at most one chunk per racing worker.
+    uint32_t next = __atomic_load_n(&r->next, __ATOMIC_RELAXED);
+    if (next >= r->end) {
+        return 0;
+    }
+    // As in guided scheduling, never take more than half of what's
+    // left, so that there's still something for other workers to
+    // steal near the end of the job.
+    uint32_t n = (uint32_t)chunk_size;
+    uint32_t half = (r->end - next) / 2;
+    if (n > half) {
+        n = half > 0 ? half : 1;
+    }
+    uint32_t first = __sync_fetch_and_add(&r->next, n);
+    if (first >= r->end) {
+        return 0;
+    }
+    *offset = first;
+    return (int)min(n, r->end - first);
+}
+
+// Claim a chunk of tasks from the worker's home range. If the home
+// range is empty, steal from the other ranges, and adopt the victim
+// as the new home range so that subsequent claims go straight
+// there. Returns the number of tasks claimed, which is zero once
+// every range in the job is empty.
+WEAK int claim_tasks(work *job, int *range, int chunk_size, int *idx) {
+    uint32_t offset;
+    for (int i = 0; i < job->num_ranges; i++) {
+        int r = *range + i;
+        if (r >= job->num_ranges) {
+            r -= job->num_ranges;
+        }
+        int claimed = claim_from_range(&job->ranges[r], chunk_size, &offset);
+        if (claimed) {
+            *range = r;
+            *idx = job->min + (int)offset;
+            return claimed;
+        }
+    }
+    return 0;
+}
+
+// Pick the next chunk size given how long the last chunk of
+// num_tasks tasks took. Moves towards chunks that take
+// TARGET_CHUNK_NS, at most doubling or halving at a time so that a
+// single noisy measurement can't throw it far off.
+WEAK int adapt_chunk_size(int chunk_size, int num_tasks, int64_t elapsed_ns) {
+    int64_t target;
+    if (elapsed_ns <= 0) {
+        target = (int64_t)chunk_size * 2;
+    } else {
+        target = ((int64_t)TARGET_CHUNK_NS * num_tasks) / elapsed_ns;
+    }
+    if (target > (int64_t)chunk_size * 2) {
+        target = (int64_t)chunk_size * 2;
+    } else if (target < chunk_size / 2) {
+        target = chunk_size / 2;
+    }
+    if (target < 1) {
+        target = 1;
+    } else if (target > MAX_CHUNK_SIZE) {
+        target = MAX_CHUNK_SIZE;
+    }
+    return (int)target;
+}
+
+// Pick the job a thread should help with: the one at the top of the
+// stack. A job owner only helps with its own job or jobs pushed after
+// it, which are nested inside its tasks or unrelated to them. Running
+// a task from lower down the stack on top of the owner's stack frame
+// could deadlock if the task blocks on a semaphore that only the
+// suspended task underneath it would release.
+WEAK work *job_to_join_already_locked(work_queue_t *queue, work *owned_job) {
+    if (owned_job == NULL) {
+        return queue->jobs;
+    }
+    for (work *job = queue->jobs; job; job = job->next_job) {
+        if (job == owned_job) {
+            return queue->jobs;
+        }
+    }
+    return NULL;
+}
+
+WEAK void worker_thread_already_locked(work_queue_t *queue, work *owned_job, int worker_index) {
+    // Whether this thread is currently pinned to a core. Only worker
+    // threads get pinned; job owners belong to the caller.
+    int pinned = 0;
+
+    // Whether this thread has already spun since it last found some
+    // work. If so, it should go to sleep.
+    bool spun = false;
+
     // If I'm a job owner, then I was the thread that called
     // do_par_for, and I should only stay in this function until my
     // job is complete. If I'm a lowly worker thread, I should stay in
     // this function as long as the work queue is running.
     while (owned_job != NULL ? owned_job->running()
-           : work_queue.running()) {
+           : queue->running()) {
 
-        if (work_queue.jobs == NULL) {
-            if (owned_job) {
+        work *job = job_to_join_already_locked(queue, owned_job);
+
+        if (job == NULL) {
+            if (!spun && queue->spin_count > 0 &&
+                (owned_job || queue->a_team_size <= queue->target_a_team_size)) {
+                // There are no jobs pending, but one may arrive very
+                // soon (e.g. the next parallel loop in the same
+                // pipeline). Spin for a bit before paying for a
+                // sleep and a wakeup.
+                int64_t start = stats_clock();
+                if (!owned_job) {
+                    queue->a_team_spinners++;
+                }
+                spin_already_locked(queue, owned_job);
+                if (owned_job) {
+                    queue->stats.owner_wait_time += stats_elapsed(start);
+                } else {
+                    queue->a_team_spinners--;
+                    queue->stats.idle_time += stats_elapsed(start);
+                }
+                spun = true;
+            } else if (owned_job) {
                 // There are no jobs pending. Wait for the last worker
                 // to signal that the job is finished.
-                halide_cond_wait(&work_queue.wakeup_owners, &work_queue.mutex);
-            } else if (work_queue.a_team_size <= work_queue.target_a_team_size) {
+                int64_t start = stats_clock();
+                halide_cond_wait(&queue->wakeup_owners, &queue->mutex);
+                queue->stats.owner_wait_time += stats_elapsed(start);
+            } else if (queue->a_team_size <= queue->target_a_team_size) {
                 // There are no jobs pending. Wait until more jobs are enqueued.
-                halide_cond_wait(&work_queue.wakeup_a_team, &work_queue.mutex);
+                int64_t start = stats_clock();
+                queue->a_team_sleepers++;
+                halide_cond_wait(&queue->wakeup_a_team, &queue->mutex);
+                queue->a_team_sleepers--;
+                uint64_t elapsed = stats_elapsed(start);
+                queue->stats.idle_time += elapsed;
+                queue->stats.sleep_time += elapsed;
             } else {
                 // There are no jobs pending, and there are too many
                 // threads in the A team. Transition to the B team
                 // until the wakeup_b_team condition is fired.
-                work_queue.a_team_size--;
-                halide_cond_wait(&work_queue.wakeup_b_team, &work_queue.mutex);
-                work_queue.a_team_size++;
+                int64_t start = stats_clock();
+                queue->stats.b_team_transitions++;
+                queue->a_team_size--;
+                queue->b_team_sleepers++;
+                halide_cond_wait(&queue->wakeup_b_team, &queue->mutex);
+                queue->b_team_sleepers--;
+                queue->a_team_size++;
+                uint64_t elapsed = stats_elapsed(start);
+                queue->stats.idle_time += elapsed;
+                queue->stats.sleep_time += elapsed;
             }
         } else {
-            // Grab the next job.
-            work *job = work_queue.jobs;
+            if (owned_job == NULL && pinned != queue->affinity) {
+                pin_worker_already_locked(queue, worker_index);
+                pinned = queue->affinity;
+            }
 
-            // Claim a task from it.
-            work myjob = *job;
-            job->next++;
+            spun = false;
+            if (job != owned_job && !job->helped) {
+                job->helped = true;
+                queue->stats.jobs_helped++;
+                uint64_t latency = stats_elapsed(job->enqueue_time);
+                queue->stats.total_join_latency += latency;
+                queue->stats.max_join_latency = max(queue->stats.max_join_latency, latency);
+            }
 
-            // If there were no more tasks pending for this job,
-            // remove it from the stack.
-            if (job->next == job->max) {
-                work_queue.jobs = job->next_job;
+            int range;
+            if (queue->affinity) {
+                // Give each worker the same slice of the indices
+                // every time, so that consecutive parallel loops over
+                // the same data touch it from the same cores.
+                range = ((int64_t)worker_index * job->num_ranges) / queue->desired_num_threads;
+                range %= job->num_ranges;
+                job->workers_joined++;
+            } else {
+                range = (job->workers_joined++) % job->num_ranges;
             }
 
             // Increment the active_worker count so that other threads
             // are aware that this job is still in progress even
-            // though there are no outstanding tasks for it.
+            // though there may be no outstanding tasks for it.
             job->active_workers++;
 
-            // Release the lock and do the task.
-            halide_mutex_unlock(&work_queue.mutex);
-            int result = halide_do_task(myjob.user_context, myjob.f, myjob.next,
-                                        myjob.closure);
-            halide_mutex_lock(&work_queue.mutex);
+            // Release the lock and claim and run chunks of tasks
+            // until there are none left anywhere in the job.
+            halide_mutex_unlock(&queue->mutex);
+            int exit_status = 0;
+            int chunk_size = __atomic_load_n(&job->chunk_size, __ATOMIC_RELAXED);
+            int tasks_run = 0, chunks_run = 0, max_chunk_size = 0;
+            int idx, claimed;
+#if HALIDE_THREAD_POOL_HAS_CLOCK
+            int64_t t = halide_current_time_ns(job->user_context);
+#endif
+            while ((claimed = claim_tasks(job, &range, chunk_size, &idx)) > 0) {
+                for (int i = 0; i < claimed; i++) {
+                    int result = halide_do_task(job->user_context, job->f, idx + i,
+                                                job->closure);
+                    // If this task failed, remember its exit status.
+                    if (result) {
+                        exit_status = result;
+                    }
+                }
+                tasks_run += claimed;
+                chunks_run++;
+                max_chunk_size = max(max_chunk_size, claimed);
+#if HALIDE_THREAD_POOL_HAS_CLOCK
+                int64_t t_now = halide_current_time_ns(job->user_context);
+                // A chunk cut short by the end of a range says
+                // nothing about whether the chunk size was too large.
+                if (claimed == chunk_size || t_now - t > TARGET_CHUNK_NS) {
+                    chunk_size = adapt_chunk_size(chunk_size, claimed, t_now - t);
+                    __atomic_store_n(&job->chunk_size, chunk_size, __ATOMIC_RELAXED);
+                }
+                t = t_now;
+#endif
+            }
+            halide_mutex_lock(&queue->mutex);
+
+            if (exit_status) {
+                job->exit_status = exit_status;
+            }
+
+            queue->stats.tasks += tasks_run;
+            queue->stats.chunks += chunks_run;
+            queue->stats.max_chunk_size = max(queue->stats.max_chunk_size, (uint64_t)max_chunk_size);
+            if (worker_index < queue->thread_tasks_capacity) {
+                queue->thread_tasks[worker_index] += tasks_run;
+            }
 
-            // If this task failed, set the exit status on the job.
-            if (result) {
-                job->exit_status = result;
+            // There are no more tasks pending for this job, so
+            // remove it from the stack if nobody else already
+            // has. Other jobs may have been pushed above it in the
+            // meantime.
+            if (!job->drained) {
+                job->drained = true;
+                work **prev = &queue->jobs;
+                while (*prev != job) {
+                    prev = &((*prev)->next_job);
+                }
+                *prev = job->next_job;
             }
 
             // We are no longer active on this job
@@ -143,16 +599,223 @@ WEAK void worker_thread_already_locked(work *owned_job) {
             // If the job is done and I'm not the owner of it, wake up
             // the owner.
             if (!job->running() && job != owned_job) {
-                halide_cond_broadcast(&work_queue.wakeup_owners);
+                halide_cond_broadcast(&queue->wakeup_owners);
             }
         }
     }
 }
 
-WEAK void worker_thread(void *) {
-    halide_mutex_lock(&work_queue.mutex);
-    worker_thread_already_locked(NULL);
-    halide_mutex_unlock(&work_queue.mutex);
+WEAK void worker_thread(void *void_arg) {
+    worker_arg *arg = (worker_arg *)void_arg;
+    work_queue_t *queue = arg->queue;
+    int worker_index = arg->worker_index;
+    free(arg);
+
+    if (queue->priority) {
+        // Failing to change priority isn't worth stopping for.
+        halide_set_current_thread_priority(queue->priority);
+    }
+
+    halide_mutex_lock(&queue->mutex);
+    worker_thread_already_locked(queue, NULL, worker_index);
+    halide_mutex_unlock(&queue->mutex);
+}
+
+// A thread pool created with halide_thread_pool_create. These are
+// kept in a list so that the profiler can report on all of them.
+struct thread_pool_instance {
+    work_queue_t queue;
+    thread_pool_instance *next;
+};
+
+// The user_contexts that have been bound to thread pools other than
+// the default one.
+struct thread_pool_binding {
+    void *user_context;
+    thread_pool_instance *pool;
+    thread_pool_binding *next;
+};
+
+// Both lists are protected by this spin lock. The lock is only
+// taken by calls to do_par_for if any bindings exist at all.
+WEAK thread_pool_instance *thread_pools = NULL;
+WEAK thread_pool_binding *thread_pool_bindings = NULL;
+WEAK volatile int thread_pools_lock = 0;
+
+// Set by the destructor that shuts down the default pool at static
+// destruction time, after which its lock no longer exists.
+WEAK bool work_queue_destroyed = false;
+
+// Holds the lock of a work queue while its statistics are read or
+// reset, because growing the thread array replaces thread_tasks. The
+// profiler may report after the default pool has been destroyed, but
+// then there are no worker threads left to race with, so that is the
+// one case that goes without the lock.
+class ScopedStatsLock {
+    work_queue_t *queue;
+    bool locked;
+
+public:
+    ScopedStatsLock(work_queue_t *q)
+        : queue(q), locked(!(q == &work_queue && work_queue_destroyed)) {
+        if (locked) {
+            halide_mutex_lock(&queue->mutex);
+        }
+    }
+
+    ~ScopedStatsLock() {
+        if (locked) {
+            halide_mutex_unlock(&queue->mutex);
+        }
+    }
+};
+
+// Find the work queue that calls with the given user_context should
+// use.
+WEAK work_queue_t *find_work_queue(void *user_context) {
+    if (__atomic_load_n(&thread_pool_bindings, __ATOMIC_ACQUIRE) == NULL) {
+        return &work_queue;
+    }
+    ScopedSpinLock lock(&thread_pools_lock);
+    for (thread_pool_binding *b = thread_pool_bindings; b; b = b->next) {
+        if (b->user_context == user_context) {
+            return &b->pool->queue;
+        }
+    }
+    return &work_queue;
+}
+
+WEAK void initialize_work_queue_already_locked(work_queue_t *queue) {
+    queue->shutdown = false;
+    halide_cond_init(&queue->wakeup_owners);
+    halide_cond_init(&queue->wakeup_a_team);
+    halide_cond_init(&queue->wakeup_b_team);
+    halide_cond_init(&queue->wakeup_semaphore_waiters);
+    queue->jobs = NULL;
+
+    // Compute the desired number of threads to use. Other code
+    // can also mess with this value, but only when the work queue
+    // is locked.
+    if (!queue->desired_num_threads) {
+        queue->desired_num_threads = default_desired_num_threads();
+    }
+    queue->desired_num_threads = clamp_num_threads(queue->desired_num_threads);
+    queue->threads_created = 0;
+    queue->threads_blocked = 0;
+    if (!queue->threads_capacity) {
+        // Also makes room to count the tasks run by calling threads,
+        // even if no worker threads are ever needed.
+        grow_thread_array(queue, 0);
+    }
+
+    if (!queue->affinity_overridden) {
+        queue->affinity = default_affinity();
+    }
+    if (!queue->spin_count_overridden) {
+        queue->spin_count = default_spin_count();
+    }
+    if (!thread_pool_stats_overridden) {
+        thread_pool_stats_enabled = default_stats_enabled();
+    }
+
+#if HALIDE_THREAD_POOL_HAS_CLOCK
+    // Chunk sizes and statistics are based on halide_current_time_ns,
+    // which isn't calibrated on all platforms until the clock has been
+    // started.
+    halide_start_clock(NULL);
+#endif
+
+    // Everyone starts on the a team.
+    queue->a_team_size = 0;
+    queue->a_team_sleepers = 0;
+    queue->a_team_spinners = 0;
+    queue->b_team_sleepers = 0;
+
+    queue->initialized = true;
+}
+
+// Make sure there's a worker thread for each desired thread other
+// than the caller, plus one for each thread blocked on a semaphore.
+WEAK void spawn_workers_already_locked(work_queue_t *queue) {
+    int wanted = queue->desired_num_threads - 1 + queue->threads_blocked;
+    if (wanted > MAX_THREADS) {
+        wanted = MAX_THREADS;
+    }
+    while (queue->threads_created < wanted) {
+        // We might need to make some new threads, if
+        // desired_num_threads has increased.
+        if (queue->threads_created == queue->threads_capacity) {
+            grow_thread_array(queue, wanted);
+        }
+        // Worker indices start at one. Zero is the calling thread.
+        worker_arg *arg = (worker_arg *)malloc(sizeof(worker_arg));
+        halide_assert(NULL, arg != NULL);
+        arg->queue = queue;
+        arg->worker_index = ++queue->threads_created;
+        queue->threads[queue->threads_created - 1] =
+            halide_spawn_thread(worker_thread, arg);
+        queue->a_team_size++;
+        queue->stats.workers++;
+    }
+}
+
+// The private contents of a halide_semaphore_t.
+struct semaphore_impl {
+    // The count, plus HALIDE_SEMAPHORE_CLOSED once closed.
+    int value;
+    // The number of threads blocked in halide_semaphore_acquire.
+    int waiters;
+    // The work queue whose lock and condition variable blocked
+    // threads wait on.
+    work_queue_t *queue;
+};
+
+struct wakeup_impl {
+    halide_mutex mutex;
+    halide_cond cond;
+    int pending;
+};
+
+// Whether acquiring n from a semaphore can never succeed, because
+// it has been closed with less than n left.
+WEAK bool semaphore_exhausted(semaphore_impl *s, int n) {
+    int value = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+    return (value & HALIDE_SEMAPHORE_CLOSED) && (value & ~HALIDE_SEMAPHORE_CLOSED) < n;
+}
+
+// Wake up all the threads of a work queue, wait for them to exit, and
+// release its resources.
+WEAK void shutdown_work_queue(work_queue_t *queue) {
+    if (!queue->initialized) return;
+
+    // Wake everyone up and tell them the party's over and it's time
+    // to go home
+    halide_mutex_lock(&queue->mutex);
+    queue->shutdown = true;
+    halide_cond_broadcast(&queue->wakeup_owners);
+    halide_cond_broadcast(&queue->wakeup_a_team);
+    halide_cond_broadcast(&queue->wakeup_b_team);
+    halide_cond_broadcast(&queue->wakeup_semaphore_waiters);
+    halide_mutex_unlock(&queue->mutex);
+
+    // Wait until they leave
+    for (int i = 0; i < queue->threads_created; i++) {
+        halide_join_thread(queue->threads[i]);
+    }
+
+    // Tidy up
+    free(queue->threads);
+    queue->threads = NULL;
+    queue->threads_capacity = 0;
+    free(queue->cpu_order);
+    queue->cpu_order = NULL;
+    queue->num_cpus = 0;
+    halide_mutex_destroy(&queue->mutex);
+    halide_cond_destroy(&queue->wakeup_owners);
+    halide_cond_destroy(&queue->wakeup_a_team);
+    halide_cond_destroy(&queue->wakeup_b_team);
+    halide_cond_destroy(&queue->wakeup_semaphore_waiters);
+    queue->initialized = false;
 }
 
 }}}  // namespace Halide::Runtime::Internal
@@ -173,126 +836,472 @@ WEAK int halide_default_do_par_for(void *user_context, halide_task_t f,
         return 0;
     }
 
-    // Grab the lock. If it hasn't been initialized yet, then the
-    // field will be zero-initialized because it's a static global.
-    halide_mutex_lock(&work_queue.mutex);
-
-    if (!work_queue.initialized) {
-        work_queue.shutdown = false;
-        halide_cond_init(&work_queue.wakeup_owners);
-        halide_cond_init(&work_queue.wakeup_a_team);
-        halide_cond_init(&work_queue.wakeup_b_team);
-        work_queue.jobs = NULL;
-
-        // Compute the desired number of threads to use. Other code
-        // can also mess with this value, but only when the work queue
-        // is locked.
-        if (!work_queue.desired_num_threads) {
-            work_queue.desired_num_threads = default_desired_num_threads();
-        }
-        work_queue.desired_num_threads = clamp_num_threads(work_queue.desired_num_threads);
-        work_queue.threads_created = 0;
+    work_queue_t *queue = find_work_queue(user_context);
 
-        // Everyone starts on the a team.
-        work_queue.a_team_size = work_queue.desired_num_threads;
+    // Grab the lock. If it hasn't been initialized yet, then the
+    // field will be zero-initialized because it's a static global (or
+    // was zeroed by halide_thread_pool_create).
+    halide_mutex_lock(&queue->mutex);
 
-        work_queue.initialized = true;
+    if (!queue->initialized) {
+        initialize_work_queue_already_locked(queue);
     }
 
-    while (work_queue.threads_created < work_queue.desired_num_threads - 1) {
-        // We might need to make some new threads, if work_queue.desired_num_threads has
-        // increased.
-        work_queue.threads[work_queue.threads_created++] =
-            halide_spawn_thread(worker_thread, NULL);
-    }
+    spawn_workers_already_locked(queue);
 
     // Make the job.
     work job;
     job.f = f;               // The job should call this function. It takes an index and a closure.
     job.user_context = user_context;
-    job.next = min;          // Start at this index.
-    job.max  = min + size;   // Keep going until one less than this index.
+    job.min = min;           // Task indices are offsets from here.
     job.closure = closure;   // Use this closure.
     job.exit_status = 0;     // The job hasn't failed yet
     job.active_workers = 0;  // Nobody is working on this yet
+    job.workers_joined = 0;
+    job.chunk_size = 1;      // Start with one task at a time until we know how long they take.
+    job.drained = false;
+    job.helped = false;
 
-    if (!work_queue.jobs && size < work_queue.desired_num_threads) {
+    // Split the tasks into one range per worker that could
+    // participate (including this thread).
+    int num_ranges = queue->desired_num_threads;
+    if (num_ranges > size) {
+        num_ranges = size;
+    }
+    if (num_ranges > MAX_RANGES) {
+        num_ranges = MAX_RANGES;
+    }
+    job.num_ranges = num_ranges;
+    for (int i = 0; i < num_ranges; i++) {
+        job.ranges[i].next = (uint32_t)(((int64_t)size * i) / num_ranges);
+        job.ranges[i].end = (uint32_t)(((int64_t)size * (i + 1)) / num_ranges);
+    }
+
+    // The number of worker threads that could usefully help this
+    // thread with the job.
+    int helpers_wanted = num_ranges - 1;
+
+    if (!queue->jobs && size < queue->desired_num_threads) {
         // If there's no nested parallelism happening and there are
         // fewer tasks to do than threads, then set the target A team
         // size so that some threads will put themselves to sleep
         // until a larger job arrives.
-        work_queue.target_a_team_size = size;
+        queue->target_a_team_size = size - 1 + queue->threads_blocked;
     } else {
-        // Otherwise the target A team size is
-        // desired_num_threads. This may still be less than
-        // threads_created if desired_num_threads has been reduced by
-        // other code.
-        work_queue.target_a_team_size = work_queue.desired_num_threads;
+        // Otherwise the target A team size is all the worker
+        // threads. This may still be less than threads_created if
+        // desired_num_threads has been reduced by other code.
+        queue->target_a_team_size = queue->desired_num_threads - 1 + queue->threads_blocked;
+        helpers_wanted = queue->desired_num_threads - 1;
     }
 
     // Push the job onto the stack.
-    job.next_job = work_queue.jobs;
-    work_queue.jobs = &job;
+    job.next_job = queue->jobs;
+    queue->jobs = &job;
+    job.enqueue_time = stats_clock();
+    queue->stats.jobs++;
 
-    // Wake up our A team.
-    halide_cond_broadcast(&work_queue.wakeup_a_team);
+    // Wake up as many of our sleeping A team as there is work
+    // for. Threads in the A team that are currently busy or spinning
+    // will find the job on their own.
+    int to_wake = helpers_wanted - queue->a_team_spinners;
+    if (to_wake > queue->a_team_sleepers) {
+        to_wake = queue->a_team_sleepers;
+    }
+    for (int i = 0; i < to_wake; i++) {
+        halide_cond_signal(&queue->wakeup_a_team);
+    }
 
     // If there are fewer threads than we would like on the a team,
-    // wake up the b team too.
-    if (work_queue.target_a_team_size > work_queue.a_team_size) {
-        halide_cond_broadcast(&work_queue.wakeup_b_team);
+    // wake up some of the b team too.
+    int to_promote = queue->target_a_team_size - queue->a_team_size;
+    if (to_promote > queue->b_team_sleepers) {
+        to_promote = queue->b_team_sleepers;
+    }
+    for (int i = 0; i < to_promote; i++) {
+        halide_cond_signal(&queue->wakeup_b_team);
     }
 
     // Do some work myself.
-    worker_thread_already_locked(&job);
+    worker_thread_already_locked(queue, &job, 0);
 
-    halide_mutex_unlock(&work_queue.mutex);
+    halide_mutex_unlock(&queue->mutex);
 
     // Return zero if the job succeeded, otherwise return the exit
     // status of one of the failing jobs (whichever one failed last).
     return job.exit_status;
 }
 
+WEAK int halide_semaphore_init(void *user_context, halide_semaphore_t *sem, int count) {
+    semaphore_impl *s = (semaphore_impl *)sem;
+    s->value = count;
+    s->waiters = 0;
+    s->queue = find_work_queue(user_context);
+    return 0;
+}
+
+WEAK int halide_semaphore_release(halide_semaphore_t *sem, int n) {
+    semaphore_impl *s = (semaphore_impl *)sem;
+    if (n <= 0) {
+        return 0;
+    }
+    // This is a full barrier, so the load of waiters below can't
+    // move above it. An acquirer increments waiters before its last
+    // check of the value, so either it sees this release, or we see
+    // it waiting. The same goes for closing a semaphore.
+    __sync_fetch_and_add(&s->value, n);
+    if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) > 0) {
+        work_queue_t *queue = s->queue;
+        halide_mutex_lock(&queue->mutex);
+        halide_cond_broadcast(&queue->wakeup_semaphore_waiters);
+        halide_mutex_unlock(&queue->mutex);
+    }
+    return 0;
+}
+
+WEAK bool halide_semaphore_try_acquire(halide_semaphore_t *sem, int n) {
+    semaphore_impl *s = (semaphore_impl *)sem;
+    if (n <= 0) {
+        return true;
+    }
+    int value = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+    while ((value & ~HALIDE_SEMAPHORE_CLOSED) >= n) {
+        if (__atomic_compare_exchange_n(&s->value, &value, value - n,
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+WEAK void halide_semaphore_close(void *user_context, void *sem) {
+    semaphore_impl *s = (semaphore_impl *)sem;
+    __sync_fetch_and_or(&s->value, HALIDE_SEMAPHORE_CLOSED);
+    if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) > 0) {
+        work_queue_t *queue = s->queue;
+        halide_mutex_lock(&queue->mutex);
+        halide_cond_broadcast(&queue->wakeup_semaphore_waiters);
+        halide_mutex_unlock(&queue->mutex);
+    }
+}
+
+WEAK bool halide_can_spawn_threads() {
+    return true;
+}
+
+WEAK void halide_wakeup_init(halide_wakeup *wakeup) {
+    wakeup_impl *w = (wakeup_impl *)wakeup;
+    halide_cond_init(&w->cond);
+    w->pending = 0;
+}
+
+WEAK void halide_wakeup_destroy(halide_wakeup *wakeup) {
+    wakeup_impl *w = (wakeup_impl *)wakeup;
+    halide_cond_destroy(&w->cond);
+    halide_mutex_destroy(&w->mutex);
+}
+
+WEAK void halide_wakeup_wait(halide_wakeup *wakeup) {
+    wakeup_impl *w = (wakeup_impl *)wakeup;
+    halide_mutex_lock(&w->mutex);
+    while (!w->pending) {
+        halide_cond_wait(&w->cond, &w->mutex);
+    }
+    w->pending = 0;
+    halide_mutex_unlock(&w->mutex);
+}
+
+WEAK void halide_wakeup_signal(halide_wakeup *wakeup) {
+    wakeup_impl *w = (wakeup_impl *)wakeup;
+    halide_mutex_lock(&w->mutex);
+    w->pending = 1;
+    halide_cond_signal(&w->cond);
+    halide_mutex_unlock(&w->mutex);
+}
+
+WEAK int halide_semaphore_acquire(halide_semaphore_t *sem, int n) {
+    if (halide_semaphore_try_acquire(sem, n)) {
+        return 0;
+    }
+
+    semaphore_impl *s = (semaphore_impl *)sem;
+    work_queue_t *queue = s->queue;
+
+    // The other side of a producer-consumer pair is usually only a
+    // little behind, so spin for a while before paying for a sleep.
+    int spin_count = __atomic_load_n(&queue->spin_count, __ATOMIC_RELAXED);
+    for (int i = 0; i < spin_count; i++) {
+        if (halide_semaphore_try_acquire(sem, n)) {
+            return 0;
+        }
+        if (semaphore_exhausted(s, n)) {
+            return halide_error_code_generic_error;
+        }
+        if ((i & 31) == 31) {
+            halide_thread_yield();
+        }
+    }
+
+    halide_mutex_lock(&queue->mutex);
+    if (!queue->initialized) {
+        initialize_work_queue_already_locked(queue);
+    }
+    __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+
+    // This thread is about to stop doing useful work. Bring in
+    // another thread to take its place, so that the task that will
+    // release the semaphore can run even if every other thread is
+    // busy or blocked too.
+    queue->threads_blocked++;
+    queue->target_a_team_size++;
+    if (queue->a_team_sleepers > 0) {
+        halide_cond_signal(&queue->wakeup_a_team);
+    } else if (queue->b_team_sleepers > 0) {
+        halide_cond_signal(&queue->wakeup_b_team);
+    } else {
+        spawn_workers_already_locked(queue);
+    }
+
+    bool acquired;
+    while (!(acquired = halide_semaphore_try_acquire(sem, n)) &&
+           !semaphore_exhausted(s, n) && !queue->shutdown) {
+        halide_cond_wait(&queue->wakeup_semaphore_waiters, &queue->mutex);
+    }
+
+    queue->threads_blocked--;
+    if (queue->target_a_team_size > 0) {
+        queue->target_a_team_size--;
+    }
+    __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    halide_mutex_unlock(&queue->mutex);
+    return acquired ? 0 : halide_error_code_generic_error;
+}
+
 WEAK int halide_set_num_threads(int n) {
+    work_queue_t *queue = &work_queue;
     if (n < 0) {
         halide_error(NULL, "halide_set_num_threads: must be >= 0.");
     }
     // Don't make this an atomic swap - we don't want to be changing
     // the desired number of threads while another thread is in the
     // middle of a sequence of non-atomic operations.
-    halide_mutex_lock(&work_queue.mutex);
+    halide_mutex_lock(&queue->mutex);
     if (n == 0) {
         n = default_desired_num_threads();
     }
-    int old = work_queue.desired_num_threads;
-    work_queue.desired_num_threads = clamp_num_threads(n);
-    halide_mutex_unlock(&work_queue.mutex);
+    int old = queue->desired_num_threads;
+    queue->desired_num_threads = clamp_num_threads(n);
+    halide_mutex_unlock(&queue->mutex);
+    return old;
+}
+
+WEAK int halide_set_thread_pool_stats(int enabled) {
+    int old = __atomic_load_n(&thread_pool_stats_enabled, __ATOMIC_RELAXED);
+    if (!thread_pool_stats_overridden && !work_queue.initialized) {
+        old = default_stats_enabled();
+    }
+    thread_pool_stats_overridden = true;
+    __atomic_store_n(&thread_pool_stats_enabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+    return old;
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK void add_thread_pool_stats(halide_thread_pool_stats_t *stats, work_queue_t *queue) {
+    ScopedStatsLock lock(queue);
+    const halide_thread_pool_stats_t &s = queue->stats;
+    stats->jobs += s.jobs;
+    stats->tasks += s.tasks;
+    stats->chunks += s.chunks;
+    stats->max_chunk_size = max(stats->max_chunk_size, s.max_chunk_size);
+    stats->jobs_helped += s.jobs_helped;
+    stats->total_join_latency += s.total_join_latency;
+    stats->max_join_latency = max(stats->max_join_latency, s.max_join_latency);
+    stats->idle_time += s.idle_time;
+    stats->sleep_time += s.sleep_time;
+    stats->owner_wait_time += s.owner_wait_time;
+    stats->b_team_transitions += s.b_team_transitions;
+    stats->workers += s.workers;
+}
+
+// Add the task counts of a queue to the first max_threads entries of
+// tasks, and return how many threads it has counts for.
+WEAK int add_thread_tasks(uint64_t *tasks, int max_threads, work_queue_t *queue) {
+    ScopedStatsLock lock(queue);
+    int n = min(max_threads, queue->thread_tasks_capacity);
+    for (int i = 0; i < n; i++) {
+        tasks[i] += queue->thread_tasks[i];
+    }
+    return queue->thread_tasks_capacity;
+}
+
+WEAK void reset_thread_pool_stats(work_queue_t *queue) {
+    ScopedStatsLock lock(queue);
+    memset(&queue->stats, 0, sizeof(queue->stats));
+    if (queue->thread_tasks) {
+        memset(queue->thread_tasks, 0, queue->thread_tasks_capacity * sizeof(uint64_t));
+    }
+    // Worker threads that are still running still count.
+    queue->stats.workers = queue->threads_created;
+}
+
+}}}  // namespace Halide::Runtime::Internal
+
+WEAK void halide_thread_pool_get_stats(halide_thread_pool *pool_arg, halide_thread_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (pool_arg) {
+        add_thread_pool_stats(stats, &((thread_pool_instance *)pool_arg)->queue);
+        return;
+    }
+    add_thread_pool_stats(stats, &work_queue);
+    ScopedSpinLock lock(&thread_pools_lock);
+    for (thread_pool_instance *p = thread_pools; p; p = p->next) {
+        add_thread_pool_stats(stats, &p->queue);
+    }
+}
+
+WEAK int halide_thread_pool_get_thread_tasks(halide_thread_pool *pool_arg, uint64_t *tasks, int max_threads) {
+    for (int i = 0; i < max_threads; i++) {
+        tasks[i] = 0;
+    }
+    if (pool_arg) {
+        return add_thread_tasks(tasks, max_threads, &((thread_pool_instance *)pool_arg)->queue);
+    }
+    int available = add_thread_tasks(tasks, max_threads, &work_queue);
+    ScopedSpinLock lock(&thread_pools_lock);
+    for (thread_pool_instance *p = thread_pools; p; p = p->next) {
+        available = max(available, add_thread_tasks(tasks, max_threads, &p->queue));
+    }
+    return available;
+}
+
+WEAK void halide_thread_pool_reset_stats(halide_thread_pool *pool_arg) {
+    if (pool_arg) {
+        reset_thread_pool_stats(&((thread_pool_instance *)pool_arg)->queue);
+        return;
+    }
+    reset_thread_pool_stats(&work_queue);
+    ScopedSpinLock lock(&thread_pools_lock);
+    for (thread_pool_instance *p = thread_pools; p; p = p->next) {
+        reset_thread_pool_stats(&p->queue);
+    }
+}
+
+WEAK int halide_set_thread_pool_spin_count(int spin_count) {
+    work_queue_t *queue = &work_queue;
+    if (spin_count < 0) {
+        halide_error(NULL, "halide_set_thread_pool_spin_count: must be >= 0.");
+    }
+    halide_mutex_lock(&queue->mutex);
+    int old = queue->spin_count;
+    if (!queue->initialized && !queue->spin_count_overridden) {
+        old = default_spin_count();
+    }
+    queue->spin_count = spin_count;
+    queue->spin_count_overridden = true;
+    halide_mutex_unlock(&queue->mutex);
+    return old;
+}
+
+WEAK int halide_set_thread_affinity(int enabled) {
+    work_queue_t *queue = &work_queue;
+    halide_mutex_lock(&queue->mutex);
+    int old = queue->affinity;
+    if (!queue->initialized && !queue->affinity_overridden) {
+        old = default_affinity();
+    }
+    queue->affinity = enabled ? 1 : 0;
+    queue->affinity_overridden = true;
+    halide_mutex_unlock(&queue->mutex);
     return old;
 }
 
 WEAK void halide_shutdown_thread_pool() {
-    if (!work_queue.initialized) return;
+    shutdown_work_queue(&work_queue);
+}
 
-    // Wake everyone up and tell them the party's over and it's time
-    // to go home
-    halide_mutex_lock(&work_queue.mutex);
-    work_queue.shutdown = true;
-    halide_cond_broadcast(&work_queue.wakeup_owners);
-    halide_cond_broadcast(&work_queue.wakeup_a_team);
-    halide_cond_broadcast(&work_queue.wakeup_b_team);
-    halide_mutex_unlock(&work_queue.mutex);
+WEAK halide_thread_pool *halide_thread_pool_create(int num_threads, int priority) {
+    if (num_threads < 0) {
+        halide_error(NULL, "halide_thread_pool_create: num_threads must be >= 0.");
+        return NULL;
+    }
+    thread_pool_instance *pool = (thread_pool_instance *)malloc(sizeof(thread_pool_instance));
+    if (!pool) {
+        return NULL;
+    }
+    // A zeroed work queue is ready to use, just like the static
+    // global one. It gets initialized on first use.
+    memset(pool, 0, sizeof(thread_pool_instance));
+    pool->queue.desired_num_threads =
+        clamp_num_threads(num_threads ? num_threads : default_desired_num_threads());
+    pool->queue.priority = priority;
 
-    // Wait until they leave
-    for (int i = 0; i < work_queue.threads_created; i++) {
-        halide_join_thread(work_queue.threads[i]);
+    ScopedSpinLock lock(&thread_pools_lock);
+    pool->next = thread_pools;
+    thread_pools = pool;
+    return (halide_thread_pool *)pool;
+}
+
+WEAK void halide_thread_pool_destroy(halide_thread_pool *pool_arg) {
+    thread_pool_instance *pool = (thread_pool_instance *)pool_arg;
+    if (!pool) return;
+    {
+        // Remove any bindings to this pool, and the pool itself
+        // from the list of pools.
+        ScopedSpinLock lock(&thread_pools_lock);
+        thread_pool_binding **b = &thread_pool_bindings;
+        while (*b) {
+            if ((*b)->pool == pool) {
+                thread_pool_binding *dead = *b;
+                *b = dead->next;
+                free(dead);
+            } else {
+                b = &((*b)->next);
+            }
+        }
+        thread_pool_instance **p = &thread_pools;
+        while (*p && *p != pool) {
+            p = &((*p)->next);
+        }
+        if (*p) {
+            *p = pool->next;
+        }
     }
+    shutdown_work_queue(&pool->queue);
+    free(pool->queue.thread_tasks);
+    free(pool);
+}
 
-    // Tidy up
-    halide_mutex_destroy(&work_queue.mutex);
-    halide_cond_destroy(&work_queue.wakeup_owners);
-    halide_cond_destroy(&work_queue.wakeup_a_team);
-    halide_cond_destroy(&work_queue.wakeup_b_team);
-    work_queue.initialized = false;
+WEAK int halide_thread_pool_bind(void *user_context, halide_thread_pool *pool_arg) {
+    thread_pool_instance *pool = (thread_pool_instance *)pool_arg;
+    ScopedSpinLock lock(&thread_pools_lock);
+    // Replace or remove any existing binding for this user_context.
+    thread_pool_binding **b = &thread_pool_bindings;
+    while (*b && (*b)->user_context != user_context) {
+        b = &((*b)->next);
+    }
+    if (*b) {
+        if (pool) {
+            (*b)->pool = pool;
+        } else {
+            thread_pool_binding *dead = *b;
+            *b = dead->next;
+            free(dead);
+        }
+        return 0;
+    }
+    if (!pool) {
+        return 0;
+    }
+    thread_pool_binding *binding = (thread_pool_binding *)malloc(sizeof(thread_pool_binding));
+    if (!binding) {
+        return halide_error_code_out_of_memory;
+    }
+    binding->user_context = user_context;
+    binding->pool = pool;
+    binding->next = thread_pool_bindings;
+    __atomic_store_n(&thread_pool_bindings, binding, __ATOMIC_RELEASE);
+    return 0;
 }
 
 }
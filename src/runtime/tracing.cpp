@@ -1,5 +1,6 @@
 #include "HalideRuntime.h"
 #include "printer.h"
+#include "scoped_mutex_lock.h"
 #include "scoped_spin_lock.h"
 
 extern "C" {
@@ -10,123 +11,160 @@ typedef int32_t (*trace_fn)(void *, const halide_trace_event_t *);
 
 namespace Halide { namespace Runtime { namespace Internal {
 
-// A spinlock that allows for shared and exclusive access. It's
-// equivalent to a reader-writer lock, but in my case the "readers"
-// will actually be writing simultaneously to the trace buffer, so
-// that's a bad name. We use the __sync primitives used elsewhere in
-// the runtime for atomic work. They are well supported by clang.
-class SharedExclusiveSpinLock {
-    volatile uint32_t lock;
-
-    // Covers a single bit indicating one owner has exclusive
-    // access. The waiting bit can be set while the exclusive bit is
-    // set, but the bits masked by shared_mask must be zero while this
-    // bit is set.
-    const static uint32_t exclusive_held_mask = 0x80000000;
-
-    // Set to indicate a thread needs to acquire exclusive
-    // access. Other fields of the lock may be set, but no shared
-    // access request will proceed while this bit is set.
-    const static uint32_t exclusive_waiting_mask = 0x40000000;
-
-    // Count of threads currently holding shared access. Must be zero
-    // if the exclusive bit is set. Cannot increase if the waiting bit
-    // is set.
-    const static uint32_t shared_mask = 0x3fffffff;
+const static int buffer_size = 1024 * 1024;
 
-public:
-    __attribute__((always_inline)) void acquire_shared() {
-        while (1) {
-            uint32_t x = lock & shared_mask;
-            if (__sync_bool_compare_and_swap(&lock, x, x + 1)) {
-                return;
-            }
+// The number of buffers packets can be written to while full ones
+// wait to be written out.
+const static int num_buffers = 8;
+
+// Packets are written to a ring of buffers, in the order their space
+// was claimed, so the file has the same packet order as a single
+// buffer would. A thread claims space with a single atomic add on the
+// cursor, and no lock. When a buffer fills, the thread whose claim
+// overflowed it seals it and moves the cursor to the next buffer, and
+// a background thread writes the sealed buffers to the file. Threads
+// only wait for a write if all the other buffers are still waiting to
+// be written. Where threads can't be spawned, the thread that seals a
+// buffer writes it out.
+class TraceBuffer {
+    // The high 32 bits are the sequence number of the buffer being
+    // filled, and the low 32 bits the bytes claimed in it. Buffer
+    // number n is buf[n % num_buffers].
+    uint64_t cursor;
+
+    // Buffers before this one are sealed, and their sizes set.
+    uint32_t sealed;
+
+    // Buffers before this one have been written to the file.
+    uint32_t written;
+
+    // The bytes claimed in each sealed buffer, and the bytes of
+    // packets written into each buffer so far.
+    uint32_t size[num_buffers];
+    uint32_t committed[num_buffers];
+
+    // Only changed with write_lock held.
+    int fd;
+    bool write_failed;
+
+    // Signaled when a buffer is sealed, if there is a background
+    // thread to write it out.
+    halide_wakeup *writer_wakeup;
+
+    // Held while writing buffers to the file.
+    halide_mutex write_lock;
+
+    uint8_t buf[num_buffers][buffer_size];
+
+    // Seal the buffer being filled, with the given number of bytes
+    // claimed in it, and move to the next one. Must be called by the
+    // one thread whose claim took the buffer past its end.
+    __attribute__((always_inline)) void seal(uint32_t seq, uint32_t bytes) {
+        size[seq % num_buffers] = bytes;
+        __atomic_store_n(&sealed, seq + 1, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&written, __ATOMIC_ACQUIRE) + num_buffers <= seq + 1) {
+            // The next buffer still holds packets waiting to be
+            // written out. Write it ourselves.
+            write_sealed();
         }
-    }
-
-     __attribute__((always_inline)) void release_shared() {
-        __sync_fetch_and_sub(&lock, 1);
-    }
-
-    __attribute__((always_inline)) void acquire_exclusive() {
-        while (1) {
-            // If multiple threads are trying to acquire exclusive
-            // ownership, we may need to rerequest exclusive waiting
-            // while we spin, as it gets unset whenever a thread
-            // acquires exclusive ownership.
-            __sync_fetch_and_or(&lock, exclusive_waiting_mask);
-            if (__sync_bool_compare_and_swap(&lock, exclusive_waiting_mask, exclusive_held_mask)) {
-                return;
-            }
+        __atomic_store_n(&cursor, (uint64_t)(seq + 1) << 32, __ATOMIC_RELEASE);
+        if (writer_wakeup) {
+            halide_wakeup_signal(writer_wakeup);
+        } else {
+            write_sealed();
         }
     }
 
-    __attribute__((always_inline)) void release_exclusive() {
-        __sync_fetch_and_and(&lock, ~exclusive_held_mask);
+    // Wait for the buffer being filled to be sealed by another thread.
+    __attribute__((always_inline)) void wait_for_seal(uint32_t seq) {
+        while ((uint32_t)(__atomic_load_n(&cursor, __ATOMIC_ACQUIRE) >> 32) == seq) {
+        }
     }
 
-    SharedExclusiveSpinLock() : lock(0) {}
-};
-
-const static int buffer_size = 1024 * 1024;
-
-class TraceBuffer {
-    SharedExclusiveSpinLock lock;
-    uint32_t cursor;
-    uint8_t buf[buffer_size];
-
     // Attempt to atomically acquire space in the buffer to write a
     // packet. Returns NULL if the buffer was full.
     __attribute__((always_inline)) halide_trace_packet_t *try_acquire_packet(void *user_context, uint32_t size) {
-        lock.acquire_shared();
         halide_assert(user_context, size <= buffer_size);
-        uint32_t my_cursor = __sync_fetch_and_add(&cursor, size);
-        if (my_cursor + size > sizeof(buf)) {
-            __sync_fetch_and_sub(&cursor, size);
-            lock.release_shared();
-            return NULL;
+        uint64_t old = __atomic_fetch_add(&cursor, (uint64_t)size, __ATOMIC_ACQ_REL);
+        uint32_t seq = (uint32_t)(old >> 32);
+        uint32_t my_cursor = (uint32_t)old;
+        if (my_cursor + size <= buffer_size) {
+            return (halide_trace_packet_t *)(buf[seq % num_buffers] + my_cursor);
+        } else if (my_cursor <= buffer_size) {
+            seal(seq, my_cursor);
         } else {
-            return (halide_trace_packet_t *)(buf + my_cursor);
+            wait_for_seal(seq);
         }
+        return NULL;
     }
 
 public:
 
-    // Wait for all writers to finish with their packets, stall any
-    // new writers, and flush the buffer to the fd.
-    __attribute__((always_inline)) void flush(void *user_context, int fd) {
-        lock.acquire_exclusive();
-        bool success = true;
-        if (cursor) {
-            success = (cursor == (uint32_t)write(fd, buf, cursor));
-            cursor = 0;
+    // Write all sealed buffers to the file, in order, once the packets
+    // in them are complete.
+    void write_sealed() {
+        ScopedMutexLock lock(&write_lock);
+        uint32_t end = __atomic_load_n(&sealed, __ATOMIC_ACQUIRE);
+        for (uint32_t seq = written; seq != end; seq++) {
+            int i = seq % num_buffers;
+            // Wait for any threads still writing packets into it.
+            while (__atomic_load_n(&committed[i], __ATOMIC_ACQUIRE) != size[i]) {
+            }
+            if (size[i] && size[i] != (uint32_t)write(fd, buf[i], size[i])) {
+                write_failed = true;
+            }
+            committed[i] = 0;
+            __atomic_store_n(&written, seq + 1, __ATOMIC_RELEASE);
         }
-        lock.release_exclusive();
-        halide_assert(user_context, success && "Could not write to trace file");
+    }
+
+    // Seal the buffer being filled, even if it isn't full, and write
+    // everything traced so far to the file.
+    __attribute__((always_inline)) void flush(void *user_context) {
+        uint64_t old = __atomic_fetch_add(&cursor, (uint64_t)buffer_size + 1, __ATOMIC_ACQ_REL);
+        uint32_t seq = (uint32_t)(old >> 32);
+        uint32_t my_cursor = (uint32_t)old;
+        if (my_cursor <= buffer_size) {
+            seal(seq, my_cursor);
+        } else {
+            wait_for_seal(seq);
+        }
+        write_sealed();
+        halide_assert(user_context, !write_failed && "Could not write to trace file");
     }
 
     // Acquire and return a packet's worth of space in the trace
-    // buffer, flushing the trace buffer to the given fd to make space
-    // if necessary. The region acquired is protected from other
-    // threads writing or reading to it, so it must be released before
-    // a flush can occur.
-    __attribute__((always_inline)) halide_trace_packet_t *acquire_packet(void *user_context, int fd, uint32_t size) {
+    // buffer. The packet must be released before the buffer it is in
+    // can be written out.
+    __attribute__((always_inline)) halide_trace_packet_t *acquire_packet(void *user_context, uint32_t size) {
         halide_trace_packet_t *packet = NULL;
         while (!(packet = try_acquire_packet(user_context, size))) {
-            // Couldn't acquire space to write a packet. Flush and try again.
-            flush(user_context, fd);
+            // The buffer was full. Try again in the next one.
         }
         return packet;
     }
 
-    // Release a packet, allowing it to be written out with flush
-    __attribute__((always_inline)) void release_packet(halide_trace_packet_t *) {
-        // Need a memory barrier to guarantee all the writes are done.
-        __sync_synchronize();
-        lock.release_shared();
+    // Release a packet, allowing it to be written out.
+    __attribute__((always_inline)) void release_packet(halide_trace_packet_t *packet) {
+        int i = (int)(((uint8_t *)packet - &buf[0][0]) / buffer_size);
+        // Release ordering guarantees all the writes to the packet
+        // are done.
+        __atomic_fetch_add(&committed[i], packet->size, __ATOMIC_RELEASE);
+    }
+
+    // Write everything traced so far to the current file, and send
+    // packets traced from now on to a new one.
+    void set_fd(void *user_context, int new_fd) {
+        flush(user_context);
+        ScopedMutexLock lock(&write_lock);
+        fd = new_fd;
     }
 
-    TraceBuffer() : cursor(0) {}
+    void init(int trace_fd, halide_wakeup *wakeup) {
+        memset(this, 0, sizeof(*this) - sizeof(buf));
+        fd = trace_fd;
+        writer_wakeup = wakeup;
+    }
 };
 
 WEAK TraceBuffer *halide_trace_buffer = NULL;
@@ -135,6 +173,51 @@ WEAK int halide_trace_file_lock = 0;
 WEAK bool halide_trace_file_initialized = false;
 WEAK void *halide_trace_file_internally_opened = NULL;
 
+// The background thread that writes out sealed trace buffers, what
+// it sleeps on while there are none, and the flag that tells it to
+// stop.
+WEAK halide_thread *halide_trace_writer = NULL;
+WEAK halide_wakeup halide_trace_writer_wakeup;
+WEAK bool halide_trace_writer_stop = false;
+
+WEAK void trace_writer_thread(void *) {
+    while (true) {
+        halide_wakeup_wait(&halide_trace_writer_wakeup);
+        if (__atomic_load_n(&halide_trace_writer_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        TraceBuffer *b = __atomic_load_n(&halide_trace_buffer, __ATOMIC_ACQUIRE);
+        b->write_sealed();
+    }
+}
+
+// Get the buffer packets for the given fd are written to, creating it
+// and starting the thread that writes it out on first use.
+WEAK TraceBuffer *get_trace_buffer(void *user_context, int fd) {
+    TraceBuffer *b = __atomic_load_n(&halide_trace_buffer, __ATOMIC_ACQUIRE);
+    if (b) {
+        return b;
+    }
+    ScopedSpinLock lock(&halide_trace_file_lock);
+    if (!halide_trace_buffer) {
+        b = (TraceBuffer *)malloc(sizeof(TraceBuffer));
+        halide_assert(user_context, b && "Could not allocate trace buffer");
+        // If threads aren't available, the threads that fill buffers
+        // write them out instead.
+        bool use_writer = halide_can_spawn_threads();
+        if (use_writer) {
+            halide_wakeup_init(&halide_trace_writer_wakeup);
+        }
+        b->init(fd, use_writer ? &halide_trace_writer_wakeup : NULL);
+        __atomic_store_n(&halide_trace_buffer, b, __ATOMIC_RELEASE);
+        if (use_writer) {
+            halide_trace_writer_stop = false;
+            halide_trace_writer = halide_spawn_thread(trace_writer_thread, NULL);
+        }
+    }
+    return halide_trace_buffer;
+}
+
 }}}
 
 extern "C" {
@@ -156,7 +239,8 @@ WEAK int32_t halide_default_trace(void *user_context, const halide_trace_event_t
         uint32_t total_size = (total_size_without_padding + 3) & ~3;
 
         // Claim some space to write to in the trace buffer
-        halide_trace_packet_t *packet = halide_trace_buffer->acquire_packet(user_context, fd, total_size);
+        TraceBuffer *trace_buffer = get_trace_buffer(user_context, fd);
+        halide_trace_packet_t *packet = trace_buffer->acquire_packet(user_context, total_size);
 
         if (total_size > 4096) {
             print(NULL) << total_size << "\n";
@@ -179,12 +263,12 @@ WEAK int32_t halide_default_trace(void *user_context, const halide_trace_event_t
         memcpy((void *)packet->func(), e->func, name_bytes);
 
         // Release it
-        halide_trace_buffer->release_packet(packet);
+        trace_buffer->release_packet(packet);
 
         // We should also flush the trace buffer if we hit an event
         // that might be the end of the trace.
         if (e->event == halide_trace_end_pipeline) {
-            halide_trace_buffer->flush(user_context, fd);
+            trace_buffer->flush(user_context);
         }
 
     } else {
@@ -307,12 +391,23 @@ WEAK trace_fn halide_set_custom_trace(trace_fn t) {
 }
 
 WEAK void halide_set_trace_file(int fd) {
-    halide_trace_file = fd;
+    // Packets already traced belong in the old file.
+    TraceBuffer *b = __atomic_load_n(&halide_trace_buffer, __ATOMIC_ACQUIRE);
+    if (b) {
+        b->set_fd(NULL, fd);
+    }
+    __atomic_store_n(&halide_trace_file, fd, __ATOMIC_RELEASE);
 }
 
 extern int errno;
 
 WEAK int halide_get_trace_file(void *user_context) {
+    // This is called for every event, so don't take the lock once
+    // the file is known.
+    int fd = __atomic_load_n(&halide_trace_file, __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+        return fd;
+    }
     ScopedSpinLock lock(&halide_trace_file_lock);
     if (halide_trace_file < 0) {
         const char *trace_file_name = getenv("HL_TRACE_FILE");
@@ -321,9 +416,6 @@ WEAK int halide_get_trace_file(void *user_context) {
             halide_assert(user_context, file && "Failed to open trace file\n");
             halide_set_trace_file(fileno(file));
             halide_trace_file_internally_opened = file;
-            if (!halide_trace_buffer) {
-                halide_trace_buffer = (TraceBuffer *)malloc(sizeof(TraceBuffer));
-            }
         } else {
             halide_set_trace_file(0);
         }
@@ -336,14 +428,23 @@ WEAK int32_t halide_trace(void *user_context, const halide_trace_event_t *e) {
 }
 
 WEAK int halide_shutdown_trace() {
+    if (halide_trace_buffer) {
+        halide_trace_buffer->flush(NULL);
+        if (halide_trace_writer) {
+            __atomic_store_n(&halide_trace_writer_stop, true, __ATOMIC_RELEASE);
+            halide_wakeup_signal(&halide_trace_writer_wakeup);
+            halide_join_thread(halide_trace_writer);
+            halide_trace_writer = NULL;
+            halide_wakeup_destroy(&halide_trace_writer_wakeup);
+        }
+        free(halide_trace_buffer);
+        halide_trace_buffer = NULL;
+    }
     if (halide_trace_file_internally_opened) {
         int ret = fclose(halide_trace_file_internally_opened);
         halide_trace_file = 0;
         halide_trace_file_initialized = false;
         halide_trace_file_internally_opened = NULL;
-        if (halide_trace_buffer) {
-            free(halide_trace_buffer);
-        }
         return ret;
     } else {
         return 0;
@@ -20,13 +20,22 @@ typedef struct {
 extern WIN32API Thread CreateThread(void *, size_t, void *(*fn)(void *), void *, int32_t, int32_t *);
 extern WIN32API void InitializeConditionVariable(ConditionVariable *);
 extern WIN32API void WakeAllConditionVariable(ConditionVariable *);
+extern WIN32API void WakeConditionVariable(ConditionVariable *);
 extern WIN32API void SleepConditionVariableCS(ConditionVariable *, CriticalSection *, int);
 extern WIN32API void InitializeCriticalSection(CriticalSection *);
 extern WIN32API void DeleteCriticalSection(CriticalSection *);
 extern WIN32API void EnterCriticalSection(CriticalSection *);
 extern WIN32API void LeaveCriticalSection(CriticalSection *);
 extern WIN32API int32_t WaitForSingleObject(Thread, int32_t timeout);
+extern WIN32API Thread GetCurrentThread();
+extern WIN32API bool SwitchToThread();
+extern WIN32API uint64_t SetThreadAffinityMask(Thread, uint64_t);
+extern WIN32API bool SetThreadPriority(Thread, int);
 extern WIN32API bool InitOnceExecuteOnce(InitOnce *, bool WIN32API (*f)(InitOnce *, void *, void **), void *, void **);
+extern WIN32API uint32_t FlsAlloc(void WIN32API (*callback)(void *));
+extern WIN32API bool FlsFree(uint32_t);
+extern WIN32API void *FlsGetValue(uint32_t);
+extern WIN32API bool FlsSetValue(uint32_t, void *);
 
 } // extern "C"
 
@@ -106,12 +115,51 @@ WEAK void halide_cond_broadcast(struct halide_cond *cond_arg) {
     WakeAllConditionVariable(cond);
 }
 
+WEAK void halide_cond_signal(struct halide_cond *cond_arg) {
+    ConditionVariable *cond = (ConditionVariable *)cond_arg;
+    WakeConditionVariable(cond);
+}
+
 WEAK void halide_cond_wait(struct halide_cond *cond_arg, struct halide_mutex *mutex_arg) {
     ConditionVariable *cond = (ConditionVariable *)cond_arg;
     windows_mutex *mutex = (windows_mutex *)mutex_arg;
     SleepConditionVariableCS(cond, &mutex->critical_section, -1);
 }
 
+WEAK int halide_get_cpu_order(int *cpus, int max_cpus) {
+    // We don't query the NUMA topology on windows, so just use the
+    // cores in order.
+    int count = halide_host_cpu_count();
+    if (count > max_cpus) {
+        count = max_cpus;
+    }
+    for (int i = 0; i < count; i++) {
+        cpus[i] = i;
+    }
+    return count;
+}
+
+WEAK int halide_set_current_thread_cpu(int cpu) {
+    // Affinity masks only cover the first processor group.
+    if (cpu >= 64) {
+        return -1;
+    }
+    uint64_t mask = cpu < 0 ? ~(uint64_t)0 : ((uint64_t)1) << cpu;
+    return SetThreadAffinityMask(GetCurrentThread(), mask) ? 0 : -1;
+}
+
+WEAK void halide_thread_yield() {
+    SwitchToThread();
+}
+
+WEAK int halide_set_current_thread_priority(int priority) {
+    // Windows thread priorities run from THREAD_PRIORITY_LOWEST (-2)
+    // to THREAD_PRIORITY_HIGHEST (2).
+    if (priority < -2) priority = -2;
+    if (priority > 2) priority = 2;
+    return SetThreadPriority(GetCurrentThread(), priority) ? 0 : -1;
+}
+
 WEAK int halide_host_cpu_count() {
     // Apparently a standard windows environment variable
     char *num_cores = getenv("NUMBER_OF_PROCESSORS");
@@ -123,3 +171,38 @@ WEAK int halide_host_cpu_count() {
 }
 
 } // extern "C"
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// Fiber local storage, rather than thread local storage, because only
+// it runs a callback when a thread exits.
+const uint32_t kFlsOutOfIndexes = 0xffffffff;
+WEAK uint32_t thread_id_key = kFlsOutOfIndexes;
+WEAK void (*thread_id_key_destructor)(void *) = NULL;
+
+WEAK WIN32API void thread_id_key_callback(void *value) {
+    thread_id_key_destructor(value);
+}
+
+WEAK bool thread_id_key_create(void (*destructor)(void *)) {
+    thread_id_key_destructor = destructor;
+    thread_id_key = FlsAlloc(thread_id_key_callback);
+    return thread_id_key != kFlsOutOfIndexes;
+}
+
+WEAK void thread_id_key_delete() {
+    FlsFree(thread_id_key);
+    thread_id_key = kFlsOutOfIndexes;
+}
+
+WEAK void *thread_id_key_get() {
+    return FlsGetValue(thread_id_key);
+}
+
+WEAK bool thread_id_key_set(void *value) {
+    return FlsSetValue(thread_id_key, value);
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+#include "thread_ids.h"
@@ -0,0 +1,172 @@
+#include "HalideRuntime.h"
+#include "runtime_internal.h"
+#include "scoped_mutex_lock.h"
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// Buffers for allocations inside parallel loops whose size doesn't
+// change from one task to the next. The pipeline creates a set of
+// buffers before the loop, and each task acquires one of them instead
+// of calling halide_malloc.
+//
+// A task's first choice of slot is the one picked by the id of the
+// thread running it. A worker thread running one task after another
+// then gets the same buffer every time, which is still in its cache.
+// If that slot is in use, e.g. because the thread is running a task
+// nested inside another, the task takes the next free one.
+//
+// Slot buffers are allocated the first time they are acquired. Each
+// one records the address of its slot's in-use flag in the word before
+// it, so halide_worker_buffers_release can find it. Buffers handed out
+// when every slot is in use record NULL there instead.
+
+const int kMaxWorkerBufferSlotsLog2 = 8;
+const int kMaxWorkerBufferSlots = 1 << kMaxWorkerBufferSlotsLog2;
+
+// The most sets kept between calls when caching is enabled.
+const int kMaxCachedWorkerBufferSets = 16;
+
+struct WorkerBufferSet {
+    size_t size;
+    WorkerBufferSet *next;
+    int in_use[kMaxWorkerBufferSlots];
+    void *slots[kMaxWorkerBufferSlots];
+};
+
+WEAK halide_mutex worker_buffer_cache_lock;
+WEAK WorkerBufferSet *cached_worker_buffer_sets = NULL;
+WEAK int num_cached_worker_buffer_sets = 0;
+WEAK bool worker_buffer_caching = false;
+
+WEAK int worker_buffer_slot_hint() {
+    return current_thread_slot(kMaxWorkerBufferSlotsLog2);
+}
+
+// Allocate a buffer of the given size with a header word in front of
+// it, keeping the buffer aligned.
+WEAK void *new_worker_buffer(void *user_context, size_t size, int *in_use) {
+    const size_t alignment = halide_malloc_alignment();
+    void *orig = halide_malloc(user_context, size + alignment);
+    if (orig == NULL) {
+        return NULL;
+    }
+    void *ptr = (char *)orig + alignment;
+    ((int **)ptr)[-1] = in_use;
+    return ptr;
+}
+
+WEAK void free_worker_buffer(void *user_context, void *ptr) {
+    halide_free(user_context, (char *)ptr - halide_malloc_alignment());
+}
+
+WEAK void free_worker_buffer_set(void *user_context, WorkerBufferSet *set) {
+    for (int i = 0; i < kMaxWorkerBufferSlots; i++) {
+        if (set->slots[i]) {
+            free_worker_buffer(user_context, set->slots[i]);
+        }
+    }
+    halide_free(user_context, set);
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+using namespace Halide::Runtime::Internal;
+
+extern "C" {
+
+WEAK void *halide_worker_buffers_create(void *user_context, uint64_t size) {
+    if (__atomic_load_n(&worker_buffer_caching, __ATOMIC_RELAXED)) {
+        ScopedMutexLock lock(&worker_buffer_cache_lock);
+        WorkerBufferSet **prev = &cached_worker_buffer_sets;
+        for (WorkerBufferSet *set = *prev; set; prev = &set->next, set = set->next) {
+            if (set->size == size) {
+                *prev = set->next;
+                num_cached_worker_buffer_sets--;
+                set->next = NULL;
+                return set;
+            }
+        }
+    }
+
+    WorkerBufferSet *set = (WorkerBufferSet *)halide_malloc(user_context, sizeof(WorkerBufferSet));
+    if (set == NULL) {
+        return NULL;
+    }
+    memset(set, 0, sizeof(WorkerBufferSet));
+    set->size = size;
+    return set;
+}
+
+WEAK void *halide_worker_buffers_acquire(void *user_context, void *buffers) {
+    WorkerBufferSet *set = (WorkerBufferSet *)buffers;
+    int start = worker_buffer_slot_hint();
+    for (int j = 0; j < kMaxWorkerBufferSlots; j++) {
+        int i = (start + j) % kMaxWorkerBufferSlots;
+        if (__sync_bool_compare_and_swap(&set->in_use[i], 0, 1)) {
+            // This task owns slot i until it releases it.
+            if (set->slots[i] == NULL) {
+                set->slots[i] = new_worker_buffer(user_context, set->size, &set->in_use[i]);
+                if (set->slots[i] == NULL) {
+                    __sync_lock_release(&set->in_use[i]);
+                    return NULL;
+                }
+            }
+            return set->slots[i];
+        }
+    }
+    // More tasks than slots are running at once.
+    return new_worker_buffer(user_context, set->size, NULL);
+}
+
+WEAK void halide_worker_buffers_release(void *user_context, void *ptr) {
+    int *in_use = ((int **)ptr)[-1];
+    if (in_use) {
+        __sync_lock_release(in_use);
+    } else {
+        free_worker_buffer(user_context, ptr);
+    }
+}
+
+WEAK void halide_worker_buffers_destroy(void *user_context, void *buffers) {
+    WorkerBufferSet *set = (WorkerBufferSet *)buffers;
+    if (__atomic_load_n(&worker_buffer_caching, __ATOMIC_RELAXED)) {
+        ScopedMutexLock lock(&worker_buffer_cache_lock);
+        if (num_cached_worker_buffer_sets < kMaxCachedWorkerBufferSets) {
+            set->next = cached_worker_buffer_sets;
+            cached_worker_buffer_sets = set;
+            num_cached_worker_buffer_sets++;
+            return;
+        }
+    }
+    free_worker_buffer_set(user_context, set);
+}
+
+WEAK void halide_worker_buffers_set_caching(bool enabled) {
+    __atomic_store_n(&worker_buffer_caching, enabled, __ATOMIC_RELAXED);
+}
+
+WEAK void halide_worker_buffers_trim(void *user_context) {
+    WorkerBufferSet *sets;
+    {
+        ScopedMutexLock lock(&worker_buffer_cache_lock);
+        sets = cached_worker_buffer_sets;
+        cached_worker_buffer_sets = NULL;
+        num_cached_worker_buffer_sets = 0;
+    }
+    while (sets) {
+        WorkerBufferSet *next = sets->next;
+        free_worker_buffer_set(user_context, sets);
+        sets = next;
+    }
+}
+
+namespace {
+
+__attribute__((destructor))
+WEAK void halide_worker_buffers_cleanup() {
+    halide_worker_buffers_trim(NULL);
+}
+
+}
+
+}
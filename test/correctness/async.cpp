@@ -0,0 +1,137 @@
+#include "Halide.h"
+#include <stdio.h>
+
+using namespace Halide;
+
+bool error_occurred = false;
+void my_error_handler(void *ctx, const char *msg) {
+    // Don't emit "error" to stdout, or the test is reported as failing
+    // on some platforms.
+    printf("Saw (expected) err: %s\n", msg);
+    error_occurred = true;
+}
+
+int check(const Buffer<int> &out, int offset) {
+    for (int y = 0; y < out.height(); y++) {
+        for (int x = 0; x < out.width(); x++) {
+            // Each test computes g(x, y) = f(x, y - 1) + f(x, y) + f(x, y + 1)
+            // with f(x, y) = x + y + offset
+            int correct = 3 * (x + y + offset);
+            if (out(x, y) != correct) {
+                printf("out(%d, %d) = %d instead of %d\n",
+                       x, y, out(x, y), correct);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int run_tests() {
+    Var x, y;
+
+    {
+        // An async producer with its storage folded into a circular
+        // buffer, computed a row at a time and consumed with a
+        // sliding window.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y - 1) + f(x, y) + f(x, y + 1);
+        f.store_root().compute_at(g, y).fold_storage(y, 4).async();
+
+        Buffer<int> out = g.realize(64, 64);
+        if (check(out, 0)) return -1;
+    }
+
+    {
+        // An async producer computed per row band, without storage folding.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y - 1) + f(x, y) + f(x, y + 1);
+        Var yo, yi;
+        g.split(y, yo, yi, 8);
+        f.compute_at(g, yo).async();
+
+        Buffer<int> out = g.realize(64, 64);
+        if (check(out, 0)) return -1;
+    }
+
+    {
+        // The async producer reads from another Func computed at the
+        // same level, which the producer task has to compute as well.
+        Func h, f, g;
+        h(x, y) = x + y;
+        f(x, y) = h(x, y) + 1;
+        g(x, y) = f(x, y - 1) + f(x, y) + f(x, y + 1);
+        h.compute_at(g, y);
+        f.store_root().compute_at(g, y).fold_storage(y, 4).async();
+
+        Buffer<int> out = g.realize(64, 64);
+        if (check(out, 1)) return -1;
+    }
+
+    {
+        // An async producer inside a parallel loop, with its own
+        // parallel loops.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y - 1) + f(x, y) + f(x, y + 1);
+        Var yo, yi;
+        g.split(y, yo, yi, 16).parallel(yo);
+        f.store_at(g, yo).compute_at(g, yi).fold_storage(y, 4).async().parallel(x, 16);
+
+        Buffer<int> out = g.realize(64, 64);
+        if (check(out, 0)) return -1;
+    }
+
+    {
+        // The producer fails partway through while the consumer is
+        // waiting for it. The consumer must give up too.
+        Func f, g;
+        f(x, y) = require(y < 32, x + y, "f is only defined for y < 32");
+        g(x, y) = f(x, y - 1) + f(x, y) + f(x, y + 1);
+        f.store_root().compute_at(g, y).fold_storage(y, 4).async();
+        g.set_error_handler(my_error_handler);
+
+        error_occurred = false;
+        g.realize(64, 64);
+        if (!error_occurred) {
+            printf("The producer should have failed\n");
+            return -1;
+        }
+    }
+
+    {
+        // The consumer fails partway through while the producer is
+        // waiting for a free slot in the folded storage.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = require(y < 32, f(x, y - 1) + f(x, y) + f(x, y + 1),
+                          "g is only defined for y < 32");
+        f.store_root().compute_at(g, y).fold_storage(y, 4).async();
+        g.set_error_handler(my_error_handler);
+
+        error_occurred = false;
+        g.realize(64, 64);
+        if (!error_occurred) {
+            printf("The consumer should have failed\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (run_tests()) return -1;
+
+    // The producer and consumer must make progress even when the
+    // thread pool only has one thread.
+    static char num_threads[] = "HL_NUM_THREADS=1";
+    putenv(num_threads);
+    Halide::Internal::JITSharedRuntime::release_all();
+    if (run_tests()) return -1;
+
+    printf("Success!\n");
+    return 0;
+}
@@ -613,6 +613,133 @@ int main(int argc, char **argv) {
 
     }
 
+    {
+        // Results in one partition of the cache must not be evicted to
+        // make room for results in another, however many there are.
+        Param<uint8_t> keep_val, churn_val;
+        Var x, y;
+
+        Func keep_calls;
+        keep_calls.define_extern("count_calls_with_arg", {keep_val}, UInt(8), 2);
+        keep_calls.compute_root().memoize("keep");
+        Func keep;
+        keep(x, y) = keep_calls(x, y);
+
+        Func churn_calls;
+        churn_calls.define_extern("count_calls_with_arg", {churn_val}, UInt(8), 2);
+        churn_calls.compute_root().memoize();
+        Func churn;
+        churn(x, y) = churn_calls(x, y);
+        Pipeline churn_pipe(churn);
+        churn_pipe.set_memoization_partition("churn");
+
+        Internal::JITSharedRuntime::memoization_cache_set_partition_size("keep", 100000);
+        Internal::JITSharedRuntime::memoization_cache_set_partition_size("churn", 100000);
+
+        call_count_with_arg = 0;
+        keep_val.set(7);
+        Buffer<uint8_t> out1 = keep.realize(128, 128);
+        assert(call_count_with_arg == 1);
+
+        // Each result is 16K, so this is several times the size of
+        // the churn partition.
+        for (int v = 0; v < 64; v++) {
+            churn_val.set((uint8_t)v);
+            Buffer<uint8_t> churned = churn_pipe.realize(128, 128);
+            assert(churned(0, 0) == v);
+        }
+        assert(call_count_with_arg == 65);
+
+        Buffer<uint8_t> out2 = keep.realize(128, 128);
+        assert(call_count_with_arg == 65);
+        for (int32_t i = 0; i < 128; i++) {
+            for (int32_t j = 0; j < 128; j++) {
+                assert(out1(i, j) == 7);
+                assert(out2(i, j) == 7);
+            }
+        }
+
+        Internal::JITSharedRuntime::memoization_cache_set_partition_size("keep", 0);
+        Internal::JITSharedRuntime::memoization_cache_set_partition_size("churn", 0);
+    }
+
+    {
+        // A memoized Func scheduled to reuse crops is not recomputed
+        // when the region required lies within one computed before.
+        Param<uint8_t> val;
+        Param<int> offset;
+        Var x, y;
+
+        Func count_calls;
+        count_calls.define_extern("count_calls_with_arg", {val}, UInt(8), 2);
+        count_calls.compute_root().memoize_reuse_crops();
+        Func f;
+        f(x, y) = count_calls(x + offset, y + offset);
+
+        call_count_with_arg = 0;
+        val.set(11);
+        offset.set(0);
+        Buffer<uint8_t> whole = f.realize(128, 128);
+        assert(call_count_with_arg == 1);
+
+        offset.set(16);
+        Buffer<uint8_t> cropped = f.realize(64, 64);
+        assert(call_count_with_arg == 1);
+        for (int32_t i = 0; i < 64; i++) {
+            for (int32_t j = 0; j < 64; j++) {
+                assert(cropped(i, j) == 11);
+            }
+        }
+
+        // Only partly within the region computed before.
+        offset.set(100);
+        Buffer<uint8_t> shifted = f.realize(64, 64);
+        assert(call_count_with_arg == 2);
+    }
+
+#ifndef _WIN32
+    {
+        // Results written to the on-disk tier outlive the runtime
+        // that computed them. Everything is named explicitly, so that
+        // later pipelines have the same cache key and algorithm as
+        // the first. Only pipelines compiled with memoize_disk use
+        // the disk tier, so the first two runs compute the result
+        // each time.
+        static std::string disk_dir = "HL_MEMOIZATION_CACHE_DIR=" + Internal::dir_make_temp();
+        putenv(&disk_dir[0]);
+
+        for (int run = 0; run < 4; run++) {
+            Internal::JITSharedRuntime::release_all();
+
+            Param<uint8_t> val("disk_tier_val");
+            Var x("x"), y("y");
+            Func count_calls("disk_tier_count_calls");
+            count_calls.define_extern("count_calls_with_arg", {val}, UInt(8), 2);
+            count_calls.compute_root().memoize();
+            Func f("disk_tier_f");
+            f(x, y) = count_calls(x, y);
+
+            call_count_with_arg = 0;
+            val.set(23);
+            Target t = get_jit_target_from_environment();
+            if (run >= 2) {
+                t.set_feature(Target::MemoizeDisk);
+            }
+            Buffer<uint8_t> out = f.realize(128, 128, t);
+            assert(call_count_with_arg == (run == 3 ? 0 : 1));
+            for (int32_t i = 0; i < 128; i++) {
+                for (int32_t j = 0; j < 128; j++) {
+                    assert(out(i, j) == 23);
+                }
+            }
+        }
+
+        static char no_disk_dir[] = "HL_MEMOIZATION_CACHE_DIR=";
+        putenv(no_disk_dir);
+        Internal::JITSharedRuntime::release_all();
+    }
+#endif
+
     fprintf(stderr, "Success!\n");
     return 0;
 }
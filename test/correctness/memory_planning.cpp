@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include "Halide.h"
+
+using namespace Halide;
+
+int malloc_count = 0;
+int free_count = 0;
+size_t largest_malloc = 0;
+
+void *my_malloc(void *user_context, size_t x) {
+    malloc_count++;
+    largest_malloc = std::max(largest_malloc, x);
+    void *orig = malloc(x+32);
+    void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    return ptr;
+}
+
+void my_free(void *user_context, void *ptr) {
+    free_count++;
+    free(((void**)ptr)[-1]);
+}
+
+int main(int argc, char **argv) {
+    const int size = 256;
+    const size_t stage_bytes = size * size * sizeof(int);
+
+    // A chain of three stages computed at root, with a bounded
+    // output so that each intermediate has a known size. f is dead by
+    // the time h is computed, so h can reuse its memory.
+    Func f, g, h, out;
+    Var x, y;
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) * 2;
+    h(x, y) = g(x, y) + 1;
+    out(x, y) = h(x, y) + g(x, y);
+    f.compute_root();
+    g.compute_root();
+    h.compute_root();
+    out.bound(x, 0, size).bound(y, 0, size);
+
+    out.set_custom_allocator(my_malloc, my_free);
+    Buffer<int> result = out.realize(size, size);
+
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int correct = 4 * (x + y) + 1;
+            if (result(x, y) != correct) {
+                printf("result(%d, %d) = %d instead of %d\n", x, y, result(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    // The three intermediates should come from one allocation, big
+    // enough for two of them at a time.
+    if (malloc_count != 1 || free_count != 1) {
+        printf("Expected one call each to malloc and free, got %d and %d\n",
+               malloc_count, free_count);
+        return -1;
+    }
+
+    if (largest_malloc < 2 * stage_bytes || largest_malloc >= 3 * stage_bytes) {
+        printf("Unexpected arena size: %d\n", (int)largest_malloc);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <atomic>
+#include <stdio.h>
+#include "Halide.h"
+
+using namespace Halide;
+
+std::atomic<int> malloc_count(0);
+std::atomic<int> free_count(0);
+
+void *my_malloc(void *user_context, size_t x) {
+    malloc_count++;
+    void *orig = malloc(x+32);
+    void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    return ptr;
+}
+
+void my_free(void *user_context, void *ptr) {
+    free_count++;
+    free(((void**)ptr)[-1]);
+}
+
+int main(int argc, char **argv) {
+    const int rows = 1024;
+
+    // f is computed per row of a parallel loop, and its size depends
+    // on the width of the output, so it can't go on the stack. The
+    // size is the same for every row though, so each worker should
+    // reuse one buffer instead of allocating one per row.
+    Func f, g;
+    Var x, y;
+    f(x, y) = x + y;
+    g(x, y) = f(x - 1, y) + f(x + 1, y);
+    f.compute_at(g, y);
+    g.parallel(y);
+
+    g.set_custom_allocator(my_malloc, my_free);
+    Buffer<int> out = g.realize(100, rows);
+
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < 100; x++) {
+            int correct = 2 * (x + y);
+            if (out(x, y) != correct) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    if (malloc_count >= rows) {
+        printf("Expected fewer than one allocation per row, got %d\n", (int)malloc_count);
+        return -1;
+    }
+
+    if (malloc_count != free_count) {
+        printf("Mismatched calls to malloc and free: %d vs %d\n",
+               (int)malloc_count, (int)free_count);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include "Halide.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "test/common/halide_test_dirs.h"
+
+using namespace Halide;
+
+// Just enough of a JSON parser to check the profiler's output.
+struct JSONValue {
+    enum Kind {Null, Bool, Number, String, Array, Object} kind = Null;
+    std::string str;
+    double num = 0;
+    std::vector<JSONValue> items;
+    std::vector<std::pair<std::string, JSONValue>> members;
+
+    const JSONValue *get(const std::string &key) const {
+        for (const auto &m : members) {
+            if (m.first == key) {
+                return &m.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+struct JSONParser {
+    const std::string &text;
+    size_t pos = 0;
+    bool ok = true;
+
+    JSONParser(const std::string &text) : text(text) {}
+
+    void skip_space() {
+        while (pos < text.size() && isspace((unsigned char)text[pos])) {
+            pos++;
+        }
+    }
+
+    bool expect(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        ok = false;
+        return false;
+    }
+
+    bool peek(char c) {
+        skip_space();
+        return pos < text.size() && text[pos] == c;
+    }
+
+    std::string parse_string() {
+        std::string result;
+        if (!expect('"')) {
+            return result;
+        }
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if ((unsigned char)c < 0x20) {
+                ok = false;
+                return result;
+            }
+            if (c != '\\') {
+                result += c;
+                continue;
+            }
+            if (pos >= text.size()) {
+                break;
+            }
+            c = text[pos++];
+            switch (c) {
+            case '"': case '\\': case '/': result += c; break;
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u':
+                if (pos + 4 > text.size()) {
+                    ok = false;
+                    return result;
+                }
+                result += (char)strtol(text.substr(pos, 4).c_str(), nullptr, 16);
+                pos += 4;
+                break;
+            default:
+                ok = false;
+                return result;
+            }
+        }
+        expect('"');
+        return result;
+    }
+
+    JSONValue parse_value() {
+        JSONValue v;
+        skip_space();
+        if (pos >= text.size()) {
+            ok = false;
+        } else if (peek('{')) {
+            v.kind = JSONValue::Object;
+            expect('{');
+            while (ok && !peek('}')) {
+                std::string key = parse_string();
+                expect(':');
+                v.members.emplace_back(key, parse_value());
+                if (!peek('}')) {
+                    expect(',');
+                }
+            }
+            expect('}');
+        } else if (peek('[')) {
+            v.kind = JSONValue::Array;
+            expect('[');
+            while (ok && !peek(']')) {
+                v.items.push_back(parse_value());
+                if (!peek(']')) {
+                    expect(',');
+                }
+            }
+            expect(']');
+        } else if (peek('"')) {
+            v.kind = JSONValue::String;
+            v.str = parse_string();
+        } else if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+            v.kind = JSONValue::Bool;
+            pos += text[pos] == 't' ? 4 : 5;
+        } else if (text.compare(pos, 4, "null") == 0) {
+            pos += 4;
+        } else {
+            v.kind = JSONValue::Number;
+            const char *start = text.c_str() + pos;
+            char *end;
+            v.num = strtod(start, &end);
+            if (end == start) {
+                ok = false;
+            }
+            pos += end - start;
+        }
+        return v;
+    }
+};
+
+int main(int argc, char **argv) {
+    std::string json_file = Internal::get_test_tmp_dir() + "profiler_json.json";
+    Internal::ensure_no_file_exists(json_file);
+    // The JIT writes the profiler stats to this file after each run.
+#ifdef _WIN32
+    _putenv_s("HL_PROFILER_JSON", json_file.c_str());
+#else
+    setenv("HL_PROFILER_JSON", json_file.c_str(), 1);
+#endif
+
+    // Quotes and backslashes in Func names must be escaped.
+    const std::string quoted_name = "say \"hi\" \\ there";
+    Func f(quoted_name), g("g");
+    Var x, y;
+    f(x, y) = sin(x) + cos(y);
+    g(x, y) = f(x, y) + f(x + 1, y);
+    f.compute_root();
+
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    g.realize(1000, 1000, t);
+
+    Internal::assert_file_exists(json_file);
+    std::ifstream in(json_file);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    const std::string text = contents.str();
+
+    JSONParser parser(text);
+    JSONValue root = parser.parse_value();
+    parser.skip_space();
+    if (!parser.ok || parser.pos != text.size()) {
+        printf("%s is not valid JSON (stopped at byte %d):\n%s\n",
+               json_file.c_str(), (int)parser.pos, text.c_str());
+        return -1;
+    }
+
+    const char *keys[] = {"pipelines", "huge_pages", "thread_pool"};
+    if (root.kind != JSONValue::Object || root.members.size() != 3) {
+        printf("Expected an object with three members:\n%s\n", text.c_str());
+        return -1;
+    }
+    for (const char *key : keys) {
+        if (!root.get(key)) {
+            printf("Missing top-level key %s:\n%s\n", key, text.c_str());
+            return -1;
+        }
+    }
+
+    const JSONValue *pipelines = root.get("pipelines");
+    if (pipelines->kind != JSONValue::Array || pipelines->items.size() != 1) {
+        printf("Expected one pipeline:\n%s\n", text.c_str());
+        return -1;
+    }
+    const JSONValue &p = pipelines->items[0];
+    const JSONValue *runs = p.get("runs");
+    const JSONValue *funcs = p.get("funcs");
+    if (!runs || runs->num != 1 || !funcs || funcs->kind != JSONValue::Array) {
+        printf("Expected a pipeline that ran once, with a list of Funcs:\n%s\n", text.c_str());
+        return -1;
+    }
+    bool found = false;
+    for (const JSONValue &func : funcs->items) {
+        const JSONValue *name = func.get("name");
+        const JSONValue *time = func.get("time_ns");
+        if (!name || name->kind != JSONValue::String || !time || time->kind != JSONValue::Number) {
+            printf("Func without a name or time:\n%s\n", text.c_str());
+            return -1;
+        }
+        found = found || name->str == quoted_name;
+    }
+    if (!found) {
+        printf("Func %s is missing:\n%s\n", quoted_name.c_str(), text.c_str());
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "test/common/halide_test_dirs.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    std::string trace_file = Internal::get_test_tmp_dir() + "tracing_file.bin";
+    Internal::ensure_no_file_exists(trace_file);
+    // Halide opens this file the first time a pipeline is traced.
+#ifdef _WIN32
+    _putenv_s("HL_TRACE_FILE", trace_file.c_str());
+#else
+    setenv("HL_TRACE_FILE", trace_file.c_str(), 1);
+#endif
+
+    // Many threads tracing stores at once, into more packets than fit
+    // in one trace buffer.
+    const int width = 1000, height = 1000;
+    Func f("f");
+    Var x, y;
+    f(x, y) = x + y;
+    f.parallel(y).trace_stores();
+
+    Buffer<int> im = f.realize(width, height);
+
+    // The trace is written out by the end of the pipeline.
+    Internal::assert_file_exists(trace_file);
+    FILE *file = fopen(trace_file.c_str(), "rb");
+    if (!file) {
+        printf("Could not open %s\n", trace_file.c_str());
+        return -1;
+    }
+
+    std::vector<bool> seen(width * height, false);
+    int stores = 0, packets = 0;
+    int first_event = -1, last_event = -1;
+    halide_trace_packet_t header;
+    uint8_t payload[4096];
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        size_t payload_size = header.size - sizeof(header);
+        if (header.size < sizeof(header) || payload_size > sizeof(payload) ||
+            fread(payload, 1, payload_size, file) != payload_size) {
+            printf("Bad packet %d of size %u\n", packets, header.size);
+            return -1;
+        }
+        packets++;
+        if (first_event < 0) {
+            first_event = header.event;
+        }
+        last_event = header.event;
+        if (header.event != halide_trace_store) {
+            continue;
+        }
+        const int *coords = (const int *)payload;
+        const int *value = coords + header.dimensions;
+        for (int i = 0; i < header.type.lanes; i++) {
+            int px = coords[i], py = coords[header.type.lanes + i];
+            if (px < 0 || px >= width || py < 0 || py >= height ||
+                value[i] != px + py || seen[py * width + px]) {
+                printf("Bad store to f(%d, %d) of %d\n", px, py, value[i]);
+                return -1;
+            }
+            seen[py * width + px] = true;
+            stores++;
+        }
+    }
+    fclose(file);
+
+    if (stores != width * height) {
+        printf("Expected %d stores in the trace, found %d\n", width * height, stores);
+        return -1;
+    }
+
+    if (first_event != halide_trace_begin_pipeline || last_event != halide_trace_end_pipeline) {
+        printf("The trace should start and end with the pipeline\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "HalideRuntime.h"
+#include "HalideBuffer.h"
+
+#include <stdio.h>
+
+#include "huge_pages.h"
+
+using namespace Halide::Runtime;
+
+const int size = 1024;
+
+bool run(Buffer<float> &input, Buffer<float> &output) {
+    if (huge_pages(input, output) != 0) {
+        printf("huge_pages failed\n");
+        return false;
+    }
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            float correct = (input(x, y) + input(x + 1, y) + input(x, y + 1) + input(x + 1, y + 1)) / 4;
+            if (output(x, y) != correct) {
+                printf("output(%d, %d) = %f instead of %f\n", x, y, output(x, y), correct);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+#if !defined(__linux__) || defined(__mips__)
+    printf("Huge pages are only supported on Linux. Skipping test.\n");
+    return 0;
+#endif
+
+    Buffer<float> input(size + 1, size + 1);
+    input.for_each_element([&](int x, int y) {
+        input(x, y) = (float)((x * 3 + y * 5) % 16);
+    });
+    Buffer<float> output(size, size);
+
+    // The 4MB intermediate is above the threshold.
+    halide_set_huge_page_mode(halide_huge_pages_transparent, 1024 * 1024);
+
+    halide_huge_page_stats_t stats;
+    if (!run(input, output)) {
+        return -1;
+    }
+    halide_huge_page_get_stats(&stats);
+    if (stats.mapped != 1 || stats.reused != 0 || stats.in_use_bytes != 0 ||
+        stats.peak_in_use_bytes < size * (size + 1) * sizeof(float) ||
+        stats.cached_bytes != stats.mapped_bytes) {
+        printf("After the first run: mapped %llu, reused %llu, in use %llu, cached %llu\n",
+               (unsigned long long)stats.mapped, (unsigned long long)stats.reused,
+               (unsigned long long)stats.in_use_bytes, (unsigned long long)stats.cached_bytes);
+        return -1;
+    }
+
+    // The second run reuses the region the first one freed.
+    if (!run(input, output)) {
+        return -1;
+    }
+    halide_huge_page_get_stats(&stats);
+    if (stats.mapped != 1 || stats.reused != 1 || stats.in_use_bytes != 0 ||
+        stats.cached_bytes != stats.mapped_bytes) {
+        printf("After the second run: mapped %llu, reused %llu, in use %llu, cached %llu\n",
+               (unsigned long long)stats.mapped, (unsigned long long)stats.reused,
+               (unsigned long long)stats.in_use_bytes, (unsigned long long)stats.cached_bytes);
+        return -1;
+    }
+
+    int64_t released = halide_huge_page_trim(nullptr);
+    halide_huge_page_get_stats(&stats);
+    if (released != (int64_t)stats.mapped_bytes || stats.cached_bytes != 0 ||
+        stats.unmapped_bytes != stats.mapped_bytes) {
+        printf("Trimming released %lld bytes, leaving %llu cached\n",
+               (long long)released, (unsigned long long)stats.cached_bytes);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
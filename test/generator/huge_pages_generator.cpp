@@ -0,0 +1,25 @@
+#include "Halide.h"
+
+namespace {
+
+class HugePages : public Halide::Generator<HugePages> {
+public:
+    Input<Buffer<float>> input{"input", 2};
+    Output<Buffer<float>> output{"output", 2};
+
+    void generate() {
+        Var x, y;
+
+        // An intermediate the size of the output, which is allocated
+        // with halide_malloc.
+        Func blur_x;
+        blur_x(x, y) = (input(x, y) + input(x + 1, y)) / 2;
+        output(x, y) = (blur_x(x, y) + blur_x(x, y + 1)) / 2;
+
+        blur_x.compute_root();
+    }
+};
+
+}  // namespace
+
+HALIDE_REGISTER_GENERATOR(HugePages, huge_pages)
@@ -0,0 +1,173 @@
+#include "HalideRuntime.h"
+#include "HalideBuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "scratch_memory.h"
+#include "scratch_memory_multitarget.h"
+#include "scratch_memory_no_asserts.h"
+
+using namespace Halide::Runtime;
+
+const int size = 256;
+
+int mallocs = 0, errors = 0;
+
+void *my_halide_malloc(void *user_context, size_t x) {
+    mallocs++;
+    return halide_default_malloc(user_context, x);
+}
+
+void my_halide_error(void *user_context, const char *msg) {
+    // Don't use the word "error": if CMake sees it in the output
+    // from an add_custom_command() on Windows, it can decide that
+    // the command failed, regardless of error code.
+    errors++;
+}
+
+// The multitarget wrapper caches which sub-target it picked, so each
+// run of the test only exercises one of them.
+bool use_debug_feature() {
+    const char *value = getenv("HL_SCRATCH_MEMORY_TEST_USE_DEBUG_FEATURE");
+    return value && atoi(value) != 0;
+}
+
+int my_can_use_target_features(uint64_t features) {
+    if (features & (1ULL << halide_target_feature_debug)) {
+        return use_debug_feature() ? 1 : 0;
+    }
+    return 1;
+}
+
+typedef int (*pipeline_t)(void *, uint64_t, halide_buffer_t *, halide_buffer_t *);
+
+// Run a pipeline with the size its _scratch_bytes() entry point
+// returned, and check the output.
+bool check_output(const char *name, pipeline_t pipeline, int64_t scratch_bytes,
+                  Buffer<uint8_t> &input, Buffer<uint8_t> &output) {
+    std::vector<uint8_t> scratch(scratch_bytes + 1);
+
+    // The size returned by _scratch_bytes() must be enough however
+    // the memory is aligned.
+    for (int offset = 0; offset < 2; offset++) {
+        output.fill(0);
+        mallocs = 0;
+        int result = pipeline(scratch.data() + offset, scratch_bytes, input, output);
+        if (result != 0) {
+            printf("%s with %lld bytes of scratch memory returned %d\n", name, (long long)scratch_bytes, result);
+            return false;
+        }
+        if (mallocs != 0) {
+            printf("%s called halide_malloc %d times\n", name, mallocs);
+            return false;
+        }
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                uint8_t correct = (uint8_t)((input(x, y) + input(x + 1, y) + input(x, y + 1)) / 3);
+                if (output(x, y) != correct) {
+                    printf("%s: output(%d, %d) = %d instead of %d\n", name, x, y, output(x, y), correct);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Run a pipeline with no scratch memory, then with one byte less than
+// the variant that will run needs, then with enough.
+bool check(const char *name, pipeline_t pipeline, int64_t required, int64_t scratch_bytes,
+           Buffer<uint8_t> &input, Buffer<uint8_t> &output) {
+    std::vector<uint8_t> scratch(scratch_bytes + 1);
+
+    errors = 0;
+    int result = pipeline(nullptr, 0, input, output);
+    if (result != halide_error_code_scratch_too_small || errors != 1) {
+        printf("%s with no scratch memory returned %d, with %d errors reported\n", name, result, errors);
+        return false;
+    }
+
+    errors = 0;
+    result = pipeline(scratch.data(), required - 1, input, output);
+    if (result != halide_error_code_scratch_too_small || errors != 1) {
+        printf("%s with too little scratch memory returned %d, with %d errors reported\n", name, result, errors);
+        return false;
+    }
+
+    return check_output(name, pipeline, scratch_bytes, input, output);
+}
+
+int main(int argc, char **argv) {
+    Buffer<uint8_t> input(size + 1, size + 1);
+    input.for_each_element([&](int x, int y) {
+        input(x, y) = (uint8_t)(x * 7 + y * 13);
+    });
+    Buffer<uint8_t> output(size, size);
+
+    halide_set_custom_malloc(&my_halide_malloc);
+    halide_set_error_handler(&my_halide_error);
+    halide_set_custom_can_use_target_features(&my_can_use_target_features);
+
+    // The intermediate is a 257x257 array of int16s.
+    const int64_t scratch_bytes = scratch_memory_scratch_bytes();
+    if (scratch_bytes < (size + 1) * (size + 1) * 2) {
+        printf("scratch_memory_scratch_bytes() returned %lld\n", (long long)scratch_bytes);
+        return -1;
+    }
+    if (!check("scratch_memory", scratch_memory, scratch_bytes, scratch_bytes, input, output)) {
+        return -1;
+    }
+
+    // The debug sub-target of the multitarget library uses int32s,
+    // and the wrapper must ask for enough memory for either.
+    const int64_t multitarget_scratch_bytes = scratch_memory_multitarget_scratch_bytes();
+    if (multitarget_scratch_bytes < (size + 1) * (size + 1) * 4 ||
+        multitarget_scratch_bytes <= scratch_bytes) {
+        printf("scratch_memory_multitarget_scratch_bytes() returned %lld\n",
+               (long long)multitarget_scratch_bytes);
+        return -1;
+    }
+    const int64_t required = use_debug_feature() ? multitarget_scratch_bytes : scratch_bytes;
+    if (!check("scratch_memory_multitarget", scratch_memory_multitarget,
+               required, multitarget_scratch_bytes, input, output)) {
+        return -1;
+    }
+
+    // Without asserts, a pipeline given too little memory can't
+    // return the error code, but it must still report it, and must
+    // not write the memory or the output.
+    const int64_t no_asserts_scratch_bytes = scratch_memory_no_asserts_scratch_bytes();
+    std::vector<uint8_t> scratch(no_asserts_scratch_bytes, 0);
+    output.fill(0);
+    mallocs = 0;
+    errors = 0;
+    scratch_memory_no_asserts(scratch.data(), no_asserts_scratch_bytes - 1, input, output);
+    if (errors != 1 || mallocs != 0) {
+        printf("scratch_memory_no_asserts with too little scratch memory reported %d errors and called halide_malloc %d times\n",
+               errors, mallocs);
+        return -1;
+    }
+    for (uint8_t b : scratch) {
+        if (b != 0) {
+            printf("scratch_memory_no_asserts wrote to scratch memory that was too small\n");
+            return -1;
+        }
+    }
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            if (output(x, y) != 0) {
+                printf("scratch_memory_no_asserts wrote output(%d, %d) with too little scratch memory\n", x, y);
+                return -1;
+            }
+        }
+    }
+    if (!check_output("scratch_memory_no_asserts", scratch_memory_no_asserts,
+                      no_asserts_scratch_bytes, input, output)) {
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
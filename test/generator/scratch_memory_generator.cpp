@@ -0,0 +1,31 @@
+#include "Halide.h"
+
+namespace {
+
+class ScratchMemory : public Halide::Generator<ScratchMemory> {
+public:
+    Input<Buffer<uint8_t>> input{"input", 2};
+    Output<Buffer<uint8_t>> output{"output", 2};
+
+    void generate() {
+        Var x, y;
+
+        // The debug variant of the multitarget library uses a wider
+        // intermediate, so it needs more scratch memory than the
+        // other one.
+        Type t = get_target().has_feature(Target::Debug) ? Int(32) : Int(16);
+
+        Func f;
+        f(x, y) = cast(t, input(x, y)) * 3;
+        output(x, y) = cast<uint8_t>((f(x, y) + f(x + 1, y) + f(x, y + 1)) / 9);
+
+        // Constant bounds give f a constant size, too large for the stack,
+        // so it is placed in the scratch memory.
+        f.compute_root();
+        output.bound(x, 0, 256).bound(y, 0, 256);
+    }
+};
+
+}  // namespace
+
+HALIDE_REGISTER_GENERATOR(ScratchMemory, scratch_memory)
@@ -0,0 +1,63 @@
+#include "Halide.h"
+#include <cstdio>
+#include "halide_benchmark.h"
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+int main(int argc, char **argv) {
+    // Two memoized Funcs that compete for the cache: a small one that
+    // is expensive to compute and is reused every few runs, and a
+    // large one that is cheap to compute and never reused. Evicting
+    // by recency throws out the expensive results to make room for
+    // the cheap ones. Evicting by cost per byte keeps them.
+    Var x, y;
+    Param<int> p_expensive, p_cheap;
+
+    Func expensive("expensive");
+    RDom r(0, 256);
+    expensive(x, y) = sum(sqrt(cast<float>(x + y * r + p_expensive)));
+    expensive.compute_root().memoize();
+
+    Func cheap("cheap");
+    cheap(x, y) = cast<float>(x + y + p_cheap);
+    cheap.compute_root().memoize();
+
+    Func out("out");
+    out(x, y) = expensive(x % 64, y % 64) + cheap(x, y);
+
+    // The expensive results take 16K each, and the cheap ones 1M.
+    const int reuse_distance = 16;
+    const int64_t cache_size = 4 * 1024 * 1024;
+    Buffer<float> result(512, 512);
+
+    static char policy_buf[64];
+    const char *policies[] = {"lru", "cost"};
+    double times[2];
+    for (int p = 0; p < 2; p++) {
+        snprintf(policy_buf, sizeof(policy_buf), "HL_MEMOIZATION_CACHE_POLICY=%s", policies[p]);
+        putenv(policy_buf);
+        Halide::Internal::JITSharedRuntime::release_all();
+        out.compile_jit();
+        Halide::Internal::JITSharedRuntime::memoization_cache_set_size(cache_size);
+
+        int iteration = 0;
+        auto run = [&]() {
+            p_expensive.set(iteration % reuse_distance);
+            p_cheap.set(iteration);
+            out.realize(result);
+            iteration++;
+        };
+        // Warm up the cache with every expensive result.
+        for (int i = 0; i < reuse_distance; i++) {
+            run();
+        }
+        times[p] = benchmark(5, reuse_distance * 4, run);
+        printf("Evicting by %s: %f ms per run\n", policies[p], times[p] * 1e3);
+    }
+
+    printf("Evicting by cost is %fx faster than evicting by recency\n", times[0] / times[1]);
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include "Halide.h"
+#include <cstdio>
+#include <thread>
+#include "halide_benchmark.h"
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+void set_env(const char *name, int value, char *buf, size_t size) {
+    snprintf(buf, size, "%s=%d", name, value);
+    putenv(buf);
+}
+
+int main(int argc, char **argv) {
+    const int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // A chain of parallel loops whose tasks do almost nothing, so the
+    // runtime is dominated by the round trip through the thread
+    // pool: waking workers, handing out tasks, and waiting for the
+    // last one to finish.
+    const int stages = 8;
+    Var x;
+    std::vector<Func> f(stages);
+    f[0](x) = x;
+    for (int i = 1; i < stages; i++) {
+        f[i](x) = f[i-1](x) + 1;
+    }
+    for (int i = 0; i < stages; i++) {
+        f[i].compute_root().parallel(x);
+    }
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    static char threads_buf[64], spin_buf[64];
+    for (int t : thread_counts) {
+        Buffer<int> out(t);
+        double times[2];
+        for (int spin = 0; spin < 2; spin++) {
+            set_env("HL_NUM_THREADS", t, threads_buf, sizeof(threads_buf));
+            // Zero disables spinning. 1000 is the default.
+            set_env("HL_THREAD_POOL_SPIN_COUNT", spin ? 1000 : 0, spin_buf, sizeof(spin_buf));
+            Halide::Internal::JITSharedRuntime::release_all();
+            f[stages - 1].compile_jit();
+            // Start up the thread pool.
+            f[stages - 1].realize(out);
+            times[spin] = benchmark(10, 100, [&]() { f[stages - 1].realize(out); });
+        }
+        printf("%3d threads: %f us per empty parallel loop when blocking immediately, %f us when spinning first\n",
+               t, times[0] * 1e6 / stages, times[1] * 1e6 / stages);
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "Halide.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "halide_benchmark.h"
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+std::mutex thread_ids_mutex;
+std::set<std::thread::id> thread_ids;
+
+// Sleep for a bit so that every task is in flight at once regardless
+// of the number of cores, then record which thread ran the task.
+extern "C" DLLEXPORT int record_thread(int x) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard<std::mutex> lock(thread_ids_mutex);
+    thread_ids.insert(std::this_thread::get_id());
+    return x;
+}
+HalideExtern_1(int, record_thread, int);
+
+void set_num_threads(int t) {
+    // The thread pool reads HL_NUM_THREADS when the runtime is
+    // first used, so we need a fresh runtime each time.
+    static char buf[32];
+    snprintf(buf, sizeof(buf), "HL_NUM_THREADS=%d", t);
+    putenv(buf);
+    Halide::Internal::JITSharedRuntime::release_all();
+}
+
+int main(int argc, char **argv) {
+    const int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // A parallel loop with lots of very cheap tasks, so that the cost
+    // of claiming tasks from the thread pool dominates.
+    Func fine;
+    Var x, y;
+    fine(x, y) = x + y;
+    fine.parallel(y);
+
+    // A parallel loop with fewer, more expensive tasks.
+    Func coarse;
+    Expr math = cast<float>(x + y);
+    for (int i = 0; i < 20; i++) math = sqrt(cos(sin(math)));
+    coarse(x, y) = math;
+    coarse.parallel(y);
+
+    Buffer<int> fine_out(4, 100000);
+    Buffer<float> coarse_out(1024, 512);
+
+    // Powers of two, plus the full machine.
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    double fine_serial = 0, coarse_serial = 0;
+    for (int t : thread_counts) {
+        set_num_threads(t);
+        fine.compile_jit();
+        coarse.compile_jit();
+
+        double fine_time = benchmark([&]() { fine.realize(fine_out); });
+        double coarse_time = benchmark([&]() { coarse.realize(coarse_out); });
+
+        if (t == 1) {
+            fine_serial = fine_time;
+            coarse_serial = coarse_time;
+        }
+
+        printf("%3d threads: fine-grained %f ms (speedup %f), coarse-grained %f ms (speedup %f)\n",
+               t, fine_time * 1e3, fine_serial / fine_time,
+               coarse_time * 1e3, coarse_serial / coarse_time);
+
+        if (t > 1 && fine_time > fine_serial * 2) {
+            printf("WARNING: %d threads made a fine-grained parallel loop much slower than 1 thread\n", t);
+        }
+    }
+
+    // The thread pool used to be capped at 64 threads. Check that we
+    // can actually get more than that when we ask for them.
+    {
+        const int many_threads = 128;
+        set_num_threads(many_threads);
+        Func f;
+        f(x) = record_thread(x);
+        f.parallel(x);
+        f.realize(many_threads);
+        printf("Asked for %d threads, tasks ran on %d distinct threads\n",
+               many_threads, (int)thread_ids.size());
+        if ((int)thread_ids.size() <= 64) {
+            printf("The thread pool did not use more than 64 threads\n");
+            return -1;
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace Halide;
+
+float read_mb = -1, write_mb = -1;
+void my_print(void *, const char *msg) {
+    if (strncmp(msg, "  copy:", 7) != 0) {
+        return;
+    }
+    const char *traffic = strstr(msg, " read: ");
+    if (traffic) {
+        sscanf(traffic, " read: %fMB write: %fMB", &read_mb, &write_mb);
+    }
+}
+
+int main(int argc, char **argv) {
+    const int width = 1024, height = 1024;
+
+    // A Func that reads a float from its input and writes one, for
+    // every pixel.
+    ImageParam in(Float(32), 2);
+    Func copy("copy");
+    Var x, y;
+    copy(x, y) = in(x, y) * 2.0f + 1.0f;
+    copy.vectorize(x, 8).parallel(y);
+
+    Buffer<float> input(width, height);
+    input.fill(1.0f);
+    in.set(input);
+
+    copy.set_custom_print(&my_print);
+    Target t = get_jit_target_from_environment().with_feature(Target::ProfileMemoryTraffic);
+    Buffer<float> output = copy.realize(width, height, t);
+
+    const float expected_mb = width * height * sizeof(float) / 1000000.0f;
+    printf("copy: read %fMB, wrote %fMB, expected %fMB each\n", read_mb, write_mb, expected_mb);
+
+    if (read_mb < expected_mb * 0.99f || read_mb > expected_mb * 1.01f ||
+        write_mb < expected_mb * 0.99f || write_mb > expected_mb * 1.01f) {
+        printf("Wrong number of bytes read or written by copy\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
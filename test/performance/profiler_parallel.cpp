@@ -0,0 +1,70 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace Halide;
+
+int fields = 0;
+float ms = 0, cpu_ms = 0, threads = 0;
+void my_print(void *, const char *msg) {
+    float this_ms, this_threads, this_cpu_ms = 0;
+    int this_percentage;
+    int val = sscanf(msg, " expensive: %fms (%d%%) threads: %f",
+                     &this_ms, &this_percentage, &this_threads);
+    // The cpu time comes after any memory columns.
+    const char *cpu = strstr(msg, " cpu: ");
+    if (val == 3 && cpu && sscanf(cpu, " cpu: %fms", &this_cpu_ms) == 1) {
+        val++;
+    }
+    if (val >= 2) {
+        fields = val;
+        ms = this_ms;
+        threads = this_threads;
+        cpu_ms = this_cpu_ms;
+    }
+}
+
+int main(int argc, char **argv) {
+    // An expensive Func computed per row of a parallel loop, next to
+    // a cheap one computed at root. Each thread running a row should
+    // be billed to the expensive Func separately.
+    Func cheap("cheap"), expensive("expensive"), out("out");
+    Var x, y;
+    cheap(x, y) = cast<float>(x + y);
+    Expr e = cheap(x, y);
+    for (int j = 0; j < 200; j++) {
+        e = sin(e);
+    }
+    expensive(x, y) = e;
+    out(x, y) = expensive(x, y) + cheap(x, y);
+
+    cheap.compute_root();
+    expensive.compute_at(out, y);
+    out.parallel(y);
+
+    out.set_custom_print(&my_print);
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    Buffer<float> im = out.realize(1000, 1000, t);
+
+    if (fields < 2) {
+        printf("Didn't find the profile of Func expensive\n");
+        return -1;
+    }
+
+    if (fields == 2) {
+        // The pipeline only ever ran on one thread, so there are no
+        // thread counts to check.
+        printf("Success!\n");
+        return 0;
+    }
+
+    printf("expensive: %fms, %f threads, %fms of cpu time\n", ms, threads, cpu_ms);
+
+    if (threads < 1.0f || cpu_ms < ms * 0.99f) {
+        printf("The cpu time of expensive should be its time times the threads running it\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+
+#include "test/common/halide_test_dirs.h"
+
+using namespace Halide;
+
+int count_occurrences(const std::string &s, const std::string &pattern) {
+    int count = 0;
+    for (size_t pos = s.find(pattern); pos != std::string::npos; pos = s.find(pattern, pos + 1)) {
+        count++;
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    std::string trace_file = Internal::get_test_tmp_dir() + "profiler_timeline.json";
+    Internal::ensure_no_file_exists(trace_file);
+    // The JIT writes the timeline here after the pipeline runs.
+#ifdef _WIN32
+    _putenv_s("HL_PROFILER_TRACE", trace_file.c_str());
+#else
+    setenv("HL_PROFILER_TRACE", trace_file.c_str(), 1);
+#endif
+
+    // A producer computed per row of a parallel loop, and one computed
+    // at root before it.
+    Func producer("producer"), consumer("consumer"), root("root");
+    Var x, y;
+    root(x, y) = x + y;
+    producer(x, y) = root(x, y) * 2;
+    consumer(x, y) = producer(x, y) + producer(x + 1, y);
+
+    root.compute_root();
+    producer.compute_at(consumer, y);
+    consumer.parallel(y);
+
+    Target t = get_jit_target_from_environment().with_feature(Target::ProfileTimeline);
+    Buffer<int> im = consumer.realize(100, 64, t);
+
+    Internal::assert_file_exists(trace_file);
+    std::ifstream f(trace_file);
+    std::stringstream contents;
+    contents << f.rdbuf();
+    std::string trace = contents.str();
+
+    // Every row is a task, which runs the producer and then the
+    // consumer. The root Func is computed once, by the calling thread.
+    int tasks = count_occurrences(trace, "{\"name\": \"task\"");
+    int producers = count_occurrences(trace, "{\"name\": \"producer\"");
+    int consumers = count_occurrences(trace, "{\"name\": \"consumer\"");
+    int roots = count_occurrences(trace, "{\"name\": \"root\"");
+    printf("tasks: %d producer: %d consumer: %d root: %d\n", tasks, producers, consumers, roots);
+
+    if (tasks != 64 || producers != 64 || consumers < 64 || roots != 1) {
+        printf("Expected one task, producer and consumer per row, and one root\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
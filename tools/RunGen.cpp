@@ -811,6 +811,18 @@ Flags:
         allocation during run; note that this may slow down execution, so
         benchmarks may be inaccurate if you combine --benchmark with this.
 
+    --profiler_json=FILE:
+        Write the stats of the sampling profiler to FILE as JSON after the
+        run (or the benchmark runs). The filter must be compiled with the
+        "profile" target feature for there to be any stats.
+
+    --profiler_trace=FILE:
+        Record which Func each thread was running at every sample of the
+        sampling profiler, and write that timeline to FILE in the Chrome
+        trace event format after the run (or the benchmark runs). Can be
+        viewed with chrome://tracing or Perfetto. Requires the "profile"
+        target feature, as above.
+
 Known Issues:
 
     * Filters running on GPU (vs CPU) have not been tested.
@@ -903,6 +915,7 @@ int main(int argc, char **argv) {
     double benchmark_min_time = BenchmarkConfig().min_time;
     int benchmark_min_iters = BenchmarkConfig().min_iters;
     int benchmark_max_iters = BenchmarkConfig().max_iters;
+    std::string profiler_json, profiler_trace;
     for (int i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
             const char *p = argv[i] + 1; // skip -
@@ -960,6 +973,16 @@ int main(int argc, char **argv) {
                 if (!parse_scalar(flag_value, &benchmark_max_iters)) {
                     fail() << "Invalid value for flag: " << flag_name;
                 }
+            } else if (flag_name == "profiler_json") {
+                if (flag_value.empty()) {
+                    fail() << "Invalid value for flag: " << flag_name;
+                }
+                profiler_json = flag_value;
+            } else if (flag_name == "profiler_trace") {
+                if (flag_value.empty()) {
+                    fail() << "Invalid value for flag: " << flag_name;
+                }
+                profiler_trace = flag_value;
             } else if (flag_name == "output_extents") {
                 default_output_shape = parse_extents(flag_value);
             } else {
@@ -1093,6 +1116,10 @@ int main(int argc, char **argv) {
         tracker.install();
     }
 
+    if (!profiler_trace.empty()) {
+        halide_profiler_record_timeline(1);
+    }
+
     {
         std::vector<void*> filter_argv(args.size(), nullptr);
         for (auto &arg_pair : args) {
@@ -1145,6 +1172,19 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (!profiler_json.empty()) {
+        info() << "Writing profiler stats to " << profiler_json << " ...";
+        if (halide_profiler_write_json(nullptr, profiler_json.c_str()) != 0) {
+            fail() << "Unable to write profiler stats: " << profiler_json;
+        }
+    }
+    if (!profiler_trace.empty()) {
+        info() << "Writing profiler timeline to " << profiler_trace << " ...";
+        if (halide_profiler_write_trace(nullptr, profiler_trace.c_str()) != 0) {
+            fail() << "Unable to write profiler timeline: " << profiler_trace;
+        }
+    }
+
     if (track_memory) {
         // Ensure that we copy any GPU-output buffers back to host before
         // we report on memory usage.